@@ -216,7 +216,7 @@ ngx_http_lua_access_handler_file(ngx_http_request_t *r)
     L = ngx_http_lua_get_lua_vm(r, NULL);
 
     /*  load Lua script file (w/ cache)        sp = 1 */
-    rc = ngx_http_lua_cache_loadfile(r->connection->log, L, script_path,
+    rc = ngx_http_lua_cache_loadfile(r, L, script_path,
                                      llcf->access_src_key);
     if (rc != NGX_OK) {
         if (rc < NGX_HTTP_SPECIAL_RESPONSE) {
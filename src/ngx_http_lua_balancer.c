@@ -56,7 +56,7 @@ ngx_http_lua_balancer_handler_file(ngx_http_request_t *r,
 {
     ngx_int_t           rc;
 
-    rc = ngx_http_lua_cache_loadfile(r->connection->log, L,
+    rc = ngx_http_lua_cache_loadfile(r, L,
                                      lscf->balancer.src.data,
                                      lscf->balancer.src_key);
     if (rc != NGX_OK) {
@@ -29,9 +29,31 @@
 
 static void ngx_http_lua_body_filter_by_lua_env(lua_State *L,
     ngx_http_request_t *r, ngx_chain_t *in);
+static int ngx_http_lua_ngx_chain_count(lua_State *L);
+static int ngx_http_lua_ngx_chain_size(lua_State *L);
+static int ngx_http_lua_ngx_chain_get(lua_State *L);
+static int ngx_http_lua_ngx_chain_prepend(lua_State *L);
+static int ngx_http_lua_ngx_chain_append(lua_State *L);
+static int ngx_http_lua_ngx_chain_replace(lua_State *L);
+static ngx_chain_t *ngx_http_lua_body_filter_get_chain(lua_State *L,
+    ngx_http_request_t **rp, ngx_http_lua_ctx_t **ctxp);
+static ngx_chain_t *ngx_http_lua_body_filter_dup_chain(lua_State *L,
+    ngx_http_request_t *r, ngx_chain_t *in);
+static ngx_chain_t *ngx_http_lua_body_filter_nth_link(lua_State *L,
+    ngx_chain_t **chain, int idx, ngx_chain_t ***llp);
+static ngx_chain_t *ngx_http_lua_body_filter_new_link(lua_State *L,
+    ngx_http_request_t *r, ngx_http_lua_ctx_t *ctx, int idx);
+static void ngx_http_lua_body_filter_slice(lua_State *L, off_t size,
+    int idx, off_t *from, off_t *to);
+static void ngx_http_lua_body_filter_trim_buf(ngx_buf_t *b, off_t skip,
+    off_t len);
 static ngx_http_output_body_filter_pt ngx_http_next_body_filter;
 
 
+/* tag for the bufs referencing the memory or file of other modules' bufs */
+static char ngx_http_lua_body_filter_shadow_tag;
+
+
 /* key for the ngx_chain_t *in pointer in the Lua thread */
 #define ngx_http_lua_chain_key  "__ngx_cl"
 
@@ -66,17 +88,9 @@ ngx_http_lua_body_filter_by_lua_env(lua_State *L, ngx_http_request_t *r,
      * in the global env.
      *
      * all variables created in the script-env will be thrown away at the end
-     * of the script run.
+     * of the script run (see ngx_http_lua_push_phase_env).
      * */
-    ngx_http_lua_create_new_globals_table(L, 0 /* narr */, 1 /* nrec */);
-
-    /*  {{{ make new env inheriting main thread's globals table */
-    lua_createtable(L, 0, 1 /* nrec */);    /*  the metatable for the new
-                                                env */
-    ngx_http_lua_get_globals_table(L);
-    lua_setfield(L, -2, "__index");
-    lua_setmetatable(L, -2);    /*  setmetatable({}, {__index = _G}) */
-    /*  }}} */
+    ngx_http_lua_push_phase_env(L, r);
 
     lua_setfenv(L, -2);    /*  set new running env for the code closure */
 }
@@ -109,6 +123,8 @@ ngx_http_lua_body_filter_by_chunk(lua_State *L, ngx_http_request_t *r,
 
     lua_remove(L, 1);  /* remove traceback function */
 
+    ngx_http_lua_release_phase_env(L, r);
+
 #if (NGX_PCRE)
     /* XXX: work-around to nginx regex subsystem */
     ngx_http_lua_pcre_malloc_done(old_pool);
@@ -209,7 +225,7 @@ ngx_http_lua_body_filter_file(ngx_http_request_t *r, ngx_chain_t *in)
     L = ngx_http_lua_get_lua_vm(r, NULL);
 
     /*  load Lua script file (w/ cache)        sp = 1 */
-    rc = ngx_http_lua_cache_loadfile(r->connection->log, L, script_path,
+    rc = ngx_http_lua_cache_loadfile(r, L, script_path,
                                      llcf->body_filter_src_key);
     if (rc != NGX_OK) {
         return NGX_ERROR;
@@ -395,6 +411,13 @@ ngx_http_lua_body_filter_param_get(lua_State *L)
         dd("seen only single buffer");
 
         b = in->buf;
+
+        if (!ngx_buf_in_memory(b)) {
+            /* see lua_body_filter_in_memory */
+            lua_pushliteral(L, "");
+            return 1;
+        }
+
         lua_pushlstring(L, (char *) b->pos, b->last - b->pos);
         return 1;
     }
@@ -404,7 +427,9 @@ ngx_http_lua_body_filter_param_get(lua_State *L)
     for (cl = in; cl; cl = cl->next) {
         b = cl->buf;
 
-        size += b->last - b->pos;
+        if (ngx_buf_in_memory(b)) {
+            size += b->last - b->pos;
+        }
 
         if (b->last_buf || b->last_in_chain) {
             break;
@@ -415,7 +440,10 @@ ngx_http_lua_body_filter_param_get(lua_State *L)
 
     for (p = data, cl = in; cl; cl = cl->next) {
         b = cl->buf;
-        p = ngx_copy(p, b->pos, b->last - b->pos);
+
+        if (ngx_buf_in_memory(b)) {
+            p = ngx_copy(p, b->pos, b->last - b->pos);
+        }
 
         if (b->last_buf || b->last_in_chain) {
             break;
@@ -540,6 +568,7 @@ ngx_http_lua_body_filter_param_set(lua_State *L, ngx_http_request_t *r,
 
             dd("mark the buf as consumed: %d", (int) ngx_buf_size(b));
             b->pos = b->last;
+            b->file_pos = b->file_last;
         }
 
         /* cl == NULL */
@@ -576,6 +605,7 @@ ngx_http_lua_body_filter_param_set(lua_State *L, ngx_http_request_t *r,
 
         dd("mark the buf as consumed: %d", (int) ngx_buf_size(cl->buf));
         cl->buf->pos = cl->buf->last;
+        cl->buf->file_pos = cl->buf->file_last;
     }
 
     /* cl == NULL */
@@ -630,4 +660,551 @@ done:
     return 0;
 }
 
+
+void
+ngx_http_lua_inject_chain_api(lua_State *L)
+{
+    lua_createtable(L, 0 /* narr */, 6 /* nrec */);    /* ngx.chain */
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_chain_count);
+    lua_setfield(L, -2, "count");
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_chain_size);
+    lua_setfield(L, -2, "size");
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_chain_get);
+    lua_setfield(L, -2, "get");
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_chain_prepend);
+    lua_setfield(L, -2, "prepend");
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_chain_append);
+    lua_setfield(L, -2, "append");
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_chain_replace);
+    lua_setfield(L, -2, "replace");
+
+    lua_setfield(L, -2, "chain");
+}
+
+
+static int
+ngx_http_lua_ngx_chain_count(lua_State *L)
+{
+    int                      n;
+    ngx_chain_t             *cl;
+    ngx_http_request_t      *r;
+    ngx_http_lua_ctx_t      *ctx;
+
+    if (lua_gettop(L) != 0) {
+        return luaL_error(L, "expecting no arguments, but got %d",
+                          lua_gettop(L));
+    }
+
+    n = 0;
+
+    for (cl = ngx_http_lua_body_filter_get_chain(L, &r, &ctx);
+         cl;
+         cl = cl->next)
+    {
+        n++;
+    }
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_ngx_chain_size(lua_State *L)
+{
+    ngx_buf_t               *b;
+    ngx_chain_t             *in, *cl;
+    ngx_http_request_t      *r;
+    ngx_http_lua_ctx_t      *ctx;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting 1 argument, but got %d",
+                          lua_gettop(L));
+    }
+
+    in = ngx_http_lua_body_filter_get_chain(L, &r, &ctx);
+
+    cl = ngx_http_lua_body_filter_nth_link(L, &in, 1, NULL);
+    b = cl->buf;
+
+    lua_pushnumber(L, (lua_Number) ngx_buf_size(b));
+    lua_pushboolean(L, !ngx_buf_in_memory(b) && b->in_file);
+    return 2;
+}
+
+
+static int
+ngx_http_lua_ngx_chain_get(lua_State *L)
+{
+    int                      n;
+    off_t                    from, to;
+    size_t                   len;
+    ssize_t                  rc;
+    u_char                  *p;
+    ngx_buf_t               *b;
+    ngx_chain_t             *in, *cl;
+    ngx_http_request_t      *r;
+    ngx_http_lua_ctx_t      *ctx;
+
+    n = lua_gettop(L);
+    if (n < 1 || n > 3) {
+        return luaL_error(L, "expecting 1, 2, or 3 arguments, but got %d", n);
+    }
+
+    in = ngx_http_lua_body_filter_get_chain(L, &r, &ctx);
+
+    cl = ngx_http_lua_body_filter_nth_link(L, &in, 1, NULL);
+    b = cl->buf;
+
+    ngx_http_lua_body_filter_slice(L, ngx_buf_size(b), 2, &from, &to);
+
+    if (from > to) {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+
+    len = (size_t) (to - from + 1);
+
+    if (ngx_buf_in_memory(b)) {
+        lua_pushlstring(L, (char *) b->pos + from - 1, len);
+        return 1;
+    }
+
+    /* only the requested bytes of file bufs are ever read */
+
+    p = lua_newuserdata(L, len);
+
+    rc = ngx_read_file(b->file, p, len, b->file_pos + from - 1);
+
+    if (rc != (ssize_t) len) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "failed to read the file buffer");
+        return 2;
+    }
+
+    lua_pushlstring(L, (char *) p, len);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_ngx_chain_prepend(lua_State *L)
+{
+    ngx_chain_t             *in, *out, *cl;
+    ngx_http_request_t      *r;
+    ngx_http_lua_ctx_t      *ctx;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting 1 argument, but got %d",
+                          lua_gettop(L));
+    }
+
+    in = ngx_http_lua_body_filter_get_chain(L, &r, &ctx);
+
+    cl = ngx_http_lua_body_filter_new_link(L, r, ctx, 1);
+    if (cl == NULL) {
+        return 0;
+    }
+
+    /* the links of the input chain are never modified */
+
+    cl->next = in;
+    out = cl;
+
+    lua_pushlightuserdata(L, out);
+    lua_setglobal(L, ngx_http_lua_chain_key);
+    return 0;
+}
+
+
+static int
+ngx_http_lua_ngx_chain_append(lua_State *L)
+{
+    ngx_buf_t               *b;
+    ngx_chain_t             *in, *out, *cl, **ll;
+    ngx_http_request_t      *r;
+    ngx_http_lua_ctx_t      *ctx;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting 1 argument, but got %d",
+                          lua_gettop(L));
+    }
+
+    in = ngx_http_lua_body_filter_get_chain(L, &r, &ctx);
+
+    cl = ngx_http_lua_body_filter_new_link(L, r, ctx, 1);
+    if (cl == NULL) {
+        return 0;
+    }
+
+    out = ngx_http_lua_body_filter_dup_chain(L, r, in);
+
+    if (out == NULL) {
+        out = cl;
+        goto done;
+    }
+
+    for (ll = &out; (*ll)->next; ll = &(*ll)->next) { /* void */ }
+
+    b = (*ll)->buf;
+
+    if (ngx_buf_size(b) == 0) {
+        /* keep the trailing special buf (like the "last_buf" one) at the
+         * end of the chain */
+
+        cl->next = *ll;
+        *ll = cl;
+
+    } else {
+        cl->buf->last_buf = b->last_buf;
+        cl->buf->last_in_chain = b->last_in_chain;
+        cl->buf->flush = b->flush;
+
+        b->last_buf = 0;
+        b->last_in_chain = 0;
+        b->flush = 0;
+
+        (*ll)->next = cl;
+    }
+
+done:
+
+    lua_pushlightuserdata(L, out);
+    lua_setglobal(L, ngx_http_lua_chain_key);
+    return 0;
+}
+
+
+static int
+ngx_http_lua_ngx_chain_replace(lua_State *L)
+{
+    int                      n;
+    off_t                    size, from, to, pre, suf;
+    unsigned                 last_buf, last_in_chain, flush;
+    ngx_buf_t               *b, *prefix;
+    ngx_chain_t             *in, *out, *cl, *ln, *data, *rest;
+    ngx_chain_t             *seq, *tail, **ll;
+    ngx_http_request_t      *r;
+    ngx_http_lua_ctx_t      *ctx;
+
+    n = lua_gettop(L);
+    if (n != 3 && n != 4) {
+        return luaL_error(L, "expecting 3 or 4 arguments, but got %d", n);
+    }
+
+    in = ngx_http_lua_body_filter_get_chain(L, &r, &ctx);
+
+    (void) ngx_http_lua_body_filter_nth_link(L, &in, 1, NULL);
+
+    data = NULL;
+
+    if (n == 4 && !lua_isnil(L, 4)) {
+        data = ngx_http_lua_body_filter_new_link(L, r, ctx, 4);
+    }
+
+    out = ngx_http_lua_body_filter_dup_chain(L, r, in);
+
+    cl = ngx_http_lua_body_filter_nth_link(L, &out, 1, &ll);
+    b = cl->buf;
+    rest = cl->next;
+
+    size = ngx_buf_size(b);
+
+    ngx_http_lua_body_filter_slice(L, size, 2, &from, &to);
+
+    if (to < from - 1) {
+        to = from - 1;  /* a pure insertion */
+    }
+
+    pre = from - 1;
+    suf = size - to;
+
+    last_buf = b->last_buf;
+    last_in_chain = b->last_in_chain;
+    flush = b->flush;
+
+    b->last_buf = 0;
+    b->last_in_chain = 0;
+    b->flush = 0;
+
+    seq = NULL;
+    tail = NULL;
+
+    if (pre > 0) {
+        if (suf > 0) {
+            /* the original buf keeps the suffix, which is sent last, so that
+             * its owner cannot reuse the memory under the prefix too early */
+
+            prefix = ngx_alloc_buf(r->pool);
+            if (prefix == NULL) {
+                return luaL_error(L, "no memory");
+            }
+
+            *prefix = *b;
+
+            prefix->tag = (ngx_buf_tag_t) &ngx_http_lua_body_filter_shadow_tag;
+            prefix->recycled = 0;
+            prefix->sync = 0;
+
+            ln = ngx_alloc_chain_link(r->pool);
+            if (ln == NULL) {
+                return luaL_error(L, "no memory");
+            }
+
+            ln->buf = prefix;
+
+        } else {
+            prefix = b;
+            ln = cl;
+        }
+
+        ngx_http_lua_body_filter_trim_buf(prefix, 0, pre);
+
+        seq = ln;
+        tail = ln;
+    }
+
+    if (data) {
+        if (tail) {
+            tail->next = data;
+
+        } else {
+            seq = data;
+        }
+
+        tail = data;
+    }
+
+    if (suf > 0) {
+        ngx_http_lua_body_filter_trim_buf(b, to, suf);
+
+        if (tail) {
+            tail->next = cl;
+
+        } else {
+            seq = cl;
+        }
+
+        tail = cl;
+
+    } else if (pre == 0) {
+        /* the whole buf is gone */
+        ngx_http_lua_body_filter_trim_buf(b, size, 0);
+    }
+
+    if (last_buf || last_in_chain || flush) {
+        if (tail == NULL) {
+            tail = ngx_http_lua_chain_get_free_buf(r->connection->log,
+                                                   r->pool,
+                                                   &ctx->free_bufs, 0);
+            if (tail == NULL) {
+                return luaL_error(L, "no memory");
+            }
+
+            seq = tail;
+        }
+
+        tail->buf->last_buf = last_buf;
+        tail->buf->last_in_chain = last_in_chain;
+        tail->buf->flush = flush;
+    }
+
+    if (tail) {
+        tail->next = rest;
+        *ll = seq;
+
+    } else {
+        *ll = rest;
+    }
+
+    lua_pushlightuserdata(L, out);
+    lua_setglobal(L, ngx_http_lua_chain_key);
+    return 0;
+}
+
+
+static ngx_chain_t *
+ngx_http_lua_body_filter_get_chain(lua_State *L, ngx_http_request_t **rp,
+    ngx_http_lua_ctx_t **ctxp)
+{
+    ngx_chain_t                 *in;
+    ngx_http_request_t          *r;
+    ngx_http_lua_ctx_t          *ctx;
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        luaL_error(L, "no request found");
+        return NULL;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        luaL_error(L, "no ctx found");
+        return NULL;
+    }
+
+    if (!(ctx->context & NGX_HTTP_LUA_CONTEXT_BODY_FILTER)) {
+        luaL_error(L, "API disabled in the context of %s",
+                   ngx_http_lua_context_name(ctx->context));
+        return NULL;
+    }
+
+    lua_getglobal(L, ngx_http_lua_chain_key);
+    in = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    *rp = r;
+    *ctxp = ctx;
+
+    return in;
+}
+
+
+/* the links of the input chain belong to the previous filters */
+static ngx_chain_t *
+ngx_http_lua_body_filter_dup_chain(lua_State *L, ngx_http_request_t *r,
+    ngx_chain_t *in)
+{
+    ngx_chain_t         *cl, *ln, *out, **ll;
+
+    ll = &out;
+
+    for (cl = in; cl; cl = cl->next) {
+        ln = ngx_alloc_chain_link(r->pool);
+        if (ln == NULL) {
+            luaL_error(L, "no memory");
+            return NULL;
+        }
+
+        ln->buf = cl->buf;
+
+        *ll = ln;
+        ll = &ln->next;
+    }
+
+    *ll = NULL;
+
+    return out;
+}
+
+
+static ngx_chain_t *
+ngx_http_lua_body_filter_nth_link(lua_State *L, ngx_chain_t **chain, int idx,
+    ngx_chain_t ***llp)
+{
+    int                  i, n;
+    ngx_chain_t        **ll;
+
+    n = luaL_checkint(L, idx);
+
+    for (i = 1, ll = chain; *ll && i < n; i++, ll = &(*ll)->next) {
+        /* void */
+    }
+
+    if (n < 1 || *ll == NULL) {
+        luaL_argerror(L, idx, "buffer index out of range");
+        return NULL;
+    }
+
+    if (llp) {
+        *llp = ll;
+    }
+
+    return *ll;
+}
+
+
+static ngx_chain_t *
+ngx_http_lua_body_filter_new_link(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, int idx)
+{
+    size_t               len;
+    const char          *data;
+    ngx_chain_t         *cl;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TSTRING:
+    case LUA_TNUMBER:
+        data = lua_tolstring(L, idx, &len);
+        break;
+
+    default:
+        luaL_error(L, "bad chunk data type: %s", luaL_typename(L, idx));
+        return NULL;
+    }
+
+    if (len == 0) {
+        return NULL;
+    }
+
+    cl = ngx_http_lua_chain_get_free_buf(r->connection->log, r->pool,
+                                         &ctx->free_bufs, len);
+    if (cl == NULL) {
+        luaL_error(L, "no memory");
+        return NULL;
+    }
+
+    cl->buf->last = ngx_copy(cl->buf->pos, data, len);
+
+    return cl;
+}
+
+
+/* turns the optional string.sub() style arguments at idx and idx + 1 into
+ * the 1-based range [from, to] of a buf of the given size */
+static void
+ngx_http_lua_body_filter_slice(lua_State *L, off_t size, int idx,
+    off_t *from, off_t *to)
+{
+    off_t           i, j;
+
+    i = (off_t) luaL_optnumber(L, idx, 1);
+    j = (off_t) luaL_optnumber(L, idx + 1, -1);
+
+    if (i < 0) {
+        i += size + 1;
+    }
+
+    if (j < 0) {
+        j += size + 1;
+    }
+
+    if (i < 1) {
+        i = 1;
+    }
+
+    if (i > size + 1) {
+        i = size + 1;
+    }
+
+    if (j > size) {
+        j = size;
+    }
+
+    *from = i;
+    *to = j;
+}
+
+
+/* keeps the len bytes of the buf starting at the offset skip */
+static void
+ngx_http_lua_body_filter_trim_buf(ngx_buf_t *b, off_t skip, off_t len)
+{
+    if (ngx_buf_in_memory(b)) {
+        b->pos += skip;
+        b->last = b->pos + len;
+    }
+
+    if (b->in_file) {
+        b->file_pos += skip;
+        b->file_last = b->file_pos + len;
+    }
+}
+
 /* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -24,6 +24,7 @@ ngx_int_t ngx_http_lua_body_filter_file(ngx_http_request_t *r,
 int ngx_http_lua_body_filter_param_get(lua_State *L);
 int ngx_http_lua_body_filter_param_set(lua_State *L, ngx_http_request_t *r,
     ngx_http_lua_ctx_t *ctx);
+void ngx_http_lua_inject_chain_api(lua_State *L);
 
 
 #endif /* _NGX_HTTP_LUA_BODYFILTERBY_H_INCLUDED_ */
@@ -0,0 +1,344 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_lua_bundle.h"
+#include "ngx_http_lua_util.h"
+
+
+#define ngx_http_lua_bundle_u32(p)                                           \
+    ((uint32_t) (p)[0] | ((uint32_t) (p)[1] << 8)                            \
+     | ((uint32_t) (p)[2] << 16) | ((uint32_t) (p)[3] << 24))
+
+
+static int ngx_http_lua_bundle_loader(lua_State *L);
+static u_char *ngx_http_lua_bundle_find(ngx_http_lua_bundle_t *b,
+    u_char *name, size_t len, size_t *code_len);
+static int ngx_http_lua_bundle_cmp(u_char *a, size_t alen, u_char *b,
+    size_t blen);
+#if !(NGX_WIN32)
+static void ngx_http_lua_bundle_cleanup(void *data);
+#endif
+
+
+char *
+ngx_http_lua_bundle_open(ngx_conf_t *cf, ngx_http_lua_main_conf_t *lmcf,
+    ngx_str_t *path)
+{
+#if (NGX_WIN32)
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "lua package bundles are not supported on this "
+                       "platform");
+    return NGX_CONF_ERROR;
+
+#else
+
+    u_char                      *p, *e, *prev;
+    size_t                       prev_len;
+    uint64_t                     off, len;
+    ngx_fd_t                     fd;
+    ngx_uint_t                   i;
+    const char                  *err;
+    ngx_file_info_t              fi;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_lua_bundle_t       *b, **bp;
+
+    if (lmcf->bundles == NULL) {
+        lmcf->bundles = ngx_array_create(cf->pool, 2,
+                                         sizeof(ngx_http_lua_bundle_t *));
+        if (lmcf->bundles == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    b = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_bundle_t));
+    if (b == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    b->name = ngx_http_lua_rebase_path(cf->pool, path->data, path->len);
+    if (b->name == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    fd = ngx_open_file(b->name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%s\" failed", b->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%s\" failed", b->name);
+        (void) ngx_close_file(fd);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_file_size(&fi) < NGX_HTTP_LUA_BUNDLE_HEADER_SIZE) {
+        (void) ngx_close_file(fd);
+        err = "file too small";
+        goto invalid;
+    }
+
+    b->size = (size_t) ngx_file_size(&fi);
+
+    /* the mapping is created by the master process so that all the
+     * workers share the same pages of the page cache */
+
+    p = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%s\" failed", b->name);
+    }
+
+    if (p == MAP_FAILED) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           "mmap(\"%s\") failed", b->name);
+        return NGX_CONF_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        (void) munmap(p, b->size);
+        return NGX_CONF_ERROR;
+    }
+
+    b->start = p;
+
+    cln->handler = ngx_http_lua_bundle_cleanup;
+    cln->data = b;
+
+    /* validate the whole index once so that the loader can trust it */
+
+    if (ngx_memcmp(p, NGX_HTTP_LUA_BUNDLE_MAGIC,
+                   sizeof(NGX_HTTP_LUA_BUNDLE_MAGIC) - 1)
+        != 0)
+    {
+        err = "bad magic";
+        goto invalid;
+    }
+
+    b->nmodules = ngx_http_lua_bundle_u32(p + 8);
+
+    if (b->nmodules > (b->size - NGX_HTTP_LUA_BUNDLE_HEADER_SIZE)
+                      / NGX_HTTP_LUA_BUNDLE_ENTRY_SIZE)
+    {
+        err = "truncated index";
+        goto invalid;
+    }
+
+    prev = NULL;
+    prev_len = 0;
+
+    for (i = 0; i < b->nmodules; i++) {
+        e = p + NGX_HTTP_LUA_BUNDLE_HEADER_SIZE
+            + i * NGX_HTTP_LUA_BUNDLE_ENTRY_SIZE;
+
+        off = ngx_http_lua_bundle_u32(e);
+        len = ngx_http_lua_bundle_u32(e + 4);
+
+        if (len == 0 || off + len > b->size) {
+            err = "bad module name";
+            goto invalid;
+        }
+
+        if (prev && ngx_http_lua_bundle_cmp(prev, prev_len, p + off,
+                                            (size_t) len)
+                    >= 0)
+        {
+            err = "module names not sorted or duplicated";
+            goto invalid;
+        }
+
+        prev = p + off;
+        prev_len = (size_t) len;
+
+        off = ngx_http_lua_bundle_u32(e + 8);
+        len = ngx_http_lua_bundle_u32(e + 12);
+
+        if (off + len > b->size) {
+            err = "bad module code";
+            goto invalid;
+        }
+    }
+
+    bp = ngx_array_push(lmcf->bundles);
+    if (bp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *bp = b;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "lua package bundle \"%s\" with %ui modules",
+                   b->name, b->nmodules);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid lua package bundle \"%s\": %s", b->name, err);
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+
+#if !(NGX_WIN32)
+
+static void
+ngx_http_lua_bundle_cleanup(void *data)
+{
+    ngx_http_lua_bundle_t       *b = data;
+
+    if (munmap(b->start, b->size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "munmap(\"%s\") failed", b->name);
+    }
+}
+
+#endif
+
+
+void
+ngx_http_lua_bundle_inject_loader(lua_State *L,
+    ngx_http_lua_main_conf_t *lmcf)
+{
+    int              i, n;
+
+    /* stack: package */
+
+    lua_getfield(L, -1, "loaders");
+
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+
+    /* right after the package.preload searcher and before the searchers
+     * walking package.path and package.cpath */
+
+    n = lua_objlen(L, -1);
+
+    for (i = n; i >= 2; i--) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_pushlightuserdata(L, lmcf);
+    lua_pushcclosure(L, ngx_http_lua_bundle_loader, 1);
+    lua_rawseti(L, -2, 2);
+
+    lua_pop(L, 1);
+}
+
+
+static int
+ngx_http_lua_bundle_loader(lua_State *L)
+{
+    u_char                      *name, *code;
+    size_t                       len, code_len;
+    ngx_uint_t                   i;
+    ngx_http_lua_bundle_t      **bundles;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    name = (u_char *) luaL_checklstring(L, 1, &len);
+
+    lmcf = lua_touserdata(L, lua_upvalueindex(1));
+
+    bundles = lmcf->bundles->elts;
+
+    for (i = 0; i < lmcf->bundles->nelts; i++) {
+        code = ngx_http_lua_bundle_find(bundles[i], name, len, &code_len);
+        if (code == NULL) {
+            continue;
+        }
+
+        dd("found module \"%s\" in bundle \"%s\"", name, bundles[i]->name);
+
+        lua_pushfstring(L, "=%s", name);
+
+        if (luaL_loadbuffer(L, (char *) code, code_len, lua_tostring(L, -1))
+            != 0)
+        {
+            return luaL_error(L, "error loading module '%s' from lua "
+                              "package bundle \"%s\":\n\t%s", name,
+                              bundles[i]->name, lua_tostring(L, -1));
+        }
+
+        return 1;
+    }
+
+    lua_pushfstring(L, "\n\tno module '%s' in the lua package bundles", name);
+    return 1;
+}
+
+
+static u_char *
+ngx_http_lua_bundle_find(ngx_http_lua_bundle_t *b, u_char *name, size_t len,
+    size_t *code_len)
+{
+    int              rc;
+    u_char          *e;
+    ngx_uint_t       lo, hi, mid;
+
+    lo = 0;
+    hi = b->nmodules;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        e = b->start + NGX_HTTP_LUA_BUNDLE_HEADER_SIZE
+            + mid * NGX_HTTP_LUA_BUNDLE_ENTRY_SIZE;
+
+        rc = ngx_http_lua_bundle_cmp(name, len,
+                                     b->start + ngx_http_lua_bundle_u32(e),
+                                     ngx_http_lua_bundle_u32(e + 4));
+
+        if (rc == 0) {
+            *code_len = ngx_http_lua_bundle_u32(e + 12);
+            return b->start + ngx_http_lua_bundle_u32(e + 8);
+        }
+
+        if (rc < 0) {
+            hi = mid;
+
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+
+static int
+ngx_http_lua_bundle_cmp(u_char *a, size_t alen, u_char *b, size_t blen)
+{
+    int              rc;
+
+    rc = ngx_memcmp(a, b, ngx_min(alen, blen));
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (alen == blen) {
+        return 0;
+    }
+
+    return alen < blen ? -1 : 1;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
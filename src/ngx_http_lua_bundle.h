@@ -0,0 +1,43 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_LUA_BUNDLE_H_INCLUDED_
+#define _NGX_HTTP_LUA_BUNDLE_H_INCLUDED_
+
+
+#include "ngx_http_lua_common.h"
+
+
+/* the bundle file layout, all integers being 32-bit little endian:
+ *
+ *  header: "NGXLUAB1" nmodules reserved
+ *  index:  nmodules * (name_offset name_len code_offset code_len),
+ *          sorted by module name in byte order
+ *  data:   the module names and code blobs the index points into
+ */
+
+#define NGX_HTTP_LUA_BUNDLE_MAGIC         "NGXLUAB1"
+#define NGX_HTTP_LUA_BUNDLE_HEADER_SIZE   16
+#define NGX_HTTP_LUA_BUNDLE_ENTRY_SIZE    16
+
+
+typedef struct {
+    u_char              *name;  /* the file path */
+    u_char              *start;
+    size_t               size;
+    ngx_uint_t           nmodules;
+} ngx_http_lua_bundle_t;
+
+
+char *ngx_http_lua_bundle_open(ngx_conf_t *cf, ngx_http_lua_main_conf_t *lmcf,
+    ngx_str_t *path);
+void ngx_http_lua_bundle_inject_loader(lua_State *L,
+    ngx_http_lua_main_conf_t *lmcf);
+
+
+#endif /* _NGX_HTTP_LUA_BUNDLE_H_INCLUDED_ */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
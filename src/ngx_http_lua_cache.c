@@ -19,6 +19,18 @@
 #include "ngx_http_lua_util.h"
 
 
+/* identifies the version of a Lua file for lua_code_cache stat */
+typedef struct {
+    ngx_file_uniq_t      uniq;
+    time_t               mtime;
+    off_t                size;
+} ngx_http_lua_file_id_t;
+
+
+static ngx_int_t ngx_http_lua_cache_stat_file(ngx_http_request_t *r,
+    const u_char *script, ngx_http_lua_file_id_t *id);
+
+
 /**
  * Find code chunk associated with the given key in code cache,
  * and push it to the top of Lua stack if found.
@@ -30,11 +42,17 @@
  *         | code chunk | <- top
  *         |     ...    |
  *
+ * When id is not NULL, the cached code is only used if it was loaded
+ * from the same version of the file.
+ *
  * */
 static ngx_int_t
 ngx_http_lua_cache_load_code(ngx_log_t *log, lua_State *L,
-    const char *key)
+    const char *key, ngx_http_lua_file_id_t *id)
 {
+    size_t       len;
+    const char  *s;
+
     int          rc;
     u_char      *err;
 
@@ -51,6 +69,32 @@ ngx_http_lua_cache_load_code(ngx_log_t *log, lua_State *L,
 
     lua_getfield(L, -1, key);    /*  sp++ */
 
+    if (id && lua_isfunction(L, -1)) {
+        /*  the file id is keyed by the closure factory loaded from it */
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+
+        s = lua_tolstring(L, -1, &len);
+
+        if (s == NULL
+            || len != sizeof(ngx_http_lua_file_id_t)
+            || ngx_memcmp(s, id, len) != 0)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "lua code cache entry \"%s\" is stale", key);
+
+            /*  drop the stale closure factory */
+            lua_pop(L, 1);
+            lua_pushnil(L);
+            lua_rawset(L, -3);
+            lua_pop(L, 1);
+
+            return NGX_DECLINED;
+        }
+
+        lua_pop(L, 1);
+    }
+
     if (lua_isfunction(L, -1)) {
         /*  call closure factory to gen new closure */
         rc = lua_pcall(L, 0, 1, 0);
@@ -100,7 +144,8 @@ ngx_http_lua_cache_load_code(ngx_log_t *log, lua_State *L,
  *
  * */
 static ngx_int_t
-ngx_http_lua_cache_store_code(lua_State *L, const char *key)
+ngx_http_lua_cache_store_code(lua_State *L, const char *key,
+    ngx_http_lua_file_id_t *id)
 {
     int rc;
 
@@ -118,6 +163,12 @@ ngx_http_lua_cache_store_code(lua_State *L, const char *key)
     lua_pushvalue(L, -2); /* closure cache closure */
     lua_setfield(L, -2, key); /* closure cache */
 
+    if (id) {
+        lua_pushvalue(L, -2); /* closure cache closure */
+        lua_pushlstring(L, (char *) id, sizeof(ngx_http_lua_file_id_t));
+        lua_rawset(L, -3); /* closure cache */
+    }
+
     /*  remove cache table, leave closure factory at top of stack */
     lua_pop(L, 1); /* closure */
 
@@ -145,7 +196,7 @@ ngx_http_lua_cache_loadbuffer(ngx_log_t *log, lua_State *L,
 
     dd("XXX cache key: [%s]", cache_key);
 
-    rc = ngx_http_lua_cache_load_code(log, L, (char *) cache_key);
+    rc = ngx_http_lua_cache_load_code(log, L, (char *) cache_key, NULL);
     if (rc == NGX_OK) {
         /*  code chunk loaded from cache, sp++ */
         dd("Code cache hit! cache key='%s', stack top=%d, script='%.*s'",
@@ -184,7 +235,7 @@ ngx_http_lua_cache_loadbuffer(ngx_log_t *log, lua_State *L,
 
     /*  store closure factory and gen new closure at the top of lua stack to
      *  code cache */
-    rc = ngx_http_lua_cache_store_code(L, (char *) cache_key);
+    rc = ngx_http_lua_cache_store_code(L, (char *) cache_key, NULL);
     if (rc != NGX_OK) {
         err = "fail to generate new closure from the closure factory";
         goto error;
@@ -202,17 +253,30 @@ error:
 
 
 ngx_int_t
-ngx_http_lua_cache_loadfile(ngx_log_t *log, lua_State *L,
+ngx_http_lua_cache_loadfile(ngx_http_request_t *r, lua_State *L,
     const u_char *script, const u_char *cache_key)
 {
-    int              n;
-    ngx_int_t        rc, errcode = NGX_ERROR;
-    u_char          *p;
-    u_char           buf[NGX_HTTP_LUA_FILE_KEY_LEN + 1];
-    const char      *err = NULL;
+    int                          n;
+    ngx_int_t                    rc, errcode = NGX_ERROR;
+    u_char                      *p;
+    u_char                       buf[NGX_HTTP_LUA_FILE_KEY_LEN + 1];
+    ngx_log_t                   *log;
+    const char                  *err = NULL;
+    ngx_http_lua_file_id_t       file_id, *id = NULL;
+    ngx_http_lua_loc_conf_t     *llcf;
 
     n = lua_gettop(L);
 
+    log = r->connection->log;
+
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    if (llcf->enable_code_cache == NGX_HTTP_LUA_CODE_CACHE_STAT
+        && ngx_http_lua_cache_stat_file(r, script, &file_id) == NGX_OK)
+    {
+        id = &file_id;
+    }
+
     /*  calculate digest of script file path */
     if (cache_key == NULL) {
         dd("CACHE file key not pre-calculated...calculating");
@@ -229,7 +293,7 @@ ngx_http_lua_cache_loadfile(ngx_log_t *log, lua_State *L,
 
     dd("XXX cache key for file: [%s]", cache_key);
 
-    rc = ngx_http_lua_cache_load_code(log, L, (char *) cache_key);
+    rc = ngx_http_lua_cache_load_code(log, L, (char *) cache_key, id);
     if (rc == NGX_OK) {
         /*  code chunk loaded from cache, sp++ */
         dd("Code cache hit! cache key='%s', stack top=%d, file path='%s'",
@@ -276,7 +340,7 @@ ngx_http_lua_cache_loadfile(ngx_log_t *log, lua_State *L,
 
     /*  store closure factory and gen new closure at the top of lua stack
      *  to code cache */
-    rc = ngx_http_lua_cache_store_code(L, (char *) cache_key);
+    rc = ngx_http_lua_cache_store_code(L, (char *) cache_key, id);
     if (rc != NGX_OK) {
         err = "fail to generate new closure from the closure factory";
         goto error;
@@ -293,4 +357,51 @@ error:
     return errcode;
 }
 
+
+/* looks up the file through the open_file_cache of the location (if any),
+ * so that the files are not stat()ed more often than
+ * open_file_cache_valid */
+static ngx_int_t
+ngx_http_lua_cache_stat_file(ngx_http_request_t *r, const u_char *script,
+    ngx_http_lua_file_id_t *id)
+{
+    ngx_str_t                    path;
+    ngx_open_file_info_t         of;
+    ngx_http_core_loc_conf_t    *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+    of.test_only = 1;
+
+    path.data = (u_char *) script;
+    path.len = ngx_strlen(script);
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
+        != NGX_OK)
+    {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, of.err,
+                       "lua failed to stat \"%V\" (%s)", &path,
+                       of.failed ? of.failed : "unknown");
+
+        /* use the cached code if any, otherwise the Lua loader will
+         * report the error */
+        return NGX_ERROR;
+    }
+
+    /* zero the padding bytes as well since the id is compared as a whole */
+    ngx_memzero(id, sizeof(ngx_http_lua_file_id_t));
+
+    id->uniq = of.uniq;
+    id->mtime = of.mtime;
+    id->size = of.size;
+
+    return NGX_OK;
+}
+
 /* vi:set ft=c ts=4 sw=4 et fdm=marker: */
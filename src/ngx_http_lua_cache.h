@@ -15,7 +15,7 @@
 ngx_int_t ngx_http_lua_cache_loadbuffer(ngx_log_t *log, lua_State *L,
     const u_char *src, size_t src_len, const u_char *cache_key,
     const char *name);
-ngx_int_t ngx_http_lua_cache_loadfile(ngx_log_t *log, lua_State *L,
+ngx_int_t ngx_http_lua_cache_loadfile(ngx_http_request_t *r, lua_State *L,
     const u_char *script, const u_char *cache_key);
 
 
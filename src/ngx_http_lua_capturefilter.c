@@ -18,6 +18,18 @@
 #include "ngx_http_lua_subrequest.h"
 
 
+/*
+ * keeps a streamed subrequest from being finalized while its buffers wait
+ * for the reader. r->buffered is only 4 bits wide and all of them belong
+ * to the stock filters, so we borrow the bit of the SSI filter: it comes
+ * after us in the filter chain and never sees a captured subrequest since
+ * we swallow both its header and its body. The bit of the copy filter
+ * cannot be shared because that filter runs before us and resets its own
+ * bit on every call.
+ */
+#define NGX_HTTP_LUA_CAPTURE_BUFFERED  NGX_HTTP_SSI_BUFFERED
+
+
 ngx_http_output_header_filter_pt ngx_http_lua_next_header_filter;
 ngx_http_output_body_filter_pt ngx_http_lua_next_body_filter;
 
@@ -25,6 +37,8 @@ ngx_http_output_body_filter_pt ngx_http_lua_next_body_filter;
 static ngx_int_t ngx_http_lua_capture_header_filter(ngx_http_request_t *r);
 static ngx_int_t ngx_http_lua_capture_body_filter(ngx_http_request_t *r,
     ngx_chain_t *in);
+static ngx_int_t ngx_http_lua_capture_stream_body(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_chain_t *in);
 
 
 ngx_int_t
@@ -83,6 +97,7 @@ ngx_http_lua_capture_header_filter(ngx_http_request_t *r)
 
                 ctx->capture = old_ctx->capture;
                 ctx->index = old_ctx->index;
+                ctx->stream = old_ctx->stream;
                 ctx->body = NULL;
                 ctx->last_body = &ctx->body;
                 psr_data->ctx = ctx;
@@ -103,6 +118,13 @@ ngx_http_lua_capture_header_filter(ngx_http_request_t *r)
             r->header_only = 1;
         }
 
+        if (ctx->stream) {
+            ctx->stream->status = r->headers_out.status;
+            ctx->stream->header_ready = 1;
+
+            ngx_http_lua_subrequest_stream_wakeup(ctx->stream);
+        }
+
         return NGX_OK;
     }
 
@@ -121,12 +143,16 @@ ngx_http_lua_capture_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua capture body filter, uri \"%V\"", &r->uri);
 
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    if (ctx && ctx->stream && !ctx->run_post_subrequest) {
+        return ngx_http_lua_capture_stream_body(r, ctx, in);
+    }
+
     if (in == NULL) {
         return ngx_http_lua_next_body_filter(r, NULL);
     }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
-
     if (!ctx || !ctx->capture) {
         dd("no ctx or no capture %.*s", (int) r->uri.len, r->uri.data);
 
@@ -173,4 +199,60 @@ ngx_http_lua_capture_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     return NGX_OK;
 }
 
+
+static ngx_int_t
+ngx_http_lua_capture_stream_body(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_chain_t *in)
+{
+    ngx_chain_t                         *cl, *ln;
+    ngx_http_lua_subrequest_stream_t    *st;
+
+    st = ctx->stream;
+
+    for (cl = in; cl; cl = cl->next) {
+        if (cl->buf->last_in_chain || cl->buf->last_buf) {
+            ctx->seen_last_for_subreq = 1;
+        }
+
+        if (st->discard
+            || !ngx_buf_in_memory(cl->buf)
+            || cl->buf->pos == cl->buf->last)
+        {
+            cl->buf->pos = cl->buf->last;
+            cl->buf->file_pos = cl->buf->file_last;
+            continue;
+        }
+
+        /* keep the buffer busy until the reader copies it out */
+
+        ln = ngx_alloc_chain_link(r->pool);
+        if (ln == NULL) {
+            return NGX_ERROR;
+        }
+
+        ln->buf = cl->buf;
+        ln->next = NULL;
+
+        *st->last_pending = ln;
+        st->last_pending = &ln->next;
+    }
+
+    if (st->pending == NULL) {
+        st->blocked = 0;
+        r->buffered &= ~NGX_HTTP_LUA_CAPTURE_BUFFERED;
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua capture body filter waiting for the stream reader, "
+                   "uri \"%V\"", &r->uri);
+
+    st->blocked = 1;
+    r->buffered |= NGX_HTTP_LUA_CAPTURE_BUFFERED;
+
+    ngx_http_lua_subrequest_stream_wakeup(st);
+
+    return NGX_AGAIN;
+}
+
 /* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -103,6 +103,10 @@ typedef struct {
 #define NGX_HTTP_LUA_CONTEXT_SSL_CERT       0x400
 
 
+/* the "stat" value of lua_code_cache; "off" and "on" are 0 and 1 */
+#define NGX_HTTP_LUA_CODE_CACHE_STAT        2
+
+
 #ifndef NGX_LUA_NO_FFI_API
 #define NGX_HTTP_LUA_FFI_NO_REQ_CTX         -100
 #define NGX_HTTP_LUA_FFI_BAD_CONTEXT        -101
@@ -119,6 +123,8 @@ typedef struct ngx_http_lua_balancer_peer_data_s
 
 typedef struct ngx_http_lua_semaphore_mm_s  ngx_http_lua_semaphore_mm_t;
 
+typedef struct ngx_http_lua_logbuf_s  ngx_http_lua_logbuf_t;
+
 
 typedef ngx_int_t (*ngx_http_lua_main_conf_handler_pt)(ngx_log_t *log,
     ngx_http_lua_main_conf_t *lmcf, lua_State *L);
@@ -147,24 +153,59 @@ struct ngx_http_lua_main_conf_s {
     ngx_int_t            max_running_timers;
     ngx_int_t            running_timers;
 
+#if (NGX_HTTP_SSL)
+    ngx_int_t            ssl_max_pending_tasks;
+    ngx_int_t            ssl_pending_tasks;  /* OpenSSL tasks in the thread
+                                                pool */
+#if (NGX_THREADS)
+    ngx_thread_pool_t   *ssl_thread_pool;
+#endif
+#endif
+
     ngx_connection_t    *watcher;  /* for watching the process exit event */
 
+    ngx_pool_t         **fake_pools;  /* recycled pools of fake requests */
+    ngx_uint_t           fake_pools_free;
+    ngx_uint_t           fake_pools_reused;
+    ngx_uint_t           fake_pools_created;
+
 #if (NGX_PCRE)
     ngx_int_t            regex_cache_entries;
     ngx_int_t            regex_cache_max_entries;
     ngx_int_t            regex_match_limit;
+
+    ngx_rbtree_t         regex_cache_rbtree;
+    ngx_rbtree_node_t    regex_cache_sentinel;
+    ngx_queue_t          regex_cache_queue;  /* LRU queue of the compiled
+                                                regexes, hottest first */
+
+    ngx_uint_t           regex_cache_hits;
+    ngx_uint_t           regex_cache_misses;
+    ngx_uint_t           regex_cache_evictions;
 #endif
 
     ngx_array_t         *shm_zones;  /* of ngx_shm_zone_t* */
 
+    ngx_array_t         *bundles;  /* of ngx_http_lua_bundle_t* */
+
     ngx_array_t         *preload_hooks; /* of ngx_http_lua_preload_hook_t */
 
     ngx_flag_t           postponed_to_rewrite_phase_end;
     ngx_flag_t           postponed_to_access_phase_end;
 
+    ngx_flag_t           reuse_phase_env;
+    ngx_uint_t           phase_envs_used;  /* pooled envs of the running
+                                              header_filter_by_lua*,
+                                              body_filter_by_lua*, and
+                                              log_by_lua* handlers */
+
     ngx_http_lua_main_conf_handler_pt    init_handler;
     ngx_str_t                            init_src;
 
+    ngx_flag_t           freeze_init_heap;
+    size_t               init_heap_size;  /* size of the Lua heap frozen
+                                             after init_by_lua* */
+
     ngx_http_lua_main_conf_handler_pt    init_worker_handler;
     ngx_str_t                            init_worker_src;
 
@@ -178,6 +219,8 @@ struct ngx_http_lua_main_conf_s {
 
     ngx_http_lua_semaphore_mm_t    *semaphore_mm;
 
+    ngx_http_lua_logbuf_t          *logbuf;  /* lua_log_buffer */
+
     unsigned             requires_header_filter:1;
     unsigned             requires_body_filter:1;
     unsigned             requires_capture_filter:1;
@@ -214,13 +257,18 @@ typedef struct {
     ngx_uint_t              ssl_verify_depth;
     ngx_str_t               ssl_trusted_certificate;
     ngx_str_t               ssl_crl;
+    ngx_shm_zone_t         *ssl_session_cache;  /* lua_shared_dict holding
+                                                   SSL sessions shared by
+                                                   all workers */
 #endif
 
     ngx_flag_t              force_read_body; /* whether force request body to
                                                 be read */
 
     ngx_flag_t              enable_code_cache; /* whether to enable
-                                                  code cache */
+                                                  code cache, or
+                                                  NGX_HTTP_LUA_CODE_CACHE_STAT
+                                                  to also check the files */
 
     ngx_flag_t              http10_buffering;
 
@@ -283,6 +331,7 @@ typedef struct {
 
     ngx_flag_t                       transform_underscores_in_resp_headers;
     ngx_flag_t                       log_socket_errors;
+    ngx_flag_t                       body_filter_in_memory;
     ngx_flag_t                       check_client_abort;
     ngx_flag_t                       use_default_type;
 } ngx_http_lua_loc_conf_t;
@@ -309,12 +358,27 @@ typedef struct ngx_http_lua_co_ctx_s  ngx_http_lua_co_ctx_t;
 
 typedef struct ngx_http_lua_posted_thread_s  ngx_http_lua_posted_thread_t;
 
+typedef struct ngx_http_lua_subrequest_stream_s
+    ngx_http_lua_subrequest_stream_t;
+
+typedef struct ngx_http_lua_headers_in_index_s
+    ngx_http_lua_headers_in_index_t;
+
+typedef struct ngx_http_lua_pinned_str_s  ngx_http_lua_pinned_str_t;
+
 struct ngx_http_lua_posted_thread_s {
     ngx_http_lua_co_ctx_t               *co_ctx;
     ngx_http_lua_posted_thread_t        *next;
 };
 
 
+struct ngx_http_lua_pinned_str_s {
+    ngx_buf_t                           *buf;  /* points into the string */
+    int                                  ref;  /* anchor in the Lua registry */
+    ngx_http_lua_pinned_str_t           *next;
+};
+
+
 enum {
     NGX_HTTP_LUA_SUBREQ_TRUNCATED = 1
 };
@@ -425,6 +489,24 @@ typedef struct ngx_http_lua_ctx_s {
 
     ngx_chain_t            **last_body; /* for the "body" field */
 
+    ngx_http_lua_subrequest_stream_t   *stream; /* the stream reading the
+                                                  response body of the
+                                                  current subrequest */
+
+    ngx_http_lua_subrequest_stream_t   *streams; /* streamed subrequests
+                                                   issued by the current
+                                                   request */
+
+    ngx_http_lua_headers_in_index_t    *headers_in_index; /* built on demand
+                                                           by header
+                                                           lookups */
+
+    ngx_http_lua_pinned_str_t          *pinned_strs; /* Lua strings sent by
+                                                       ngx.print/ngx.say
+                                                       without copying */
+
+    ngx_http_lua_pinned_str_t          *free_pinned_strs;
+
     ngx_str_t                exec_uri;
     ngx_str_t                exec_args;
 
@@ -496,6 +578,9 @@ typedef struct ngx_http_lua_ctx_s {
                                                   socket */
     unsigned         acquired_raw_req_socket:1;  /* whether a raw req socket
                                                     is acquired */
+    unsigned         pinned_strs_cleanup:1; /* whether the pool cleanup
+                                               releasing pinned_strs is
+                                               registered */
 } ngx_http_lua_ctx_t;
 
 
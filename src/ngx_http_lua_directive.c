@@ -24,6 +24,8 @@
 #include "ngx_http_lua_initby.h"
 #include "ngx_http_lua_initworkerby.h"
 #include "ngx_http_lua_shdict.h"
+#include "ngx_http_lua_logbuf.h"
+#include "ngx_http_lua_bundle.h"
 #include "ngx_http_lua_ssl_certby.h"
 #include "ngx_http_lua_lex.h"
 
@@ -75,8 +77,13 @@ ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_str_t                  *value, name;
     ngx_shm_zone_t             *zone;
     ngx_shm_zone_t            **zp;
-    ngx_http_lua_shdict_ctx_t  *ctx;
-    ssize_t                     size;
+    ngx_http_lua_shdict_ctx_t  *ctx, *sctx;
+    ngx_pool_cleanup_t         *cln;
+    ssize_t                     size, l1_size;
+    ngx_msec_t                  l1_ttl;
+    ngx_str_t                   s;
+    ngx_uint_t                  i;
+    ngx_int_t                   shards;
 
     if (lmcf->shm_zones == NULL) {
         lmcf->shm_zones = ngx_palloc(cf->pool, sizeof(ngx_array_t));
@@ -112,14 +119,137 @@ ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    l1_size = 0;
+    l1_ttl = NGX_CONF_UNSET_MSEC;
+    shards = 1;
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards == NGX_ERROR || shards == 0 || shards > 256) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "l1_size=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            l1_size = ngx_parse_size(&s);
+            if (l1_size == NGX_ERROR || l1_size == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "l1_ttl=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            l1_ttl = ngx_parse_time(&s, 0);
+            if (l1_ttl == (ngx_msec_t) NGX_ERROR || l1_ttl == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (l1_ttl != NGX_CONF_UNSET_MSEC && l1_size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"l1_ttl\" requires \"l1_size\" for lua shared "
+                           "dict \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (shards > 1) {
+#if !(NGX_HAVE_ATOMIC_OPS)
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"shards\" requires atomic operations for lua "
+                           "shared dict \"%V\"", &name);
+        return NGX_CONF_ERROR;
+#endif
+
+        if (ngx_http_lua_shdict_shard_pages((size_t) size, name.len,
+                                            (ngx_uint_t) shards)
+            < NGX_HTTP_LUA_SHDICT_MIN_SHARD_PAGES)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "lua shared dict size \"%V\" is too small "
+                               "for %i shards", &value[2], shards);
+            return NGX_CONF_ERROR;
+        }
+
+        if (l1_size && l1_size / shards == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"l1_size\" is too small for %i shards",
+                               shards);
+            return NGX_CONF_ERROR;
+        }
+    }
+
     ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_shdict_ctx_t));
     if (ctx == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    ctx->name = name;
-    ctx->main_conf = lmcf;
-    ctx->log = &cf->cycle->new_log;
+    ctx->shards = ngx_palloc(cf->pool,
+                             shards * sizeof(ngx_http_lua_shdict_ctx_t *));
+    if (ctx->shards == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->nshards = (ngx_uint_t) shards;
+
+    for (i = 0; i < ctx->nshards; i++) {
+
+        if (i == 0) {
+            sctx = ctx;
+
+        } else {
+            sctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_shdict_ctx_t));
+            if (sctx == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        ctx->shards[i] = sctx;
+
+        sctx->name = name;
+        sctx->main_conf = lmcf;
+        sctx->log = &cf->cycle->new_log;
+
+        if (l1_size == 0) {
+            continue;
+        }
+
+        /* every shard keeps its own L1 cache keyed by its own version */
+
+        sctx->l1_max_size = (size_t) l1_size / shards;
+        sctx->l1_ttl = (l1_ttl == NGX_CONF_UNSET_MSEC) ? 1000 : l1_ttl;
+
+        ngx_rbtree_init(&sctx->l1_rbtree, &sctx->l1_sentinel,
+                        ngx_str_rbtree_insert_value);
+
+        ngx_queue_init(&sctx->l1_queue);
+
+        cln = ngx_pool_cleanup_add(cf->pool, 0);
+        if (cln == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        cln->handler = ngx_http_lua_shdict_l1_cleanup;
+        cln->data = sctx;
+    }
 
     zone = ngx_shared_memory_add(cf, &name, (size_t) size,
                                  &ngx_http_lua_module);
@@ -149,27 +279,181 @@ ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     lmcf->requires_shm = 1;
 
     return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid lua shared dict parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+
+char *
+ngx_http_lua_log_buffer(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_lua_main_conf_t   *lmcf = conf;
+
+    ngx_str_t                  *value, s;
+    ngx_int_t                   size, batch;
+    ngx_msec_t                  interval;
+    ngx_uint_t                  i, drop_oldest;
+    ngx_http_lua_logbuf_t      *lb;
+
+    if (lmcf->logbuf) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_atoi(value[1].data, value[1].len);
+    if (size == NGX_ERROR || size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid lua log buffer size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    batch = NGX_CONF_UNSET;
+    interval = 1000;
+    drop_oldest = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "batch=", 6) == 0) {
+
+            batch = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (batch == NGX_ERROR || batch == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "flush=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            interval = ngx_parse_time(&s, 0);
+            if (interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "drop=oldest") == 0) {
+            drop_oldest = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "drop=newest") == 0) {
+            drop_oldest = 0;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (batch == NGX_CONF_UNSET) {
+        batch = ngx_min(size, 100);
+
+    } else if (batch > size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"batch\" is larger than the lua log buffer "
+                           "size %i", size);
+        return NGX_CONF_ERROR;
+    }
+
+    lb = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_logbuf_t));
+    if (lb == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    lb->size = (ngx_uint_t) size;
+    lb->batch = (ngx_uint_t) batch;
+    lb->interval = interval;
+    lb->drop_oldest = drop_oldest;
+
+    lmcf->logbuf = lb;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid lua log buffer parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
 }
 
 
+#if (NGX_HTTP_SSL)
+
+char *
+ngx_http_lua_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_lua_loc_conf_t    *llcf = conf;
+
+    ngx_str_t                  *value;
+
+    if (llcf->ssl_session_cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        llcf->ssl_session_cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    /* the zone itself must be declared by lua_shared_dict */
+
+    llcf->ssl_session_cache = ngx_shared_memory_add(cf, &value[1], 0,
+                                                    &ngx_http_lua_module);
+    if (llcf->ssl_session_cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+#endif
+
+
 char *
 ngx_http_lua_code_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char             *p = conf;
     ngx_flag_t       *fp;
-    char             *ret;
+    ngx_str_t        *value;
+
+    fp = (ngx_flag_t *) (p + cmd->offset);
 
-    ret = ngx_conf_set_flag_slot(cf, cmd, conf);
-    if (ret != NGX_CONF_OK) {
-        return ret;
+    if (*fp != NGX_CONF_UNSET) {
+        return "is duplicate";
     }
 
-    fp = (ngx_flag_t *) (p + cmd->offset);
+    value = cf->args->elts;
+
+    if (ngx_strcasecmp(value[1].data, (u_char *) "on") == 0) {
+        *fp = 1;
+
+    } else if (ngx_strcasecmp(value[1].data, (u_char *) "stat") == 0) {
+        *fp = NGX_HTTP_LUA_CODE_CACHE_STAT;
+
+    } else if (ngx_strcasecmp(value[1].data, (u_char *) "off") == 0) {
+        *fp = 0;
 
-    if (!*fp) {
         ngx_conf_log_error(NGX_LOG_ALERT, cf, 0,
                            "lua_code_cache is off; this will hurt "
                            "performance");
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive, "
+                           "it must be \"on\", \"off\", or \"stat\"",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
     }
 
     return NGX_CONF_OK;
@@ -218,6 +502,24 @@ ngx_http_lua_package_path(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+char *
+ngx_http_lua_package_bundle(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_lua_main_conf_t *lmcf = conf;
+    ngx_str_t                *value;
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid lua package bundle \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    return ngx_http_lua_bundle_open(cf, lmcf, &value[1]);
+}
+
+
 #if defined(NDK) && NDK
 char *
 ngx_http_lua_set_by_lua_block(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -407,7 +709,7 @@ ngx_http_lua_filter_set_by_lua_file(ngx_http_request_t *r, ngx_str_t *val,
     L = ngx_http_lua_get_lua_vm(r, NULL);
 
     /*  load Lua script file (w/ cache)        sp = 1 */
-    rc = ngx_http_lua_cache_loadfile(r->connection->log, L, script_path,
+    rc = ngx_http_lua_cache_loadfile(r, L, script_path,
                                      filter_data->key);
     if (rc != NGX_OK) {
         return NGX_ERROR;
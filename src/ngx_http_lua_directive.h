@@ -13,10 +13,17 @@
 
 
 char *ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_lua_log_buffer(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+#if (NGX_HTTP_SSL)
+char *ngx_http_lua_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+#endif
 char *ngx_http_lua_package_cpath(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 char *ngx_http_lua_package_path(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+char *ngx_http_lua_package_bundle(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 char *ngx_http_lua_content_by_lua_block(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 char *ngx_http_lua_content_by_lua(ngx_conf_t *cf, ngx_command_t *cmd,
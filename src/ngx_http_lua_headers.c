@@ -26,6 +26,7 @@ static int ngx_http_lua_ngx_req_get_headers(lua_State *L);
 static int ngx_http_lua_ngx_req_header_clear(lua_State *L);
 static int ngx_http_lua_ngx_req_header_set(lua_State *L);
 static int ngx_http_lua_ngx_resp_get_headers(lua_State *L);
+static int ngx_http_lua_headers_table_index(lua_State *L);
 
 
 static int
@@ -955,30 +956,62 @@ ngx_http_lua_inject_req_header_api(lua_State *L)
 void
 ngx_http_lua_create_headers_metatable(ngx_log_t *log, lua_State *L)
 {
-    int rc;
-    const char buf[] =
-        "local tb, key = ...\n"
-        "local new_key = string.gsub(string.lower(key), '_', '-')\n"
-        "if new_key ~= key then return tb[new_key] else return nil end";
-
     lua_pushlightuserdata(L, &ngx_http_lua_headers_metatable_key);
 
     /* metatable for ngx.req.get_headers(_, true) and
      * ngx.resp.get_headers(_, true) */
     lua_createtable(L, 0, 1);
 
-    rc = luaL_loadbuffer(L, buf, sizeof(buf) - 1, "=headers metatable");
-    if (rc != 0) {
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-                      "failed to load Lua code for the metamethod for "
-                      "headers: %i: %s", rc, lua_tostring(L, -1));
+    lua_pushcfunction(L, ngx_http_lua_headers_table_index);
+    lua_setfield(L, -2, "__index");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+
+/* retries a missed lookup in a headers table with the key lowercased and
+ * with "_" replaced by "-" */
+static int
+ngx_http_lua_headers_table_index(lua_State *L)
+{
+    u_char              *p, c;
+    size_t               len, i;
+    unsigned             changed;
+    luaL_Buffer          b;
 
-        lua_pop(L, 3);
-        return;
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        lua_pushnil(L);
+        return 1;
     }
 
-    lua_setfield(L, -2, "__index");
-    lua_rawset(L, LUA_REGISTRYINDEX);
+    p = (u_char *) lua_tolstring(L, 2, &len);
+
+    changed = 0;
+
+    luaL_buffinit(L, &b);
+
+    for (i = 0; i < len; i++) {
+        c = ngx_tolower(p[i]);
+
+        if (c == '_') {
+            c = '-';
+        }
+
+        if (c != p[i]) {
+            changed = 1;
+        }
+
+        luaL_addchar(&b, c);
+    }
+
+    luaL_pushresult(&b);
+
+    if (!changed) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_rawget(L, 1);
+    return 1;
 }
 
 
@@ -1064,6 +1097,37 @@ ngx_http_lua_ffi_req_get_headers(ngx_http_request_t *r,
 }
 
 
+int
+ngx_http_lua_ffi_req_get_header(ngx_http_request_t *r, const u_char *key,
+    size_t key_len, ngx_http_lua_ffi_str_t *values, int max_nvalues)
+{
+    int                  found;
+    ngx_uint_t           next;
+    ngx_table_elt_t     *h;
+
+    if (r->connection->fd == (ngx_socket_t) -1) {
+        return NGX_HTTP_LUA_FFI_BAD_CONTEXT;
+    }
+
+    found = 0;
+    next = 0;
+
+    while (found < max_nvalues) {
+        h = ngx_http_lua_find_input_header(r, (u_char *) key, key_len, &next);
+        if (h == NULL) {
+            break;
+        }
+
+        values[found].data = h->value.data;
+        values[found].len = (int) h->value.len;
+
+        found++;
+    }
+
+    return found;
+}
+
+
 int
 ngx_http_lua_ffi_set_resp_header(ngx_http_request_t *r, const u_char *key_data,
     size_t key_len, int is_nil, const u_char *sval, size_t sval_len,
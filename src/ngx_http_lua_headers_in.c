@@ -41,6 +41,11 @@ static ngx_int_t ngx_http_set_host_header(ngx_http_request_t *r,
     ngx_http_lua_header_val_t *hv, ngx_str_t *value);
 static ngx_int_t ngx_http_lua_rm_header_helper(ngx_list_t *l,
     ngx_list_part_t *cur, ngx_uint_t i);
+static ngx_uint_t ngx_http_lua_header_name_hash(u_char *name, size_t len);
+static ngx_int_t ngx_http_lua_header_name_eq(u_char *a, u_char *b,
+    size_t len);
+static ngx_http_lua_headers_in_index_t *ngx_http_lua_get_headers_in_index(
+    ngx_http_request_t *r);
 
 
 static ngx_http_lua_set_header_t  ngx_http_lua_set_handlers[] = {
@@ -651,11 +656,19 @@ ngx_http_lua_set_input_header(ngx_http_request_t *r, ngx_str_t key,
 {
     ngx_http_lua_header_val_t         hv;
     ngx_http_lua_set_header_t        *handlers = ngx_http_lua_set_handlers;
+    ngx_http_lua_ctx_t               *ctx;
 
     ngx_uint_t                        i;
 
     dd("set header value: %.*s", (int) value.len, value.data);
 
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    if (ctx && ctx->headers_in_index) {
+        /* the handlers below may remove list elements or move them around */
+        ctx->headers_in_index->valid = 0;
+    }
+
     hv.hash = ngx_hash_key_lc(key.data, key.len);
     hv.key = key;
 
@@ -827,4 +840,218 @@ ngx_http_lua_rm_header_helper(ngx_list_t *l, ngx_list_part_t *cur,
     return NGX_OK;
 }
 
+
+/* header names are matched the way $http_NAME does it: ignoring case and
+ * treating "_" and "-" as the same character */
+static ngx_uint_t
+ngx_http_lua_header_name_hash(u_char *name, size_t len)
+{
+    u_char          c;
+    ngx_uint_t      hash;
+
+    hash = 0;
+
+    while (len--) {
+        c = ngx_tolower(*name);
+        name++;
+
+        hash = ngx_hash(hash, c == '_' ? '-' : c);
+    }
+
+    return hash;
+}
+
+
+static ngx_int_t
+ngx_http_lua_header_name_eq(u_char *a, u_char *b, size_t len)
+{
+    u_char          c1, c2;
+
+    while (len--) {
+        c1 = ngx_tolower(*a);
+        c2 = ngx_tolower(*b);
+        a++;
+        b++;
+
+        if (c1 == c2
+            || ((c1 == '_' || c1 == '-') && (c2 == '_' || c2 == '-')))
+        {
+            continue;
+        }
+
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static ngx_http_lua_headers_in_index_t *
+ngx_http_lua_get_headers_in_index(ngx_http_request_t *r)
+{
+    size_t                               size;
+    ngx_uint_t                           i, n, hash;
+    ngx_list_part_t                     *part;
+    ngx_table_elt_t                     *h;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_lua_header_slot_t          *slot;
+    ngx_http_lua_headers_in_index_t     *idx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    n = 0;
+
+    for (part = &r->headers_in.headers.part; part; part = part->next) {
+        n += part->nelts;
+    }
+
+    idx = ctx->headers_in_index;
+
+    /* other modules may also add or remove request headers, which we can
+     * only notice by the change in their number */
+
+    if (idx && idx->valid && idx->nheaders == n) {
+        return idx;
+    }
+
+    if (idx == NULL) {
+        idx = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_headers_in_index_t));
+        if (idx == NULL) {
+            return NULL;
+        }
+
+        ctx->headers_in_index = idx;
+    }
+
+    size = 16;
+    while (size < 2 * n) {
+        size <<= 1;
+    }
+
+    if (idx->slots == NULL || idx->mask + 1 < size) {
+        idx->slots = ngx_palloc(r->pool,
+                                size * sizeof(ngx_http_lua_header_slot_t));
+        if (idx->slots == NULL) {
+            return NULL;
+        }
+
+        idx->mask = size - 1;
+    }
+
+    ngx_memzero(idx->slots,
+                (idx->mask + 1) * sizeof(ngx_http_lua_header_slot_t));
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        hash = ngx_http_lua_header_name_hash(h[i].key.data, h[i].key.len);
+
+        /* linear probing keeps the values of a multi-value header in their
+         * original order */
+
+        for (slot = &idx->slots[hash & idx->mask];
+             slot->header;
+             slot = &idx->slots[(slot - idx->slots + 1) & idx->mask])
+        {
+            /* void */
+        }
+
+        slot->hash = hash;
+        slot->header = &h[i];
+    }
+
+    idx->nheaders = n;
+    idx->valid = 1;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua indexed %ui request headers", n);
+
+    return idx;
+}
+
+
+/* returns the request headers named "name" one at a time; *next must be
+ * 0 for the first call and be kept intact between the calls */
+ngx_table_elt_t *
+ngx_http_lua_find_input_header(ngx_http_request_t *r, u_char *name,
+    size_t len, ngx_uint_t *next)
+{
+    ngx_uint_t                           i, n, hash;
+    ngx_list_part_t                     *part;
+    ngx_table_elt_t                     *h;
+    ngx_http_lua_header_slot_t          *slot;
+    ngx_http_lua_headers_in_index_t     *idx;
+
+    idx = ngx_http_lua_get_headers_in_index(r);
+
+    if (idx == NULL) {
+        /* no lua ctx or no memory: fall back to a linear scan */
+
+        n = 0;
+        part = &r->headers_in.headers.part;
+        h = part->elts;
+
+        for (i = 0; /* void */; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    return NULL;
+                }
+
+                part = part->next;
+                h = part->elts;
+                i = 0;
+            }
+
+            if (n++ < *next) {
+                continue;
+            }
+
+            if (h[i].key.len == len
+                && ngx_http_lua_header_name_eq(h[i].key.data, name, len))
+            {
+                *next = n;
+                return &h[i];
+            }
+        }
+    }
+
+    hash = ngx_http_lua_header_name_hash(name, len);
+
+    i = *next ? *next - 1 : hash & idx->mask;
+
+    for ( ;; ) {
+        slot = &idx->slots[i];
+
+        if (slot->header == NULL) {
+            return NULL;
+        }
+
+        i = (i + 1) & idx->mask;
+
+        if (slot->hash == hash
+            && slot->header->key.len == len
+            && ngx_http_lua_header_name_eq(slot->header->key.data, name, len))
+        {
+            *next = i + 1;
+            return slot->header;
+        }
+    }
+}
+
 /* vi:set ft=c ts=4 sw=4 et fdm=marker: */
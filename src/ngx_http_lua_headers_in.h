@@ -13,8 +13,24 @@
 #include "ngx_http_lua_common.h"
 
 
+typedef struct {
+    ngx_uint_t                   hash;
+    ngx_table_elt_t             *header;
+} ngx_http_lua_header_slot_t;
+
+
+struct ngx_http_lua_headers_in_index_s {
+    ngx_http_lua_header_slot_t  *slots;     /* open addressing */
+    ngx_uint_t                   mask;
+    ngx_uint_t                   nheaders;  /* size of headers_in when built */
+    unsigned                     valid:1;
+};
+
+
 ngx_int_t ngx_http_lua_set_input_header(ngx_http_request_t *r, ngx_str_t key,
     ngx_str_t value, unsigned override);
+ngx_table_elt_t *ngx_http_lua_find_input_header(ngx_http_request_t *r,
+    u_char *name, size_t len, ngx_uint_t *next);
 
 
 #endif /* _NGX_HTTP_LUA_HEADERS_IN_H_INCLUDED_ */
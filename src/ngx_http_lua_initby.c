@@ -13,6 +13,10 @@
 #include "ngx_http_lua_util.h"
 
 
+static void ngx_http_lua_freeze_init_heap(ngx_log_t *log,
+    ngx_http_lua_main_conf_t *lmcf, lua_State *L);
+
+
 ngx_int_t
 ngx_http_lua_init_by_inline(ngx_log_t *log, ngx_http_lua_main_conf_t *lmcf,
     lua_State *L)
@@ -23,7 +27,15 @@ ngx_http_lua_init_by_inline(ngx_log_t *log, ngx_http_lua_main_conf_t *lmcf,
                              lmcf->init_src.len, "=init_by_lua")
              || ngx_http_lua_do_call(log, L);
 
-    return ngx_http_lua_report(log, L, status, "init_by_lua");
+    if (ngx_http_lua_report(log, L, status, "init_by_lua") != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (lmcf->freeze_init_heap) {
+        ngx_http_lua_freeze_init_heap(log, lmcf, L);
+    }
+
+    return NGX_OK;
 }
 
 
@@ -36,7 +48,54 @@ ngx_http_lua_init_by_file(ngx_log_t *log, ngx_http_lua_main_conf_t *lmcf,
     status = luaL_loadfile(L, (char *) lmcf->init_src.data)
              || ngx_http_lua_do_call(log, L);
 
-    return ngx_http_lua_report(log, L, status, "init_by_lua_file");
+    if (ngx_http_lua_report(log, L, status, "init_by_lua_file") != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (lmcf->freeze_init_heap) {
+        ngx_http_lua_freeze_init_heap(log, lmcf, L);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * LuaJIT keeps the GC marks in the object headers, so the first full
+ * cycle of a worker process writes to every page holding a live object
+ * inherited from the master and there is no way to exempt objects from
+ * marking. What we can do before forking is to leave nothing but live
+ * objects behind: otherwise every worker process sweeps the same garbage
+ * and then reuses the freed holes, copying the pages around them too.
+ */
+
+static void
+ngx_http_lua_freeze_init_heap(ngx_log_t *log, ngx_http_lua_main_conf_t *lmcf,
+    lua_State *L)
+{
+    int              i;
+    size_t           size, prev;
+
+    /* ngx_http_lua_report() has just run a full cycle, but objects
+     * resurrected by __gc metamethods only go away in the next ones */
+
+    size = ngx_http_lua_gc_size(L);
+
+    for (i = 0; i < 4; i++) {
+        prev = size;
+
+        lua_gc(L, LUA_GCCOLLECT, 0);
+
+        size = ngx_http_lua_gc_size(L);
+        if (size >= prev) {
+            break;
+        }
+    }
+
+    lmcf->init_heap_size = size;
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "lua init heap frozen at %uz bytes", size);
 }
 
 /* vi:set ft=c ts=4 sw=4 et fdm=marker: */
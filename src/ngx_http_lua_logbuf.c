@@ -0,0 +1,428 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_lua_logbuf.h"
+#include "ngx_http_lua_util.h"
+#include "ngx_http_lua_contentby.h"
+
+
+static int ngx_http_lua_logbuf_append(lua_State *L);
+static int ngx_http_lua_logbuf_wait(lua_State *L);
+static int ngx_http_lua_logbuf_stats(lua_State *L);
+static int ngx_http_lua_logbuf_push_batch(lua_State *L,
+    ngx_http_lua_logbuf_t *lb);
+static void ngx_http_lua_logbuf_handler(ngx_event_t *ev);
+static void ngx_http_lua_logbuf_cleanup(void *data);
+static ngx_int_t ngx_http_lua_logbuf_resume(ngx_http_request_t *r);
+
+
+void
+ngx_http_lua_inject_logbuf_api(lua_State *L)
+{
+    lua_createtable(L, 0 /* narr */, 3 /* nrec */);    /* ngx.logbuf. */
+
+    lua_pushcfunction(L, ngx_http_lua_logbuf_append);
+    lua_setfield(L, -2, "append");
+
+    lua_pushcfunction(L, ngx_http_lua_logbuf_wait);
+    lua_setfield(L, -2, "wait");
+
+    lua_pushcfunction(L, ngx_http_lua_logbuf_stats);
+    lua_setfield(L, -2, "stats");
+
+    lua_setfield(L, -2, "logbuf");
+}
+
+
+static int
+ngx_http_lua_logbuf_append(lua_State *L)
+{
+    int                          n;
+    ngx_uint_t                   slot;
+    ngx_http_request_t          *r;
+    ngx_http_lua_logbuf_t       *lb;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    n = lua_gettop(L);
+    if (n != 1) {
+        return luaL_error(L, "expecting 1 argument, but got %d", n);
+    }
+
+    luaL_argcheck(L, !lua_isnil(L, 1), 1, "non-nil value expected");
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    lb = lmcf->logbuf;
+    if (lb == NULL) {
+        return luaL_error(L, "no lua_log_buffer configured");
+    }
+
+    /*
+     * the records live in the registry of the main VM, where the flusher
+     * picks them up; requests running in a VM of their own (as with
+     * "lua_code_cache off") would put them out of its reach
+     */
+
+    if (ngx_http_lua_get_lua_vm(r, NULL) != lmcf->lua) {
+        return luaL_error(L, "lua_log_buffer not usable with "
+                          "lua_code_cache off");
+    }
+
+    if (lb->count == lb->size) {
+        lb->dropped++;
+
+        if (!lb->drop_oldest) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "full");
+            return 2;
+        }
+
+        /* make room by overwriting the oldest record */
+
+        lb->head = (lb->head + 1) % lb->size;
+        lb->count--;
+    }
+
+    slot = (lb->head + lb->count) % lb->size;
+
+    lua_pushlightuserdata(L, &ngx_http_lua_logbuf_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, (int) slot + 1);
+
+    lb->count++;
+
+    if (lb->count >= lb->batch) {
+        ngx_http_lua_logbuf_wakeup(lmcf);
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_logbuf_wait(lua_State *L)
+{
+    int                          n;
+    ngx_http_request_t          *r;
+    ngx_http_lua_ctx_t          *ctx;
+    ngx_http_lua_co_ctx_t       *coctx;
+    ngx_http_lua_logbuf_t       *lb;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    n = lua_gettop(L);
+    if (n != 0) {
+        return luaL_error(L, "expecting 0 arguments, but got %d", n);
+    }
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return luaL_error(L, "no request ctx found");
+    }
+
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_REWRITE
+                               | NGX_HTTP_LUA_CONTEXT_ACCESS
+                               | NGX_HTTP_LUA_CONTEXT_CONTENT
+                               | NGX_HTTP_LUA_CONTEXT_TIMER);
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    lb = lmcf->logbuf;
+    if (lb == NULL) {
+        return luaL_error(L, "no lua_log_buffer configured");
+    }
+
+    if (ngx_http_lua_get_lua_vm(r, ctx) != lmcf->lua) {
+        return luaL_error(L, "lua_log_buffer not usable with "
+                          "lua_code_cache off");
+    }
+
+    if (lb->waiter) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "busy");
+        return 2;
+    }
+
+    if (lb->count >= lb->batch || (lb->count && ngx_exiting)) {
+        return ngx_http_lua_logbuf_push_batch(L, lb);
+    }
+
+    if (ngx_exiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "exiting");
+        return 2;
+    }
+
+    coctx = ctx->cur_co_ctx;
+    if (coctx == NULL) {
+        return luaL_error(L, "no co ctx found");
+    }
+
+    ngx_http_lua_cleanup_pending_operation(coctx);
+    coctx->cleanup = ngx_http_lua_logbuf_cleanup;
+    coctx->data = r;
+
+    coctx->sleep.handler = ngx_http_lua_logbuf_handler;
+    coctx->sleep.data = coctx;
+    coctx->sleep.log = r->connection->log;
+
+    ngx_add_timer(&coctx->sleep, lb->interval);
+
+    lb->waiter = coctx;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua log buffer waiting with %ui records for %M ms",
+                   lb->count, lb->interval);
+
+    return lua_yield(L, 0);
+}
+
+
+static int
+ngx_http_lua_logbuf_stats(lua_State *L)
+{
+    ngx_http_request_t          *r;
+    ngx_http_lua_logbuf_t       *lb;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    lb = lmcf->logbuf;
+    if (lb == NULL) {
+        return luaL_error(L, "no lua_log_buffer configured");
+    }
+
+    lua_createtable(L, 0 /* narr */, 3 /* nrec */);
+
+    lua_pushinteger(L, (lua_Integer) lb->count);
+    lua_setfield(L, -2, "pending");
+
+    lua_pushnumber(L, (lua_Number) lb->flushed);
+    lua_setfield(L, -2, "flushed");
+
+    lua_pushnumber(L, (lua_Number) lb->dropped);
+    lua_setfield(L, -2, "dropped");
+
+    return 1;
+}
+
+
+void
+ngx_http_lua_logbuf_wakeup(ngx_http_lua_main_conf_t *lmcf)
+{
+    ngx_event_t             *ev;
+
+    if (lmcf->logbuf == NULL || lmcf->logbuf->waiter == NULL) {
+        return;
+    }
+
+    ev = &lmcf->logbuf->waiter->sleep;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    ngx_post_event(ev, &ngx_posted_events);
+}
+
+
+static int
+ngx_http_lua_logbuf_push_batch(lua_State *L, ngx_http_lua_logbuf_t *lb)
+{
+    int                  i, n;
+
+    n = (int) ngx_min(lb->count, lb->batch);
+
+    lua_createtable(L, n, 0);
+
+    lua_pushlightuserdata(L, &ngx_http_lua_logbuf_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+
+    /* stack: batch ring */
+
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, -1, (int) lb->head + 1);
+        lua_rawseti(L, -3, i);
+
+        lua_pushnil(L);
+        lua_rawseti(L, -2, (int) lb->head + 1);
+
+        lb->head = (lb->head + 1) % lb->size;
+    }
+
+    lua_pop(L, 1);
+
+    lb->count -= n;
+    lb->flushed += n;
+
+    return 1;
+}
+
+
+static void
+ngx_http_lua_logbuf_handler(ngx_event_t *ev)
+{
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_lua_ctx_t          *ctx;
+    ngx_http_log_ctx_t          *log_ctx;
+    ngx_http_lua_co_ctx_t       *coctx;
+    ngx_http_lua_logbuf_t       *lb;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    coctx = ev->data;
+
+    r = coctx->data;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    if (ctx == NULL) {
+        return;
+    }
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+    lb = lmcf->logbuf;
+
+    if (lb->count == 0 && !ngx_exiting) {
+        /* nothing to flush in this interval; keep waiting */
+        ngx_add_timer(ev, lb->interval);
+        return;
+    }
+
+    lb->waiter = NULL;
+
+    if (c->fd != (ngx_socket_t) -1) {  /* not a fake connection */
+        log_ctx = c->log->data;
+        log_ctx->current_request = r;
+    }
+
+    coctx->cleanup = NULL;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua log buffer flusher woken up with %ui records",
+                   lb->count);
+
+    ctx->cur_co_ctx = coctx;
+
+    if (ctx->entered_content_phase) {
+        (void) ngx_http_lua_logbuf_resume(r);
+
+    } else {
+        ctx->resume_handler = ngx_http_lua_logbuf_resume;
+        ngx_http_core_run_phases(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_lua_logbuf_cleanup(void *data)
+{
+    ngx_http_lua_co_ctx_t          *coctx = data;
+
+    ngx_http_request_t             *r;
+    ngx_http_lua_main_conf_t       *lmcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua clean up the pending ngx.logbuf.wait");
+
+    if (coctx->sleep.timer_set) {
+        ngx_del_timer(&coctx->sleep);
+    }
+
+    if (coctx->sleep.posted) {
+        ngx_delete_posted_event(&coctx->sleep);
+    }
+
+    r = coctx->data;
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    lmcf->logbuf->waiter = NULL;
+}
+
+
+static ngx_int_t
+ngx_http_lua_logbuf_resume(ngx_http_request_t *r)
+{
+    int                          nrets;
+    lua_State                   *vm;
+    lua_State                   *co;
+    ngx_connection_t            *c;
+    ngx_int_t                    rc;
+    ngx_http_lua_ctx_t          *ctx;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->resume_handler = ngx_http_lua_wev_handler;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    co = ctx->cur_co_ctx->co;
+
+    if (lmcf->logbuf->count) {
+        nrets = ngx_http_lua_logbuf_push_batch(co, lmcf->logbuf);
+
+    } else {
+        /* woken up by the worker shutdown with nothing left */
+        lua_pushnil(co);
+        lua_pushliteral(co, "exiting");
+        nrets = 2;
+    }
+
+    c = r->connection;
+    vm = ngx_http_lua_get_lua_vm(r, ctx);
+
+    rc = ngx_http_lua_run_thread(vm, r, ctx, nrets);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua run thread returned %d", rc);
+
+    if (rc == NGX_AGAIN) {
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_http_lua_finalize_request(r, NGX_DONE);
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    }
+
+    if (ctx->entered_content_phase) {
+        ngx_http_lua_finalize_request(r, rc);
+        return NGX_DONE;
+    }
+
+    return rc;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -0,0 +1,37 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_LUA_LOGBUF_H_INCLUDED_
+#define _NGX_HTTP_LUA_LOGBUF_H_INCLUDED_
+
+
+#include "ngx_http_lua_common.h"
+
+
+struct ngx_http_lua_logbuf_s {
+    ngx_uint_t                   size;      /* max number of records */
+    ngx_uint_t                   batch;     /* max records per batch */
+    ngx_msec_t                   interval;  /* max time to hold records */
+
+    ngx_uint_t                   head;      /* ring slot of the oldest */
+    ngx_uint_t                   count;
+
+    ngx_uint_t                   dropped;
+    ngx_uint_t                   flushed;
+
+    ngx_http_lua_co_ctx_t       *waiter;    /* the flusher in wait() */
+
+    unsigned                     drop_oldest:1;
+};
+
+
+void ngx_http_lua_inject_logbuf_api(lua_State *L);
+void ngx_http_lua_logbuf_wakeup(ngx_http_lua_main_conf_t *lmcf);
+
+
+#endif /* _NGX_HTTP_LUA_LOGBUF_H_INCLUDED_ */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
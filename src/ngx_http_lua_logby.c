@@ -49,16 +49,9 @@ ngx_http_lua_log_by_lua_env(lua_State *L, ngx_http_request_t *r)
      * in the global env.
      *
      * all variables created in the script-env will be thrown away at the end
-     * of the script run.
+     * of the script run (see ngx_http_lua_push_phase_env).
      * */
-    ngx_http_lua_create_new_globals_table(L, 0 /* narr */, 1 /* nrec */);
-
-    /*  {{{ make new env inheriting main thread's globals table */
-    lua_createtable(L, 0, 1);    /*  the metatable for the new env */
-    ngx_http_lua_get_globals_table(L);
-    lua_setfield(L, -2, "__index");
-    lua_setmetatable(L, -2);    /*  setmetatable({}, {__index = _G}) */
-    /*  }}} */
+    ngx_http_lua_push_phase_env(L, r);
 
     lua_setfenv(L, -2);    /*  set new running env for the code closure */
 }
@@ -151,7 +144,7 @@ ngx_http_lua_log_handler_file(ngx_http_request_t *r)
     L = ngx_http_lua_get_lua_vm(r, NULL);
 
     /*  load Lua script file (w/ cache)        sp = 1 */
-    rc = ngx_http_lua_cache_loadfile(r->connection->log, L, script_path,
+    rc = ngx_http_lua_cache_loadfile(r, L, script_path,
                                      llcf->log_src_key);
     if (rc != NGX_OK) {
         return NGX_ERROR;
@@ -192,6 +185,8 @@ ngx_http_lua_log_by_chunk(lua_State *L, ngx_http_request_t *r)
 
         lua_remove(L, 1);  /* remove traceback function */
 
+        ngx_http_lua_release_phase_env(L, r);
+
 #if (NGX_PCRE)
         /* XXX: work-around to nginx regex subsystem */
         ngx_http_lua_pcre_malloc_done(old_pool);
@@ -26,6 +26,7 @@
 #include "ngx_http_lua_semaphore.h"
 #include "ngx_http_lua_balancer.h"
 #include "ngx_http_lua_ssl_certby.h"
+#include "ngx_http_lua_regex.h"
 #include <openssl/ssl.h>
 
 
@@ -44,6 +45,7 @@ static void *ngx_http_lua_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_lua_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static ngx_int_t ngx_http_lua_init(ngx_conf_t *cf);
+static void ngx_http_lua_exit_process(ngx_cycle_t *cycle);
 static char *ngx_http_lua_lowat_check(ngx_conf_t *cf, void *post, void *data);
 #if (NGX_HTTP_SSL)
 static ngx_int_t ngx_http_lua_set_ssl(ngx_conf_t *cf,
@@ -81,6 +83,13 @@ static ngx_command_t ngx_http_lua_cmds[] = {
       offsetof(ngx_http_lua_main_conf_t, max_running_timers),
       NULL },
 
+    { ngx_string("lua_reuse_phase_env"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_main_conf_t, reuse_phase_env),
+      NULL },
+
     { ngx_string("lua_max_pending_timers"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_num_slot,
@@ -88,8 +97,15 @@ static ngx_command_t ngx_http_lua_cmds[] = {
       offsetof(ngx_http_lua_main_conf_t, max_pending_timers),
       NULL },
 
+    { ngx_string("lua_log_buffer"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_lua_log_buffer,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("lua_shared_dict"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_lua_shared_dict,
       0,
       0,
@@ -125,9 +141,16 @@ static ngx_command_t ngx_http_lua_cmds[] = {
       0,
       NULL },
 
+    { ngx_string("lua_package_bundle"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_package_bundle,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("lua_code_cache"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-                        |NGX_CONF_FLAG,
+                        |NGX_CONF_TAKE1,
       ngx_http_lua_code_cache,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_lua_loc_conf_t, enable_code_cache),
@@ -157,6 +180,13 @@ static ngx_command_t ngx_http_lua_cmds[] = {
       offsetof(ngx_http_lua_loc_conf_t, log_socket_errors),
       NULL },
 
+    { ngx_string("lua_freeze_init_heap"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_main_conf_t, freeze_init_heap),
+      NULL },
+
     { ngx_string("init_by_lua_block"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_NOARGS,
       ngx_http_lua_init_by_lua_block,
@@ -395,6 +425,14 @@ static ngx_command_t ngx_http_lua_cmds[] = {
       0,
       (void *) ngx_http_lua_body_filter_file },
 
+    { ngx_string("lua_body_filter_in_memory"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_lua_loc_conf_t, body_filter_in_memory),
+      NULL },
+
     { ngx_string("balancer_by_lua_block"),
       NGX_HTTP_UPS_CONF|NGX_CONF_BLOCK|NGX_CONF_NOARGS,
       ngx_http_lua_balancer_by_lua_block,
@@ -511,6 +549,20 @@ static ngx_command_t ngx_http_lua_cmds[] = {
 
 #if (NGX_HTTP_SSL)
 
+    { ngx_string("lua_ssl_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_ssl_thread_pool,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_ssl_max_pending_tasks"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_main_conf_t, ssl_max_pending_tasks),
+      NULL },
+
     { ngx_string("ssl_certificate_by_lua"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_http_lua_ssl_cert_by_lua,
@@ -541,6 +593,13 @@ static ngx_command_t ngx_http_lua_cmds[] = {
       offsetof(ngx_http_lua_loc_conf_t, ssl_trusted_certificate),
       NULL },
 
+    { ngx_string("lua_ssl_session_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_ssl_session_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("lua_ssl_crl"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -579,7 +638,7 @@ ngx_module_t ngx_http_lua_module = {
     ngx_http_lua_init_worker,   /*  init process */
     NULL,                       /*  init thread */
     NULL,                       /*  exit thread */
-    NULL,                       /*  exit process */
+    ngx_http_lua_exit_process,  /*  exit process */
     NULL,                       /*  exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -725,6 +784,19 @@ ngx_http_lua_init(ngx_conf_t *cf)
 }
 
 
+static void
+ngx_http_lua_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_lua_module);
+
+    if (lmcf && lmcf->fake_pools_free) {
+        ngx_http_lua_destroy_fake_pools(cycle, lmcf);
+    }
+}
+
+
 static char *
 ngx_http_lua_lowat_check(ngx_conf_t *cf, void *post, void *data)
 {
@@ -759,6 +831,9 @@ ngx_http_lua_create_main_conf(ngx_conf_t *cf)
 {
     ngx_http_lua_main_conf_t    *lmcf;
     ngx_http_lua_semaphore_mm_t *mm;
+#if (NGX_PCRE)
+    ngx_pool_cleanup_t          *cln;
+#endif
 
     lmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_main_conf_t));
     if (lmcf == NULL) {
@@ -771,13 +846,25 @@ ngx_http_lua_create_main_conf(ngx_conf_t *cf)
      *      lmcf->lua_cpath = { 0, NULL };
      *      lmcf->pending_timers = 0;
      *      lmcf->running_timers = 0;
+     *      lmcf->ssl_pending_tasks = 0;
+     *      lmcf->ssl_thread_pool = NULL;
      *      lmcf->watcher = NULL;
+     *      lmcf->fake_pools = NULL;
+     *      lmcf->fake_pools_free = 0;
+     *      lmcf->fake_pools_reused = 0;
+     *      lmcf->fake_pools_created = 0;
      *      lmcf->regex_cache_entries = 0;
+     *      lmcf->regex_cache_hits = 0;
+     *      lmcf->regex_cache_misses = 0;
+     *      lmcf->regex_cache_evictions = 0;
      *      lmcf->shm_zones = NULL;
+     *      lmcf->bundles = NULL;
+     *      lmcf->logbuf = NULL;
      *      lmcf->init_handler = NULL;
      *      lmcf->init_src = { 0, NULL };
      *      lmcf->shm_zones_inited = 0;
      *      lmcf->preload_hooks = NULL;
+     *      lmcf->init_heap_size = 0;
      *      lmcf->requires_header_filter = 0;
      *      lmcf->requires_body_filter = 0;
      *      lmcf->requires_capture_filter = 0;
@@ -790,12 +877,30 @@ ngx_http_lua_create_main_conf(ngx_conf_t *cf)
     lmcf->pool = cf->pool;
     lmcf->max_pending_timers = NGX_CONF_UNSET;
     lmcf->max_running_timers = NGX_CONF_UNSET;
+#if (NGX_HTTP_SSL)
+    lmcf->ssl_max_pending_tasks = NGX_CONF_UNSET;
+#endif
 #if (NGX_PCRE)
     lmcf->regex_cache_max_entries = NGX_CONF_UNSET;
     lmcf->regex_match_limit = NGX_CONF_UNSET;
+
+    ngx_rbtree_init(&lmcf->regex_cache_rbtree, &lmcf->regex_cache_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_queue_init(&lmcf->regex_cache_queue);
+
+    /* free the compiled regexes (and their JIT code) along with the cycle */
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->data = lmcf;
+    cln->handler = ngx_http_lua_regex_cache_cleanup;
 #endif
     lmcf->postponed_to_rewrite_phase_end = NGX_CONF_UNSET;
     lmcf->postponed_to_access_phase_end = NGX_CONF_UNSET;
+    lmcf->reuse_phase_env = NGX_CONF_UNSET;
+    lmcf->freeze_init_heap = NGX_CONF_UNSET;
 
     mm = ngx_palloc(cf->pool, sizeof(ngx_http_lua_semaphore_mm_t));
     if (mm == NULL) {
@@ -844,6 +949,20 @@ ngx_http_lua_init_main_conf(ngx_conf_t *cf, void *conf)
         lmcf->max_running_timers = 256;
     }
 
+#if (NGX_HTTP_SSL)
+    if (lmcf->ssl_max_pending_tasks == NGX_CONF_UNSET) {
+        lmcf->ssl_max_pending_tasks = 16;
+    }
+#endif
+
+    if (lmcf->reuse_phase_env == NGX_CONF_UNSET) {
+        lmcf->reuse_phase_env = 0;
+    }
+
+    if (lmcf->freeze_init_heap == NGX_CONF_UNSET) {
+        lmcf->freeze_init_heap = 0;
+    }
+
     lmcf->cycle = cf->cycle;
 
     return NGX_CONF_OK;
@@ -970,9 +1089,11 @@ ngx_http_lua_create_loc_conf(ngx_conf_t *cf)
 
     conf->transform_underscores_in_resp_headers = NGX_CONF_UNSET;
     conf->log_socket_errors = NGX_CONF_UNSET;
+    conf->body_filter_in_memory = NGX_CONF_UNSET;
 
 #if (NGX_HTTP_SSL)
     conf->ssl_verify_depth = NGX_CONF_UNSET_UINT;
+    conf->ssl_session_cache = NGX_CONF_UNSET_PTR;
 #endif
 
     return conf;
@@ -1044,6 +1165,8 @@ ngx_http_lua_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_str_value(conf->ssl_trusted_certificate,
                              prev->ssl_trusted_certificate, "");
     ngx_conf_merge_str_value(conf->ssl_crl, prev->ssl_crl, "");
+    ngx_conf_merge_ptr_value(conf->ssl_session_cache,
+                             prev->ssl_session_cache, NULL);
 
     if (ngx_http_lua_set_ssl(cf, conf) != NGX_OK) {
         return NGX_CONF_ERROR;
@@ -1083,6 +1206,9 @@ ngx_http_lua_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->log_socket_errors, prev->log_socket_errors, 1);
 
+    ngx_conf_merge_value(conf->body_filter_in_memory,
+                         prev->body_filter_in_memory, 1);
+
     return NGX_CONF_OK;
 }
 
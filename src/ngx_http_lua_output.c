@@ -9,12 +9,38 @@
 #include <math.h>
 
 
+/* Lua strings at least this long are sent by ngx.print and ngx.say without
+ * copying them into the output buffers */
+#define NGX_HTTP_LUA_PIN_STR_MIN_LEN  4096
+
+
+typedef struct {
+    ngx_http_request_t          *request;
+    ngx_http_lua_ctx_t          *ctx;
+    ngx_chain_t                 *out;
+    ngx_chain_t                **last_out;
+    ngx_chain_t                 *last_run;  /* link of the last small run */
+    u_char                      *run;       /* start of the pending run */
+    u_char                      *last;      /* end of the pending run */
+} ngx_http_lua_echo_ctx_t;
+
+
 static int ngx_http_lua_ngx_say(lua_State *L);
 static int ngx_http_lua_ngx_print(lua_State *L);
 static int ngx_http_lua_ngx_flush(lua_State *L);
 static int ngx_http_lua_ngx_eof(lua_State *L);
 static int ngx_http_lua_ngx_send_headers(lua_State *L);
 static int ngx_http_lua_ngx_echo(lua_State *L, unsigned newline);
+static int ngx_http_lua_table_max_index(lua_State *L, int index);
+static size_t ngx_http_lua_calc_pinned_strlen_in_table(lua_State *L,
+    int index);
+static ngx_chain_t *ngx_http_lua_echo_pinned(lua_State *L,
+    ngx_http_request_t *r, ngx_http_lua_ctx_t *ctx, size_t size,
+    unsigned newline);
+static ngx_int_t ngx_http_lua_echo_value(lua_State *L, int index,
+    ngx_http_lua_echo_ctx_t *ectx);
+static ngx_int_t ngx_http_lua_echo_flush_run(ngx_http_lua_echo_ctx_t *ectx);
+static void ngx_http_lua_pinned_strs_cleanup(void *data);
 static void ngx_http_lua_flush_cleanup(void *data);
 
 
@@ -42,6 +68,7 @@ ngx_http_lua_ngx_echo(lua_State *L, unsigned newline)
     const char                  *p;
     size_t                       len;
     size_t                       size;
+    size_t                       pinned;
     ngx_buf_t                   *b;
     ngx_chain_t                 *cl;
     ngx_int_t                    rc;
@@ -85,6 +112,7 @@ ngx_http_lua_ngx_echo(lua_State *L, unsigned newline)
 
     nargs = lua_gettop(L);
     size = 0;
+    pinned = 0;
 
     for (i = 1; i <= nargs; i++) {
 
@@ -96,6 +124,13 @@ ngx_http_lua_ngx_echo(lua_State *L, unsigned newline)
 
                 lua_tolstring(L, i, &len);
                 size += len;
+
+                if (type == LUA_TSTRING
+                    && len >= NGX_HTTP_LUA_PIN_STR_MIN_LEN)
+                {
+                    pinned += len;
+                }
+
                 break;
 
             case LUA_TNIL:
@@ -118,6 +153,7 @@ ngx_http_lua_ngx_echo(lua_State *L, unsigned newline)
 
                 size += ngx_http_lua_calc_strlen_in_table(L, i, i,
                                                           0 /* strict */);
+                pinned += ngx_http_lua_calc_pinned_strlen_in_table(L, i);
                 break;
 
             case LUA_TLIGHTUSERDATA:
@@ -151,6 +187,19 @@ ngx_http_lua_ngx_echo(lua_State *L, unsigned newline)
         return 1;
     }
 
+    if (pinned) {
+        cl = ngx_http_lua_echo_pinned(L, r, ctx, size - pinned, newline);
+        if (cl == NULL) {
+            return luaL_error(L, "no memory");
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua sending %uz bytes of Lua strings without copying",
+                       pinned);
+
+        goto send;
+    }
+
     cl = ngx_http_lua_chain_get_free_buf(r->connection->log, r->pool,
                                          &ctx->free_bufs, size);
 
@@ -218,6 +267,8 @@ ngx_http_lua_ngx_echo(lua_State *L, unsigned newline)
     }
 #endif
 
+send:
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    newline ? "lua say response" : "lua print response");
 
@@ -229,14 +280,386 @@ ngx_http_lua_ngx_echo(lua_State *L, unsigned newline)
         return 2;
     }
 
-    dd("downstream write: %d, buf len: %d", (int) rc,
-       (int) (b->last - b->pos));
+    dd("downstream write: %d", (int) rc);
 
     lua_pushinteger(L, 1);
     return 1;
 }
 
 
+static int
+ngx_http_lua_table_max_index(lua_State *L, int index)
+{
+    int                 max;
+    double              key;
+
+    max = 0;
+
+    lua_pushnil(L); /* stack: table key */
+    while (lua_next(L, index) != 0) { /* stack: table key value */
+        key = lua_tonumber(L, -2);
+        if (key > max) {
+            max = (int) key;
+        }
+
+        lua_pop(L, 1); /* stack: table key */
+    }
+
+    return max;
+}
+
+
+static size_t
+ngx_http_lua_calc_pinned_strlen_in_table(lua_State *L, int index)
+{
+    int                 i, n;
+    size_t              len, size;
+
+    /* the table has already been checked by
+     * ngx_http_lua_calc_strlen_in_table() */
+
+    if (index < 0) {
+        index = lua_gettop(L) + index + 1;
+    }
+
+    n = ngx_http_lua_table_max_index(L, index);
+    size = 0;
+
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, index, i); /* stack: table value */
+
+        switch (lua_type(L, -1)) {
+            case LUA_TSTRING:
+
+                lua_tolstring(L, -1, &len);
+                if (len >= NGX_HTTP_LUA_PIN_STR_MIN_LEN) {
+                    size += len;
+                }
+
+                break;
+
+            case LUA_TTABLE:
+
+                size += ngx_http_lua_calc_pinned_strlen_in_table(L, -1);
+                break;
+
+            default:
+                break;
+        }
+
+        lua_pop(L, 1); /* stack: table */
+    }
+
+    return size;
+}
+
+
+/*
+ * Builds the output chain for ngx.print/ngx.say arguments containing long
+ * strings: the long strings get their own bufs pointing to the Lua string
+ * data, which are anchored in the Lua registry until the bufs are sent,
+ * while the short fragments in between are coalesced into a single memory
+ * block of "size" bytes.
+ */
+
+static ngx_chain_t *
+ngx_http_lua_echo_pinned(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, size_t size, unsigned newline)
+{
+    int                          i, nargs;
+    ngx_chain_t                 *own;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_lua_echo_ctx_t      ectx;
+
+    if (!ctx->pinned_strs_cleanup) {
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NULL;
+        }
+
+        cln->handler = ngx_http_lua_pinned_strs_cleanup;
+        cln->data = ctx;
+        ctx->pinned_strs_cleanup = 1;
+    }
+
+    own = NULL;
+
+    ectx.request = r;
+    ectx.ctx = ctx;
+    ectx.out = NULL;
+    ectx.last_out = &ectx.out;
+    ectx.last_run = NULL;
+    ectx.run = NULL;
+    ectx.last = NULL;
+
+    if (size) {
+        own = ngx_http_lua_chain_get_free_buf(r->connection->log, r->pool,
+                                              &ctx->free_bufs, size);
+        if (own == NULL) {
+            return NULL;
+        }
+
+        ectx.run = own->buf->start;
+        ectx.last = own->buf->start;
+    }
+
+    nargs = lua_gettop(L);
+
+    for (i = 1; i <= nargs; i++) {
+        if (ngx_http_lua_echo_value(L, i, &ectx) != NGX_OK) {
+            return NULL;
+        }
+    }
+
+    if (newline) {
+        *ectx.last++ = '\n';
+    }
+
+    if (own == NULL) {
+        return ectx.out;
+    }
+
+    /*
+     * The block of the short fragments is owned by a recyclable buf, which
+     * must be the last one of them in the chain: the output filters consume
+     * the chain in order, so the block cannot be reused before all of its
+     * runs have been sent.
+     */
+
+    if (ectx.run != ectx.last) {
+        own->buf->pos = ectx.run;
+        own->buf->last = ectx.last;
+
+        *ectx.last_out = own;
+        ectx.last_out = &own->next;
+
+        return ectx.out;
+    }
+
+    own->buf->pos = ectx.last_run->buf->pos;
+    own->buf->last = ectx.last_run->buf->last;
+
+    ectx.last_run->buf = own->buf;
+
+    ngx_free_chain(r->pool, own);
+
+    return ectx.out;
+}
+
+
+static ngx_int_t
+ngx_http_lua_echo_value(lua_State *L, int index, ngx_http_lua_echo_ctx_t *ectx)
+{
+    int                          i, n;
+    size_t                       len;
+    const char                  *p;
+    ngx_buf_t                   *b;
+    ngx_chain_t                 *cl;
+    ngx_http_request_t          *r;
+    ngx_http_lua_pinned_str_t   *ps;
+
+    switch (lua_type(L, index)) {
+        case LUA_TNUMBER:
+        case LUA_TSTRING:
+            break;
+
+        case LUA_TNIL:
+            ectx->last = ngx_copy(ectx->last, "nil", sizeof("nil") - 1);
+            return NGX_OK;
+
+        case LUA_TBOOLEAN:
+            if (lua_toboolean(L, index)) {
+                ectx->last = ngx_copy(ectx->last, "true",
+                                      sizeof("true") - 1);
+
+            } else {
+                ectx->last = ngx_copy(ectx->last, "false",
+                                      sizeof("false") - 1);
+            }
+
+            return NGX_OK;
+
+        case LUA_TTABLE:
+
+            if (index < 0) {
+                index = lua_gettop(L) + index + 1;
+            }
+
+            n = ngx_http_lua_table_max_index(L, index);
+
+            for (i = 1; i <= n; i++) {
+                lua_rawgeti(L, index, i); /* stack: table value */
+
+                if (ngx_http_lua_echo_value(L, -1, ectx) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                lua_pop(L, 1); /* stack: table */
+            }
+
+            return NGX_OK;
+
+        case LUA_TLIGHTUSERDATA:
+            if (lua_touserdata(L, index) == NULL) {
+                ectx->last = ngx_copy(ectx->last, "null",
+                                      sizeof("null") - 1);
+            }
+
+            return NGX_OK;
+
+        default:
+            return NGX_ERROR;
+    }
+
+    p = lua_tolstring(L, index, &len);
+
+    if (lua_type(L, index) != LUA_TSTRING
+        || len < NGX_HTTP_LUA_PIN_STR_MIN_LEN)
+    {
+        ectx->last = ngx_copy(ectx->last, p, len);
+        return NGX_OK;
+    }
+
+    if (ngx_http_lua_echo_flush_run(ectx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r = ectx->request;
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    ps = ectx->ctx->free_pinned_strs;
+
+    if (ps) {
+        ectx->ctx->free_pinned_strs = ps->next;
+
+    } else {
+        ps = ngx_palloc(r->pool, sizeof(ngx_http_lua_pinned_str_t));
+        if (ps == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    b->memory = 1;
+    b->start = (u_char *) p;
+    b->pos = b->start;
+    b->end = b->start + len;
+    b->last = b->end;
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    *ectx->last_out = cl;
+    ectx->last_out = &cl->next;
+
+    /* keep the string alive until the buf has been sent */
+
+    lua_pushlightuserdata(L, &ngx_http_lua_pinned_strs_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, index < 0 ? index - 1 : index);
+    ps->ref = luaL_ref(L, -2);
+    lua_pop(L, 1);
+
+    ps->buf = b;
+    ps->next = ectx->ctx->pinned_strs;
+    ectx->ctx->pinned_strs = ps;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_echo_flush_run(ngx_http_lua_echo_ctx_t *ectx)
+{
+    ngx_buf_t           *b;
+    ngx_chain_t         *cl;
+    ngx_http_request_t  *r;
+
+    if (ectx->run == ectx->last) {
+        return NGX_OK;
+    }
+
+    r = ectx->request;
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->memory = 1;
+    b->pos = ectx->run;
+    b->last = ectx->last;
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    *ectx->last_out = cl;
+    ectx->last_out = &cl->next;
+
+    ectx->last_run = cl;
+    ectx->run = ectx->last;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_lua_release_pinned_strs(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, unsigned all)
+{
+    lua_State                    *L;
+    ngx_http_lua_pinned_str_t    *ps, **pps;
+
+    L = ngx_http_lua_get_lua_vm(r, ctx);
+
+    lua_pushlightuserdata(L, &ngx_http_lua_pinned_strs_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+
+    pps = &ctx->pinned_strs;
+
+    while (*pps) {
+        ps = *pps;
+
+        if (!all && ngx_buf_size(ps->buf)) {
+            pps = &ps->next;
+            continue;
+        }
+
+        luaL_unref(L, -1, ps->ref);
+
+        *pps = ps->next;
+        ps->next = ctx->free_pinned_strs;
+        ctx->free_pinned_strs = ps;
+    }
+
+    lua_pop(L, 1);
+}
+
+
+static void
+ngx_http_lua_pinned_strs_cleanup(void *data)
+{
+    ngx_http_lua_ctx_t  *ctx = data;
+
+    if (ctx->pinned_strs) {
+        ngx_http_lua_release_pinned_strs(ctx->request, ctx, 1 /* all */);
+    }
+}
+
+
 size_t
 ngx_http_lua_calc_strlen_in_table(lua_State *L, int index, int arg_i,
     unsigned strict)
@@ -22,6 +22,9 @@ u_char *ngx_http_lua_copy_str_in_table(lua_State *L, int index, u_char *dst);
 ngx_int_t ngx_http_lua_flush_resume_helper(ngx_http_request_t *r,
     ngx_http_lua_ctx_t *ctx);
 
+void ngx_http_lua_release_pinned_strs(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, unsigned all);
+
 
 #endif /* _NGX_HTTP_LUA_OUTPUT_H_INCLUDED_ */
 
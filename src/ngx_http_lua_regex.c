@@ -44,8 +44,9 @@
 
 
 typedef struct {
-#ifndef NGX_LUA_NO_FFI_API
     ngx_pool_t                   *pool;
+
+#ifndef NGX_LUA_NO_FFI_API
     u_char                       *name_table;
     int                           name_count;
     int                           name_entry_size;
@@ -77,9 +78,19 @@ typedef struct {
 } ngx_http_lua_regex_compile_t;
 
 
+typedef struct {
+    ngx_str_node_t                sn;     /* sn.str holds the cache key */
+    ngx_queue_t                   queue;  /* in the LRU queue */
+    ngx_http_lua_regex_t         *re;
+    ngx_uint_t                    refs;   /* pinned by gmatch iterators and
+                                             sub/gsub replace callbacks */
+} ngx_http_lua_regex_cache_node_t;
+
+
 typedef struct {
     ngx_http_cleanup_pt     *cleanup;
     ngx_http_request_t      *request;
+    ngx_http_lua_regex_cache_node_t     *node;
     pcre                    *regex;
     pcre_extra              *regex_sd;
     int                      ncaptures;
@@ -102,6 +113,14 @@ static int ngx_http_lua_ngx_re_gsub(lua_State *L);
 static void ngx_http_lua_regex_free_study_data(ngx_pool_t *pool,
     pcre_extra *sd);
 static ngx_int_t ngx_http_lua_regex_compile(ngx_http_lua_regex_compile_t *rc);
+static ngx_http_lua_regex_cache_node_t *ngx_http_lua_regex_cache_lookup(
+    ngx_http_lua_main_conf_t *lmcf, ngx_str_t *key);
+static ngx_pool_t *ngx_http_lua_regex_cache_create_pool(
+    ngx_http_lua_main_conf_t *lmcf, ngx_log_t *log);
+static ngx_http_lua_regex_cache_node_t *ngx_http_lua_regex_cache_add(
+    ngx_http_lua_main_conf_t *lmcf, ngx_str_t *key, ngx_http_lua_regex_t *re);
+static void ngx_http_lua_regex_destroy_pool(ngx_pool_t *pool, pcre_extra *sd);
+static int ngx_http_lua_ngx_re_cache_stats(lua_State *L);
 static void ngx_http_lua_ngx_re_gmatch_cleanup(void *data);
 static int ngx_http_lua_ngx_re_gmatch_gc(lua_State *L);
 static void ngx_http_lua_re_collect_named_captures(lua_State *L,
@@ -161,8 +180,10 @@ ngx_http_lua_ngx_re_match_helper(lua_State *L, int wantcaps)
     u_char                      *name_table = NULL;
     int                          exec_opts;
     int                          group_id = 0;
+    ngx_str_t                    key;
 
-    ngx_http_lua_regex_compile_t      re_comp;
+    ngx_http_lua_regex_compile_t         re_comp;
+    ngx_http_lua_regex_cache_node_t     *node = NULL;
 
     nargs = lua_gettop(L);
 
@@ -245,38 +266,31 @@ ngx_http_lua_ngx_re_match_helper(lua_State *L, int wantcaps)
     lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
 
     if (flags & NGX_LUA_RE_COMPILE_ONCE) {
-        pool = lmcf->pool;
-
-        dd("server pool %p", lmcf->pool);
-
-        lua_pushlightuserdata(L, &ngx_http_lua_regex_cache_key);
-        lua_rawget(L, LUA_REGISTRYINDEX); /* table */
-
         lua_pushliteral(L, "m");
-        lua_pushvalue(L, 2); /* table regex */
+        lua_pushvalue(L, 2); /* regex */
 
         dd("options size: %d", (int) sizeof(re_comp.options));
 
         lua_pushlstring(L, (char *) &re_comp.options, sizeof(re_comp.options));
-                /* table regex opts */
+                /* regex opts */
 
-        lua_concat(L, 3); /* table key */
-        lua_pushvalue(L, -1); /* table key key */
+        lua_concat(L, 3); /* key */
 
-        dd("regex cache key: %.*s", (int) (pat.len + sizeof(re_comp.options)),
-           lua_tostring(L, -1));
+        key.data = (u_char *) lua_tolstring(L, -1, &key.len);
 
-        lua_rawget(L, -3); /* table key re */
-        re = lua_touserdata(L, -1);
+        dd("regex cache key: %.*s", (int) key.len, key.data);
 
-        lua_pop(L, 1); /* table key */
+        node = ngx_http_lua_regex_cache_lookup(lmcf, &key);
 
-        if (re) {
+        if (node) {
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "lua regex cache hit for match regex \"%s\" with "
                            "options \"%s\"", pat.data, opts.data);
 
-            lua_pop(L, 2);
+            lua_pop(L, 1);
+
+            re = node->re;
+            pool = re->pool;
 
             dd("restoring regex %p, ncaptures %d,  captures %p", re->regex,
                re->ncaptures, re->captures);
@@ -300,15 +314,10 @@ ngx_http_lua_ngx_re_match_helper(lua_State *L, int wantcaps)
                        "lua regex cache miss for match regex \"%s\" "
                        "with options \"%s\"", pat.data, opts.data);
 
-        if (lmcf->regex_cache_entries >= lmcf->regex_cache_max_entries) {
-
-            if (lmcf->regex_cache_entries == lmcf->regex_cache_max_entries) {
-                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                              "lua exceeding regex cache max entries (%i)",
-                              lmcf->regex_cache_max_entries);
-
-                lmcf->regex_cache_entries++;
-            }
+        pool = ngx_http_lua_regex_cache_create_pool(lmcf,
+                                                    r->connection->log);
+        if (pool == NULL) {
+            lua_pop(L, 1);
 
             pool = r->pool;
             flags &= ~NGX_LUA_RE_COMPILE_ONCE;
@@ -342,6 +351,10 @@ ngx_http_lua_ngx_re_match_helper(lua_State *L, int wantcaps)
     if (rc != NGX_OK) {
         dd("compile failed");
 
+        if (flags & NGX_LUA_RE_COMPILE_ONCE) {
+            ngx_destroy_pool(pool);
+        }
+
         lua_pushnil(L);
         if (!wantcaps) {
             lua_pushnil(L);
@@ -430,7 +443,6 @@ ngx_http_lua_ngx_re_match_helper(lua_State *L, int wantcaps)
     cap = ngx_palloc(pool, ovecsize * sizeof(int));
 
     if (cap == NULL) {
-        flags &= ~NGX_LUA_RE_COMPILE_ONCE;
         msg = "no memory";
         goto error;
     }
@@ -451,19 +463,20 @@ ngx_http_lua_ngx_re_match_helper(lua_State *L, int wantcaps)
         dd("saving regex %p, ncaptures %d,  captures %p", re_comp.regex,
            re_comp.captures, cap);
 
+        re->pool = pool;
         re->regex = re_comp.regex;
         re->regex_sd = sd;
         re->ncaptures = re_comp.captures;
         re->captures = cap;
         re->replace = NULL;
 
-        lua_pushlightuserdata(L, re); /* table key value */
-        lua_rawset(L, -3); /* table */
-        lua_pop(L, 1);
-
-        if (lmcf) {
-            lmcf->regex_cache_entries++;
+        node = ngx_http_lua_regex_cache_add(lmcf, &key, re);
+        if (node == NULL) {
+            msg = "no memory";
+            goto error;
         }
+
+        lua_pop(L, 1); /* key */
     }
 
 exec:
@@ -631,7 +644,13 @@ exec:
 
 error:
 
-    if (!(flags & NGX_LUA_RE_COMPILE_ONCE)) {
+    if (flags & NGX_LUA_RE_COMPILE_ONCE) {
+        if (node == NULL) {
+            /* not saved into the regex cache yet */
+            ngx_http_lua_regex_destroy_pool(pool, sd);
+        }
+
+    } else {
         if (sd) {
             ngx_http_lua_regex_free_study_data(pool, sd);
         }
@@ -674,8 +693,10 @@ ngx_http_lua_ngx_re_gmatch(lua_State *L)
     u_char                       errstr[NGX_MAX_CONF_ERRSTR + 1];
     pcre_extra                  *sd = NULL;
     ngx_http_cleanup_t          *cln;
+    ngx_str_t                    key;
 
-    ngx_http_lua_regex_compile_t      re_comp;
+    ngx_http_lua_regex_compile_t         re_comp;
+    ngx_http_lua_regex_cache_node_t     *node = NULL;
 
     nargs = lua_gettop(L);
 
@@ -710,38 +731,31 @@ ngx_http_lua_ngx_re_gmatch(lua_State *L)
     lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
 
     if (flags & NGX_LUA_RE_COMPILE_ONCE) {
-        pool = lmcf->pool;
-
-        dd("server pool %p", lmcf->pool);
-
-        lua_pushlightuserdata(L, &ngx_http_lua_regex_cache_key);
-        lua_rawget(L, LUA_REGISTRYINDEX); /* table */
-
         lua_pushliteral(L, "m");
-        lua_pushvalue(L, 2); /* table regex */
+        lua_pushvalue(L, 2); /* regex */
 
         dd("options size: %d", (int) sizeof(re_comp.options));
 
         lua_pushlstring(L, (char *) &re_comp.options,
-                        sizeof(re_comp.options)); /* table regex opts */
+                        sizeof(re_comp.options)); /* regex opts */
 
-        lua_concat(L, 3); /* table key */
-        lua_pushvalue(L, -1); /* table key key */
+        lua_concat(L, 3); /* key */
 
-        dd("regex cache key: %.*s", (int) (pat.len + sizeof(re_comp.options)),
-           lua_tostring(L, -1));
+        key.data = (u_char *) lua_tolstring(L, -1, &key.len);
 
-        lua_rawget(L, -3); /* table key re */
-        re = lua_touserdata(L, -1);
+        dd("regex cache key: %.*s", (int) key.len, key.data);
 
-        lua_pop(L, 1); /* table key */
+        node = ngx_http_lua_regex_cache_lookup(lmcf, &key);
 
-        if (re) {
+        if (node) {
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "lua regex cache hit for match regex \"%s\" "
                            "with options \"%s\"", pat.data, opts.data);
 
-            lua_pop(L, 2);
+            lua_pop(L, 1);
+
+            re = node->re;
+            pool = re->pool;
 
             dd("restoring regex %p, ncaptures %d,  captures %p", re->regex,
                re->ncaptures, re->captures);
@@ -765,15 +779,10 @@ ngx_http_lua_ngx_re_gmatch(lua_State *L)
                        "lua regex cache miss for match regex \"%s\" "
                        "with options \"%s\"", pat.data, opts.data);
 
-        if (lmcf->regex_cache_entries >= lmcf->regex_cache_max_entries) {
-
-            if (lmcf->regex_cache_entries == lmcf->regex_cache_max_entries) {
-                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                              "lua exceeding regex cache max entries (%i)",
-                              lmcf->regex_cache_max_entries);
-
-                lmcf->regex_cache_entries++;
-            }
+        pool = ngx_http_lua_regex_cache_create_pool(lmcf,
+                                                    r->connection->log);
+        if (pool == NULL) {
+            lua_pop(L, 1);
 
             pool = r->pool;
             flags &= ~NGX_LUA_RE_COMPILE_ONCE;
@@ -805,6 +814,10 @@ ngx_http_lua_ngx_re_gmatch(lua_State *L)
     if (rc != NGX_OK) {
         dd("compile failed");
 
+        if (flags & NGX_LUA_RE_COMPILE_ONCE) {
+            ngx_destroy_pool(pool);
+        }
+
         lua_pushnil(L);
         lua_pushlstring(L, (char *) re_comp.err.data, re_comp.err.len);
         return 2;
@@ -888,7 +901,6 @@ ngx_http_lua_ngx_re_gmatch(lua_State *L)
 
     cap = ngx_palloc(pool, ovecsize * sizeof(int));
     if (cap == NULL) {
-        flags &= ~NGX_LUA_RE_COMPILE_ONCE;
         msg = "no memory";
         goto error;
     }
@@ -909,19 +921,20 @@ ngx_http_lua_ngx_re_gmatch(lua_State *L)
         dd("saving regex %p, ncaptures %d,  captures %p", re_comp.regex,
            re_comp.captures, cap);
 
+        re->pool = pool;
         re->regex = re_comp.regex;
         re->regex_sd = sd;
         re->ncaptures = re_comp.captures;
         re->captures = cap;
         re->replace = NULL;
 
-        lua_pushlightuserdata(L, re); /* table key value */
-        lua_rawset(L, -3); /* table */
-        lua_pop(L, 1);
-
-        if (lmcf) {
-            lmcf->regex_cache_entries++;
+        node = ngx_http_lua_regex_cache_add(lmcf, &key, re);
+        if (node == NULL) {
+            msg = "no memory";
+            goto error;
         }
+
+        lua_pop(L, 1); /* key */
     }
 
 compiled:
@@ -931,31 +944,36 @@ compiled:
     ctx = lua_newuserdata(L, sizeof(ngx_http_lua_regex_ctx_t));
 
     ctx->request = r;
+    ctx->node = NULL;
     ctx->regex = re_comp.regex;
     ctx->regex_sd = sd;
     ctx->ncaptures = re_comp.captures;
     ctx->captures = cap;
     ctx->captures_len = ovecsize;
     ctx->flags = (uint8_t) flags;
+    ctx->cleanup = NULL;
 
-    if (!(flags & NGX_LUA_RE_COMPILE_ONCE)) {
-        lua_createtable(L, 0 /* narr */, 1 /* nrec */); /* metatable */
-        lua_pushcfunction(L, ngx_http_lua_ngx_re_gmatch_gc);
-        lua_setfield(L, -2, "__gc");
-        lua_setmetatable(L, -2);
+    /* cached regexes are pinned so that they cannot get evicted from the
+     * regex cache while the iterator is still alive */
 
-        cln = ngx_http_cleanup_add(r, 0);
-        if (cln == NULL) {
-            msg = "no memory";
-            goto error;
-        }
+    lua_createtable(L, 0 /* narr */, 1 /* nrec */); /* metatable */
+    lua_pushcfunction(L, ngx_http_lua_ngx_re_gmatch_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
 
-        cln->handler = ngx_http_lua_ngx_re_gmatch_cleanup;
-        cln->data = ctx;
-        ctx->cleanup = &cln->handler;
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        msg = "no memory";
+        goto error;
+    }
 
-    } else {
-        ctx->cleanup = NULL;
+    cln->handler = ngx_http_lua_ngx_re_gmatch_cleanup;
+    cln->data = ctx;
+    ctx->cleanup = &cln->handler;
+
+    if (node) {
+        node->refs++;
+        ctx->node = node;
     }
 
     lua_pushinteger(L, 0);
@@ -967,7 +985,13 @@ compiled:
 
 error:
 
-    if (!(flags & NGX_LUA_RE_COMPILE_ONCE)) {
+    if (flags & NGX_LUA_RE_COMPILE_ONCE) {
+        if (node == NULL) {
+            /* not saved into the regex cache yet */
+            ngx_http_lua_regex_destroy_pool(pool, sd);
+        }
+
+    } else {
         if (sd) {
             ngx_http_lua_regex_free_study_data(pool, sd);
         }
@@ -1312,10 +1336,12 @@ ngx_http_lua_ngx_re_sub_helper(lua_State *L, unsigned global)
     int                          name_entry_size = 0, name_count;
     u_char                      *name_table = NULL;
     int                          exec_opts;
+    ngx_str_t                    key;
 
     ngx_http_lua_regex_compile_t               re_comp;
     ngx_http_lua_complex_value_t              *ctpl = NULL;
     ngx_http_lua_compile_complex_value_t       ccv;
+    ngx_http_lua_regex_cache_node_t           *node = NULL;
 
     nargs = lua_gettop(L);
 
@@ -1373,13 +1399,6 @@ ngx_http_lua_ngx_re_sub_helper(lua_State *L, unsigned global)
     lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
 
     if (flags & NGX_LUA_RE_COMPILE_ONCE) {
-        pool = lmcf->pool;
-
-        dd("server pool %p", lmcf->pool);
-
-        lua_pushlightuserdata(L, &ngx_http_lua_regex_cache_key);
-        lua_rawget(L, LUA_REGISTRYINDEX); /* table */
-
         lua_pushliteral(L, "s");
         lua_pushinteger(L, tpl.len);
         lua_pushliteral(L, ":");
@@ -1392,33 +1411,32 @@ ngx_http_lua_ngx_re_sub_helper(lua_State *L, unsigned global)
         dd("options size: %d", (int) sizeof(re_comp.options));
 
         lua_pushlstring(L, (char *) &re_comp.options, sizeof(re_comp.options));
-                /* table regex opts */
+                /* regex opts */
 
         if (tpl.len == 0) {
-            lua_concat(L, 5); /* table key */
+            lua_concat(L, 5); /* key */
 
         } else {
-            lua_concat(L, 6); /* table key */
+            lua_concat(L, 6); /* key */
         }
 
-        lua_pushvalue(L, -1); /* table key key */
-
-        dd("regex cache key: %.*s", (int) (pat.len + sizeof(re_comp.options)),
-           lua_tostring(L, -1));
+        key.data = (u_char *) lua_tolstring(L, -1, &key.len);
 
-        lua_rawget(L, -3); /* table key re */
-        re = lua_touserdata(L, -1);
+        dd("regex cache key: %.*s", (int) key.len, key.data);
 
-        lua_pop(L, 1); /* table key */
+        node = ngx_http_lua_regex_cache_lookup(lmcf, &key);
 
-        if (re) {
+        if (node) {
             ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "lua regex cache hit for sub regex \"%s\" with "
                            "options \"%s\" and replace \"%s\"",
                            pat.data, opts.data,
                            func ? (u_char *) "<func>" : tpl.data);
 
-            lua_pop(L, 2);
+            lua_pop(L, 1);
+
+            re = node->re;
+            pool = re->pool;
 
             dd("restoring regex %p, ncaptures %d,  captures %p", re->regex,
                re->ncaptures, re->captures);
@@ -1445,15 +1463,10 @@ ngx_http_lua_ngx_re_sub_helper(lua_State *L, unsigned global)
                        global ? "g" : "", pat.data, opts.data,
                        func ? (u_char *) "<func>" : tpl.data);
 
-        if (lmcf->regex_cache_entries >= lmcf->regex_cache_max_entries) {
-
-            if (lmcf->regex_cache_entries == lmcf->regex_cache_max_entries) {
-                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                              "lua exceeding regex cache max entries (%i)",
-                              lmcf->regex_cache_max_entries);
-
-                lmcf->regex_cache_entries++;
-            }
+        pool = ngx_http_lua_regex_cache_create_pool(lmcf,
+                                                    r->connection->log);
+        if (pool == NULL) {
+            lua_pop(L, 1);
 
             pool = r->pool;
             flags &= ~NGX_LUA_RE_COMPILE_ONCE;
@@ -1487,6 +1500,10 @@ ngx_http_lua_ngx_re_sub_helper(lua_State *L, unsigned global)
     if (rc != NGX_OK) {
         dd("compile failed");
 
+        if (flags & NGX_LUA_RE_COMPILE_ONCE) {
+            ngx_destroy_pool(pool);
+        }
+
         lua_pushnil(L);
         lua_pushnil(L);
         lua_pushlstring(L, (char *) re_comp.err.data, re_comp.err.len);
@@ -1571,7 +1588,6 @@ ngx_http_lua_ngx_re_sub_helper(lua_State *L, unsigned global)
 
     cap = ngx_palloc(pool, ovecsize * sizeof(int));
     if (cap == NULL) {
-        flags &= ~NGX_LUA_RE_COMPILE_ONCE;
         msg = "no memory";
         goto error;
     }
@@ -1582,7 +1598,6 @@ ngx_http_lua_ngx_re_sub_helper(lua_State *L, unsigned global)
     } else {
         ctpl = ngx_palloc(pool, sizeof(ngx_http_lua_complex_value_t));
         if (ctpl == NULL) {
-            flags &= ~NGX_LUA_RE_COMPILE_ONCE;
             msg = "no memory";
             goto error;
         }
@@ -1591,7 +1606,6 @@ ngx_http_lua_ngx_re_sub_helper(lua_State *L, unsigned global)
             /* copy the string buffer pointed to by tpl.data from Lua VM */
             p = ngx_palloc(pool, tpl.len + 1);
             if (p == NULL) {
-                flags &= ~NGX_LUA_RE_COMPILE_ONCE;
                 msg = "no memory";
                 goto error;
             }
@@ -1609,18 +1623,19 @@ ngx_http_lua_ngx_re_sub_helper(lua_State *L, unsigned global)
         ccv.complex_value = ctpl;
 
         if (ngx_http_lua_compile_complex_value(&ccv) != NGX_OK) {
-            ngx_pfree(pool, cap);
-            ngx_pfree(pool, ctpl);
+            if (flags & NGX_LUA_RE_COMPILE_ONCE) {
+                ngx_http_lua_regex_destroy_pool(pool, sd);
 
-            if ((flags & NGX_LUA_RE_COMPILE_ONCE) && tpl.len != 0) {
-                ngx_pfree(pool, tpl.data);
-            }
+            } else {
+                ngx_pfree(pool, cap);
+                ngx_pfree(pool, ctpl);
 
-            if (sd) {
-                ngx_http_lua_regex_free_study_data(pool, sd);
-            }
+                if (sd) {
+                    ngx_http_lua_regex_free_study_data(pool, sd);
+                }
 
-            ngx_pfree(pool, re_comp.regex);
+                ngx_pfree(pool, re_comp.regex);
+            }
 
             lua_pushnil(L);
             lua_pushnil(L);
@@ -1645,23 +1660,29 @@ ngx_http_lua_ngx_re_sub_helper(lua_State *L, unsigned global)
         dd("saving regex %p, ncaptures %d,  captures %p", re_comp.regex,
            re_comp.captures, cap);
 
+        re->pool = pool;
         re->regex = re_comp.regex;
         re->regex_sd = sd;
         re->ncaptures = re_comp.captures;
         re->captures = cap;
         re->replace = ctpl;
 
-        lua_pushlightuserdata(L, re); /* table key value */
-        lua_rawset(L, -3); /* table */
-        lua_pop(L, 1);
-
-        if (lmcf) {
-            lmcf->regex_cache_entries++;
+        node = ngx_http_lua_regex_cache_add(lmcf, &key, re);
+        if (node == NULL) {
+            msg = "no memory";
+            goto error;
         }
+
+        lua_pop(L, 1); /* key */
     }
 
 exec:
 
+    if (node && func) {
+        /* the replace function might evict this regex from the cache */
+        node->refs++;
+    }
+
     count = 0;
     offset = 0;
     cp_offset = 0;
@@ -1778,7 +1799,15 @@ exec:
 
             dd("stack size at call: %d", lua_gettop(L));
 
-            lua_call(L, 1 /* nargs */, 1 /* nresults */);
+            if (lua_pcall(L, 1 /* nargs */, 1 /* nresults */, 0) != 0) {
+                /* unpin the regex before rethrowing the error */
+                if (node) {
+                    node->refs--;
+                }
+
+                return lua_error(L);
+            }
+
             type = lua_type(L, -1);
             switch (type) {
                 case LUA_TNUMBER:
@@ -1787,6 +1816,10 @@ exec:
                     break;
 
                 default:
+                    if (node) {
+                        node->refs--;
+                    }
+
                     msg = lua_pushfstring(L, "string or number expected to be "
                                           "returned by the replace "
                                           "function, got %s",
@@ -1863,6 +1896,10 @@ exec:
         dd("the dst string: %s", lua_tostring(L, -1));
     }
 
+    if (node && func) {
+        node->refs--;
+    }
+
     if (!(flags & NGX_LUA_RE_COMPILE_ONCE)) {
         if (sd) {
             ngx_http_lua_regex_free_study_data(pool, sd);
@@ -1886,7 +1923,16 @@ exec:
 
 error:
 
-    if (!(flags & NGX_LUA_RE_COMPILE_ONCE)) {
+    if (flags & NGX_LUA_RE_COMPILE_ONCE) {
+        if (node == NULL) {
+            /* not saved into the regex cache yet */
+            ngx_http_lua_regex_destroy_pool(pool, sd);
+
+        } else if (func) {
+            node->refs--;
+        }
+
+    } else {
         if (sd) {
             ngx_http_lua_regex_free_study_data(pool, sd);
         }
@@ -1916,7 +1962,7 @@ ngx_http_lua_inject_regex_api(lua_State *L)
 {
     /* ngx.re */
 
-    lua_createtable(L, 0, 5 /* nrec */);    /* .re */
+    lua_createtable(L, 0, 6 /* nrec */);    /* .re */
 
     lua_pushcfunction(L, ngx_http_lua_ngx_re_find);
     lua_setfield(L, -2, "find");
@@ -1933,10 +1979,186 @@ ngx_http_lua_inject_regex_api(lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_ngx_re_gsub);
     lua_setfield(L, -2, "gsub");
 
+    lua_pushcfunction(L, ngx_http_lua_ngx_re_cache_stats);
+    lua_setfield(L, -2, "cache_stats");
+
     lua_setfield(L, -2, "re");
 }
 
 
+static int
+ngx_http_lua_ngx_re_cache_stats(lua_State *L)
+{
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    if (lua_gettop(L) != 0) {
+        return luaL_error(L, "expecting no arguments");
+    }
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_module);
+    if (lmcf == NULL) {
+        return luaL_error(L, "no lua module main conf found");
+    }
+
+    lua_createtable(L, 0 /* narr */, 5 /* nrec */);
+
+    lua_pushinteger(L, (lua_Integer) lmcf->regex_cache_entries);
+    lua_setfield(L, -2, "entries");
+
+    lua_pushinteger(L, (lua_Integer) lmcf->regex_cache_max_entries);
+    lua_setfield(L, -2, "max_entries");
+
+    lua_pushnumber(L, (lua_Number) lmcf->regex_cache_hits);
+    lua_setfield(L, -2, "hits");
+
+    lua_pushnumber(L, (lua_Number) lmcf->regex_cache_misses);
+    lua_setfield(L, -2, "misses");
+
+    lua_pushnumber(L, (lua_Number) lmcf->regex_cache_evictions);
+    lua_setfield(L, -2, "evictions");
+
+    return 1;
+}
+
+
+static ngx_http_lua_regex_cache_node_t *
+ngx_http_lua_regex_cache_lookup(ngx_http_lua_main_conf_t *lmcf,
+    ngx_str_t *key)
+{
+    uint32_t                             hash;
+    ngx_str_node_t                      *sn;
+    ngx_http_lua_regex_cache_node_t     *node;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    sn = ngx_str_rbtree_lookup(&lmcf->regex_cache_rbtree, key, hash);
+    if (sn == NULL) {
+        lmcf->regex_cache_misses++;
+        return NULL;
+    }
+
+    node = (ngx_http_lua_regex_cache_node_t *) sn;
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&lmcf->regex_cache_queue, &node->queue);
+
+    lmcf->regex_cache_hits++;
+
+    return node;
+}
+
+
+/*
+ * makes room for a new entry by evicting the least recently used regexes
+ * that are not pinned, and returns a dedicated pool for compiling the new
+ * one into. returns NULL when the regex should not be cached at all.
+ */
+static ngx_pool_t *
+ngx_http_lua_regex_cache_create_pool(ngx_http_lua_main_conf_t *lmcf,
+    ngx_log_t *log)
+{
+    ngx_queue_t                         *q, *prev;
+    ngx_http_lua_regex_t                *re;
+    ngx_http_lua_regex_cache_node_t     *node;
+
+    if (lmcf->regex_cache_max_entries <= 0) {
+        return NULL;
+    }
+
+    q = ngx_queue_last(&lmcf->regex_cache_queue);
+
+    while (lmcf->regex_cache_entries >= lmcf->regex_cache_max_entries
+           && q != ngx_queue_sentinel(&lmcf->regex_cache_queue))
+    {
+        prev = ngx_queue_prev(q);
+
+        node = ngx_queue_data(q, ngx_http_lua_regex_cache_node_t, queue);
+
+        if (node->refs == 0) {
+            re = node->re;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "lua regex cache evicting regex \"%V\"",
+                           &node->sn.str);
+
+            ngx_queue_remove(q);
+            ngx_rbtree_delete(&lmcf->regex_cache_rbtree, &node->sn.node);
+
+            lmcf->regex_cache_entries--;
+            lmcf->regex_cache_evictions++;
+
+            ngx_http_lua_regex_destroy_pool(re->pool, re->regex_sd);
+        }
+
+        q = prev;
+    }
+
+    if (lmcf->regex_cache_entries >= lmcf->regex_cache_max_entries) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua regex cache full of pinned regexes (%i)",
+                       lmcf->regex_cache_entries);
+        return NULL;
+    }
+
+    return ngx_create_pool(512, ngx_cycle->log);
+}
+
+
+static ngx_http_lua_regex_cache_node_t *
+ngx_http_lua_regex_cache_add(ngx_http_lua_main_conf_t *lmcf, ngx_str_t *key,
+    ngx_http_lua_regex_t *re)
+{
+    ngx_http_lua_regex_cache_node_t     *node;
+
+    node = ngx_palloc(re->pool, sizeof(ngx_http_lua_regex_cache_node_t)
+                      + key->len);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->sn.str.data = (u_char *) node
+                        + sizeof(ngx_http_lua_regex_cache_node_t);
+    node->sn.str.len = key->len;
+    ngx_memcpy(node->sn.str.data, key->data, key->len);
+
+    node->sn.node.key = ngx_crc32_short(key->data, key->len);
+    node->re = re;
+    node->refs = 0;
+
+    ngx_rbtree_insert(&lmcf->regex_cache_rbtree, &node->sn.node);
+    ngx_queue_insert_head(&lmcf->regex_cache_queue, &node->queue);
+
+    lmcf->regex_cache_entries++;
+
+    return node;
+}
+
+
+void
+ngx_http_lua_regex_cache_cleanup(void *data)
+{
+    ngx_http_lua_main_conf_t    *lmcf = data;
+
+    ngx_queue_t                         *q;
+    ngx_http_lua_regex_t                *re;
+    ngx_http_lua_regex_cache_node_t     *node;
+
+    while (!ngx_queue_empty(&lmcf->regex_cache_queue)) {
+        q = ngx_queue_head(&lmcf->regex_cache_queue);
+        node = ngx_queue_data(q, ngx_http_lua_regex_cache_node_t, queue);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&lmcf->regex_cache_rbtree, &node->sn.node);
+
+        re = node->re;
+        ngx_http_lua_regex_destroy_pool(re->pool, re->regex_sd);
+    }
+
+    lmcf->regex_cache_entries = 0;
+}
+
+
 static void
 ngx_http_lua_regex_free_study_data(ngx_pool_t *pool, pcre_extra *sd)
 {
@@ -1954,6 +2176,17 @@ ngx_http_lua_regex_free_study_data(ngx_pool_t *pool, pcre_extra *sd)
 }
 
 
+static void
+ngx_http_lua_regex_destroy_pool(ngx_pool_t *pool, pcre_extra *sd)
+{
+    if (sd) {
+        ngx_http_lua_regex_free_study_data(pool, sd);
+    }
+
+    ngx_destroy_pool(pool);
+}
+
+
 static ngx_int_t
 ngx_http_lua_regex_compile(ngx_http_lua_regex_compile_t *rc)
 {
@@ -2014,6 +2247,13 @@ ngx_http_lua_ngx_re_gmatch_cleanup(void *data)
     ngx_http_lua_regex_ctx_t    *ctx = data;
 
     if (ctx) {
+        if (ctx->node) {
+            /* the study data is owned by the regex cache */
+            ctx->node->refs--;
+            ctx->node = NULL;
+            ctx->regex_sd = NULL;
+        }
+
         if (ctx->regex_sd) {
             ngx_http_lua_regex_free_study_data(ctx->request->pool,
                                                ctx->regex_sd);
@@ -14,6 +14,7 @@
 
 #if (NGX_PCRE)
 void ngx_http_lua_inject_regex_api(lua_State *L);
+void ngx_http_lua_regex_cache_cleanup(void *data);
 #endif
 
 
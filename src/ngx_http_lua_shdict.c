@@ -22,7 +22,7 @@ static int ngx_http_lua_shdict_get_stale(lua_State *L);
 static int ngx_http_lua_shdict_get_helper(lua_State *L, int get_stale);
 static int ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx,
     ngx_uint_t n);
-static ngx_int_t ngx_http_lua_shdict_lookup(ngx_shm_zone_t *shm_zone,
+static ngx_int_t ngx_http_lua_shdict_lookup(ngx_http_lua_shdict_ctx_t *ctx,
     ngx_uint_t hash, u_char *kdata, size_t klen,
     ngx_http_lua_shdict_node_t **sdp);
 static int ngx_http_lua_shdict_set_helper(lua_State *L, int flags);
@@ -30,19 +30,59 @@ static int ngx_http_lua_shdict_add(lua_State *L);
 static int ngx_http_lua_shdict_safe_add(lua_State *L);
 static int ngx_http_lua_shdict_replace(lua_State *L);
 static int ngx_http_lua_shdict_incr(lua_State *L);
+static int ngx_http_lua_shdict_lpush(lua_State *L);
+static int ngx_http_lua_shdict_rpush(lua_State *L);
+static int ngx_http_lua_shdict_push_helper(lua_State *L, int flags);
+static int ngx_http_lua_shdict_lpop(lua_State *L);
+static int ngx_http_lua_shdict_rpop(lua_State *L);
+static int ngx_http_lua_shdict_pop_helper(lua_State *L, int flags);
+static int ngx_http_lua_shdict_llen(lua_State *L);
+static ngx_int_t ngx_http_lua_shdict_push_locked(
+    ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash, u_char *kdata, size_t klen,
+    int flags, int value_type, u_char *data, size_t len, int64_t exptime,
+    char **err);
+static ngx_http_lua_shdict_list_node_t *ngx_http_lua_shdict_pop_locked(
+    ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash, u_char *kdata, size_t klen,
+    int flags, char **err);
+static void ngx_http_lua_shdict_free_node(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd);
 static int ngx_http_lua_shdict_delete(lua_State *L);
 static int ngx_http_lua_shdict_flush_all(lua_State *L);
+static void ngx_http_lua_shdict_flush_all_shards(
+    ngx_http_lua_shdict_ctx_t *dict);
 static int ngx_http_lua_shdict_flush_expired(lua_State *L);
 static int ngx_http_lua_shdict_get_keys(lua_State *L);
+static int ngx_http_lua_shdict_l1_stats(lua_State *L);
+static ngx_int_t ngx_http_lua_shdict_init_shards(ngx_shm_zone_t *shm_zone,
+    ngx_http_lua_shdict_ctx_t *ctx);
+static void ngx_http_lua_shdict_init_shctx(ngx_http_lua_shdict_shctx_t *sh);
+static ngx_uint_t ngx_http_lua_shdict_slab_pages(size_t size);
+static ngx_uint_t ngx_http_lua_shdict_alloc_pages(size_t size);
+static ngx_uint_t ngx_http_lua_shdict_slice_pages(ngx_uint_t free,
+    ngx_uint_t nshards, ngx_uint_t *nlarger, ngx_uint_t *shard_pages);
+static ngx_http_lua_shdict_l1_node_t *ngx_http_lua_shdict_l1_lookup(
+    ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash, u_char *kdata,
+    size_t klen);
+static void ngx_http_lua_shdict_l1_store(ngx_http_lua_shdict_ctx_t *ctx,
+    uint32_t hash, u_char *kdata, size_t klen, ngx_atomic_uint_t version,
+    int value_type, u_char *data, size_t len, uint32_t user_flags,
+    uint64_t expires);
+static void ngx_http_lua_shdict_l1_delete(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_l1_node_t *l1);
 
 
 static ngx_inline ngx_shm_zone_t *ngx_http_lua_shdict_get_zone(lua_State *L,
                                                                int index);
+static ngx_inline ngx_http_lua_shdict_ctx_t *ngx_http_lua_shdict_shard(
+    ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash);
 
 
-#define NGX_HTTP_LUA_SHDICT_ADD         0x0001
-#define NGX_HTTP_LUA_SHDICT_REPLACE     0x0002
-#define NGX_HTTP_LUA_SHDICT_SAFE_STORE  0x0004
+#define NGX_HTTP_LUA_SHDICT_LEFT        0x0001
+#define NGX_HTTP_LUA_SHDICT_RIGHT       0x0002
+
+
+#define ngx_http_lua_shdict_get_list_head(sd, klen)                          \
+    ((ngx_queue_t *) ngx_align_ptr((sd)->data + (klen), NGX_ALIGNMENT))
 
 
 enum {
@@ -56,6 +96,7 @@ ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     ngx_http_lua_shdict_ctx_t  *octx = data;
 
     size_t                      len;
+    ngx_uint_t                  i;
     ngx_http_lua_shdict_ctx_t  *ctx;
     ngx_http_lua_main_conf_t   *lmcf;
 
@@ -67,7 +108,7 @@ ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
         ctx->sh = octx->sh;
         ctx->shpool = octx->shpool;
 
-        goto done;
+        goto shards;
     }
 
     ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
@@ -75,21 +116,9 @@ ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     if (shm_zone->shm.exists) {
         ctx->sh = ctx->shpool->data;
 
-        goto done;
-    }
-
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_lua_shdict_shctx_t));
-    if (ctx->sh == NULL) {
-        return NGX_ERROR;
+        goto shards;
     }
 
-    ctx->shpool->data = ctx->sh;
-
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_lua_shdict_rbtree_insert_value);
-
-    ngx_queue_init(&ctx->sh->queue);
-
     len = sizeof(" in lua_shared_dict zone \"\"") + shm_zone->shm.name.len;
 
     ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
@@ -104,7 +133,24 @@ ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     ctx->shpool->log_nomem = 0;
 #endif
 
-done:
+    if (ngx_http_lua_shdict_init_shards(shm_zone, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+shards:
+
+    if (ctx->sh->nshards != ctx->nshards) {
+        ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                      "lua_shared_dict \"%V\" cannot change from %ui to %ui "
+                      "shards without changing its size", &ctx->name,
+                      ctx->sh->nshards, ctx->nshards);
+        return NGX_ERROR;
+    }
+
+    for (i = 1; i < ctx->nshards; i++) {
+        ctx->shards[i]->shpool = ctx->sh->shpools[i];
+        ctx->shards[i]->sh = ctx->sh->shpools[i]->data;
+    }
 
     dd("get lmcf");
 
@@ -127,6 +173,269 @@ done:
 }
 
 
+static ngx_int_t
+ngx_http_lua_shdict_init_shards(ngx_shm_zone_t *shm_zone,
+    ngx_http_lua_shdict_ctx_t *ctx)
+{
+    u_char                       *p;
+    size_t                        size;
+    ngx_uint_t                    i, free, slice, nlarger, shard_pages;
+    ngx_slab_page_t              *page;
+    ngx_slab_pool_t              *sp;
+    ngx_http_lua_shdict_shctx_t  *sh;
+
+    /*
+     * the first shard lives in the slab pool nginx created for the zone,
+     * the others get slices of it, each being a slab pool (and thus a
+     * mutex) of its own
+     */
+
+    sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_lua_shdict_shctx_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->sh = sh;
+    ctx->shpool->data = sh;
+
+    ngx_http_lua_shdict_init_shctx(sh);
+
+    sh->nshards = ctx->nshards;
+
+    sh->shpools = ngx_slab_alloc(ctx->shpool,
+                                 ctx->nshards * sizeof(ngx_slab_pool_t *));
+    if (sh->shpools == NULL) {
+        return NGX_ERROR;
+    }
+
+    sh->shpools[0] = ctx->shpool;
+
+    /* the slices come out of the pages still free in the zone's pool */
+
+    free = 0;
+
+    for (page = ctx->shpool->free.next;
+         page != &ctx->shpool->free;
+         page = page->next)
+    {
+        free += page->slab;
+    }
+
+    slice = ngx_http_lua_shdict_slice_pages(free, ctx->nshards, &nlarger,
+                                            &shard_pages);
+
+    if (shard_pages < NGX_HTTP_LUA_SHDICT_MIN_SHARD_PAGES) {
+        ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                      "lua_shared_dict \"%V\" is too small for %ui "
+                      "shards", &ctx->name, ctx->nshards);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "lua shared dict \"%V\": %ui shards of %ui free pages "
+                   "(%ui pages a slice)", &ctx->name, ctx->nshards,
+                   shard_pages, slice);
+
+    for (i = 1; i < ctx->nshards; i++) {
+
+        size = (slice + (i <= nlarger)) << ngx_pagesize_shift;
+
+        p = ngx_slab_alloc(ctx->shpool, size);
+        if (p == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                          "lua_shared_dict \"%V\" is too small for %ui "
+                          "shards", &ctx->name, ctx->nshards);
+            return NGX_ERROR;
+        }
+
+        sp = (ngx_slab_pool_t *) p;
+
+        sp->end = p + size;
+        sp->min_shift = 3;
+        sp->addr = p;
+
+        if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_slab_init(sp);
+
+        sp->log_ctx = ctx->shpool->log_ctx;
+
+#if defined(nginx_version) && nginx_version >= 1005013
+        sp->log_nomem = 0;
+#endif
+
+        sh = ngx_slab_alloc(sp, sizeof(ngx_http_lua_shdict_shctx_t));
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        sp->data = sh;
+
+        ngx_http_lua_shdict_init_shctx(sh);
+
+        ctx->sh->shpools[i] = sp;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * returns the number of pages a zone of "size" bytes split into "nshards"
+ * shards leaves to each of them, which is checked while parsing
+ * lua_shared_dict; it assumes the worst case of the metadata allocations
+ * made by ngx_http_lua_shdict_init_zone() each taking pages of their own
+ */
+
+ngx_uint_t
+ngx_http_lua_shdict_shard_pages(size_t size, size_t name_len,
+    ngx_uint_t nshards)
+{
+    ngx_uint_t      free, used, nlarger, shard_pages;
+
+    free = ngx_http_lua_shdict_slab_pages(size);
+
+    used = ngx_http_lua_shdict_alloc_pages(
+               sizeof(" in lua_shared_dict zone \"\"") + name_len)
+           + ngx_http_lua_shdict_alloc_pages(
+               sizeof(ngx_http_lua_shdict_shctx_t))
+           + ngx_http_lua_shdict_alloc_pages(
+               nshards * sizeof(ngx_slab_pool_t *));
+
+    if (free <= used) {
+        return 0;
+    }
+
+    (void) ngx_http_lua_shdict_slice_pages(free - used, nshards, &nlarger,
+                                           &shard_pages);
+
+    return shard_pages;
+}
+
+
+/*
+ * returns the number of free pages ngx_slab_init() leaves in a page
+ * aligned slab pool of "size" bytes, mirroring its layout: the pool
+ * header, the slots (and their stats), the page array, and the pages
+ */
+
+static ngx_uint_t
+ngx_http_lua_shdict_slab_pages(size_t size)
+{
+    size_t          meta, off;
+    ngx_uint_t      n, pages, avail;
+
+    n = ngx_pagesize_shift - 3;  /* slots for min_shift 3 */
+
+    meta = sizeof(ngx_slab_pool_t) + n * sizeof(ngx_slab_page_t);
+
+#if defined(nginx_version) && nginx_version >= 1011007
+    meta += n * sizeof(ngx_slab_stat_t);
+#endif
+
+    if (size <= meta) {
+        return 0;
+    }
+
+    pages = (size - meta) / (ngx_pagesize + sizeof(ngx_slab_page_t));
+
+    off = ngx_align(meta + pages * sizeof(ngx_slab_page_t), ngx_pagesize);
+    if (off >= size) {
+        return 0;
+    }
+
+    avail = (size - off) >> ngx_pagesize_shift;
+
+    return ngx_min(pages, avail);
+}
+
+
+/* the pages a slab allocation of "size" bytes takes at most */
+
+static ngx_uint_t
+ngx_http_lua_shdict_alloc_pages(size_t size)
+{
+    if (size > ngx_pagesize / 2) {
+        return (size + ngx_pagesize - 1) >> ngx_pagesize_shift;
+    }
+
+    return 1;  /* a page of slots */
+}
+
+
+/*
+ * splits "free" pages of the zone's pool into the slices (in pages) of
+ * the other shards so that all the shards end up with about the same
+ * number of free pages, the least of which is put into "shard_pages": a
+ * slice loses its own slab pool metadata and a page of slots for its
+ * shctx, while the first shard keeps what the slices leave behind. The
+ * first "nlarger" slices take one more page than the returned size.
+ */
+
+static ngx_uint_t
+ngx_http_lua_shdict_slice_pages(ngx_uint_t free, ngx_uint_t nshards,
+    ngx_uint_t *nlarger, ngx_uint_t *shard_pages)
+{
+    ngx_uint_t      slice, usable, rest, n;
+
+    *nlarger = 0;
+
+    if (nshards == 1) {
+        *shard_pages = free;
+        return 0;
+    }
+
+    slice = free / nshards;
+
+    for ( ;; ) {
+        if ((nshards - 1) * (slice + 1) > free) {
+            break;
+        }
+
+        usable = ngx_http_lua_shdict_slab_pages((slice + 1)
+                                                << ngx_pagesize_shift);
+
+        if (usable == 0 || usable - 1 > free - (nshards - 1) * (slice + 1)) {
+            break;
+        }
+
+        slice++;
+    }
+
+    usable = ngx_http_lua_shdict_slab_pages(slice << ngx_pagesize_shift);
+    usable = usable ? usable - 1 : 0;
+    rest = free - (nshards - 1) * slice;
+
+    /* hand out the pages the first shard has over the others */
+
+    if (rest > usable) {
+        n = (rest - usable) * (nshards - 1) / nshards;
+        *nlarger = ngx_min(n, nshards - 1);
+        rest -= *nlarger;
+    }
+
+    *shard_pages = ngx_min(usable, rest);
+
+    return slice;
+}
+
+
+static void
+ngx_http_lua_shdict_init_shctx(ngx_http_lua_shdict_shctx_t *sh)
+{
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                    ngx_http_lua_shdict_rbtree_insert_value);
+
+    ngx_queue_init(&sh->queue);
+
+    sh->version = 0;
+    sh->nshards = 0;
+    sh->shpools = NULL;
+}
+
+
 void
 ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
@@ -169,7 +478,7 @@ ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
 
 
 static ngx_int_t
-ngx_http_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
+ngx_http_lua_shdict_lookup(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
     u_char *kdata, size_t klen, ngx_http_lua_shdict_node_t **sdp)
 {
     ngx_int_t                    rc;
@@ -177,11 +486,8 @@ ngx_http_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
     uint64_t                     now;
     int64_t                      ms;
     ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_lua_shdict_ctx_t   *ctx;
     ngx_http_lua_shdict_node_t  *sd;
 
-    ctx = shm_zone->data;
-
     node = ctx->sh->rbtree.root;
     sentinel = ctx->sh->rbtree.sentinel;
 
@@ -237,6 +543,40 @@ ngx_http_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
 }
 
 
+static void
+ngx_http_lua_shdict_free_node(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd)
+{
+    ngx_queue_t                      *q, *next, *queue;
+    ngx_rbtree_node_t                *node;
+    ngx_http_lua_shdict_list_node_t  *lnode;
+
+    if (sd->value_type == SHDICT_TLIST) {
+        queue = ngx_http_lua_shdict_get_list_head(sd, sd->key_len);
+
+        for (q = ngx_queue_head(queue);
+             q != ngx_queue_sentinel(queue);
+             q = next)
+        {
+            next = ngx_queue_next(q);
+
+            lnode = ngx_queue_data(q, ngx_http_lua_shdict_list_node_t, queue);
+
+            ngx_slab_free_locked(ctx->shpool, lnode);
+        }
+    }
+
+    ngx_queue_remove(&sd->queue);
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_rbtree_delete(&ctx->sh->rbtree, node);
+
+    ngx_slab_free_locked(ctx->shpool, node);
+}
+
+
 static int
 ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t n)
 {
@@ -244,7 +584,6 @@ ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t n)
     uint64_t                     now;
     ngx_queue_t                 *q;
     int64_t                      ms;
-    ngx_rbtree_node_t           *node;
     ngx_http_lua_shdict_node_t  *sd;
     int                          freed = 0;
 
@@ -278,16 +617,13 @@ ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t n)
             if (ms > 0) {
                 return freed;
             }
-        }
-
-        ngx_queue_remove(q);
 
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
-
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        } else {
+            /* evicting a live entry by force is a visible write */
+            ctx->sh->version++;
+        }
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        ngx_http_lua_shdict_free_node(ctx, sd);
 
         freed++;
     }
@@ -307,7 +643,7 @@ ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf, lua_State *L)
         lua_createtable(L, 0, lmcf->shm_zones->nelts /* nrec */);
                 /* ngx.shared */
 
-        lua_createtable(L, 0 /* narr */, 13 /* nrec */); /* shared mt */
+        lua_createtable(L, 0 /* narr */, 19 /* nrec */); /* shared mt */
 
         lua_pushcfunction(L, ngx_http_lua_shdict_get);
         lua_setfield(L, -2, "get");
@@ -336,6 +672,21 @@ ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf, lua_State *L)
         lua_pushcfunction(L, ngx_http_lua_shdict_delete);
         lua_setfield(L, -2, "delete");
 
+        lua_pushcfunction(L, ngx_http_lua_shdict_lpush);
+        lua_setfield(L, -2, "lpush");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_rpush);
+        lua_setfield(L, -2, "rpush");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_lpop);
+        lua_setfield(L, -2, "lpop");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_rpop);
+        lua_setfield(L, -2, "rpop");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_llen);
+        lua_setfield(L, -2, "llen");
+
         lua_pushcfunction(L, ngx_http_lua_shdict_flush_all);
         lua_setfield(L, -2, "flush_all");
 
@@ -345,6 +696,9 @@ ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf, lua_State *L)
         lua_pushcfunction(L, ngx_http_lua_shdict_get_keys);
         lua_setfield(L, -2, "get_keys");
 
+        lua_pushcfunction(L, ngx_http_lua_shdict_l1_stats);
+        lua_setfield(L, -2, "l1_stats");
+
         lua_pushvalue(L, -1); /* shared mt mt */
         lua_setfield(L, -2, "__index"); /* shared mt */
 
@@ -402,6 +756,17 @@ ngx_http_lua_shdict_get_zone(lua_State *L, int index)
 }
 
 
+static ngx_inline ngx_http_lua_shdict_ctx_t *
+ngx_http_lua_shdict_shard(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash)
+{
+    if (ctx->nshards <= 1) {
+        return ctx;
+    }
+
+    return ctx->shards[hash % ctx->nshards];
+}
+
+
 static int
 ngx_http_lua_shdict_get_helper(lua_State *L, int get_stale)
 {
@@ -418,6 +783,9 @@ ngx_http_lua_shdict_get_helper(lua_State *L, int get_stale)
     u_char                       c;
     ngx_shm_zone_t              *zone;
     uint32_t                     user_flags = 0;
+    uint64_t                     expires;
+    ngx_atomic_uint_t            version;
+    ngx_http_lua_shdict_l1_node_t  *l1;
 
     n = lua_gettop(L);
 
@@ -460,11 +828,46 @@ ngx_http_lua_shdict_get_helper(lua_State *L, int get_stale)
 
     hash = ngx_crc32_short(key.data, key.len);
 
+    ctx = ngx_http_lua_shdict_shard(ctx, hash);
+
 #if (NGX_DEBUG)
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
                    "fetching key \"%V\" in shared dict \"%V\"", &key, &name);
 #endif /* NGX_DEBUG */
 
+    if (ctx->l1_max_size && !get_stale) {
+        l1 = ngx_http_lua_shdict_l1_lookup(ctx, hash, key.data, key.len);
+
+        if (l1) {
+            switch (l1->value_type) {
+            case LUA_TNIL:
+                lua_pushnil(L);
+                return 1;
+
+            case LUA_TSTRING:
+                lua_pushlstring(L, (char *) l1->data + key.len,
+                                l1->value_len);
+                break;
+
+            case LUA_TNUMBER:
+                ngx_memcpy(&num, l1->data + key.len, sizeof(double));
+                lua_pushnumber(L, num);
+                break;
+
+            default: /* LUA_TBOOLEAN */
+                lua_pushboolean(L, l1->data[key.len] ? 1 : 0);
+                break;
+            }
+
+            if (l1->user_flags) {
+                lua_pushinteger(L, (lua_Integer) l1->user_flags);
+                return 2;
+            }
+
+            return 1;
+        }
+    }
+
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
 #if 1
@@ -473,12 +876,20 @@ ngx_http_lua_shdict_get_helper(lua_State *L, int get_stale)
     }
 #endif
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key.data, key.len, &sd);
+    version = ctx->sh->version;
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key.data, key.len, &sd);
 
     dd("shdict lookup returns %d", (int) rc);
 
     if (rc == NGX_DECLINED || (rc == NGX_DONE && !get_stale)) {
         ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        if (ctx->l1_max_size && !get_stale) {
+            ngx_http_lua_shdict_l1_store(ctx, hash, key.data, key.len,
+                                         version, LUA_TNIL, NULL, 0, 0, 0);
+        }
+
         lua_pushnil(L);
         return 1;
     }
@@ -531,6 +942,14 @@ ngx_http_lua_shdict_get_helper(lua_State *L, int get_stale)
         lua_pushboolean(L, c ? 1 : 0);
         break;
 
+    case SHDICT_TLIST:
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "value is a list");
+        return 2;
+
     default:
 
         ngx_shmtx_unlock(&ctx->shpool->mutex);
@@ -541,9 +960,37 @@ ngx_http_lua_shdict_get_helper(lua_State *L, int get_stale)
     }
 
     user_flags = sd->user_flags;
+    expires = sd->expires;
 
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
+    if (ctx->l1_max_size && !get_stale) {
+
+        /* the shm copy may change once unlocked, so copy from the stack */
+
+        switch (value_type) {
+        case LUA_TSTRING:
+            value.data = (u_char *) lua_tolstring(L, -1, &value.len);
+            break;
+
+        case LUA_TNUMBER:
+            num = lua_tonumber(L, -1);
+            value.data = (u_char *) &num;
+            value.len = sizeof(double);
+            break;
+
+        default: /* LUA_TBOOLEAN */
+            c = lua_toboolean(L, -1) ? 1 : 0;
+            value.data = &c;
+            value.len = sizeof(u_char);
+            break;
+        }
+
+        ngx_http_lua_shdict_l1_store(ctx, hash, key.data, key.len, version,
+                                     value_type, value.data, value.len,
+                                     user_flags, expires);
+    }
+
     if (get_stale) {
 
         /* always return value, flags, stale */
@@ -589,10 +1036,7 @@ ngx_http_lua_shdict_delete(lua_State *L)
 static int
 ngx_http_lua_shdict_flush_all(lua_State *L)
 {
-    ngx_queue_t                 *q;
-    ngx_http_lua_shdict_node_t  *sd;
     int                          n;
-    ngx_http_lua_shdict_ctx_t   *ctx;
     ngx_shm_zone_t              *zone;
 
     n = lua_gettop(L);
@@ -608,23 +1052,39 @@ ngx_http_lua_shdict_flush_all(lua_State *L)
         return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
     }
 
-    ctx = zone->data;
+    ngx_http_lua_shdict_flush_all_shards(zone->data);
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    return 0;
+}
 
-    for (q = ngx_queue_head(&ctx->sh->queue);
-         q != ngx_queue_sentinel(&ctx->sh->queue);
-         q = ngx_queue_next(q))
-    {
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
-        sd->expires = 1;
-    }
 
-    ngx_http_lua_shdict_expire(ctx, 0);
+static void
+ngx_http_lua_shdict_flush_all_shards(ngx_http_lua_shdict_ctx_t *dict)
+{
+    ngx_uint_t                   i;
+    ngx_queue_t                 *q;
+    ngx_http_lua_shdict_node_t  *sd;
+    ngx_http_lua_shdict_ctx_t   *ctx;
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    for (i = 0; i < dict->nshards; i++) {
+        ctx = dict->shards[i];
 
-    return 0;
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+
+        for (q = ngx_queue_head(&ctx->sh->queue);
+             q != ngx_queue_sentinel(&ctx->sh->queue);
+             q = ngx_queue_next(q))
+        {
+            sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+            sd->expires = 1;
+        }
+
+        ctx->sh->version++;
+
+        ngx_http_lua_shdict_expire(ctx, 0);
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    }
 }
 
 
@@ -633,14 +1093,14 @@ ngx_http_lua_shdict_flush_expired(lua_State *L)
 {
     ngx_queue_t                 *q, *prev;
     ngx_http_lua_shdict_node_t  *sd;
-    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_ctx_t   *ctx, *dict;
     ngx_shm_zone_t              *zone;
     ngx_time_t                  *tp;
     int                          freed = 0;
     int                          attempts = 0;
-    ngx_rbtree_node_t           *node;
     uint64_t                     now;
     int                          n;
+    ngx_uint_t                   i;
 
     n = lua_gettop(L);
 
@@ -659,46 +1119,42 @@ ngx_http_lua_shdict_flush_expired(lua_State *L)
         attempts = luaL_checkint(L, 2);
     }
 
-    ctx = zone->data;
-
-    ngx_shmtx_lock(&ctx->shpool->mutex);
-
-    if (ngx_queue_empty(&ctx->sh->queue)) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_pushnumber(L, 0);
-        return 1;
-    }
+    dict = zone->data;
 
     tp = ngx_timeofday();
 
     now = (uint64_t) tp->sec * 1000 + tp->msec;
 
-    q = ngx_queue_last(&ctx->sh->queue);
+    for (i = 0; i < dict->nshards; i++) {
+        ctx = dict->shards[i];
 
-    while (q != ngx_queue_sentinel(&ctx->sh->queue)) {
-        prev = ngx_queue_prev(q);
+        ngx_shmtx_lock(&ctx->shpool->mutex);
 
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+        q = ngx_queue_last(&ctx->sh->queue);
 
-        if (sd->expires != 0 && sd->expires <= now) {
-            ngx_queue_remove(q);
+        while (q != ngx_queue_sentinel(&ctx->sh->queue)) {
+            prev = ngx_queue_prev(q);
 
-            node = (ngx_rbtree_node_t *)
-                ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+            sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
 
-            ngx_rbtree_delete(&ctx->sh->rbtree, node);
-            ngx_slab_free_locked(ctx->shpool, node);
-            freed++;
+            if (sd->expires != 0 && sd->expires <= now) {
+                ngx_http_lua_shdict_free_node(ctx, sd);
+                freed++;
 
-            if (attempts && freed == attempts) {
-                break;
+                if (attempts && freed == attempts) {
+                    break;
+                }
             }
+
+            q = prev;
         }
 
-        q = prev;
-    }
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+        if (attempts && freed == attempts) {
+            break;
+        }
+    }
 
     lua_pushnumber(L, freed);
     return 1;
@@ -714,13 +1170,14 @@ ngx_http_lua_shdict_get_keys(lua_State *L)
 {
     ngx_queue_t                 *q, *prev;
     ngx_http_lua_shdict_node_t  *sd;
-    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_ctx_t   *ctx, *dict;
     ngx_shm_zone_t              *zone;
     ngx_time_t                  *tp;
     int                          total = 0;
     int                          attempts = 1024;
     uint64_t                     now;
     int                          n;
+    ngx_uint_t                   i;
 
     n = lua_gettop(L);
 
@@ -740,14 +1197,12 @@ ngx_http_lua_shdict_get_keys(lua_State *L)
         attempts = luaL_checkint(L, 2);
     }
 
-    ctx = zone->data;
+    dict = zone->data;
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    /* always lock the shards in the same order to avoid deadlocks */
 
-    if (ngx_queue_empty(&ctx->sh->queue)) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_createtable(L, 0, 0);
-        return 1;
+    for (i = 0; i < dict->nshards; i++) {
+        ngx_shmtx_lock(&dict->shards[i]->shpool->mutex);
     }
 
     tp = ngx_timeofday();
@@ -756,47 +1211,62 @@ ngx_http_lua_shdict_get_keys(lua_State *L)
 
     /* first run through: get total number of elements we need to allocate */
 
-    q = ngx_queue_last(&ctx->sh->queue);
+    for (i = 0; i < dict->nshards; i++) {
+        ctx = dict->shards[i];
 
-    while (q != ngx_queue_sentinel(&ctx->sh->queue)) {
-        prev = ngx_queue_prev(q);
+        q = ngx_queue_last(&ctx->sh->queue);
 
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+        while (q != ngx_queue_sentinel(&ctx->sh->queue)) {
+            prev = ngx_queue_prev(q);
 
-        if (sd->expires == 0 || sd->expires > now) {
-            total++;
-            if (attempts && total == attempts) {
-                break;
+            sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+            if (sd->expires == 0 || sd->expires > now) {
+                total++;
+                if (attempts && total == attempts) {
+                    goto alloc;
+                }
             }
-        }
 
-        q = prev;
+            q = prev;
+        }
     }
 
+alloc:
+
     lua_createtable(L, total, 0);
 
     /* second run through: add keys to table */
 
     total = 0;
-    q = ngx_queue_last(&ctx->sh->queue);
 
-    while (q != ngx_queue_sentinel(&ctx->sh->queue)) {
-        prev = ngx_queue_prev(q);
+    for (i = 0; i < dict->nshards; i++) {
+        ctx = dict->shards[i];
 
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+        q = ngx_queue_last(&ctx->sh->queue);
 
-        if (sd->expires == 0 || sd->expires > now) {
-            lua_pushlstring(L, (char *) sd->data, sd->key_len);
-            lua_rawseti(L, -2, ++total);
-            if (attempts && total == attempts) {
-                break;
+        while (q != ngx_queue_sentinel(&ctx->sh->queue)) {
+            prev = ngx_queue_prev(q);
+
+            sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+            if (sd->expires == 0 || sd->expires > now) {
+                lua_pushlstring(L, (char *) sd->data, sd->key_len);
+                lua_rawseti(L, -2, ++total);
+                if (attempts && total == attempts) {
+                    goto done;
+                }
             }
-        }
 
-        q = prev;
+            q = prev;
+        }
     }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+done:
+
+    for (i = 0; i < dict->nshards; i++) {
+        ngx_shmtx_unlock(&dict->shards[i]->shpool->mutex);
+    }
 
     /* table is at top of stack */
     return 1;
@@ -902,6 +1372,8 @@ ngx_http_lua_shdict_set_helper(lua_State *L, int flags)
 
     hash = ngx_crc32_short(key.data, key.len);
 
+    ctx = ngx_http_lua_shdict_shard(ctx, hash);
+
     value_type = lua_type(L, 3);
 
     switch (value_type) {
@@ -954,7 +1426,7 @@ ngx_http_lua_shdict_set_helper(lua_State *L, int flags)
     ngx_http_lua_shdict_expire(ctx, 1);
 #endif
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key.data, key.len, &sd);
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key.data, key.len, &sd);
 
     dd("shdict lookup returned %d", (int) rc);
 
@@ -1006,7 +1478,9 @@ ngx_http_lua_shdict_set_helper(lua_State *L, int flags)
 
 replace:
 
-        if (value.data && value.len == (size_t) sd->value_len) {
+        if (value.data && value.len == (size_t) sd->value_len
+            && sd->value_type != SHDICT_TLIST)
+        {
 
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
                            "lua shared dict set: found old entry and value "
@@ -1037,6 +1511,8 @@ replace:
             p = ngx_copy(sd->data, key.data, key.len);
             ngx_memcpy(p, value.data, value.len);
 
+            ctx->sh->version++;
+
             ngx_shmtx_unlock(&ctx->shpool->mutex);
 
             lua_pushboolean(L, 1);
@@ -1051,15 +1527,9 @@ replace:
 
 remove:
 
-        ngx_queue_remove(&sd->queue);
-
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
-
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
-
-        ngx_slab_free_locked(ctx->shpool, node);
+        ctx->sh->version++;
 
+        ngx_http_lua_shdict_free_node(ctx, sd);
     }
 
 insert:
@@ -1120,48 +1590,807 @@ insert:
         return 3;
     }
 
-allocated:
+allocated:
+
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+    node->key = hash;
+    sd->key_len = (u_short) key.len;
+
+    if (exptime > 0) {
+        tp = ngx_timeofday();
+        sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
+                      + (uint64_t) (exptime * 1000);
+
+    } else {
+        sd->expires = 0;
+    }
+
+    sd->user_flags = user_flags;
+
+    sd->value_len = (uint32_t) value.len;
+
+    dd("setting value type to %d", value_type);
+
+    sd->value_type = (uint8_t) value_type;
+
+    p = ngx_copy(sd->data, key.data, key.len);
+    ngx_memcpy(p, value.data, value.len);
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+
+    ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+
+    ctx->sh->version++;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushboolean(L, forcible);
+    return 3;
+}
+
+
+static int
+ngx_http_lua_shdict_incr(lua_State *L)
+{
+    int                          n;
+    ngx_str_t                    key;
+    uint32_t                     hash;
+    ngx_int_t                    rc;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_node_t  *sd;
+    double                       num;
+    u_char                      *p;
+    ngx_shm_zone_t              *zone;
+    double                       value;
+
+    n = lua_gettop(L);
+
+    if (n != 3) {
+        return luaL_error(L, "expecting 3 arguments, but only seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key.len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_shard(ctx, hash);
+
+    value = luaL_checknumber(L, 3);
+
+    dd("looking up key %.*s in shared dict %.*s", (int) key.len, key.data,
+       (int) ctx->name.len, ctx->name.data);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key.data, key.len, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "not found");
+        return 2;
+    }
+
+    /* rc == NGX_OK */
+
+    if (sd->value_type != LUA_TNUMBER || sd->value_len != sizeof(double)) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "not a number");
+        return 2;
+    }
+
+    ngx_queue_remove(&sd->queue);
+    ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+
+    dd("setting value type to %d", (int) sd->value_type);
+
+    p = sd->data + key.len;
+
+    ngx_memcpy(&num, p, sizeof(double));
+    num += value;
+
+    ngx_memcpy(p, (double *) &num, sizeof(double));
+
+    ctx->sh->version++;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    lua_pushnumber(L, num);
+    lua_pushnil(L);
+    return 2;
+}
+
+
+static int
+ngx_http_lua_shdict_l1_stats(lua_State *L)
+{
+    int                          n;
+    ngx_uint_t                   i;
+    ngx_uint_t                   hits, misses, evictions, entries;
+    size_t                       size, max_size;
+    ngx_http_lua_shdict_ctx_t   *ctx, *dict;
+    ngx_shm_zone_t              *zone;
+
+    n = lua_gettop(L);
+
+    if (n != 1) {
+        return luaL_error(L, "expecting 1 argument, but seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    dict = zone->data;
+
+    if (dict->l1_max_size == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "l1 cache disabled");
+        return 2;
+    }
+
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+    entries = 0;
+    size = 0;
+    max_size = 0;
+
+    for (i = 0; i < dict->nshards; i++) {
+        ctx = dict->shards[i];
+
+        hits += ctx->l1_hits;
+        misses += ctx->l1_misses;
+        evictions += ctx->l1_evictions;
+        entries += ctx->l1_entries;
+        size += ctx->l1_size;
+        max_size += ctx->l1_max_size;
+    }
+
+    lua_createtable(L, 0 /* narr */, 6 /* nrec */);
+
+    lua_pushinteger(L, (lua_Integer) hits);
+    lua_setfield(L, -2, "hits");
+
+    lua_pushinteger(L, (lua_Integer) misses);
+    lua_setfield(L, -2, "misses");
+
+    lua_pushinteger(L, (lua_Integer) evictions);
+    lua_setfield(L, -2, "evictions");
+
+    lua_pushinteger(L, (lua_Integer) entries);
+    lua_setfield(L, -2, "entries");
+
+    lua_pushinteger(L, (lua_Integer) size);
+    lua_setfield(L, -2, "size");
+
+    lua_pushinteger(L, (lua_Integer) max_size);
+    lua_setfield(L, -2, "max_size");
+
+    return 1;
+}
+
+
+static ngx_http_lua_shdict_l1_node_t *
+ngx_http_lua_shdict_l1_lookup(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash,
+    u_char *kdata, size_t klen)
+{
+    uint64_t                        now;
+    ngx_str_t                       key;
+    ngx_time_t                     *tp;
+    ngx_str_node_t                 *sn;
+    ngx_http_lua_shdict_l1_node_t  *l1;
+
+    key.data = kdata;
+    key.len = klen;
+
+    sn = ngx_str_rbtree_lookup(&ctx->l1_rbtree, &key, hash);
+
+    if (sn == NULL) {
+        ctx->l1_misses++;
+        return NULL;
+    }
+
+    l1 = (ngx_http_lua_shdict_l1_node_t *) sn;
+
+    tp = ngx_timeofday();
+
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    /*
+     * the version is read without the shm mutex: a stale read only costs
+     * us at most one more lookup within l1_ttl
+     */
+
+    if (l1->version != ctx->sh->version || l1->expires <= now) {
+        dd("l1 entry is stale");
+
+        ngx_http_lua_shdict_l1_delete(ctx, l1);
+        ctx->l1_misses++;
+        return NULL;
+    }
+
+    ngx_queue_remove(&l1->queue);
+    ngx_queue_insert_head(&ctx->l1_queue, &l1->queue);
+
+    ctx->l1_hits++;
+
+    return l1;
+}
+
+
+static void
+ngx_http_lua_shdict_l1_store(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash,
+    u_char *kdata, size_t klen, ngx_atomic_uint_t version, int value_type,
+    u_char *data, size_t len, uint32_t user_flags, uint64_t expires)
+{
+    size_t                          size;
+    uint64_t                        now;
+    ngx_str_t                       key;
+    ngx_time_t                     *tp;
+    ngx_queue_t                    *q;
+    ngx_str_node_t                 *sn;
+    ngx_http_lua_shdict_l1_node_t  *l1;
+
+    key.data = kdata;
+    key.len = klen;
+
+    sn = ngx_str_rbtree_lookup(&ctx->l1_rbtree, &key, hash);
+
+    if (sn) {
+        ngx_http_lua_shdict_l1_delete(ctx, (ngx_http_lua_shdict_l1_node_t *)
+                                      sn);
+    }
+
+    size = offsetof(ngx_http_lua_shdict_l1_node_t, data) + klen + len;
+
+    if (size > ctx->l1_max_size) {
+        return;
+    }
+
+    while (ctx->l1_size + size > ctx->l1_max_size) {
+        q = ngx_queue_last(&ctx->l1_queue);
+        l1 = ngx_queue_data(q, ngx_http_lua_shdict_l1_node_t, queue);
+
+        ngx_http_lua_shdict_l1_delete(ctx, l1);
+        ctx->l1_evictions++;
+    }
+
+    l1 = ngx_alloc(size, ngx_cycle->log);
+    if (l1 == NULL) {
+        return;
+    }
+
+    tp = ngx_timeofday();
+
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    l1->expires = now + ctx->l1_ttl;
+
+    if (expires != 0 && expires < l1->expires) {
+        l1->expires = expires;
+    }
+
+    l1->version = version;
+    l1->user_flags = user_flags;
+    l1->value_type = (uint8_t) value_type;
+    l1->value_len = len;
+
+    ngx_memcpy(l1->data, kdata, klen);
+
+    if (len) {
+        ngx_memcpy(l1->data + klen, data, len);
+    }
+
+    l1->sn.node.key = hash;
+    l1->sn.str.len = klen;
+    l1->sn.str.data = l1->data;
+
+    ngx_rbtree_insert(&ctx->l1_rbtree, &l1->sn.node);
+    ngx_queue_insert_head(&ctx->l1_queue, &l1->queue);
+
+    ctx->l1_size += size;
+    ctx->l1_entries++;
+}
+
+
+static void
+ngx_http_lua_shdict_l1_delete(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_l1_node_t *l1)
+{
+    ngx_rbtree_delete(&ctx->l1_rbtree, &l1->sn.node);
+    ngx_queue_remove(&l1->queue);
+
+    ctx->l1_size -= offsetof(ngx_http_lua_shdict_l1_node_t, data)
+                    + l1->sn.str.len + l1->value_len;
+    ctx->l1_entries--;
+
+    ngx_free(l1);
+}
+
+
+void
+ngx_http_lua_shdict_l1_cleanup(void *data)
+{
+    ngx_http_lua_shdict_ctx_t  *ctx = data;
+
+    ngx_queue_t                    *q;
+    ngx_http_lua_shdict_l1_node_t  *l1;
+
+    while (!ngx_queue_empty(&ctx->l1_queue)) {
+        q = ngx_queue_head(&ctx->l1_queue);
+        l1 = ngx_queue_data(q, ngx_http_lua_shdict_l1_node_t, queue);
+
+        ngx_http_lua_shdict_l1_delete(ctx, l1);
+    }
+}
+
+
+static int
+ngx_http_lua_shdict_lpush(lua_State *L)
+{
+    return ngx_http_lua_shdict_push_helper(L, NGX_HTTP_LUA_SHDICT_LEFT);
+}
+
+
+static int
+ngx_http_lua_shdict_rpush(lua_State *L)
+{
+    return ngx_http_lua_shdict_push_helper(L, NGX_HTTP_LUA_SHDICT_RIGHT);
+}
+
+
+static int
+ngx_http_lua_shdict_push_helper(lua_State *L, int flags)
+{
+    int                          n;
+    ngx_str_t                    key;
+    uint32_t                     hash;
+    ngx_int_t                    rc;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_str_t                    value;
+    int                          value_type;
+    double                       num;
+    lua_Number                   exptime = -1;
+    ngx_shm_zone_t              *zone;
+    char                        *err;
+
+    n = lua_gettop(L);
+
+    if (n != 3 && n != 4) {
+        return luaL_error(L, "expecting 3 or 4 arguments, "
+                          "but only seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    ctx = zone->data;
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key.len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_shard(ctx, hash);
+
+    value_type = lua_type(L, 3);
+
+    switch (value_type) {
+    case LUA_TSTRING:
+        value.data = (u_char *) lua_tolstring(L, 3, &value.len);
+        break;
+
+    case LUA_TNUMBER:
+        value.len = sizeof(double);
+        num = lua_tonumber(L, 3);
+        value.data = (u_char *) &num;
+        break;
+
+    default:
+        lua_pushnil(L);
+        lua_pushliteral(L, "bad value type");
+        return 2;
+    }
+
+    if (n == 4) {
+        exptime = luaL_checknumber(L, 4);
+        if (exptime < 0) {
+            exptime = 0;
+        }
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_push_locked(ctx, hash, key.data, key.len, flags,
+                                         value_type, value.data, value.len,
+                                         exptime < 0 ? -1
+                                         : (int64_t) (exptime * 1000),
+                                         &err);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (rc < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    lua_pushnumber(L, (lua_Number) rc);
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_push_locked(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash,
+    u_char *kdata, size_t klen, int flags, int value_type, u_char *data,
+    size_t len, int64_t exptime, char **err)
+{
+    size_t                            n;
+    ngx_int_t                         rc;
+    ngx_time_t                       *tp;
+    ngx_queue_t                      *queue;
+    ngx_rbtree_node_t                *node;
+    ngx_http_lua_shdict_node_t       *sd;
+    ngx_http_lua_shdict_list_node_t  *lnode;
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, kdata, klen, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    if (rc == NGX_OK && sd->value_type != SHDICT_TLIST) {
+        *err = "value not a list";
+        return NGX_DECLINED;
+    }
+
+    if (rc == NGX_DONE) {
+        /* exists but expired, whatever its type */
+        ngx_http_lua_shdict_free_node(ctx, sd);
+        rc = NGX_DECLINED;
+    }
+
+    if (rc == NGX_DECLINED) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict push: creating a new list");
+
+        n = offsetof(ngx_rbtree_node_t, color)
+            + offsetof(ngx_http_lua_shdict_node_t, data)
+            + klen
+            + NGX_ALIGNMENT - 1
+            + sizeof(ngx_queue_t);
+
+        node = ngx_slab_alloc_locked(ctx->shpool, n);
+        if (node == NULL) {
+            *err = "no memory";
+            return NGX_ERROR;
+        }
+
+        sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+        node->key = hash;
+        sd->key_len = (u_short) klen;
+        sd->expires = 0;
+        sd->user_flags = 0;
+        sd->value_len = 0;
+        sd->value_type = SHDICT_TLIST;
+
+        ngx_memcpy(sd->data, kdata, klen);
+
+        queue = ngx_http_lua_shdict_get_list_head(sd, klen);
+        ngx_queue_init(queue);
+
+        ngx_rbtree_insert(&ctx->sh->rbtree, node);
+        ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+
+    } else {
+        queue = ngx_http_lua_shdict_get_list_head(sd, klen);
+    }
+
+    n = offsetof(ngx_http_lua_shdict_list_node_t, data) + len;
+
+    lnode = ngx_slab_alloc_locked(ctx->shpool, n);
+
+    if (lnode == NULL) {
+
+        if (sd->value_len == 0) {
+            ngx_http_lua_shdict_free_node(ctx, sd);
+        }
+
+        *err = "no memory";
+        return NGX_ERROR;
+    }
+
+    lnode->value_len = (uint32_t) len;
+    lnode->value_type = (uint8_t) value_type;
+
+    ngx_memcpy(lnode->data, data, len);
+
+    if (flags & NGX_HTTP_LUA_SHDICT_LEFT) {
+        ngx_queue_insert_head(queue, &lnode->queue);
+
+    } else {
+        ngx_queue_insert_tail(queue, &lnode->queue);
+    }
+
+    sd->value_len++;
+
+    if (exptime > 0) {
+        tp = ngx_timeofday();
+        sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
+                      + (uint64_t) exptime;
+
+    } else if (exptime == 0) {
+        sd->expires = 0;
+    }
+
+    ctx->sh->version++;
+
+    return (ngx_int_t) sd->value_len;
+}
+
+
+static int
+ngx_http_lua_shdict_lpop(lua_State *L)
+{
+    return ngx_http_lua_shdict_pop_helper(L, NGX_HTTP_LUA_SHDICT_LEFT);
+}
+
+
+static int
+ngx_http_lua_shdict_rpop(lua_State *L)
+{
+    return ngx_http_lua_shdict_pop_helper(L, NGX_HTTP_LUA_SHDICT_RIGHT);
+}
+
+
+static int
+ngx_http_lua_shdict_pop_helper(lua_State *L, int flags)
+{
+    int                               n;
+    ngx_str_t                         name;
+    ngx_str_t                         key;
+    uint32_t                          hash;
+    ngx_http_lua_shdict_ctx_t        *ctx;
+    double                            num;
+    ngx_shm_zone_t                   *zone;
+    char                             *err;
+    ngx_http_lua_shdict_list_node_t  *lnode;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "expecting 2 arguments, "
+                          "but only seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    ctx = zone->data;
+    name = ctx->name;
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key.len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_shard(ctx, hash);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+
+    lnode = ngx_http_lua_shdict_pop_locked(ctx, hash, key.data, key.len,
+                                           flags, &err);
+
+    if (lnode == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        lua_pushnil(L);
+
+        if (err) {
+            lua_pushstring(L, err);
+            return 2;
+        }
+
+        return 1;
+    }
+
+    switch (lnode->value_type) {
+    case LUA_TSTRING:
+
+        lua_pushlstring(L, (char *) lnode->data, lnode->value_len);
+        break;
+
+    case LUA_TNUMBER:
+
+        if (lnode->value_len != sizeof(double)) {
+
+            ngx_slab_free_locked(ctx->shpool, lnode);
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+            return luaL_error(L, "bad lua list node number value size found "
+                              "for key %s in shared_dict %s: %lu", key.data,
+                              name.data, (unsigned long) lnode->value_len);
+        }
+
+        ngx_memcpy(&num, lnode->data, sizeof(double));
+
+        lua_pushnumber(L, num);
+        break;
+
+    default:
+
+        n = lnode->value_type;
+
+        ngx_slab_free_locked(ctx->shpool, lnode);
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        return luaL_error(L, "bad list node value type found for key %s in "
+                          "shared_dict %s: %d", key.data, name.data, n);
+    }
+
+    ngx_slab_free_locked(ctx->shpool, lnode);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return 1;
+}
+
+
+/*
+ * unlinks the first or last node of the list under the key and returns it,
+ * the caller has to copy its value and free it before unlocking the zone
+ */
+
+static ngx_http_lua_shdict_list_node_t *
+ngx_http_lua_shdict_pop_locked(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash,
+    u_char *kdata, size_t klen, int flags, char **err)
+{
+    ngx_int_t                         rc;
+    ngx_queue_t                      *q, *queue;
+    ngx_http_lua_shdict_node_t       *sd;
+    ngx_http_lua_shdict_list_node_t  *lnode;
 
-    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+    *err = NULL;
 
-    node->key = hash;
-    sd->key_len = (u_short) key.len;
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, kdata, klen, &sd);
 
-    if (exptime > 0) {
-        tp = ngx_timeofday();
-        sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
-                      + (uint64_t) (exptime * 1000);
+    dd("shdict lookup returned %d", (int) rc);
 
-    } else {
-        sd->expires = 0;
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        return NULL;
     }
 
-    sd->user_flags = user_flags;
+    /* rc == NGX_OK */
 
-    sd->value_len = (uint32_t) value.len;
+    if (sd->value_type != SHDICT_TLIST) {
+        *err = "value not a list";
+        return NULL;
+    }
 
-    dd("setting value type to %d", value_type);
+    queue = ngx_http_lua_shdict_get_list_head(sd, klen);
 
-    sd->value_type = (uint8_t) value_type;
+    if (ngx_queue_empty(queue)) {
+        return NULL;
+    }
 
-    p = ngx_copy(sd->data, key.data, key.len);
-    ngx_memcpy(p, value.data, value.len);
+    q = (flags & NGX_HTTP_LUA_SHDICT_LEFT) ? ngx_queue_head(queue)
+                                           : ngx_queue_last(queue);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_queue_remove(q);
 
-    ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+    lnode = ngx_queue_data(q, ngx_http_lua_shdict_list_node_t, queue);
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    if (--sd->value_len == 0) {
+        ngx_http_lua_shdict_free_node(ctx, sd);
+    }
 
-    lua_pushboolean(L, 1);
-    lua_pushnil(L);
-    lua_pushboolean(L, forcible);
-    return 3;
+    ctx->sh->version++;
+
+    return lnode;
 }
 
 
 static int
-ngx_http_lua_shdict_incr(lua_State *L)
+ngx_http_lua_shdict_llen(lua_State *L)
 {
     int                          n;
     ngx_str_t                    key;
@@ -1169,15 +2398,14 @@ ngx_http_lua_shdict_incr(lua_State *L)
     ngx_int_t                    rc;
     ngx_http_lua_shdict_ctx_t   *ctx;
     ngx_http_lua_shdict_node_t  *sd;
-    double                       num;
-    u_char                      *p;
     ngx_shm_zone_t              *zone;
-    double                       value;
+    uint32_t                     len;
 
     n = lua_gettop(L);
 
-    if (n != 3) {
-        return luaL_error(L, "expecting 3 arguments, but only seen %d", n);
+    if (n != 2) {
+        return luaL_error(L, "expecting 2 arguments, "
+                          "but only seen %d", n);
     }
 
     if (lua_type(L, 1) != LUA_TTABLE) {
@@ -1186,7 +2414,7 @@ ngx_http_lua_shdict_incr(lua_State *L)
 
     zone = ngx_http_lua_shdict_get_zone(L, 1);
     if (zone == NULL) {
-        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+        return luaL_error(L, "bad \"zone\" argument");
     }
 
     ctx = zone->data;
@@ -1213,10 +2441,7 @@ ngx_http_lua_shdict_incr(lua_State *L)
 
     hash = ngx_crc32_short(key.data, key.len);
 
-    value = luaL_checknumber(L, 3);
-
-    dd("looking up key %.*s in shared dict %.*s", (int) key.len, key.data,
-       (int) ctx->name.len, ctx->name.data);
+    ctx = ngx_http_lua_shdict_shard(ctx, hash);
 
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
@@ -1224,45 +2449,33 @@ ngx_http_lua_shdict_incr(lua_State *L)
     ngx_http_lua_shdict_expire(ctx, 1);
 #endif
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key.data, key.len, &sd);
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key.data, key.len, &sd);
 
     dd("shdict lookup returned %d", (int) rc);
 
     if (rc == NGX_DECLINED || rc == NGX_DONE) {
         ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-        lua_pushnil(L);
-        lua_pushliteral(L, "not found");
-        return 2;
+        lua_pushnumber(L, 0);
+        return 1;
     }
 
     /* rc == NGX_OK */
 
-    if (sd->value_type != LUA_TNUMBER || sd->value_len != sizeof(double)) {
+    if (sd->value_type != SHDICT_TLIST) {
         ngx_shmtx_unlock(&ctx->shpool->mutex);
 
         lua_pushnil(L);
-        lua_pushliteral(L, "not a number");
+        lua_pushliteral(L, "value not a list");
         return 2;
     }
 
-    ngx_queue_remove(&sd->queue);
-    ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
-
-    dd("setting value type to %d", (int) sd->value_type);
-
-    p = sd->data + key.len;
-
-    ngx_memcpy(&num, p, sizeof(double));
-    num += value;
-
-    ngx_memcpy(p, (double *) &num, sizeof(double));
+    len = sd->value_len;
 
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-    lua_pushnumber(L, num);
-    lua_pushnil(L);
-    return 2;
+    lua_pushnumber(L, (lua_Number) len);
+    return 1;
 }
 
 
@@ -1283,11 +2496,11 @@ ngx_http_lua_shared_dict_get(ngx_shm_zone_t *zone, u_char *key_data,
 
     hash = ngx_crc32_short(key_data, key_len);
 
-    ctx = zone->data;
+    ctx = ngx_http_lua_shdict_shard(zone->data, hash);
 
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key_data, key_len, &sd);
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key_data, key_len, &sd);
 
     dd("shdict lookup returned %d", (int) rc);
 
@@ -1407,7 +2620,8 @@ ngx_http_lua_find_zone(u_char *name_data, size_t name_len)
 }
 
 
-#ifndef NGX_LUA_NO_FFI_API
+/* also used by C code, so it is built even without the FFI API */
+
 int
 ngx_http_lua_ffi_shdict_store(ngx_shm_zone_t *zone, int op, u_char *key,
     size_t key_len, int value_type, u_char *str_value_buf,
@@ -1435,6 +2649,8 @@ ngx_http_lua_ffi_shdict_store(ngx_shm_zone_t *zone, int op, u_char *key,
 
     hash = ngx_crc32_short(key, key_len);
 
+    ctx = ngx_http_lua_shdict_shard(ctx, hash);
+
     switch (value_type) {
     case LUA_TSTRING:
         /* do nothing */
@@ -1473,7 +2689,7 @@ ngx_http_lua_ffi_shdict_store(ngx_shm_zone_t *zone, int op, u_char *key,
     ngx_http_lua_shdict_expire(ctx, 1);
 #endif
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
 
     dd("lookup returns %d", (int) rc);
 
@@ -1518,7 +2734,9 @@ ngx_http_lua_ffi_shdict_store(ngx_shm_zone_t *zone, int op, u_char *key,
 
 replace:
 
-        if (str_value_buf && str_value_len == (size_t) sd->value_len) {
+        if (str_value_buf && str_value_len == (size_t) sd->value_len
+            && sd->value_type != SHDICT_TLIST)
+        {
 
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
                            "lua shared dict set: found old entry and value "
@@ -1549,6 +2767,8 @@ replace:
             p = ngx_copy(sd->data, key, key_len);
             ngx_memcpy(p, str_value_buf, str_value_len);
 
+            ctx->sh->version++;
+
             ngx_shmtx_unlock(&ctx->shpool->mutex);
 
             return NGX_OK;
@@ -1560,15 +2780,9 @@ replace:
 
 remove:
 
-        ngx_queue_remove(&sd->queue);
-
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
-
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
-
-        ngx_slab_free_locked(ctx->shpool, node);
+        ctx->sh->version++;
 
+        ngx_http_lua_shdict_free_node(ctx, sd);
     }
 
 insert:
@@ -1649,12 +2863,35 @@ allocated:
 
     ngx_rbtree_insert(&ctx->sh->rbtree, node);
     ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+    ctx->sh->version++;
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
     return NGX_OK;
 }
 
 
+ngx_int_t
+ngx_http_lua_shdict_set_string(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, u_char *data, size_t len, ngx_msec_t exptime)
+{
+    int          forcible;
+    char        *errmsg = "no zone";
+    ngx_int_t    rc;
+
+    rc = ngx_http_lua_ffi_shdict_store(zone, 0, key, key_len, LUA_TSTRING,
+                                       data, len, 0, (int) exptime, 0,
+                                       &errmsg, &forcible);
+    if (rc != NGX_OK) {
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "lua shared dict failed to set \"%*s\": %s",
+                       key_len, key, errmsg);
+    }
+
+    return rc;
+}
+
+
+#ifndef NGX_LUA_NO_FFI_API
 int
 ngx_http_lua_ffi_shdict_get(ngx_shm_zone_t *zone, u_char *key,
     size_t key_len, int *value_type, u_char **str_value_buf,
@@ -1667,6 +2904,9 @@ ngx_http_lua_ffi_shdict_get(ngx_shm_zone_t *zone, u_char *key,
     ngx_http_lua_shdict_ctx_t   *ctx;
     ngx_http_lua_shdict_node_t  *sd;
     ngx_str_t                    value;
+    uint64_t                     expires;
+    ngx_atomic_uint_t            version;
+    ngx_http_lua_shdict_l1_node_t  *l1;
 
     if (zone == NULL) {
         return NGX_ERROR;
@@ -1677,12 +2917,60 @@ ngx_http_lua_ffi_shdict_get(ngx_shm_zone_t *zone, u_char *key,
 
     hash = ngx_crc32_short(key, key_len);
 
+    ctx = ngx_http_lua_shdict_shard(ctx, hash);
+
 #if (NGX_DEBUG)
     ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
                    "fetching key \"%*s\" in shared dict \"%V\"", key_len,
                    key, &name);
 #endif /* NGX_DEBUG */
 
+    if (ctx->l1_max_size && !get_stale) {
+        l1 = ngx_http_lua_shdict_l1_lookup(ctx, hash, key, key_len);
+
+        if (l1) {
+            *value_type = l1->value_type;
+
+            if (*value_type == LUA_TNIL) {
+                return NGX_OK;
+            }
+
+            if (*str_value_len < l1->value_len) {
+                if (*value_type == LUA_TBOOLEAN) {
+                    return NGX_ERROR;
+                }
+
+                if (*value_type == LUA_TSTRING) {
+                    *str_value_buf = malloc(l1->value_len);
+                    if (*str_value_buf == NULL) {
+                        return NGX_ERROR;
+                    }
+                }
+            }
+
+            switch (*value_type) {
+            case LUA_TSTRING:
+                *str_value_len = l1->value_len;
+                ngx_memcpy(*str_value_buf, l1->data + key_len,
+                           l1->value_len);
+                break;
+
+            case LUA_TNUMBER:
+                *str_value_len = sizeof(double);
+                ngx_memcpy(num_value, l1->data + key_len, sizeof(double));
+                break;
+
+            default: /* LUA_TBOOLEAN */
+                ngx_memcpy(*str_value_buf, l1->data + key_len,
+                           sizeof(u_char));
+                break;
+            }
+
+            *user_flags = l1->user_flags;
+            return NGX_OK;
+        }
+    }
+
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
 #if 1
@@ -1691,12 +2979,20 @@ ngx_http_lua_ffi_shdict_get(ngx_shm_zone_t *zone, u_char *key,
     }
 #endif
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+    version = ctx->sh->version;
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
 
     dd("shdict lookup returns %d", (int) rc);
 
     if (rc == NGX_DECLINED || (rc == NGX_DONE && !get_stale)) {
         ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        if (ctx->l1_max_size && !get_stale) {
+            ngx_http_lua_shdict_l1_store(ctx, hash, key, key_len, version,
+                                         LUA_TNIL, NULL, 0, 0, 0);
+        }
+
         *value_type = LUA_TNIL;
         return NGX_OK;
     }
@@ -1761,6 +3057,13 @@ ngx_http_lua_ffi_shdict_get(ngx_shm_zone_t *zone, u_char *key,
         ngx_memcpy(*str_value_buf, value.data, value.len);
         break;
 
+    case SHDICT_TLIST:
+
+        /* lists can only be read by pop */
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_DECLINED;
+
     default:
 
         ngx_shmtx_unlock(&ctx->shpool->mutex);
@@ -1774,8 +3077,24 @@ ngx_http_lua_ffi_shdict_get(ngx_shm_zone_t *zone, u_char *key,
     *user_flags = sd->user_flags;
     dd("user flags: %d", *user_flags);
 
+    expires = sd->expires;
+
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
+    if (ctx->l1_max_size && !get_stale) {
+        if (*value_type == LUA_TNUMBER) {
+            ngx_http_lua_shdict_l1_store(ctx, hash, key, key_len, version,
+                                         LUA_TNUMBER, (u_char *) num_value,
+                                         sizeof(double), *user_flags,
+                                         expires);
+
+        } else {
+            ngx_http_lua_shdict_l1_store(ctx, hash, key, key_len, version,
+                                         *value_type, *str_value_buf,
+                                         value.len, *user_flags, expires);
+        }
+    }
+
     if (get_stale) {
 
         /* always return value, flags, stale */
@@ -1799,8 +3118,8 @@ ngx_http_lua_ffi_shdict_incr(ngx_shm_zone_t *zone, u_char *key,
     double                       num;
     u_char                      *p;
 
-    ctx = zone->data;
     hash = ngx_crc32_short(key, key_len);
+    ctx = ngx_http_lua_shdict_shard(zone->data, hash);
 
     dd("looking up key %.*s in shared dict %.*s", (int) key_len, key,
        (int) ctx->name.len, ctx->name.data);
@@ -1809,7 +3128,7 @@ ngx_http_lua_ffi_shdict_incr(ngx_shm_zone_t *zone, u_char *key,
 #if 1
     ngx_http_lua_shdict_expire(ctx, 1);
 #endif
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
 
     dd("shdict lookup returned %d", (int) rc);
 
@@ -1839,6 +3158,8 @@ ngx_http_lua_ffi_shdict_incr(ngx_shm_zone_t *zone, u_char *key,
 
     ngx_memcpy(p, (double *) &num, sizeof(double));
 
+    ctx->sh->version++;
+
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
     *value = num;
@@ -1847,30 +3168,190 @@ ngx_http_lua_ffi_shdict_incr(ngx_shm_zone_t *zone, u_char *key,
 
 
 int
-ngx_http_lua_ffi_shdict_flush_all(ngx_shm_zone_t *zone)
+ngx_http_lua_ffi_shdict_push(ngx_shm_zone_t *zone, int op, u_char *key,
+    size_t key_len, int value_type, u_char *str_value_buf,
+    size_t str_value_len, double num_value, int exptime, uint32_t *len,
+    char **errmsg)
 {
-    ngx_queue_t                 *q;
-    ngx_http_lua_shdict_node_t  *sd;
+    uint32_t                     hash;
+    ngx_int_t                    rc;
     ngx_http_lua_shdict_ctx_t   *ctx;
 
-    ctx = zone->data;
+    if (zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_short(key, key_len);
+    ctx = ngx_http_lua_shdict_shard(zone->data, hash);
+
+    switch (value_type) {
+    case LUA_TSTRING:
+        /* do nothing */
+        break;
+
+    case LUA_TNUMBER:
+        str_value_buf = (u_char *) &num_value;
+        str_value_len = sizeof(double);
+        break;
+
+    default:
+        *errmsg = "unsupported value type";
+        return NGX_ERROR;
+    }
 
     ngx_shmtx_lock(&ctx->shpool->mutex);
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+    rc = ngx_http_lua_shdict_push_locked(ctx, hash, key, key_len, op,
+                                         value_type, str_value_buf,
+                                         str_value_len, exptime, errmsg);
 
-    for (q = ngx_queue_head(&ctx->sh->queue);
-         q != ngx_queue_sentinel(&ctx->sh->queue);
-         q = ngx_queue_next(q))
-    {
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
-        sd->expires = 1;
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (rc < 0) {
+        return rc;
+    }
+
+    *len = (uint32_t) rc;
+    return NGX_OK;
+}
+
+
+int
+ngx_http_lua_ffi_shdict_pop(ngx_shm_zone_t *zone, int op, u_char *key,
+    size_t key_len, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, double *num_value, char **errmsg)
+{
+    uint32_t                          hash;
+    ngx_http_lua_shdict_ctx_t        *ctx;
+    ngx_http_lua_shdict_list_node_t  *lnode;
+
+    if (zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_short(key, key_len);
+    ctx = ngx_http_lua_shdict_shard(zone->data, hash);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+    lnode = ngx_http_lua_shdict_pop_locked(ctx, hash, key, key_len, op,
+                                           errmsg);
+
+    if (lnode == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        if (*errmsg) {
+            return NGX_DECLINED;
+        }
+
+        *value_type = LUA_TNIL;
+        return NGX_OK;
+    }
+
+    *value_type = lnode->value_type;
+
+    switch (*value_type) {
+    case LUA_TSTRING:
+
+        if (*str_value_len < (size_t) lnode->value_len) {
+            *str_value_buf = malloc(lnode->value_len);
+            if (*str_value_buf == NULL) {
+                ngx_slab_free_locked(ctx->shpool, lnode);
+                ngx_shmtx_unlock(&ctx->shpool->mutex);
+                *errmsg = "no memory";
+                return NGX_ERROR;
+            }
+        }
+
+        *str_value_len = lnode->value_len;
+        ngx_memcpy(*str_value_buf, lnode->data, lnode->value_len);
+        break;
+
+    case LUA_TNUMBER:
+
+        if (lnode->value_len != sizeof(double)) {
+            ngx_slab_free_locked(ctx->shpool, lnode);
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "bad lua list node number value size";
+            return NGX_ERROR;
+        }
+
+        *str_value_len = sizeof(double);
+        ngx_memcpy(num_value, lnode->data, sizeof(double));
+        break;
+
+    default:
+
+        ngx_slab_free_locked(ctx->shpool, lnode);
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "bad list node value type";
+        return NGX_ERROR;
+    }
+
+    ngx_slab_free_locked(ctx->shpool, lnode);
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+int
+ngx_http_lua_ffi_shdict_llen(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, uint32_t *len, char **errmsg)
+{
+    uint32_t                     hash;
+    ngx_int_t                    rc;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    if (zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_short(key, key_len);
+    ctx = ngx_http_lua_shdict_shard(zone->data, hash);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *len = 0;
+        return NGX_OK;
+    }
+
+    /* rc == NGX_OK */
+
+    if (sd->value_type != SHDICT_TLIST) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "value not a list";
+        return NGX_DECLINED;
     }
 
-    ngx_http_lua_shdict_expire(ctx, 0);
+    *len = sd->value_len;
 
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
     return NGX_OK;
 }
+
+
+int
+ngx_http_lua_ffi_shdict_flush_all(ngx_shm_zone_t *zone)
+{
+    ngx_http_lua_shdict_flush_all_shards(zone->data);
+
+    return NGX_OK;
+}
 #endif /* NGX_LUA_NO_FFI_API */
 
 
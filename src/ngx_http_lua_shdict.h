@@ -24,25 +24,100 @@ typedef struct {
 } ngx_http_lua_shdict_node_t;
 
 
+/* value_type of list nodes, next to the LUA_T* ones used for scalars */
+enum {
+    SHDICT_TLIST = 5,
+};
+
+
+typedef struct {
+    ngx_queue_t                  queue;
+    uint32_t                     value_len;
+    uint8_t                      value_type;
+    u_char                       data[1];
+} ngx_http_lua_shdict_list_node_t;
+
+
 typedef struct {
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
     ngx_queue_t                   queue;
+
+    /* bumped under the mutex by every write, read without it */
+    ngx_atomic_t                  version;
+
+    /* set in the first shard only */
+    ngx_uint_t                    nshards;
+    ngx_slab_pool_t             **shpools;
 } ngx_http_lua_shdict_shctx_t;
 
 
 typedef struct {
+    ngx_str_node_t                sn;
+    ngx_queue_t                   queue;
+    ngx_atomic_uint_t             version;
+    uint64_t                      expires;
+    uint32_t                      user_flags;
+    uint8_t                       value_type;
+    size_t                        value_len;
+    u_char                        data[1];
+} ngx_http_lua_shdict_l1_node_t;
+
+
+/* the free pages each shard of a lua_shared_dict must be left with */
+#define NGX_HTTP_LUA_SHDICT_MIN_SHARD_PAGES  2
+
+
+#define NGX_HTTP_LUA_SHDICT_ADD         0x0001
+#define NGX_HTTP_LUA_SHDICT_REPLACE     0x0002
+#define NGX_HTTP_LUA_SHDICT_SAFE_STORE  0x0004
+
+
+typedef struct ngx_http_lua_shdict_ctx_s  ngx_http_lua_shdict_ctx_t;
+
+struct ngx_http_lua_shdict_ctx_s {
     ngx_http_lua_shdict_shctx_t  *sh;
     ngx_slab_pool_t              *shpool;
     ngx_str_t                     name;
     ngx_http_lua_main_conf_t     *main_conf;
     ngx_log_t                    *log;
-} ngx_http_lua_shdict_ctx_t;
+
+    /* set by the shards= option, shards[0] is the zone's own ctx */
+    ngx_uint_t                    nshards;
+    ngx_http_lua_shdict_ctx_t   **shards;
+
+    /* per-worker L1 cache, enabled by the l1_size= option */
+    size_t                        l1_max_size;
+    size_t                        l1_size;
+    ngx_msec_t                    l1_ttl;
+    ngx_rbtree_t                  l1_rbtree;
+    ngx_rbtree_node_t             l1_sentinel;
+    ngx_queue_t                   l1_queue;
+    ngx_uint_t                    l1_entries;
+    ngx_uint_t                    l1_hits;
+    ngx_uint_t                    l1_misses;
+    ngx_uint_t                    l1_evictions;
+};
 
 
 ngx_int_t ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+ngx_uint_t ngx_http_lua_shdict_shard_pages(size_t size, size_t name_len,
+    ngx_uint_t nshards);
 void ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+void ngx_http_lua_shdict_l1_cleanup(void *data);
+ngx_int_t ngx_http_lua_shdict_set_string(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, u_char *data, size_t len, ngx_msec_t exptime);
+int ngx_http_lua_ffi_shdict_store(ngx_shm_zone_t *zone, int op, u_char *key,
+    size_t key_len, int value_type, u_char *str_value_buf,
+    size_t str_value_len, double num_value, int exptime, int user_flags,
+    char **errmsg, int *forcible);
+#ifndef NGX_LUA_NO_FFI_API
+int ngx_http_lua_ffi_shdict_get(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, double *num_value, int *user_flags,
+    int get_stale, int *is_stale);
+#endif
 void ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf,
     lua_State *L);
 
@@ -16,6 +16,16 @@
 #include "ngx_http_lua_output.h"
 #include "ngx_http_lua_contentby.h"
 #include "ngx_http_lua_probe.h"
+#include "ngx_http_lua_shdict.h"
+#include "ngx_http_lua_api.h"
+
+
+#if defined(__GNUC__) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#endif
+
+
+#define NGX_HTTP_LUA_SSL_SESSION_KEY_LEN  512
 
 
 static int ngx_http_lua_socket_tcp(lua_State *L);
@@ -68,11 +78,17 @@ static void ngx_http_lua_socket_dummy_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u);
 static ngx_int_t ngx_http_lua_socket_tcp_read(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u);
+#if nginx_version >= 1003009
+static ngx_int_t ngx_http_lua_socket_decode_chunked(ngx_http_request_t *r,
+    ngx_buf_t *b, u_char *start);
+#endif
 static void ngx_http_lua_socket_read_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u);
 static int ngx_http_lua_socket_tcp_receive_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L);
 static ngx_int_t ngx_http_lua_socket_read_line(void *data, ssize_t bytes);
+static ngx_inline u_char *ngx_http_lua_socket_scan(u_char *p, u_char *last,
+    u_char c1, u_char c2);
 static void ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx);
 static int ngx_http_lua_socket_resolve_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L);
@@ -95,8 +111,19 @@ static void ngx_http_lua_req_socket_rev_handler(ngx_http_request_t *r);
 static int ngx_http_lua_socket_tcp_getreusedtimes(lua_State *L);
 static int ngx_http_lua_socket_tcp_setkeepalive(lua_State *L);
 static ngx_int_t ngx_http_lua_get_keepalive_peer(ngx_http_request_t *r,
-    lua_State *L, int key_index,
     ngx_http_lua_socket_tcp_upstream_t *u);
+static ngx_http_lua_socket_pool_t *ngx_http_lua_socket_tcp_create_pool(
+    lua_State *L, ngx_http_request_t *r, ngx_str_t *key,
+    ngx_uint_t pool_size);
+static void ngx_http_lua_socket_pool_release_slot(ngx_log_t *log,
+    ngx_http_lua_socket_pool_t *spool);
+static int ngx_http_lua_socket_tcp_connect_helper(lua_State *L,
+    ngx_http_lua_socket_tcp_upstream_t *u, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, u_char *host_ref, size_t host_len, int port,
+    ngx_http_lua_socket_tcp_conn_op_ctx_t *op);
+static void ngx_http_lua_socket_tcp_conn_op_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_lua_socket_tcp_conn_op_resume(ngx_http_request_t *r);
+static void ngx_http_lua_socket_tcp_conn_op_cleanup(void *data);
 static void ngx_http_lua_socket_keepalive_dummy_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_lua_socket_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_lua_socket_keepalive_rev_handler(ngx_event_t *ev);
@@ -131,8 +158,16 @@ static int ngx_http_lua_ssl_handshake_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L);
 static void ngx_http_lua_ssl_handshake_handler(ngx_connection_t *c);
 static int ngx_http_lua_ssl_free_session(lua_State *L);
+static size_t ngx_http_lua_ssl_session_cache_key(
+    ngx_http_lua_socket_tcp_upstream_t *u, u_char *buf, size_t size);
+static void ngx_http_lua_ssl_session_cache_lookup(
+    ngx_http_lua_socket_tcp_upstream_t *u, ngx_connection_t *c);
+static void ngx_http_lua_ssl_session_cache_store(
+    ngx_http_lua_socket_tcp_upstream_t *u, ngx_connection_t *c);
 #endif
 static void ngx_http_lua_socket_tcp_close_connection(ngx_connection_t *c);
+static ngx_int_t ngx_http_lua_socket_tcp_apply_option(ngx_connection_t *c,
+    ngx_uint_t opt, int value);
 
 
 enum {
@@ -149,6 +184,46 @@ enum {
 };
 
 
+#define NGX_HTTP_LUA_SOCKOPT_TYPE_BOOL     0
+#define NGX_HTTP_LUA_SOCKOPT_TYPE_INT      1
+#define NGX_HTTP_LUA_SOCKOPT_TYPE_LINGER   2
+
+
+typedef struct {
+    ngx_str_t           name;
+    ngx_uint_t          type;
+    int                 level;
+    int                 optname;  /* -1 for unsupported ones */
+} ngx_http_lua_socket_tcp_option_t;
+
+
+/* indexed by NGX_HTTP_LUA_SOCKOPT_* */
+static ngx_http_lua_socket_tcp_option_t  ngx_http_lua_socket_tcp_options[] = {
+    { ngx_string("keepalive"), NGX_HTTP_LUA_SOCKOPT_TYPE_BOOL,
+      SOL_SOCKET, SO_KEEPALIVE },
+    { ngx_string("tcp-nodelay"), NGX_HTTP_LUA_SOCKOPT_TYPE_BOOL,
+      IPPROTO_TCP, TCP_NODELAY },
+    { ngx_string("sndbuf"), NGX_HTTP_LUA_SOCKOPT_TYPE_INT,
+      SOL_SOCKET, SO_SNDBUF },
+    { ngx_string("rcvbuf"), NGX_HTTP_LUA_SOCKOPT_TYPE_INT,
+      SOL_SOCKET, SO_RCVBUF },
+    { ngx_string("linger"), NGX_HTTP_LUA_SOCKOPT_TYPE_LINGER,
+      SOL_SOCKET, SO_LINGER },
+#ifdef TCP_QUICKACK
+    { ngx_string("tcp-quickack"), NGX_HTTP_LUA_SOCKOPT_TYPE_BOOL,
+      IPPROTO_TCP, TCP_QUICKACK },
+#else
+    { ngx_string("tcp-quickack"), NGX_HTTP_LUA_SOCKOPT_TYPE_BOOL, 0, -1 },
+#endif
+#ifdef TCP_CORK
+    { ngx_string("tcp-cork"), NGX_HTTP_LUA_SOCKOPT_TYPE_BOOL,
+      IPPROTO_TCP, TCP_CORK },
+#else
+    { ngx_string("tcp-cork"), NGX_HTTP_LUA_SOCKOPT_TYPE_BOOL, 0, -1 },
+#endif
+};
+
+
 #define ngx_http_lua_socket_check_busy_connecting(r, u, L)                   \
     if ((u)->conn_waiting) {                                                 \
         lua_pushnil(L);                                                      \
@@ -180,6 +255,14 @@ enum {
     }
 
 
+#if nginx_version >= 1003009
+#define ngx_http_lua_req_body_chunked(r)                                     \
+    ((r)->request_body->chunked != NULL)
+#else
+#define ngx_http_lua_req_body_chunked(r)  0
+#endif
+
+
 static char ngx_http_lua_req_socket_metatable_key;
 static char ngx_http_lua_raw_req_socket_metatable_key;
 static char ngx_http_lua_tcp_socket_metatable_key;
@@ -402,24 +485,21 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 {
     ngx_http_request_t          *r;
     ngx_http_lua_ctx_t          *ctx;
-    ngx_str_t                    host;
+    ngx_str_t                    key;
     int                          port;
-    ngx_resolver_ctx_t          *rctx, temp;
-    ngx_http_core_loc_conf_t    *clcf;
-    int                          saved_top;
     int                          n;
     u_char                      *p;
     size_t                       len;
-    ngx_url_t                    url;
-    ngx_int_t                    rc;
     ngx_http_lua_loc_conf_t     *llcf;
     ngx_peer_connection_t       *pc;
     int                          timeout;
     unsigned                     custom_pool;
     int                          key_index;
+    ngx_int_t                    pool_size;
+    ngx_int_t                    backlog;
     const char                  *msg;
-    ngx_http_lua_co_ctx_t       *coctx;
 
+    ngx_http_lua_socket_pool_t              *spool;
     ngx_http_lua_socket_tcp_upstream_t      *u;
 
     n = lua_gettop(L);
@@ -450,11 +530,51 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     key_index = 2;
     custom_pool = 0;
+    pool_size = 0;
+    backlog = -1;
 
     if (lua_type(L, n) == LUA_TTABLE) {
 
         /* found the last optional option table */
 
+        lua_getfield(L, n, "pool_size");
+
+        if (lua_isnumber(L, -1)) {
+            pool_size = (ngx_int_t) lua_tointeger(L, -1);
+
+            if (pool_size <= 0) {
+                msg = lua_pushfstring(L, "bad \"pool_size\" option value: %d",
+                                      (int) pool_size);
+                return luaL_argerror(L, n, msg);
+            }
+
+        } else if (!lua_isnil(L, -1)) {
+            msg = lua_pushfstring(L, "bad \"pool_size\" option type: %s",
+                                  luaL_typename(L, -1));
+            return luaL_argerror(L, n, msg);
+        }
+
+        lua_pop(L, 1);
+
+        lua_getfield(L, n, "backlog");
+
+        if (lua_isnumber(L, -1)) {
+            backlog = (ngx_int_t) lua_tointeger(L, -1);
+
+            if (backlog < 0) {
+                msg = lua_pushfstring(L, "bad \"backlog\" option value: %d",
+                                      (int) backlog);
+                return luaL_argerror(L, n, msg);
+            }
+
+        } else if (!lua_isnil(L, -1)) {
+            msg = lua_pushfstring(L, "bad \"backlog\" option type: %s",
+                                  luaL_typename(L, -1));
+            return luaL_argerror(L, n, msg);
+        }
+
+        lua_pop(L, 1);
+
         lua_getfield(L, n, "pool");
 
         switch (lua_type(L, -1)) {
@@ -557,8 +677,6 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     ngx_memzero(u, sizeof(ngx_http_lua_socket_tcp_upstream_t));
 
-    coctx = ctx->cur_co_ctx;
-
     u->request = r; /* set the controlling request */
 
     llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
@@ -587,7 +705,75 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
         u->connect_timeout = u->conf->connect_timeout;
     }
 
-    rc = ngx_http_lua_get_keepalive_peer(r, L, key_index, u);
+    lua_pushlightuserdata(L, &ngx_http_lua_socket_pool_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, key_index);
+    lua_rawget(L, -2);
+    spool = lua_touserdata(L, -1);
+    lua_pop(L, 2);
+
+    if (spool == NULL && (pool_size > 0 || backlog >= 0)) {
+
+        /* the connection limits must be in place before the first
+         * connection of the pool gets established */
+
+        key.data = (u_char *) lua_tolstring(L, key_index, &key.len);
+
+        spool = ngx_http_lua_socket_tcp_create_pool(L, r, &key,
+                                                    pool_size > 0
+                                                    ? (ngx_uint_t) pool_size
+                                                    : llcf->pool_size);
+        if (spool == NULL) {
+            return luaL_error(L, "no memory");
+        }
+
+        if (backlog >= 0) {
+            spool->bounded = 1;
+            spool->backlog = (ngx_uint_t) backlog;
+        }
+    }
+
+    u->socket_pool = spool;
+
+    return ngx_http_lua_socket_tcp_connect_helper(L, u, r, ctx, p, len, port,
+                                                  NULL);
+}
+
+
+static int
+ngx_http_lua_socket_tcp_connect_helper(lua_State *L,
+    ngx_http_lua_socket_tcp_upstream_t *u, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, u_char *host_ref, size_t host_len, int port,
+    ngx_http_lua_socket_tcp_conn_op_ctx_t *op)
+{
+    ngx_str_t                    host;
+    ngx_resolver_ctx_t          *rctx, temp;
+    ngx_http_core_loc_conf_t    *clcf;
+    int                          saved_top;
+    int                          n;
+    unsigned                     resuming;
+    ngx_url_t                    url;
+    ngx_int_t                    rc;
+    ngx_http_lua_co_ctx_t       *coctx;
+    ngx_http_lua_socket_pool_t  *spool;
+
+    /* "op" is only given when we are resuming a connect operation which
+     * waited for a free connection, in which case there is no Lua C
+     * function call to yield from */
+
+    resuming = (op != NULL);
+
+    coctx = ctx->cur_co_ctx;
+
+    if (u->counted) {
+
+        /* we were handed over the connection slot of a closed connection */
+
+        rc = NGX_DECLINED;
+
+    } else {
+        rc = ngx_http_lua_get_keepalive_peer(r, u);
+    }
 
     if (rc == NGX_OK) {
         lua_pushinteger(L, 1);
@@ -602,17 +788,23 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     /* rc == NGX_DECLINED */
 
-    /* TODO: we should avoid this in-pool allocation */
+    if (resuming) {
+        host = op->host;
 
-    host.data = ngx_palloc(r->pool, len + 1);
-    if (host.data == NULL) {
-        return luaL_error(L, "no memory");
-    }
+    } else {
+
+        /* TODO: we should avoid this in-pool allocation */
+
+        host.data = ngx_palloc(r->pool, host_len + 1);
+        if (host.data == NULL) {
+            return luaL_error(L, "no memory");
+        }
 
-    host.len = len;
+        host.len = host_len;
 
-    ngx_memcpy(host.data, p, len);
-    host.data[len] = '\0';
+        ngx_memcpy(host.data, host_ref, host_len);
+        host.data[host_len] = '\0';
+    }
 
     ngx_memzero(&url, sizeof(ngx_url_t));
 
@@ -635,6 +827,72 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
         return 2;
     }
 
+    spool = u->socket_pool;
+
+    if (spool && spool->bounded && !u->counted) {
+
+        if (spool->active_connections < spool->size) {
+            spool->active_connections++;
+            u->counted = 1;
+
+        } else {
+            if (!resuming) {
+                if (spool->wait_count >= spool->backlog) {
+                    lua_pushnil(L);
+                    lua_pushliteral(L, "too many waiting connect operations");
+                    return 2;
+                }
+
+                op = ngx_pcalloc(r->pool,
+                                 sizeof(ngx_http_lua_socket_tcp_conn_op_ctx_t));
+                if (op == NULL) {
+                    return luaL_error(L, "no memory");
+                }
+
+                op->upstream = u;
+                op->host = host;
+                op->port = port;
+
+                op->event.handler = ngx_http_lua_socket_tcp_conn_op_handler;
+                op->event.data = op;
+                op->event.log = r->connection->log;
+
+                ngx_add_timer(&op->event, u->connect_timeout);
+
+                ngx_queue_insert_tail(&spool->wait_connect_op, &op->queue);
+
+            } else {
+
+                /* the idle connection we were woken up for has been taken
+                 * by somebody else in the meantime, so we keep our place */
+
+                ngx_queue_insert_head(&spool->wait_connect_op, &op->queue);
+            }
+
+            spool->wait_count++;
+
+            op->queued = 1;
+            op->co_ctx = coctx;
+
+            ngx_http_lua_cleanup_pending_operation(coctx);
+            coctx->cleanup = ngx_http_lua_socket_tcp_conn_op_cleanup;
+            coctx->data = op;
+
+            u->conn_waiting = 1;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "lua tcp socket queued connect operation for "
+                           "pool \"%s\", waiting: %ui",
+                           spool->key, spool->wait_count);
+
+            if (resuming) {
+                return NGX_AGAIN;
+            }
+
+            return lua_yield(L, 0);
+        }
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua tcp socket connect timeout: %M", u->connect_timeout);
 
@@ -660,6 +918,10 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
     if (u->resolved->sockaddr) {
         rc = ngx_http_lua_socket_resolve_retval_handler(r, u, L);
         if (rc == NGX_AGAIN) {
+            if (resuming) {
+                return NGX_AGAIN;
+            }
+
             return lua_yield(L, 0);
         }
 
@@ -672,6 +934,7 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
     rctx = ngx_resolve_start(clcf->resolver, &temp);
     if (rctx == NULL) {
         u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
+        ngx_http_lua_socket_tcp_finalize(r, u);
         lua_pushnil(L);
         lua_pushliteral(L, "failed to start the resolver");
         return 2;
@@ -679,6 +942,7 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     if (rctx == NGX_NO_RESOLVER) {
         u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
+        ngx_http_lua_socket_tcp_finalize(r, u);
         lua_pushnil(L);
         lua_pushfstring(L, "no resolver defined to resolve \"%s\"", host.data);
         return 2;
@@ -708,6 +972,7 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
         u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
 
         u->resolved->ctx = NULL;
+        ngx_http_lua_socket_tcp_finalize(r, u);
         lua_pushnil(L);
         lua_pushfstring(L, "%s could not be resolved", host.data);
 
@@ -716,6 +981,11 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     if (u->conn_waiting) {
         dd("resolved and already connecting");
+
+        if (resuming) {
+            return NGX_AGAIN;
+        }
+
         return lua_yield(L, 0);
     }
 
@@ -740,6 +1010,10 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
         r->write_event_handler = ngx_http_core_run_phases;
     }
 
+    if (resuming) {
+        return NGX_AGAIN;
+    }
+
     return lua_yield(L, 0);
 }
 
@@ -1176,11 +1450,14 @@ ngx_http_lua_socket_tcp_sslhandshake(lua_State *L)
 
     ngx_http_lua_socket_tcp_upstream_t  *u;
 
-    /* Lua function arguments: self [,session] [,host] [,verify] */
+    /*
+     * Lua function arguments: self [,session] [,host] [,verify]
+     *                         [,send_status_req] [,options]
+     */
 
     n = lua_gettop(L);
-    if (n < 1 && n > 4) {
-        return luaL_error(L, "ngx.socket connect: expecting 1 ~ 4 "
+    if (n < 1 || n > 6) {
+        return luaL_error(L, "ngx.socket connect: expecting 1 ~ 6 "
                           "arguments (including the object), but seen %d", n);
     }
 
@@ -1224,6 +1501,7 @@ ngx_http_lua_socket_tcp_sslhandshake(lua_State *L)
     c = u->peer.connection;
 
     u->ssl_session_reuse = 1;
+    u->ssl_session_cache = 0;
 
     if (c->ssl && c->ssl->handshaked) {
         switch (lua_type(L, 2)) {
@@ -1324,6 +1602,23 @@ ngx_http_lua_socket_tcp_sslhandshake(lua_State *L)
                         return luaL_error(L, "no OCSP support");
 #endif
                     }
+
+                    if (n >= 6) {
+                        luaL_checktype(L, 6, LUA_TTABLE);
+
+                        lua_getfield(L, 6, "session_cache");
+                        u->ssl_session_cache = lua_toboolean(L, -1);
+                        lua_pop(L, 1);
+
+                        if (u->ssl_session_cache
+                            && u->conf->ssl_session_cache == NULL)
+                        {
+                            lua_pushnil(L);
+                            lua_pushliteral(L, "lua_ssl_session_cache not "
+                                            "configured");
+                            return 2;
+                        }
+                    }
                 }
             }
         }
@@ -1366,6 +1661,13 @@ new_ssl_name:
         }
     }
 
+    if (u->ssl_session_cache
+        && (n < 2 || lua_type(L, 2) != LUA_TUSERDATA))
+    {
+        /* no session given explicitly, try the ones of the other workers */
+        ngx_http_lua_ssl_session_cache_lookup(u, c);
+    }
+
     u->write_co_ctx = coctx;
 
 #if 0
@@ -1490,6 +1792,10 @@ ngx_http_lua_ssl_handshake_handler(ngx_connection_t *c)
 #endif
         }
 
+        if (u->ssl_session_cache) {
+            ngx_http_lua_ssl_session_cache_store(u, c);
+        }
+
         if (waiting) {
             ngx_http_lua_socket_handle_conn_success(r, u);
 
@@ -1558,6 +1864,141 @@ ngx_http_lua_ssl_handshake_retval_handler(ngx_http_request_t *r,
     return 1;
 }
 
+
+static size_t
+ngx_http_lua_ssl_session_cache_key(ngx_http_lua_socket_tcp_upstream_t *u,
+    u_char *buf, size_t size)
+{
+    u_char                          *p, *last;
+    ngx_http_upstream_resolved_t    *ur;
+
+    ur = u->resolved;
+
+    if (ur == NULL || ur->host.len == 0) {
+        return 0;
+    }
+
+    /*
+     * the SNI name is part of the key as the same peer may serve
+     * different certificates (and session contexts) per name
+     */
+
+    p = buf;
+    last = buf + size;
+
+    p = ngx_slprintf(p, last, "ssl:%V", &ur->host);
+
+    if (ur->port) {
+        p = ngx_slprintf(p, last, ":%d", (int) ur->port);
+    }
+
+    if (u->ssl_name.len) {
+        p = ngx_slprintf(p, last, "/%V", &u->ssl_name);
+    }
+
+    if (p == last) {
+        /* the key might have been truncated */
+        return 0;
+    }
+
+    return p - buf;
+}
+
+
+static void
+ngx_http_lua_ssl_session_cache_lookup(ngx_http_lua_socket_tcp_upstream_t *u,
+    ngx_connection_t *c)
+{
+    size_t                   len;
+    u_char                   key[NGX_HTTP_LUA_SSL_SESSION_KEY_LEN];
+    u_char                   buf[NGX_SSL_MAX_SESSION_SIZE];
+    ngx_int_t                rc;
+    const u_char            *p;
+    ngx_ssl_session_t       *sess;
+    ngx_http_lua_value_t     value;
+
+    len = ngx_http_lua_ssl_session_cache_key(u, key, sizeof(key));
+    if (len == 0) {
+        return;
+    }
+
+    value.type = LUA_TSTRING;
+    value.value.s.data = buf;
+    value.value.s.len = sizeof(buf);
+
+    rc = ngx_http_lua_shared_dict_get(u->conf->ssl_session_cache, key, len,
+                                      &value);
+
+    if (rc != NGX_OK || value.type != LUA_TSTRING) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "lua ssl session cache miss: \"%*s\"", len, key);
+        return;
+    }
+
+    p = buf;
+
+    sess = d2i_SSL_SESSION(NULL, &p, value.value.s.len);
+    if (sess == NULL) {
+        ERR_clear_error();
+        return;
+    }
+
+    if (ngx_ssl_set_session(c, sess) == NGX_OK) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "lua ssl session cache hit: \"%*s\"", len, key);
+    }
+
+    /* SSL_set_session() holds its own reference */
+    ngx_ssl_free_session(sess);
+}
+
+
+static void
+ngx_http_lua_ssl_session_cache_store(ngx_http_lua_socket_tcp_upstream_t *u,
+    ngx_connection_t *c)
+{
+    int                      n;
+    long                     timeout;
+    size_t                   len;
+    u_char                  *p;
+    u_char                   key[NGX_HTTP_LUA_SSL_SESSION_KEY_LEN];
+    u_char                   buf[NGX_SSL_MAX_SESSION_SIZE];
+    ngx_ssl_session_t       *sess;
+
+    if (SSL_session_reused(c->ssl->connection)) {
+        return;
+    }
+
+    sess = SSL_get_session(c->ssl->connection);  /* no new reference */
+    if (sess == NULL) {
+        return;
+    }
+
+    len = ngx_http_lua_ssl_session_cache_key(u, key, sizeof(key));
+    if (len == 0) {
+        return;
+    }
+
+    n = i2d_SSL_SESSION(sess, NULL);
+    if (n <= 0 || n > NGX_SSL_MAX_SESSION_SIZE) {
+        return;
+    }
+
+    p = buf;
+    (void) i2d_SSL_SESSION(sess, &p);
+
+    timeout = SSL_SESSION_get_timeout(sess);
+
+    if (ngx_http_lua_shdict_set_string(u->conf->ssl_session_cache, key, len,
+                                       buf, n, (ngx_msec_t) timeout * 1000)
+        == NGX_OK)
+    {
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "lua ssl session cache store: \"%*s\", timeout: %l",
+                       len, key, timeout);
+    }
+}
+
 #endif  /* NGX_HTTP_SSL */
 
 
@@ -1939,6 +2380,73 @@ ngx_http_lua_socket_read_all(void *data, ssize_t bytes)
 }
 
 
+/*
+ * returns the first byte in [p, last) that equals c1 or c2, or last if
+ * there is none; 32 or 16 bytes are compared at a time when the compiler
+ * targets AVX2 or SSE2
+ */
+static ngx_inline u_char *
+ngx_http_lua_socket_scan(u_char *p, u_char *last, u_char c1, u_char c2)
+{
+#if defined(__GNUC__) && defined(__AVX2__)
+    unsigned                     mask;
+    __m256i                      x, v1, v2;
+
+    v1 = _mm256_set1_epi8((char) c1);
+    v2 = _mm256_set1_epi8((char) c2);
+
+    while (last - p >= 32) {
+        x = _mm256_loadu_si256((const __m256i *) p);
+
+        mask = (unsigned) _mm256_movemask_epi8(
+                   _mm256_or_si256(_mm256_cmpeq_epi8(x, v1),
+                                   _mm256_cmpeq_epi8(x, v2)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+#elif defined(__GNUC__) && defined(__SSE2__)
+    unsigned                     mask;
+    __m128i                      x, v1, v2;
+
+    v1 = _mm_set1_epi8((char) c1);
+    v2 = _mm_set1_epi8((char) c2);
+
+    while (last - p >= 16) {
+        x = _mm_loadu_si128((const __m128i *) p);
+
+        mask = (unsigned) _mm_movemask_epi8(
+                   _mm_or_si128(_mm_cmpeq_epi8(x, v1),
+                                _mm_cmpeq_epi8(x, v2)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+#else
+    if (c1 == c2) {
+        p = memchr(p, c1, last - p);
+        return p ? p : last;
+    }
+#endif
+
+    while (p < last) {
+        if (*p == c1 || *p == c2) {
+            return p;
+        }
+
+        p++;
+    }
+
+    return last;
+}
+
+
 static ngx_int_t
 ngx_http_lua_socket_read_line(void *data, ssize_t bytes)
 {
@@ -1946,7 +2454,8 @@ ngx_http_lua_socket_read_line(void *data, ssize_t bytes)
 
     ngx_buf_t                   *b;
     u_char                      *dst;
-    u_char                       c;
+    u_char                      *p, *last;
+    size_t                       n;
 #if (NGX_DEBUG)
     u_char                      *begin;
 #endif
@@ -1972,13 +2481,32 @@ ngx_http_lua_socket_read_line(void *data, ssize_t bytes)
     dd("data read: %.*s", (int) bytes, b->pos);
 
     dst = u->buf_in->buf->last;
+    last = b->pos + bytes;
+
+    while (b->pos < last) {
+
+        /* copy the run of plain bytes up to the next '\r' or '\n' */
+
+        p = ngx_http_lua_socket_scan(b->pos, last, '\n', '\r');
 
-    while (bytes--) {
+        n = p - b->pos;
 
-        c = *b->pos++;
+        if (n) {
+            if (dst != b->pos) {
+                ngx_memmove(dst, b->pos, n);
+            }
+
+            dst += n;
+            b->pos = p;
+        }
+
+        if (p == last) {
+            break;
+        }
 
-        switch (c) {
-        case '\n':
+        b->pos++;
+
+        if (*p == '\n') {
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, u->request->connection->log, 0,
                            "lua tcp socket read the final line part: \"%*s\"",
                            b->pos - 1 - begin, begin);
@@ -1990,15 +2518,9 @@ ngx_http_lua_socket_read_line(void *data, ssize_t bytes)
                u->buf_in->buf->pos);
 
             return NGX_OK;
-
-        case '\r':
-            /* ignore it */
-            break;
-
-        default:
-            *dst++ = c;
-            break;
         }
+
+        /* '\r': ignore it */
     }
 
 #if (NGX_DEBUG)
@@ -2174,7 +2696,9 @@ success:
                 ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                                "http client request body preread %O", preread);
 
-                if (preread >= r->request_body->rest) {
+                if (!ngx_http_lua_req_body_chunked(r)
+                    && preread >= r->request_body->rest)
+                {
                     preread = r->request_body->rest;
                 }
 
@@ -2191,14 +2715,31 @@ success:
                 r->header_in->pos += size;
                 r->request_length += size;
 
-                if (r->request_body->rest) {
-                    r->request_body->rest -= size;
+#if nginx_version >= 1003009
+                if (ngx_http_lua_req_body_chunked(r)) {
+                    if (ngx_http_lua_socket_decode_chunked(r, b,
+                                                           b->last - size)
+                        != NGX_OK)
+                    {
+                        ngx_http_lua_socket_handle_read_error(r, u,
+                                                NGX_HTTP_LUA_SOCKET_FT_ERROR);
+                        return NGX_ERROR;
+                    }
+
+                    continue;
+                }
+#endif
+
+                if (r->request_body->rest) {
+                    r->request_body->rest -= size;
                 }
 
                 continue;
             }
 
-            if (size > (size_t) r->request_body->rest) {
+            if (!ngx_http_lua_req_body_chunked(r)
+                && size > (size_t) r->request_body->rest)
+            {
                 size = (size_t) r->request_body->rest;
             }
         }
@@ -2271,6 +2812,21 @@ success:
 
         if (u->body_downstream) {
             r->request_length += n;
+
+#if nginx_version >= 1003009
+            if (ngx_http_lua_req_body_chunked(r)) {
+                if (ngx_http_lua_socket_decode_chunked(r, b, b->last - n)
+                    != NGX_OK)
+                {
+                    ngx_http_lua_socket_handle_read_error(r, u,
+                                                NGX_HTTP_LUA_SOCKET_FT_ERROR);
+                    return NGX_ERROR;
+                }
+
+                continue;
+            }
+#endif
+
             r->request_body->rest -= n;
         }
     }
@@ -2649,8 +3205,178 @@ ngx_http_lua_socket_tcp_close(lua_State *L)
 static int
 ngx_http_lua_socket_tcp_setoption(lua_State *L)
 {
-    /* TODO */
-    return 0;
+    int                          value;
+    u_char                      *p;
+    size_t                       len;
+    ngx_err_t                    err;
+    ngx_uint_t                   i;
+    const char                  *name;
+    ngx_http_request_t          *r;
+    ngx_http_lua_loc_conf_t     *llcf;
+    u_char                       errstr[NGX_MAX_ERROR_STR];
+
+    ngx_http_lua_socket_tcp_option_t      *opt = NULL;
+    ngx_http_lua_socket_tcp_upstream_t    *u;
+
+    if (lua_gettop(L) != 3) {
+        return luaL_error(L, "expecting 3 arguments "
+                          "(including the object), but got %d", lua_gettop(L));
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    name = luaL_checklstring(L, 2, &len);
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    for (i = 0; i < NGX_HTTP_LUA_SOCKOPT_MAX; i++) {
+        opt = &ngx_http_lua_socket_tcp_options[i];
+
+        if (opt->name.len == len
+            && ngx_strncmp(opt->name.data, name, len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == NGX_HTTP_LUA_SOCKOPT_MAX || opt->optname == -1) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unsupported option \"%s\"", name);
+        return 2;
+    }
+
+    switch (opt->type) {
+
+    case NGX_HTTP_LUA_SOCKOPT_TYPE_BOOL:
+        luaL_checktype(L, 3, LUA_TBOOLEAN);
+        value = lua_toboolean(L, 3);
+        break;
+
+    case NGX_HTTP_LUA_SOCKOPT_TYPE_INT:
+        value = (int) luaL_checkinteger(L, 3);
+        if (value <= 0) {
+            return luaL_argerror(L, 3, "positive number expected");
+        }
+
+        break;
+
+    default: /* NGX_HTTP_LUA_SOCKOPT_TYPE_LINGER */
+
+        /* the timeout in seconds, or false to turn lingering off */
+
+        if (lua_type(L, 3) == LUA_TBOOLEAN && !lua_toboolean(L, 3)) {
+            value = -1;
+            break;
+        }
+
+        value = (int) luaL_checkinteger(L, 3);
+        if (value < 0) {
+            return luaL_argerror(L, 3, "non-negative number or false "
+                                 "expected");
+        }
+
+        break;
+    }
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (u == NULL
+        || u->peer.connection == NULL
+        || (u->read_closed && u->write_closed))
+    {
+        llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+        if (llcf->log_socket_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to set an option on a closed socket");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->request != r) {
+        return luaL_error(L, "bad request");
+    }
+
+    if (ngx_http_lua_socket_tcp_apply_option(u->peer.connection, i, value)
+        != NGX_OK)
+    {
+        err = ngx_socket_errno;
+
+        llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+        if (llcf->log_socket_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, err,
+                          "lua tcp socket setsockopt(\"%V\") failed",
+                          &opt->name);
+        }
+
+#if defined(nginx_version) && nginx_version >= 9000
+        p = ngx_strerror(err, errstr, sizeof(errstr));
+#else
+        p = ngx_strerror_r(err, errstr, sizeof(errstr));
+#endif
+        /* for compatibility with LuaSocket */
+        ngx_strlow(errstr, errstr, p - errstr);
+
+        lua_pushnil(L);
+        lua_pushlstring(L, (char *) errstr, p - errstr);
+        return 2;
+    }
+
+    /* remembered along with the connection in the connection pool */
+
+    u->sockopts.set |= (ngx_uint_t) 1 << i;
+    u->sockopts.values[i] = value;
+
+    lua_pushinteger(L, 1);
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_tcp_apply_option(ngx_connection_t *c, ngx_uint_t opt,
+    int value)
+{
+    int                                  rc;
+    struct linger                        linger;
+    ngx_http_lua_socket_tcp_option_t    *o;
+
+    o = &ngx_http_lua_socket_tcp_options[opt];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua tcp socket set option \"%V\" to %d", &o->name, value);
+
+    if (o->type == NGX_HTTP_LUA_SOCKOPT_TYPE_LINGER) {
+        linger.l_onoff = (value >= 0);
+        linger.l_linger = (value >= 0) ? value : 0;
+
+        rc = setsockopt(c->fd, o->level, o->optname, (const void *) &linger,
+                        sizeof(struct linger));
+
+    } else {
+        rc = setsockopt(c->fd, o->level, o->optname, (const void *) &value,
+                        sizeof(int));
+    }
+
+    if (rc == -1) {
+        return NGX_ERROR;
+    }
+
+    if (opt == NGX_HTTP_LUA_SOCKOPT_TCP_NODELAY) {
+        /* keep tcpsock:send() from overriding the user's choice */
+        c->tcp_nodelay = value ? NGX_TCP_NODELAY_SET
+                               : NGX_TCP_NODELAY_DISABLED;
+    }
+
+    return NGX_OK;
 }
 
 
@@ -2736,6 +3462,108 @@ ngx_http_lua_socket_tcp_get_peer(ngx_peer_connection_t *pc, void *data)
 }
 
 
+#if nginx_version >= 1003009
+/*
+ * Decodes the chunked request body data just read into b at "start" in
+ * place, so that the readers above only ever see the payload.
+ */
+
+static ngx_int_t
+ngx_http_lua_socket_decode_chunked(ngx_http_request_t *r, ngx_buf_t *b,
+    u_char *start)
+{
+    size_t                     size;
+    u_char                    *dst;
+    ngx_int_t                  rc;
+    ngx_buf_t                  in;
+    ngx_http_request_body_t   *rb;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    rb = r->request_body;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&in, sizeof(ngx_buf_t));
+
+    in.pos = start;
+    in.last = b->last;
+    in.temporary = 1;
+
+    dst = start;
+
+    while (in.pos < in.last) {
+
+        if (rb->rest == 0) {
+
+            /* pipelined requests are not supported after a chunked body
+             * read by ngx.req.socket() */
+
+            r->keepalive = 0;
+            break;
+        }
+
+        rc = ngx_http_parse_chunked(r, &in, rb->chunked);
+
+        if (rc == NGX_OK) {
+
+            /* a chunk has been parsed successfully */
+
+            if (clcf->client_max_body_size
+                && clcf->client_max_body_size
+                   - r->headers_in.content_length_n < rb->chunked->size)
+            {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "client intended to send too large chunked "
+                              "body: %O+%O bytes",
+                              r->headers_in.content_length_n,
+                              rb->chunked->size);
+
+                b->last = dst;
+                return NGX_ERROR;
+            }
+
+            size = ngx_min((size_t) rb->chunked->size,
+                           (size_t) (in.last - in.pos));
+
+            dst = ngx_movemem(dst, in.pos, size);
+
+            in.pos += size;
+            rb->chunked->size -= size;
+            r->headers_in.content_length_n += size;
+
+            continue;
+        }
+
+        if (rc == NGX_DONE) {
+
+            /* a whole response has been parsed successfully */
+
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "lua request body last chunk seen");
+
+            rb->rest = 0;
+            continue;
+        }
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        /* invalid */
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "client sent invalid chunked body");
+
+        b->last = dst;
+        return NGX_ERROR;
+    }
+
+    b->last = dst;
+
+    return NGX_OK;
+}
+#endif
+
+
 static void
 ngx_http_lua_socket_read_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u)
@@ -3389,21 +4217,17 @@ ngx_http_lua_socket_tcp_finalize(ngx_http_request_t *r,
 
         ngx_http_lua_socket_tcp_close_connection(c);
         u->peer.connection = NULL;
+    }
 
-        if (!u->reused) {
-            return;
-        }
+    if (u->counted) {
+        u->counted = 0;
 
         spool = u->socket_pool;
         if (spool == NULL) {
             return;
         }
 
-        spool->active_connections--;
-
-        if (spool->active_connections == 0) {
-            ngx_http_lua_socket_free_pool(r->connection->log, spool);
-        }
+        ngx_http_lua_socket_pool_release_slot(r->connection->log, spool);
     }
 }
 
@@ -3867,6 +4691,8 @@ ngx_http_lua_socket_read_until(void *data, ssize_t bytes)
     ngx_http_lua_dfa_edge_t                 *edge;
     unsigned                                 matched;
     ngx_int_t                                rc;
+    u_char                                  *p, *last;
+    size_t                                   n;
 
     u = cp->upstream;
     r = u->request;
@@ -3926,14 +4752,35 @@ ngx_http_lua_socket_read_until(void *data, ssize_t bytes)
         }
 
         if (state == 0) {
-            u->buf_in->buf->last++;
 
-            i++;
+            /*
+             * skip ahead to the next occurrence of the first byte of the
+             * pattern, the DFA only needs to look at those positions
+             */
 
-            if (u->length && --u->rest == 0) {
-                cp->state = state;
-                b->pos += i;
-                return NGX_OK;
+            last = b->pos + bytes;
+
+            if (u->length && (size_t) (bytes - i) > u->rest) {
+                last = b->pos + i + u->rest;
+            }
+
+            p = ngx_http_lua_socket_scan(b->pos + i + 1, last, pat[0],
+                                         pat[0]);
+
+            n = p - (b->pos + i);
+
+            u->buf_in->buf->last += n;
+
+            i += n;
+
+            if (u->length) {
+                u->rest -= n;
+
+                if (u->rest == 0) {
+                    cp->state = state;
+                    b->pos += i;
+                    return NGX_OK;
+                }
             }
 
             continue;
@@ -4112,14 +4959,6 @@ ngx_http_lua_req_socket(lua_State *L)
     }
 #endif
 
-#if nginx_version >= 1003009
-    if (!raw && r->headers_in.chunked) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "chunked request bodies not supported yet");
-        return 2;
-    }
-#endif
-
     ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
     if (ctx == NULL) {
         return luaL_error(L, "no ctx found");
@@ -4203,7 +5042,12 @@ ngx_http_lua_req_socket(lua_State *L)
 
         dd("req content length: %d", (int) r->headers_in.content_length_n);
 
-        if (r->headers_in.content_length_n <= 0) {
+        if (r->headers_in.content_length_n <= 0
+#if nginx_version >= 1003009
+            && !r->headers_in.chunked
+#endif
+           )
+        {
             lua_pushnil(L);
             lua_pushliteral(L, "no body");
             return 2;
@@ -4224,6 +5068,22 @@ ngx_http_lua_req_socket(lua_State *L)
 
         rb->rest = r->headers_in.content_length_n;
 
+#if nginx_version >= 1003009
+        if (r->headers_in.chunked) {
+            rb->chunked = ngx_pcalloc(r->pool, sizeof(ngx_http_chunked_t));
+            if (rb->chunked == NULL) {
+                return luaL_error(L, "no memory");
+            }
+
+            /* unknown until the last chunk is seen */
+            rb->rest = 1;
+
+            /* counts the decoded bytes, like in nginx's own chunked body
+             * filter */
+            r->headers_in.content_length_n = 0;
+        }
+#endif
+
         r->request_body = rb;
     }
 
@@ -4369,12 +5229,9 @@ ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
     ngx_http_lua_socket_tcp_upstream_t  *u;
     ngx_connection_t                    *c;
     ngx_http_lua_socket_pool_t          *spool;
-    size_t                               size, key_len;
     ngx_str_t                            key;
-    ngx_uint_t                           i;
     ngx_queue_t                         *q;
     ngx_peer_connection_t               *pc;
-    u_char                              *p;
     ngx_http_request_t                  *r;
     ngx_msec_t                           timeout;
     ngx_uint_t                           pool_size;
@@ -4382,7 +5239,8 @@ ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
     ngx_int_t                            rc;
     ngx_buf_t                           *b;
 
-    ngx_http_lua_socket_pool_item_t     *items, *item;
+    ngx_http_lua_socket_pool_item_t         *item;
+    ngx_http_lua_socket_tcp_conn_op_ctx_t   *op;
 
     n = lua_gettop(L);
 
@@ -4496,50 +5354,10 @@ ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
             return 2;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "lua tcp socket connection pool size: %ui", pool_size);
-
-        key_len = ngx_align(key.len + 1, sizeof(void *));
-
-        size = sizeof(ngx_http_lua_socket_pool_t) + key_len - 1
-               + sizeof(ngx_http_lua_socket_pool_item_t)
-               * pool_size;
-
-        spool = lua_newuserdata(L, size);
+        spool = ngx_http_lua_socket_tcp_create_pool(L, r, &key, pool_size);
         if (spool == NULL) {
             return luaL_error(L, "no memory");
         }
-
-        lua_pushlightuserdata(L, &ngx_http_lua_pool_udata_metatable_key);
-        lua_rawget(L, LUA_REGISTRYINDEX);
-        lua_setmetatable(L, -2);
-
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                       "lua tcp socket keepalive create connection pool for key"
-                       " \"%s\"", lua_tostring(L, -2));
-
-        lua_rawset(L, -3);
-
-        spool->active_connections = 0;
-        spool->lua_vm = ngx_http_lua_get_lua_vm(r, NULL);
-
-        ngx_queue_init(&spool->cache);
-        ngx_queue_init(&spool->free);
-
-        p = ngx_copy(spool->key, key.data, key.len);
-        *p++ = '\0';
-
-        items = (ngx_http_lua_socket_pool_item_t *) (spool->key + key_len);
-
-        dd("items: %p", items);
-
-        ngx_http_lua_assert((void *) items == ngx_align_ptr(items,
-                                                            sizeof(void *)));
-
-        for (i = 0; i < pool_size; i++) {
-            ngx_queue_insert_head(&spool->free, &items[i].queue);
-            items[i].socket_pool = spool;
-        }
     }
 
     if (ngx_queue_empty(&spool->free)) {
@@ -4562,10 +5380,26 @@ ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
     item->connection = c;
     ngx_queue_insert_head(&spool->cache, q);
 
-    if (!u->reused) {
+    if (!u->counted) {
         spool->active_connections++;
     }
 
+    u->counted = 0;
+
+    if (!ngx_queue_empty(&spool->wait_connect_op)) {
+
+        /* wake up the oldest connect operation waiting for a connection,
+         * which will try to pick up this one */
+
+        q = ngx_queue_head(&spool->wait_connect_op);
+        ngx_queue_remove(q);
+
+        op = ngx_queue_data(q, ngx_http_lua_socket_tcp_conn_op_ctx_t, queue);
+        op->queued = 0;
+
+        ngx_post_event(&op->event, &ngx_posted_events);
+    }
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "lua tcp socket clear current socket connection");
 
@@ -4621,6 +5455,22 @@ ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
     ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
     item->reused = u->reused;
 
+    /* flush out any data held back by the kernel before the connection
+     * goes idle */
+
+    if ((u->sockopts.set & ((ngx_uint_t) 1 << NGX_HTTP_LUA_SOCKOPT_TCP_CORK))
+        && u->sockopts.values[NGX_HTTP_LUA_SOCKOPT_TCP_CORK])
+    {
+        if (ngx_http_lua_socket_tcp_apply_option(c,
+                                            NGX_HTTP_LUA_SOCKOPT_TCP_CORK, 0)
+            == NGX_OK)
+        {
+            u->sockopts.values[NGX_HTTP_LUA_SOCKOPT_TCP_CORK] = 0;
+        }
+    }
+
+    item->sockopts = u->sockopts;
+
     if (c->read->ready) {
         rc = ngx_http_lua_socket_keepalive_close_handler(c->read);
         if (rc != NGX_OK) {
@@ -4640,43 +5490,28 @@ ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
 
 
 static ngx_int_t
-ngx_http_lua_get_keepalive_peer(ngx_http_request_t *r, lua_State *L,
-    int key_index, ngx_http_lua_socket_tcp_upstream_t *u)
+ngx_http_lua_get_keepalive_peer(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u)
 {
     ngx_http_lua_socket_pool_item_t     *item;
     ngx_http_lua_socket_pool_t          *spool;
     ngx_http_cleanup_t                  *cln;
     ngx_queue_t                         *q;
-    int                                  top;
     ngx_peer_connection_t               *pc;
     ngx_connection_t                    *c;
 
-    top = lua_gettop(L);
-
-    if (key_index < 0) {
-        key_index = top + key_index + 1;
-    }
-
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua tcp socket pool get keepalive peer");
 
     pc = &u->peer;
 
-    lua_pushlightuserdata(L, &ngx_http_lua_socket_pool_key);
-    lua_rawget(L, LUA_REGISTRYINDEX); /* table */
-    lua_pushvalue(L, key_index); /* key */
-    lua_rawget(L, -2);
-
-    spool = lua_touserdata(L, -1);
+    spool = u->socket_pool;
     if (spool == NULL) {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                        "lua tcp socket keepalive connection pool not found");
-        lua_settop(L, top);
         return NGX_DECLINED;
     }
 
-    u->socket_pool = spool;
-
     if (!ngx_queue_empty(&spool->cache)) {
         q = ngx_queue_head(&spool->cache);
 
@@ -4710,6 +5545,20 @@ ngx_http_lua_get_keepalive_peer(ngx_http_request_t *r, lua_State *L,
         pc->cached = 1;
 
         u->reused = item->reused + 1;
+        u->counted = 1;
+
+        /* the socket options stay with the file descriptor, except
+         * TCP_QUICKACK which the Linux kernel may turn off at any time */
+
+        u->sockopts = item->sockopts;
+
+        if ((u->sockopts.set
+             & ((ngx_uint_t) 1 << NGX_HTTP_LUA_SOCKOPT_TCP_QUICKACK))
+            && u->sockopts.values[NGX_HTTP_LUA_SOCKOPT_TCP_QUICKACK])
+        {
+            (void) ngx_http_lua_socket_tcp_apply_option(c,
+                                        NGX_HTTP_LUA_SOCKOPT_TCP_QUICKACK, 1);
+        }
 
 #if 1
         u->write_event_handler = ngx_http_lua_socket_dummy_handler;
@@ -4720,7 +5569,6 @@ ngx_http_lua_get_keepalive_peer(ngx_http_request_t *r, lua_State *L,
             cln = ngx_http_lua_cleanup_add(r, 0);
             if (cln == NULL) {
                 u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
-                lua_settop(L, top);
                 return NGX_ERROR;
             }
 
@@ -4729,16 +5577,12 @@ ngx_http_lua_get_keepalive_peer(ngx_http_request_t *r, lua_State *L,
             u->cleanup = &cln->handler;
         }
 
-        lua_settop(L, top);
-
         return NGX_OK;
     }
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "lua tcp socket keepalive: connection pool empty");
 
-    lua_settop(L, top);
-
     return NGX_DECLINED;
 }
 
@@ -4810,16 +5654,124 @@ close:
 
     ngx_queue_remove(&item->queue);
     ngx_queue_insert_head(&spool->free, &item->queue);
+
+    ngx_http_lua_socket_pool_release_slot(ev->log, spool);
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_http_lua_socket_pool_t *
+ngx_http_lua_socket_tcp_create_pool(lua_State *L, ngx_http_request_t *r,
+    ngx_str_t *key, ngx_uint_t pool_size)
+{
+    size_t                               size, key_len;
+    ngx_uint_t                           i;
+    u_char                              *p;
+    ngx_http_lua_socket_pool_t          *spool;
+    ngx_http_lua_socket_pool_item_t     *items;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket connection pool size: %ui", pool_size);
+
+    key_len = ngx_align(key->len + 1, sizeof(void *));
+
+    size = sizeof(ngx_http_lua_socket_pool_t) + key_len - 1
+           + sizeof(ngx_http_lua_socket_pool_item_t)
+           * pool_size;
+
+    lua_pushlightuserdata(L, &ngx_http_lua_socket_pool_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushlstring(L, (char *) key->data, key->len);
+
+    spool = lua_newuserdata(L, size);
+    if (spool == NULL) {
+        lua_pop(L, 2);
+        return NULL;
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_pool_udata_metatable_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket keepalive create connection pool for key"
+                   " \"%V\"", key);
+
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    spool->active_connections = 0;
+    spool->size = pool_size;
+    spool->backlog = 0;
+    spool->wait_count = 0;
+    spool->bounded = 0;
+    spool->lua_vm = ngx_http_lua_get_lua_vm(r, NULL);
+
+    ngx_queue_init(&spool->cache);
+    ngx_queue_init(&spool->free);
+    ngx_queue_init(&spool->wait_connect_op);
+
+    p = ngx_copy(spool->key, key->data, key->len);
+    *p++ = '\0';
+
+    items = (ngx_http_lua_socket_pool_item_t *) (spool->key + key_len);
+
+    dd("items: %p", items);
+
+    ngx_http_lua_assert((void *) items == ngx_align_ptr(items,
+                                                        sizeof(void *)));
+
+    for (i = 0; i < pool_size; i++) {
+        ngx_queue_insert_head(&spool->free, &items[i].queue);
+        items[i].socket_pool = spool;
+    }
+
+    return spool;
+}
+
+
+static void
+ngx_http_lua_socket_pool_release_slot(ngx_log_t *log,
+    ngx_http_lua_socket_pool_t *spool)
+{
+    ngx_queue_t                             *q;
+    ngx_http_lua_socket_tcp_conn_op_ctx_t   *op;
+
+    if (!ngx_queue_empty(&spool->wait_connect_op)) {
+
+        /* hand the slot over to the oldest waiting connect operation */
+
+        q = ngx_queue_head(&spool->wait_connect_op);
+        ngx_queue_remove(q);
+
+        op = ngx_queue_data(q, ngx_http_lua_socket_tcp_conn_op_ctx_t, queue);
+        op->queued = 0;
+        op->upstream->counted = 1;
+
+        spool->wait_count--;
+
+        if (op->event.timer_set) {
+            ngx_del_timer(&op->event);
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua tcp socket pool \"%s\": handing a connection "
+                       "slot over to a waiting connect operation",
+                       spool->key);
+
+        ngx_post_event(&op->event, &ngx_posted_events);
+        return;
+    }
+
     spool->active_connections--;
 
     dd("keepalive: active connections: %u",
        (unsigned) spool->active_connections);
 
-    if (spool->active_connections == 0) {
-        ngx_http_lua_socket_free_pool(ev->log, spool);
+    if (spool->active_connections == 0 && spool->wait_count == 0) {
+        ngx_http_lua_socket_free_pool(log, spool);
     }
-
-    return NGX_DECLINED;
 }
 
 
@@ -5258,6 +6210,195 @@ ngx_http_lua_coctx_cleanup(void *data)
 }
 
 
+static void
+ngx_http_lua_socket_tcp_conn_op_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                        *c;
+    ngx_http_request_t                      *r;
+    ngx_http_lua_ctx_t                      *ctx;
+    ngx_http_lua_co_ctx_t                   *coctx;
+    ngx_http_lua_socket_pool_t              *spool;
+    ngx_http_lua_socket_tcp_upstream_t      *u;
+    ngx_http_lua_socket_tcp_conn_op_ctx_t   *op;
+
+    op = ev->data;
+    u = op->upstream;
+    spool = u->socket_pool;
+    coctx = op->co_ctx;
+
+    coctx->cleanup = NULL;
+    u->conn_waiting = 0;
+
+    if (ev->timedout) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                       "lua tcp socket connect operation timed out waiting "
+                       "in pool \"%s\"", spool->key);
+
+#if defined(nginx_version) && nginx_version >= 1007005
+        if (ev->posted) {
+#else
+        if (ev->prev) {
+#endif
+            ngx_delete_posted_event(ev);
+        }
+
+        if (op->queued) {
+            ngx_queue_remove(&op->queue);
+            op->queued = 0;
+        }
+
+        spool->wait_count--;
+
+        if (spool->active_connections == 0 && spool->wait_count == 0) {
+            ngx_http_lua_socket_free_pool(ev->log, spool);
+        }
+
+    } else if (!u->counted) {
+
+        /* woken up by an idle connection put back into the pool */
+
+        spool->wait_count--;
+    }
+
+    r = u->request;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    ngx_http_lua_assert(ctx != NULL);
+
+    ctx->cur_co_ctx = coctx;
+
+    if (ctx->entered_content_phase) {
+        (void) ngx_http_lua_socket_tcp_conn_op_resume(r);
+
+    } else {
+        ctx->resume_handler = ngx_http_lua_socket_tcp_conn_op_resume;
+        ngx_http_core_run_phases(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_tcp_conn_op_resume(ngx_http_request_t *r)
+{
+    int                                      nret;
+    lua_State                               *vm;
+    ngx_int_t                                rc;
+    ngx_connection_t                        *c;
+    ngx_http_lua_ctx_t                      *ctx;
+    ngx_http_lua_co_ctx_t                   *coctx;
+    ngx_http_lua_socket_tcp_conn_op_ctx_t   *op;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->resume_handler = ngx_http_lua_wev_handler;
+
+    coctx = ctx->cur_co_ctx;
+    op = coctx->data;
+
+    if (op->event.timedout) {
+        lua_pushnil(coctx->co);
+        lua_pushliteral(coctx->co, "timeout");
+        nret = 2;
+
+    } else {
+        nret = ngx_http_lua_socket_tcp_connect_helper(coctx->co, op->upstream,
+                                                      r, ctx, op->host.data,
+                                                      op->host.len, op->port,
+                                                      op);
+
+        if (!op->queued && op->event.timer_set) {
+            ngx_del_timer(&op->event);
+        }
+
+        if (nret == NGX_AGAIN) {
+            return NGX_DONE;
+        }
+    }
+
+    c = r->connection;
+    vm = ngx_http_lua_get_lua_vm(r, ctx);
+
+    rc = ngx_http_lua_run_thread(vm, r, ctx, nret);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua run thread returned %d", rc);
+
+    if (rc == NGX_AGAIN) {
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_http_lua_finalize_request(r, NGX_DONE);
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    }
+
+    if (ctx->entered_content_phase) {
+        ngx_http_lua_finalize_request(r, rc);
+        return NGX_DONE;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_lua_socket_tcp_conn_op_cleanup(void *data)
+{
+    ngx_http_lua_co_ctx_t                   *coctx = data;
+    ngx_http_lua_socket_pool_t              *spool;
+    ngx_http_lua_socket_tcp_upstream_t      *u;
+    ngx_http_lua_socket_tcp_conn_op_ctx_t   *op;
+
+    op = coctx->data;
+    u = op->upstream;
+    spool = u->socket_pool;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua tcp socket abort waiting connect operation in "
+                   "pool \"%s\"", spool->key);
+
+    coctx->cleanup = NULL;
+    u->conn_waiting = 0;
+
+    if (op->event.timer_set) {
+        ngx_del_timer(&op->event);
+    }
+
+#if defined(nginx_version) && nginx_version >= 1007005
+    if (op->event.posted) {
+#else
+    if (op->event.prev) {
+#endif
+        ngx_delete_posted_event(&op->event);
+    }
+
+    if (op->queued) {
+        ngx_queue_remove(&op->queue);
+        op->queued = 0;
+        spool->wait_count--;
+
+    } else if (!u->counted) {
+        spool->wait_count--;
+    }
+
+    if (u->counted) {
+        u->counted = 0;
+        ngx_http_lua_socket_pool_release_slot(ngx_cycle->log, spool);
+        return;
+    }
+
+    if (spool->active_connections == 0 && spool->wait_count == 0) {
+        ngx_http_lua_socket_free_pool(ngx_cycle->log, spool);
+    }
+}
+
+
 #if (NGX_HTTP_SSL)
 
 static int
@@ -35,6 +35,25 @@ typedef void (*ngx_http_lua_socket_tcp_upstream_handler_pt)
     (ngx_http_request_t *r, ngx_http_lua_socket_tcp_upstream_t *u);
 
 
+/* the options supported by tcpsock:setoption() */
+enum {
+    NGX_HTTP_LUA_SOCKOPT_KEEPALIVE = 0,
+    NGX_HTTP_LUA_SOCKOPT_TCP_NODELAY,
+    NGX_HTTP_LUA_SOCKOPT_SNDBUF,
+    NGX_HTTP_LUA_SOCKOPT_RCVBUF,
+    NGX_HTTP_LUA_SOCKOPT_LINGER,
+    NGX_HTTP_LUA_SOCKOPT_TCP_QUICKACK,
+    NGX_HTTP_LUA_SOCKOPT_TCP_CORK,
+    NGX_HTTP_LUA_SOCKOPT_MAX
+};
+
+
+typedef struct {
+    ngx_uint_t                         set;  /* bitmask of the options set */
+    int                                values[NGX_HTTP_LUA_SOCKOPT_MAX];
+} ngx_http_lua_socket_tcp_sockopts_t;
+
+
 typedef struct {
     lua_State                         *lua_vm;
 
@@ -42,10 +61,23 @@ typedef struct {
      *                       + in-pool connections */
     ngx_uint_t                         active_connections;
 
+    /* the max number of connections of a bounded pool, and the max
+     * number of connect operations allowed to wait for one of them */
+    ngx_uint_t                         size;
+    ngx_uint_t                         backlog;
+
+    /* connect operations not holding a connection yet */
+    ngx_uint_t                         wait_count;
+
     /* queues of ngx_http_lua_socket_pool_item_t: */
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
 
+    /* queue of ngx_http_lua_socket_tcp_conn_op_ctx_t: */
+    ngx_queue_t                        wait_connect_op;
+
+    unsigned                           bounded:1;
+
     u_char                             key[1];
 
 } ngx_http_lua_socket_pool_t;
@@ -90,6 +122,8 @@ struct ngx_http_lua_socket_tcp_upstream_s {
 
     ngx_uint_t                       reused;
 
+    ngx_http_lua_socket_tcp_sockopts_t   sockopts;
+
 #if (NGX_HTTP_SSL)
     ngx_str_t                        ssl_name;
 #endif
@@ -104,9 +138,11 @@ struct ngx_http_lua_socket_tcp_upstream_s {
     unsigned                         raw_downstream:1;
     unsigned                         read_closed:1;
     unsigned                         write_closed:1;
+    unsigned                         counted:1;
 #if (NGX_HTTP_SSL)
     unsigned                         ssl_verify:1;
     unsigned                         ssl_session_reuse:1;
+    unsigned                         ssl_session_cache:1;
 #endif
 };
 
@@ -143,9 +179,24 @@ typedef struct {
 
     ngx_uint_t                       reused;
 
+    ngx_http_lua_socket_tcp_sockopts_t   sockopts;
+
 } ngx_http_lua_socket_pool_item_t;
 
 
+typedef struct {
+    ngx_queue_t                          queue;
+    ngx_event_t                          event;
+    ngx_http_lua_socket_tcp_upstream_t  *upstream;
+    ngx_http_lua_co_ctx_t               *co_ctx;
+
+    ngx_str_t                            host;
+    int                                  port;
+
+    unsigned                             queued:1;
+} ngx_http_lua_socket_tcp_conn_op_ctx_t;
+
+
 void ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L);
 void ngx_http_lua_inject_req_socket_api(lua_State *L);
 void ngx_http_lua_cleanup_conn_pools(lua_State *L);
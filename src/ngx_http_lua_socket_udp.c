@@ -24,13 +24,30 @@
 #endif
 
 
-#define UDP_MAX_DATAGRAM_SIZE 8192
+/* the max payload of an IPv4 UDP datagram */
+#define UDP_MAX_DATAGRAM_SIZE 65507
+#define UDP_DEFAULT_RECV_SIZE 8192
+
+/* the max number of datagrams received by a single receive_many() call */
+#define UDP_MAX_RECV_MANY 64
 
 
 static int ngx_http_lua_socket_udp(lua_State *L);
 static int ngx_http_lua_socket_udp_setpeername(lua_State *L);
 static int ngx_http_lua_socket_udp_send(lua_State *L);
+static int ngx_http_lua_socket_udp_send_many(lua_State *L);
+static ngx_int_t ngx_http_lua_socket_udp_send_datagrams(
+    ngx_http_lua_socket_udp_upstream_t *u, struct iovec *iovs, ngx_uint_t n,
+    ngx_uint_t *sent);
+static ngx_int_t ngx_http_lua_socket_udp_defer(
+    ngx_http_lua_socket_udp_upstream_t *u, u_char *data, size_t len);
+static ngx_int_t ngx_http_lua_socket_udp_flush(
+    ngx_http_lua_socket_udp_upstream_t *u);
+static void ngx_http_lua_socket_udp_flush_handler(ngx_event_t *ev);
 static int ngx_http_lua_socket_udp_receive(lua_State *L);
+static int ngx_http_lua_socket_udp_receive_many(lua_State *L);
+static int ngx_http_lua_socket_udp_receive_helper(lua_State *L,
+    ngx_uint_t many);
 static int ngx_http_lua_socket_udp_settimeout(lua_State *L);
 static void ngx_http_lua_socket_udp_finalize(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u);
@@ -48,6 +65,11 @@ static void ngx_http_lua_socket_dummy_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u);
 static int ngx_http_lua_socket_udp_receive_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u, lua_State *L);
+static int ngx_http_lua_socket_udp_receive_many_retval_handler(
+    ngx_http_request_t *r, ngx_http_lua_socket_udp_upstream_t *u,
+    lua_State *L);
+static ssize_t ngx_http_lua_socket_udp_recv_many(
+    ngx_http_lua_socket_udp_upstream_t *u);
 static ngx_int_t ngx_http_lua_socket_udp_read(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u);
 static void ngx_http_lua_socket_udp_read_handler(ngx_http_request_t *r,
@@ -71,6 +93,11 @@ static char ngx_http_lua_socket_udp_metatable_key;
 static char ngx_http_lua_udp_udata_metatable_key;
 static u_char ngx_http_lua_socket_udp_buffer[UDP_MAX_DATAGRAM_SIZE];
 
+/* for receive_many(), grown on demand */
+static u_char *ngx_http_lua_socket_udp_many_buffer;
+static size_t ngx_http_lua_socket_udp_many_buffer_size;
+static size_t ngx_http_lua_socket_udp_many_lens[UDP_MAX_RECV_MANY];
+
 
 void
 ngx_http_lua_inject_socket_udp_api(ngx_log_t *log, lua_State *L)
@@ -82,7 +109,7 @@ ngx_http_lua_inject_socket_udp_api(ngx_log_t *log, lua_State *L)
 
     /* udp socket object metatable */
     lua_pushlightuserdata(L, &ngx_http_lua_socket_udp_metatable_key);
-    lua_createtable(L, 0 /* narr */, 6 /* nrec */);
+    lua_createtable(L, 0 /* narr */, 8 /* nrec */);
 
     lua_pushcfunction(L, ngx_http_lua_socket_udp_setpeername);
     lua_setfield(L, -2, "setpeername"); /* ngx socket mt */
@@ -90,9 +117,15 @@ ngx_http_lua_inject_socket_udp_api(ngx_log_t *log, lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_socket_udp_send);
     lua_setfield(L, -2, "send");
 
+    lua_pushcfunction(L, ngx_http_lua_socket_udp_send_many);
+    lua_setfield(L, -2, "send_many");
+
     lua_pushcfunction(L, ngx_http_lua_socket_udp_receive);
     lua_setfield(L, -2, "receive");
 
+    lua_pushcfunction(L, ngx_http_lua_socket_udp_receive_many);
+    lua_setfield(L, -2, "receive_many");
+
     lua_pushcfunction(L, ngx_http_lua_socket_udp_settimeout);
     lua_setfield(L, -2, "settimeout"); /* ngx socket mt */
 
@@ -877,6 +910,11 @@ ngx_http_lua_socket_udp_send(lua_State *L)
     u->waiting = 0;
 #endif
 
+    if (u->deferred && u->deferred->count) {
+        /* keep the datagrams in the order they were handed to us */
+        (void) ngx_http_lua_socket_udp_flush(u);
+    }
+
     dd("sending query %.*s", (int) query.len, query.data);
 
     n = ngx_send(u->udp_connection.connection, query.data, query.len);
@@ -904,16 +942,346 @@ ngx_http_lua_socket_udp_send(lua_State *L)
 
 
 static int
-ngx_http_lua_socket_udp_receive(lua_State *L)
+ngx_http_lua_socket_udp_send_many(lua_State *L)
 {
+    int                                  nargs, defer;
+    size_t                               len;
+    u_char                              *p;
+    ngx_int_t                            rc;
+    ngx_uint_t                           i, n, total, chunk, sent;
     ngx_http_request_t                  *r;
+    ngx_http_lua_loc_conf_t             *llcf;
     ngx_http_lua_socket_udp_upstream_t  *u;
+    struct iovec                         iovs[NGX_HTTP_LUA_UDP_MAX_SEND_MANY];
+
+    nargs = lua_gettop(L);
+    if (nargs != 2 && nargs != 3) {
+        return luaL_error(L, "expecting 2 or 3 arguments "
+                          "(including the object), but got %d", nargs);
+    }
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "request object not found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    defer = lua_toboolean(L, 3);
+    total = lua_objlen(L, 2);
+
+    for (i = 1; i <= total; i++) {
+        lua_rawgeti(L, 2, i);
+
+        switch (lua_type(L, -1)) {
+        case LUA_TNUMBER:
+        case LUA_TSTRING:
+            lua_tolstring(L, -1, &len);
+            break;
+
+        default:
+            return luaL_error(L, "bad datagram type at index %d: %s",
+                              (int) i, luaL_typename(L, -1));
+        }
+
+        lua_pop(L, 1);
+
+        if (len > UDP_MAX_DATAGRAM_SIZE) {
+            return luaL_error(L, "datagram at index %d too large: %d bytes",
+                              (int) i, (int) len);
+        }
+    }
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (u == NULL || u->udp_connection.connection == NULL) {
+        llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+        if (llcf->log_socket_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to send data on a closed socket: u:%p, c:%p",
+                          u, u ? u->udp_connection.connection : NULL);
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->request != r) {
+        return luaL_error(L, "bad request");
+    }
+
+    if (u->waiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "socket busy");
+        return 2;
+    }
+
+    u->ft_type = 0;
+
+    if (defer) {
+        for (i = 1; i <= total; i++) {
+            lua_rawgeti(L, 2, i);
+            p = (u_char *) lua_tolstring(L, -1, &len);
+
+            rc = ngx_http_lua_socket_udp_defer(u, p, len);
+
+            lua_pop(L, 1);
+
+            if (rc != NGX_OK) {
+                return luaL_error(L, "no memory");
+            }
+        }
+
+        lua_pushinteger(L, total);
+        return 1;
+    }
+
+    if (u->deferred && u->deferred->count) {
+        (void) ngx_http_lua_socket_udp_flush(u);
+    }
+
+    if (!lua_checkstack(L, NGX_HTTP_LUA_UDP_MAX_SEND_MANY)) {
+        return luaL_error(L, "no memory");
+    }
+
+    for (n = 0; n < total; n += chunk) {
+        chunk = ngx_min(total - n, NGX_HTTP_LUA_UDP_MAX_SEND_MANY);
+
+        /* the payloads stay on the stack until they have been sent */
+
+        for (i = 0; i < chunk; i++) {
+            lua_rawgeti(L, 2, n + i + 1);
+            iovs[i].iov_base = (void *) lua_tolstring(L, -1, &len);
+            iovs[i].iov_len = len;
+        }
+
+        rc = ngx_http_lua_socket_udp_send_datagrams(u, iovs, chunk, &sent);
+
+        lua_pop(L, (int) chunk);
+
+        if (rc != NGX_OK) {
+            (void) ngx_http_lua_socket_error_retval_handler(r, u, L);
+            lua_pushinteger(L, n + sent);
+            return 3;
+        }
+    }
+
+    lua_pushinteger(L, total);
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_udp_send_datagrams(ngx_http_lua_socket_udp_upstream_t *u,
+    struct iovec *iovs, ngx_uint_t n, ngx_uint_t *sent)
+{
+    ngx_connection_t            *c;
+#if (NGX_HTTP_LUA_HAVE_SENDMMSG)
+    int                          rc;
+    ngx_err_t                    err;
+    ngx_uint_t                   i;
+    struct mmsghdr               msgs[NGX_HTTP_LUA_UDP_MAX_SEND_MANY];
+#else
+    ssize_t                      rc;
+#endif
+
+    c = u->udp_connection.connection;
+    *sent = 0;
+
+#if (NGX_HTTP_LUA_HAVE_SENDMMSG)
+
+    for (i = 0; i < n; i++) {
+        ngx_memzero(&msgs[i].msg_hdr, sizeof(struct msghdr));
+
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (*sent < n) {
+        rc = sendmmsg(c->fd, &msgs[*sent], n - *sent, 0);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "sendmmsg: fd:%d %d of %ui", c->fd, rc, n - *sent);
+
+        if (rc > 0) {
+            *sent += rc;
+            continue;
+        }
+
+        err = ngx_socket_errno;
+
+        if (rc == -1 && err == NGX_EINTR) {
+            continue;
+        }
+
+        u->socket_errno = err;
+
+        if (rc == -1 && err != NGX_EAGAIN) {
+            (void) ngx_connection_error(c, err, "sendmmsg() failed");
+        }
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+
+#else /* !(NGX_HTTP_LUA_HAVE_SENDMMSG) */
+
+    /* one send() call per datagram on systems without sendmmsg() */
+
+    for ( /* void */ ; *sent < n; (*sent)++) {
+        rc = ngx_send(c, iovs[*sent].iov_base, iovs[*sent].iov_len);
+
+        if (rc == NGX_ERROR || rc == NGX_AGAIN) {
+            u->socket_errno = ngx_socket_errno;
+            return NGX_ERROR;
+        }
+
+        if (rc != (ssize_t) iovs[*sent].iov_len) {
+            u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_PARTIALWRITE;
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+
+#endif
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_udp_defer(ngx_http_lua_socket_udp_upstream_t *u,
+    u_char *data, size_t len)
+{
+    ngx_connection_t                    *c;
+    ngx_http_lua_socket_udp_deferred_t  *d;
+
+    c = u->udp_connection.connection;
+    d = u->deferred;
+
+    if (d == NULL) {
+        d = ngx_alloc(sizeof(ngx_http_lua_socket_udp_deferred_t), c->log);
+        if (d == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(&d->event, sizeof(ngx_event_t));
+
+        d->event.handler = ngx_http_lua_socket_udp_flush_handler;
+        d->event.data = u;
+        d->event.log = c->log;
+        d->count = 0;
+        d->len = 0;
+
+        u->deferred = d;
+    }
+
+    if (d->count == NGX_HTTP_LUA_UDP_MAX_SEND_MANY
+        || d->len + len > NGX_HTTP_LUA_UDP_DEFERRED_SIZE)
+    {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "lua udp socket deferred buffer full, flushing %ui "
+                       "datagrams of %uz bytes", d->count, d->len);
+
+        (void) ngx_http_lua_socket_udp_flush(u);
+    }
+
+    ngx_memcpy(d->buf + d->len, data, len);
+
+    d->lens[d->count++] = len;
+    d->len += len;
+
+#if defined(nginx_version) && nginx_version >= 1007005
+    if (!d->event.posted) {
+#else
+    if (d->event.prev == NULL) {
+#endif
+        ngx_post_event(&d->event, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_udp_flush(ngx_http_lua_socket_udp_upstream_t *u)
+{
+    u_char                              *p;
     ngx_int_t                            rc;
-    ngx_http_lua_ctx_t                  *ctx;
-    ngx_http_lua_co_ctx_t               *coctx;
-    size_t                               size;
-    int                                  nargs;
+    ngx_uint_t                           i, sent;
+    ngx_connection_t                    *c;
     ngx_http_lua_loc_conf_t             *llcf;
+    ngx_http_lua_socket_udp_deferred_t  *d;
+    struct iovec                         iovs[NGX_HTTP_LUA_UDP_MAX_SEND_MANY];
+
+    d = u->deferred;
+    c = u->udp_connection.connection;
+
+#if defined(nginx_version) && nginx_version >= 1007005
+    if (d->event.posted) {
+#else
+    if (d->event.prev) {
+#endif
+        ngx_delete_posted_event(&d->event);
+    }
+
+    if (d->count == 0 || c == NULL) {
+        d->count = 0;
+        d->len = 0;
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua udp socket flushing %ui deferred datagrams "
+                   "of %uz bytes", d->count, d->len);
+
+    p = d->buf;
+
+    for (i = 0; i < d->count; i++) {
+        iovs[i].iov_base = p;
+        iovs[i].iov_len = d->lens[i];
+        p += d->lens[i];
+    }
+
+    rc = ngx_http_lua_socket_udp_send_datagrams(u, iovs, d->count, &sent);
+
+    if (rc != NGX_OK) {
+        llcf = ngx_http_get_module_loc_conf(u->request, ngx_http_lua_module);
+
+        if (llcf->log_socket_errors) {
+            ngx_log_error(NGX_LOG_ERR, c->log, u->socket_errno,
+                          "lua udp socket failed to send %ui of %ui "
+                          "deferred datagrams", d->count - sent, d->count);
+        }
+    }
+
+    d->count = 0;
+    d->len = 0;
+
+    return rc;
+}
+
+
+static void
+ngx_http_lua_socket_udp_flush_handler(ngx_event_t *ev)
+{
+    ngx_http_lua_socket_udp_upstream_t  *u;
+
+    u = ev->data;
+
+    (void) ngx_http_lua_socket_udp_flush(u);
+}
+
+
+static int
+ngx_http_lua_socket_udp_receive(lua_State *L)
+{
+    int                                  nargs;
 
     nargs = lua_gettop(L);
     if (nargs != 1 && nargs != 2) {
@@ -921,6 +1289,49 @@ ngx_http_lua_socket_udp_receive(lua_State *L)
                           "(including the object), but got %d", nargs);
     }
 
+    return ngx_http_lua_socket_udp_receive_helper(L, 0);
+}
+
+
+static int
+ngx_http_lua_socket_udp_receive_many(lua_State *L)
+{
+    int                                  nargs;
+    lua_Integer                          n;
+
+    nargs = lua_gettop(L);
+    if (nargs != 2 && nargs != 3) {
+        return luaL_error(L, "expecting 2 or 3 arguments "
+                          "(including the object), but got %d", nargs);
+    }
+
+    n = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, n >= 1 && n <= UDP_MAX_RECV_MANY, 2,
+                  "number of datagrams must be between 1 and 64");
+
+    /* leave the optional size argument at index 2 */
+
+    lua_remove(L, 2);
+
+    return ngx_http_lua_socket_udp_receive_helper(L, (ngx_uint_t) n);
+}
+
+
+static int
+ngx_http_lua_socket_udp_receive_helper(lua_State *L, ngx_uint_t many)
+{
+    ngx_http_request_t                  *r;
+    ngx_http_lua_socket_udp_upstream_t  *u;
+    ngx_int_t                            rc;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_lua_co_ctx_t               *coctx;
+    size_t                               size;
+    u_char                              *buf;
+    ngx_http_lua_loc_conf_t             *llcf;
+
+    ngx_http_lua_socket_udp_retval_handler  prepare_retvals;
+
     r = ngx_http_lua_get_req(L);
     if (r == NULL) {
         return luaL_error(L, "no request found");
@@ -968,19 +1379,43 @@ ngx_http_lua_socket_udp_receive(lua_State *L)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua udp socket read timeout: %M", u->read_timeout);
 
-    size = (size_t) luaL_optnumber(L, 2, UDP_MAX_DATAGRAM_SIZE);
+    size = (size_t) luaL_optnumber(L, 2, UDP_DEFAULT_RECV_SIZE);
     size = ngx_min(size, UDP_MAX_DATAGRAM_SIZE);
 
     u->recv_buf_size = size;
+    u->recv_many = many;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua udp socket receive buffer size: %uz", u->recv_buf_size);
 
+    if (many) {
+        size *= many;
+
+        if (size > ngx_http_lua_socket_udp_many_buffer_size) {
+            buf = ngx_alloc(size, ngx_cycle->log);
+            if (buf == NULL) {
+                return luaL_error(L, "no memory");
+            }
+
+            if (ngx_http_lua_socket_udp_many_buffer) {
+                ngx_free(ngx_http_lua_socket_udp_many_buffer);
+            }
+
+            ngx_http_lua_socket_udp_many_buffer = buf;
+            ngx_http_lua_socket_udp_many_buffer_size = size;
+        }
+
+        prepare_retvals = ngx_http_lua_socket_udp_receive_many_retval_handler;
+
+    } else {
+        prepare_retvals = ngx_http_lua_socket_udp_receive_retval_handler;
+    }
+
     rc = ngx_http_lua_socket_udp_read(r, u);
 
     if (rc == NGX_ERROR) {
         dd("read failed: %d", (int) u->ft_type);
-        rc = ngx_http_lua_socket_udp_receive_retval_handler(r, u, L);
+        rc = prepare_retvals(r, u, L);
         dd("udp receive retval returned: %d", (int) rc);
         return rc;
     }
@@ -990,7 +1425,7 @@ ngx_http_lua_socket_udp_receive(lua_State *L)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "lua udp socket receive done in a single run");
 
-        return ngx_http_lua_socket_udp_receive_retval_handler(r, u, L);
+        return prepare_retvals(r, u, L);
     }
 
     /* n == NGX_AGAIN */
@@ -1017,7 +1452,7 @@ ngx_http_lua_socket_udp_receive(lua_State *L)
 
     u->co_ctx = coctx;
     u->waiting = 1;
-    u->prepare_retvals = ngx_http_lua_socket_udp_receive_retval_handler;
+    u->prepare_retvals = prepare_retvals;
 
     return lua_yield(L, 0);
 }
@@ -1039,6 +1474,34 @@ ngx_http_lua_socket_udp_receive_retval_handler(ngx_http_request_t *r,
 }
 
 
+static int
+ngx_http_lua_socket_udp_receive_many_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_udp_upstream_t *u, lua_State *L)
+{
+    u_char                      *p;
+    ngx_uint_t                   i;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket receive_many return value handler");
+
+    if (u->ft_type) {
+        return ngx_http_lua_socket_error_retval_handler(r, u, L);
+    }
+
+    lua_createtable(L, u->received /* narr */, 0 /* nrec */);
+
+    p = ngx_http_lua_socket_udp_many_buffer;
+
+    for (i = 0; i < u->received; i++) {
+        lua_pushlstring(L, (char *) p, ngx_http_lua_socket_udp_many_lens[i]);
+        lua_rawseti(L, -2, i + 1);
+        p += u->recv_buf_size;
+    }
+
+    return 1;
+}
+
+
 static int
 ngx_http_lua_socket_udp_settimeout(lua_State *L)
 {
@@ -1092,6 +1555,14 @@ ngx_http_lua_socket_udp_finalize(ngx_http_request_t *r,
         u->resolved->ctx = NULL;
     }
 
+    if (u->deferred) {
+        /* send out whatever is still pending before closing */
+        (void) ngx_http_lua_socket_udp_flush(u);
+
+        ngx_free(u->deferred);
+        u->deferred = NULL;
+    }
+
     if (u->udp_connection.connection) {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "lua close socket connection");
@@ -1149,8 +1620,13 @@ ngx_http_lua_socket_udp_read(ngx_http_request_t *r,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "lua udp socket read data: waiting: %d", (int) u->waiting);
 
-    n = ngx_udp_recv(u->udp_connection.connection,
-                     ngx_http_lua_socket_udp_buffer, u->recv_buf_size);
+    if (u->recv_many) {
+        n = ngx_http_lua_socket_udp_recv_many(u);
+
+    } else {
+        n = ngx_udp_recv(u->udp_connection.connection,
+                         ngx_http_lua_socket_udp_buffer, u->recv_buf_size);
+    }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "lua udp recv returned %z", n);
@@ -1189,6 +1665,99 @@ ngx_http_lua_socket_udp_read(ngx_http_request_t *r,
 }
 
 
+static ssize_t
+ngx_http_lua_socket_udp_recv_many(ngx_http_lua_socket_udp_upstream_t *u)
+{
+    u_char                      *p;
+    ngx_uint_t                   i;
+    ngx_connection_t            *c;
+#if (NGX_HTTP_LUA_HAVE_RECVMMSG)
+    int                          n;
+    ngx_err_t                    err;
+    struct iovec                 iovs[UDP_MAX_RECV_MANY];
+    struct mmsghdr               msgs[UDP_MAX_RECV_MANY];
+#else
+    ssize_t                      n;
+#endif
+
+    c = u->udp_connection.connection;
+    p = ngx_http_lua_socket_udp_many_buffer;
+
+#if (NGX_HTTP_LUA_HAVE_RECVMMSG)
+
+    for (i = 0; i < u->recv_many; i++) {
+        iovs[i].iov_base = p;
+        iovs[i].iov_len = u->recv_buf_size;
+
+        ngx_memzero(&msgs[i].msg_hdr, sizeof(struct msghdr));
+
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+
+        p += u->recv_buf_size;
+    }
+
+    do {
+        n = recvmmsg(c->fd, msgs, u->recv_many, 0, NULL);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "recvmmsg: fd:%d %d of %ui", c->fd, n, u->recv_many);
+
+        if (n >= 0) {
+            for (i = 0; i < (ngx_uint_t) n; i++) {
+                ngx_http_lua_socket_udp_many_lens[i] = msgs[i].msg_len;
+            }
+
+            return n;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN || err == NGX_EINTR) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "recvmmsg() not ready");
+            n = NGX_AGAIN;
+
+        } else {
+            n = ngx_connection_error(c, err, "recvmmsg() failed");
+            break;
+        }
+
+    } while (err == NGX_EINTR);
+
+    c->read->ready = 0;
+
+    if (n == NGX_ERROR) {
+        c->read->error = 1;
+    }
+
+    return n;
+
+#else /* !(NGX_HTTP_LUA_HAVE_RECVMMSG) */
+
+    /* one recv() call per datagram on systems without recvmmsg() */
+
+    for (i = 0; i < u->recv_many; i++) {
+        n = ngx_udp_recv(c, p, u->recv_buf_size);
+
+        if (n < 0) {
+            if (i == 0) {
+                return n;
+            }
+
+            break;
+        }
+
+        ngx_http_lua_socket_udp_many_lens[i] = n;
+        p += u->recv_buf_size;
+    }
+
+    return i;
+
+#endif
+}
+
+
 static void
 ngx_http_lua_socket_udp_read_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u)
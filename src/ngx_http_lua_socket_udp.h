@@ -24,6 +24,23 @@ typedef void (*ngx_http_lua_socket_udp_upstream_handler_pt)
     (ngx_http_request_t *r, ngx_http_lua_socket_udp_upstream_t *u);
 
 
+/* the max number of datagrams sent by a single sendmmsg() call */
+#define NGX_HTTP_LUA_UDP_MAX_SEND_MANY   64
+
+#define NGX_HTTP_LUA_UDP_DEFERRED_SIZE   65536
+
+
+/* datagrams queued by send_many(tbl, true) until the end of the current
+ * event loop iteration */
+typedef struct {
+    ngx_event_t                      event;
+    ngx_uint_t                       count;
+    size_t                           len;
+    size_t                           lens[NGX_HTTP_LUA_UDP_MAX_SEND_MANY];
+    u_char                           buf[NGX_HTTP_LUA_UDP_DEFERRED_SIZE];
+} ngx_http_lua_socket_udp_deferred_t;
+
+
 struct ngx_http_lua_socket_udp_upstream_s {
     ngx_http_lua_socket_udp_retval_handler          prepare_retvals;
     ngx_http_lua_socket_udp_upstream_handler_pt     read_event_handler;
@@ -42,6 +59,11 @@ struct ngx_http_lua_socket_udp_upstream_s {
     size_t                           received; /* for receive */
     size_t                           recv_buf_size;
 
+    /* the max number of datagrams to receive, for receive_many */
+    ngx_uint_t                       recv_many;
+
+    ngx_http_lua_socket_udp_deferred_t  *deferred;
+
     ngx_http_lua_co_ctx_t           *co_ctx;
 
     unsigned                         waiting; /* :1 */
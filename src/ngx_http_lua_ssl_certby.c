@@ -27,6 +27,58 @@ static u_char *ngx_http_lua_log_ssl_cert_error(ngx_log_t *log, u_char *buf,
     size_t len);
 static ngx_int_t ngx_http_lua_ssl_cert_by_chunk(lua_State *L,
     ngx_http_request_t *r);
+#if (NGX_THREADS) && !defined(NGX_LUA_NO_FFI_API)
+static ngx_thread_task_t *ngx_http_lua_ssl_task_alloc(ngx_http_request_t *r,
+    ngx_uint_t op, size_t size, char **err);
+static int ngx_http_lua_ssl_task_post(ngx_http_request_t *r,
+    ngx_thread_task_t *task, char **err);
+static void ngx_http_lua_ssl_task_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_lua_ssl_task_event_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_lua_ssl_task_resume(ngx_http_request_t *r);
+static void ngx_http_lua_ssl_task_cleanup(void *data);
+static void ngx_http_lua_ssl_task_free(ngx_thread_task_t *task);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static ngx_int_t ngx_http_lua_ssl_init_locks(ngx_log_t *log);
+static void ngx_http_lua_ssl_locking_callback(int mode, int n,
+    const char *file, int line);
+#endif
+
+
+#define NGX_HTTP_LUA_SSL_TASK_BUF_SIZE  16384
+
+
+enum {
+    NGX_HTTP_LUA_SSL_TASK_RSA_KEYGEN = 0,
+    NGX_HTTP_LUA_SSL_TASK_GEN_CSR,
+    NGX_HTTP_LUA_SSL_TASK_SIGN_CSR
+};
+
+
+typedef struct {
+    ngx_uint_t                   op;
+    ngx_http_lua_main_conf_t    *lmcf;
+    ngx_http_lua_co_ctx_t       *wait_co_ctx;  /* NULL once the waiting
+                                                  coroutine is gone */
+
+    int                          bits;
+    csr_info_t                   info;
+
+    u_char                      *data;
+    size_t                       data_len;
+    u_char                      *data2;
+    size_t                       data2_len;
+
+    u_char                      *out;
+    size_t                       out_len;
+    char                        *err;
+    ngx_int_t                    rc;
+} ngx_http_lua_ssl_task_ctx_t;
+
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static ngx_thread_mutex_t  *ngx_http_lua_ssl_locks;
+#endif
+#endif
 
 
 ngx_int_t
@@ -35,7 +87,7 @@ ngx_http_lua_ssl_cert_handler_file(ngx_http_request_t *r,
 {
     ngx_int_t           rc;
 
-    rc = ngx_http_lua_cache_loadfile(r->connection->log, L,
+    rc = ngx_http_lua_cache_loadfile(r, L,
                                      lscf->ssl.cert_src.data,
                                      lscf->ssl.cert_src_key);
     if (rc != NGX_OK) {
@@ -149,6 +201,39 @@ ngx_http_lua_ssl_cert_by_lua(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+char *
+ngx_http_lua_ssl_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+
+    ngx_str_t                   *value;
+    ngx_http_lua_main_conf_t    *lmcf = conf;
+
+    if (lmcf->ssl_thread_pool) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    lmcf->ssl_thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (lmcf->ssl_thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V\" requires nginx built with --with-threads",
+                       &cmd->name);
+
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+
 int
 ngx_http_lua_ssl_cert_handler(ngx_ssl_conn_t *ssl_conn, void *data)
 {
@@ -656,6 +741,189 @@ failed:
 }
 
 
+void *
+ngx_http_lua_ffi_parse_der_cert(const char *data, size_t len, char **err)
+{
+    BIO               *bio;
+    X509              *x509;
+    STACK_OF(X509)    *chain;
+
+    bio = BIO_new_mem_buf((char *) data, len);
+    if (bio == NULL) {
+        *err = "BIO_new_mem_buf() failed";
+        return NULL;
+    }
+
+    chain = sk_X509_new_null();
+    if (chain == NULL) {
+        BIO_free(bio);
+        *err = "sk_X509_new_null() failed";
+        return NULL;
+    }
+
+    do {
+        x509 = d2i_X509_bio(bio, NULL);
+        if (x509 == NULL) {
+            *err = "d2i_X509_bio() failed";
+            goto failed;
+        }
+
+        if (sk_X509_push(chain, x509) == 0) {
+            X509_free(x509);
+            *err = "sk_X509_push() failed";
+            goto failed;
+        }
+
+    } while (!BIO_eof(bio));
+
+    BIO_free(bio);
+
+    *err = NULL;
+    return chain;
+
+failed:
+
+    sk_X509_pop_free(chain, X509_free);
+    BIO_free(bio);
+
+    return NULL;
+}
+
+
+void *
+ngx_http_lua_ffi_parse_der_priv_key(const char *data, size_t len, char **err)
+{
+    BIO               *bio;
+    EVP_PKEY          *pkey;
+
+    bio = BIO_new_mem_buf((char *) data, len);
+    if (bio == NULL) {
+        *err = "BIO_new_mem_buf() failed";
+        return NULL;
+    }
+
+    pkey = d2i_PrivateKey_bio(bio, NULL);
+    if (pkey == NULL) {
+        BIO_free(bio);
+        *err = "d2i_PrivateKey_bio() failed";
+        return NULL;
+    }
+
+    BIO_free(bio);
+
+    *err = NULL;
+    return pkey;
+}
+
+
+int
+ngx_http_lua_ffi_ssl_set_cert(ngx_http_request_t *r, void *cdata, char **err)
+{
+#if OPENSSL_VERSION_NUMBER < 0x1000205fL
+
+    *err = "at least OpenSSL 1.0.2e required but found " OPENSSL_VERSION_TEXT;
+    return NGX_ERROR;
+
+#else
+
+    int                i;
+    X509              *x509;
+    ngx_ssl_conn_t    *ssl_conn;
+    STACK_OF(X509)    *chain = cdata;
+
+    if (r->connection == NULL || r->connection->ssl == NULL) {
+        *err = "bad request";
+        return NGX_ERROR;
+    }
+
+    ssl_conn = r->connection->ssl->connection;
+    if (ssl_conn == NULL) {
+        *err = "bad ssl conn";
+        return NGX_ERROR;
+    }
+
+    if (sk_X509_num(chain) < 1) {
+        *err = "invalid certificate chain";
+        return NGX_ERROR;
+    }
+
+    /*
+     * the handle keeps its own references to the certificates, so all
+     * the calls below take new references instead of stealing them
+     */
+
+    x509 = sk_X509_value(chain, 0);
+
+    if (SSL_use_certificate(ssl_conn, x509) == 0) {
+        *err = "SSL_use_certificate() failed";
+        return NGX_ERROR;
+    }
+
+    for (i = 1; i < sk_X509_num(chain); i++) {
+
+        x509 = sk_X509_value(chain, i);
+
+        if (SSL_add1_chain_cert(ssl_conn, x509) == 0) {
+            *err = "SSL_add1_chain_cert() failed";
+            return NGX_ERROR;
+        }
+    }
+
+    *err = NULL;
+    return NGX_OK;
+
+#endif  /* OPENSSL_VERSION_NUMBER < 0x1000205fL */
+}
+
+
+int
+ngx_http_lua_ffi_ssl_set_priv_key(ngx_http_request_t *r, void *cdata,
+    char **err)
+{
+    EVP_PKEY          *pkey = cdata;
+    ngx_ssl_conn_t    *ssl_conn;
+
+    if (r->connection == NULL || r->connection->ssl == NULL) {
+        *err = "bad request";
+        return NGX_ERROR;
+    }
+
+    ssl_conn = r->connection->ssl->connection;
+    if (ssl_conn == NULL) {
+        *err = "bad ssl conn";
+        return NGX_ERROR;
+    }
+
+    /* SSL_use_PrivateKey() takes a new reference to the key */
+
+    if (SSL_use_PrivateKey(ssl_conn, pkey) == 0) {
+        *err = "SSL_use_PrivateKey() failed";
+        return NGX_ERROR;
+    }
+
+    *err = NULL;
+    return NGX_OK;
+}
+
+
+void
+ngx_http_lua_ffi_free_cert(void *cdata)
+{
+    STACK_OF(X509)  *chain = cdata;
+
+    sk_X509_pop_free(chain, X509_free);
+}
+
+
+void
+ngx_http_lua_ffi_free_priv_key(void *cdata)
+{
+    EVP_PKEY  *pkey = cdata;
+
+    EVP_PKEY_free(pkey);
+}
+
+
 int
 ngx_http_lua_ffi_ssl_raw_server_addr(ngx_http_request_t *r, char **addr,
     size_t *addrlen, int *addrtype, char **err)
@@ -1276,6 +1544,522 @@ failed:
     return rc;
 }
 
+
+int
+ngx_http_lua_ffi_ssl_rsa_generate_key_async(ngx_http_request_t *r, int bits,
+    char **err)
+{
+#if (NGX_THREADS)
+
+    ngx_thread_task_t               *task;
+    ngx_http_lua_ssl_task_ctx_t     *tctx;
+
+    task = ngx_http_lua_ssl_task_alloc(r, NGX_HTTP_LUA_SSL_TASK_RSA_KEYGEN,
+                                       0, err);
+    if (task == NULL) {
+        return *err == NULL ? NGX_DECLINED : NGX_ERROR;
+    }
+
+    tctx = task->ctx;
+    tctx->bits = bits;
+
+    return ngx_http_lua_ssl_task_post(r, task, err);
+
+#else
+
+    *err = "no thread support";
+    return NGX_DECLINED;
+
+#endif
+}
+
+
+int
+ngx_http_lua_ffi_ssl_generate_certificate_sign_request_async(
+    ngx_http_request_t *r, const char *data, size_t data_len,
+    csr_info_t *info, char **err)
+{
+#if (NGX_THREADS)
+
+    size_t                           len[5];
+    u_char                          *p;
+    ngx_uint_t                       i;
+    ngx_thread_task_t               *task;
+    const unsigned char             *src[5];
+    const unsigned char            **dst[5];
+    ngx_http_lua_ssl_task_ctx_t     *tctx;
+
+    src[0] = info->common_name;
+    src[1] = info->country;
+    src[2] = info->state;
+    src[3] = info->city;
+    src[4] = info->organisation;
+
+    /* the Lua strings may be collected while the task is running */
+
+    for (i = 0; i < 5; i++) {
+        len[i] = ngx_strlen(src[i]) + 1;
+        data_len += len[i];
+    }
+
+    task = ngx_http_lua_ssl_task_alloc(r, NGX_HTTP_LUA_SSL_TASK_GEN_CSR,
+                                       data_len, err);
+    if (task == NULL) {
+        return *err == NULL ? NGX_DECLINED : NGX_ERROR;
+    }
+
+    tctx = task->ctx;
+
+    dst[0] = &tctx->info.common_name;
+    dst[1] = &tctx->info.country;
+    dst[2] = &tctx->info.state;
+    dst[3] = &tctx->info.city;
+    dst[4] = &tctx->info.organisation;
+
+    p = tctx->data;
+
+    for (i = 0; i < 5; i++) {
+        *dst[i] = p;
+        p = ngx_cpymem(p, src[i], len[i]);
+        data_len -= len[i];
+    }
+
+    tctx->data = ngx_cpymem(p, data, data_len) - data_len;
+    tctx->data_len = data_len;
+
+    return ngx_http_lua_ssl_task_post(r, task, err);
+
+#else
+
+    *err = "no thread support";
+    return NGX_DECLINED;
+
+#endif
+}
+
+
+int
+ngx_http_lua_ffi_ssl_sign_certificate_sign_request_async(
+    ngx_http_request_t *r, const char *cadata, size_t calen, const char *csr,
+    size_t csrlen, char **err)
+{
+#if (NGX_THREADS)
+
+    ngx_thread_task_t               *task;
+    ngx_http_lua_ssl_task_ctx_t     *tctx;
+
+    task = ngx_http_lua_ssl_task_alloc(r, NGX_HTTP_LUA_SSL_TASK_SIGN_CSR,
+                                       calen + csrlen, err);
+    if (task == NULL) {
+        return *err == NULL ? NGX_DECLINED : NGX_ERROR;
+    }
+
+    tctx = task->ctx;
+
+    tctx->data_len = calen;
+    tctx->data2 = ngx_cpymem(tctx->data, cadata, calen);
+    tctx->data2_len = csrlen;
+    ngx_memcpy(tctx->data2, csr, csrlen);
+
+    return ngx_http_lua_ssl_task_post(r, task, err);
+
+#else
+
+    *err = "no thread support";
+    return NGX_DECLINED;
+
+#endif
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_thread_task_t *
+ngx_http_lua_ssl_task_alloc(ngx_http_request_t *r, ngx_uint_t op,
+    size_t size, char **err)
+{
+    ngx_thread_task_t               *task;
+    ngx_http_lua_ctx_t              *ctx;
+    ngx_http_lua_main_conf_t        *lmcf;
+    ngx_http_lua_ssl_task_ctx_t     *tctx;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    static ngx_uint_t                locks_inited;
+#endif
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    if (lmcf->ssl_thread_pool == NULL) {
+        /* the caller is expected to fall back to the blocking API */
+        *err = NULL;
+        return NULL;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        *err = "no request ctx found";
+        return NULL;
+    }
+
+    if (!(ctx->context & (NGX_HTTP_LUA_CONTEXT_REWRITE
+                          | NGX_HTTP_LUA_CONTEXT_ACCESS
+                          | NGX_HTTP_LUA_CONTEXT_CONTENT
+                          | NGX_HTTP_LUA_CONTEXT_TIMER
+                          | NGX_HTTP_LUA_CONTEXT_SSL_CERT)))
+    {
+        *err = "API disabled in the current context";
+        return NULL;
+    }
+
+    if (lmcf->ssl_pending_tasks >= lmcf->ssl_max_pending_tasks) {
+        *err = "too many pending tasks";
+        return NULL;
+    }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (!locks_inited) {
+        if (ngx_http_lua_ssl_init_locks(r->connection->log) != NGX_OK) {
+            *err = "failed to initialize the OpenSSL locks";
+            return NULL;
+        }
+
+        locks_inited = 1;
+    }
+#endif
+
+    /*
+     * the task is not allocated from the request pool because the
+     * request may go away while the task is still running
+     */
+
+    task = ngx_calloc(sizeof(ngx_thread_task_t)
+                      + sizeof(ngx_http_lua_ssl_task_ctx_t) + size,
+                      r->connection->log);
+    if (task == NULL) {
+        *err = "no memory";
+        return NULL;
+    }
+
+    tctx = (ngx_http_lua_ssl_task_ctx_t *) (task + 1);
+
+    task->ctx = tctx;
+
+    tctx->op = op;
+    tctx->lmcf = lmcf;
+    tctx->data = (u_char *) (tctx + 1);
+
+    return task;
+}
+
+
+static int
+ngx_http_lua_ssl_task_post(ngx_http_request_t *r, ngx_thread_task_t *task,
+    char **err)
+{
+    ngx_http_lua_ctx_t              *ctx;
+    ngx_http_lua_co_ctx_t           *coctx;
+    ngx_http_lua_ssl_task_ctx_t     *tctx;
+
+    tctx = task->ctx;
+
+    task->handler = ngx_http_lua_ssl_task_thread_handler;
+    task->event.handler = ngx_http_lua_ssl_task_event_handler;
+    task->event.data = task;
+    task->event.log = ngx_cycle->log;
+
+    if (ngx_thread_task_post(tctx->lmcf->ssl_thread_pool, task) != NGX_OK) {
+        ngx_http_lua_ssl_task_free(task);
+        *err = "ngx_thread_task_post() failed";
+        return NGX_ERROR;
+    }
+
+    tctx->lmcf->ssl_pending_tasks++;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    coctx = ctx->cur_co_ctx;
+
+    coctx->data = task;
+    coctx->cleanup = ngx_http_lua_ssl_task_cleanup;
+
+    tctx->wait_co_ctx = coctx;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua ssl task %ui posted, pending: %i",
+                   tctx->op, tctx->lmcf->ssl_pending_tasks);
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_lua_ssl_task_thread_handler(void *data, ngx_log_t *log)
+{
+    size_t                           size;
+    ngx_int_t                        rc;
+    ngx_http_lua_ssl_task_ctx_t     *tctx = data;
+
+    size = NGX_HTTP_LUA_SSL_TASK_BUF_SIZE;
+
+    for ( ;; ) {
+
+        tctx->out = ngx_alloc(size, log);
+        if (tctx->out == NULL) {
+            tctx->err = "no memory";
+            tctx->rc = NGX_ERROR;
+            return;
+        }
+
+        tctx->out_len = size;
+
+        switch (tctx->op) {
+
+        case NGX_HTTP_LUA_SSL_TASK_RSA_KEYGEN:
+            rc = ngx_http_lua_ffi_ssl_rsa_generate_key(tctx->bits, tctx->out,
+                                                       &tctx->out_len,
+                                                       &tctx->err);
+            break;
+
+        case NGX_HTTP_LUA_SSL_TASK_GEN_CSR:
+            rc = ngx_http_lua_ffi_ssl_generate_certificate_sign_request(
+                     (const char *) tctx->data, tctx->data_len, &tctx->info,
+                     tctx->out, &tctx->out_len, &tctx->err);
+            break;
+
+        default: /* NGX_HTTP_LUA_SSL_TASK_SIGN_CSR */
+            rc = ngx_http_lua_ffi_ssl_sign_certificate_sign_request(
+                     (const char *) tctx->data, tctx->data_len,
+                     (const char *) tctx->data2, tctx->data2_len,
+                     tctx->out, &tctx->out_len, &tctx->err);
+            break;
+        }
+
+        if (rc != NGX_BUSY) {
+            break;
+        }
+
+        /* the output did not fit, tctx->out_len holds the size needed */
+
+        ngx_free(tctx->out);
+        tctx->out = NULL;
+
+        size = tctx->out_len;
+    }
+
+    tctx->rc = rc;
+}
+
+
+static void
+ngx_http_lua_ssl_task_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                *c;
+    ngx_thread_task_t               *task;
+    ngx_http_request_t              *r;
+    ngx_http_lua_ctx_t              *ctx;
+    ngx_http_log_ctx_t              *log_ctx;
+    ngx_http_lua_co_ctx_t           *coctx;
+    ngx_http_lua_ssl_task_ctx_t     *tctx;
+
+    task = ev->data;
+    tctx = task->ctx;
+
+    tctx->lmcf->ssl_pending_tasks--;
+
+    coctx = tctx->wait_co_ctx;
+
+    if (coctx == NULL) {
+        /* the waiting request has already been terminated */
+        ngx_http_lua_ssl_task_free(task);
+        return;
+    }
+
+    coctx->cleanup = NULL;
+
+    r = ngx_http_lua_get_req(coctx->co);
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    ngx_http_lua_assert(ctx != NULL);
+
+    if (c->fd != (ngx_socket_t) -1) {  /* not a fake connection */
+        log_ctx = c->log->data;
+        log_ctx->current_request = r;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua ssl task %ui done", tctx->op);
+
+    ctx->cur_co_ctx = coctx;
+
+    if (ctx->entered_content_phase) {
+        (void) ngx_http_lua_ssl_task_resume(r);
+
+    } else {
+        ctx->resume_handler = ngx_http_lua_ssl_task_resume;
+        ngx_http_core_run_phases(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_lua_ssl_task_resume(ngx_http_request_t *r)
+{
+    lua_State                       *vm;
+    ngx_int_t                        rc;
+    ngx_connection_t                *c;
+    ngx_thread_task_t               *task;
+    ngx_http_lua_ctx_t              *ctx;
+    ngx_http_lua_co_ctx_t           *coctx;
+    ngx_http_lua_ssl_task_ctx_t     *tctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->resume_handler = ngx_http_lua_wev_handler;
+
+    coctx = ctx->cur_co_ctx;
+
+    task = coctx->data;
+    tctx = task->ctx;
+
+    coctx->data = NULL;
+
+    if (tctx->rc == NGX_OK) {
+        lua_pushlstring(coctx->co, (char *) tctx->out, tctx->out_len);
+        lua_pushnil(coctx->co);
+
+    } else {
+        lua_pushnil(coctx->co);
+        lua_pushstring(coctx->co, tctx->err ? tctx->err : "unknown error");
+    }
+
+    ngx_http_lua_ssl_task_free(task);
+
+    c = r->connection;
+    vm = ngx_http_lua_get_lua_vm(r, ctx);
+
+    rc = ngx_http_lua_run_thread(vm, r, ctx, 2);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua run thread returned %d", rc);
+
+    if (rc == NGX_AGAIN) {
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_http_lua_finalize_request(r, NGX_DONE);
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    }
+
+    /* rc == NGX_ERROR || rc >= NGX_OK */
+
+    if (ctx->entered_content_phase) {
+        ngx_http_lua_finalize_request(r, rc);
+        return NGX_DONE;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_lua_ssl_task_cleanup(void *data)
+{
+    ngx_http_lua_co_ctx_t           *coctx = data;
+    ngx_thread_task_t               *task;
+    ngx_http_lua_ssl_task_ctx_t     *tctx;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua ssl task cleanup");
+
+    task = coctx->data;
+    tctx = task->ctx;
+
+    /* the task cannot be canceled, it is freed once it completes */
+
+    tctx->wait_co_ctx = NULL;
+
+    coctx->data = NULL;
+    coctx->cleanup = NULL;
+}
+
+
+static void
+ngx_http_lua_ssl_task_free(ngx_thread_task_t *task)
+{
+    ngx_http_lua_ssl_task_ctx_t     *tctx;
+
+    tctx = task->ctx;
+
+    if (tctx->out) {
+        ngx_free(tctx->out);
+    }
+
+    ngx_free(task);
+}
+
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+
+static ngx_int_t
+ngx_http_lua_ssl_init_locks(ngx_log_t *log)
+{
+    int         i, n;
+
+    /*
+     * OpenSSL before 1.1.0 is only thread-safe with a locking callback,
+     * which nginx itself never installs
+     */
+
+    if (CRYPTO_get_locking_callback() != NULL) {
+        return NGX_OK;
+    }
+
+    n = CRYPTO_num_locks();
+
+    ngx_http_lua_ssl_locks = ngx_alloc(n * sizeof(ngx_thread_mutex_t), log);
+    if (ngx_http_lua_ssl_locks == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (ngx_thread_mutex_create(&ngx_http_lua_ssl_locks[i], log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    CRYPTO_set_locking_callback(ngx_http_lua_ssl_locking_callback);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_ssl_locking_callback(int mode, int n, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK) {
+        (void) ngx_thread_mutex_lock(&ngx_http_lua_ssl_locks[n],
+                                     ngx_cycle->log);
+
+    } else {
+        (void) ngx_thread_mutex_unlock(&ngx_http_lua_ssl_locks[n],
+                                       ngx_cycle->log);
+    }
+}
+
+#endif  /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+
+#endif  /* NGX_THREADS */
+
+
 #endif  /* NGX_LUA_NO_FFI_API */
 
 
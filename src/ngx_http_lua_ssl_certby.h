@@ -43,6 +43,9 @@ char *ngx_http_lua_ssl_cert_by_lua(ngx_conf_t *cf, ngx_command_t *cmd,
 
 int ngx_http_lua_ssl_cert_handler(ngx_ssl_conn_t *ssl_conn, void *data);
 
+char *ngx_http_lua_ssl_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
 
 #endif  /* NGX_HTTP_SSL */
 
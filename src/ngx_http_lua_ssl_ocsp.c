@@ -14,13 +14,28 @@
 
 
 #include "ngx_http_lua_common.h"
+#include "ngx_http_lua_shdict.h"
 
 
 #ifndef NGX_LUA_NO_FFI_API
 
 #ifdef NGX_HTTP_LUA_USE_OCSP
+static ngx_int_t ngx_http_lua_ssl_check_ocsp_response(const u_char *resp,
+    size_t resp_len, const char *chain_data, size_t chain_len,
+    u_char *errbuf, size_t *errbuf_size, time_t *next_update, u_char *id_buf,
+    size_t *id_len);
+static time_t ngx_http_lua_ssl_ocsp_time(ASN1_GENERALIZEDTIME *asn1time);
 static int ngx_http_lua_ssl_empty_status_callback(ngx_ssl_conn_t *ssl_conn,
     void *data);
+
+
+#define NGX_HTTP_LUA_OCSP_CACHE_PREFIX      "ocsp:"
+#define NGX_HTTP_LUA_OCSP_REFRESH_PREFIX    "ocsp-refresh:"
+#define NGX_HTTP_LUA_OCSP_MAX_ID_SIZE       128
+#define NGX_HTTP_LUA_OCSP_MAX_RESP_SIZE     16384
+
+/* used when the responder does not specify nextUpdate */
+#define NGX_HTTP_LUA_OCSP_DEFAULT_VALIDITY  3600
 #endif
 
 
@@ -268,7 +283,24 @@ ngx_http_lua_ffi_ssl_validate_ocsp_response(const u_char *resp,
 
 #else
 
+    return ngx_http_lua_ssl_check_ocsp_response(resp, resp_len, chain_data,
+                                                chain_len, errbuf,
+                                                errbuf_size, NULL, NULL,
+                                                NULL);
+
+#endif  /* NGX_HTTP_LUA_USE_OCSP */
+}
+
+
+#ifdef NGX_HTTP_LUA_USE_OCSP
+
+static ngx_int_t
+ngx_http_lua_ssl_check_ocsp_response(const u_char *resp, size_t resp_len,
+    const char *chain_data, size_t chain_len, u_char *errbuf,
+    size_t *errbuf_size, time_t *next_update, u_char *id_buf, size_t *id_len)
+{
     int                    n;
+    u_char                *p;
     BIO                   *bio = NULL;
     X509                  *cert = NULL, *issuer = NULL;
     OCSP_CERTID           *id = NULL;
@@ -379,6 +411,24 @@ ngx_http_lua_ffi_ssl_validate_ocsp_response(const u_char *resp,
         goto error;
     }
 
+    if (next_update) {
+        *next_update = nextupdate ? ngx_http_lua_ssl_ocsp_time(nextupdate)
+                                  : NGX_ERROR;
+    }
+
+    if (id_buf) {
+        n = i2d_OCSP_CERTID(id, NULL);
+
+        if (n <= 0 || (size_t) n > *id_len) {
+            *errbuf_size = ngx_snprintf(errbuf, *errbuf_size,
+                                        "i2d_OCSP_CERTID() failed") - errbuf;
+            goto error;
+        }
+
+        p = id_buf;
+        *id_len = i2d_OCSP_CERTID(id, &p);
+    }
+
     sk_X509_free(chain);
     X509_free(cert);
     X509_free(issuer);
@@ -422,18 +472,49 @@ error:
     ERR_clear_error();
 
     return NGX_ERROR;
+}
 
-#endif  /* NGX_HTTP_LUA_USE_OCSP */
+
+static time_t
+ngx_http_lua_ssl_ocsp_time(ASN1_GENERALIZEDTIME *asn1time)
+{
+    BIO     *bio;
+    char    *value;
+    size_t   len;
+    time_t   time;
+
+    /* same conversion as in nginx's own OCSP stapling code */
+
+    bio = BIO_new(BIO_s_mem());
+    if (bio == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* "Feb  3 00:55:52 2015 GMT" */
+
+    if (ASN1_GENERALIZEDTIME_print(bio, asn1time) != 1) {
+        BIO_free(bio);
+        ERR_clear_error();
+        return NGX_ERROR;
+    }
+
+    len = BIO_get_mem_data(bio, &value);
+
+    time = ngx_parse_http_time((u_char *) value, len);
+
+    BIO_free(bio);
+
+    return time;
 }
 
 
-#ifdef NGX_HTTP_LUA_USE_OCSP
 static int
 ngx_http_lua_ssl_empty_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
 {
     return SSL_TLSEXT_ERR_OK;
 }
-#endif
+
+#endif  /* NGX_HTTP_LUA_USE_OCSP */
 
 
 int
@@ -491,6 +572,295 @@ ngx_http_lua_ffi_ssl_set_ocsp_status_resp(ngx_http_request_t *r,
 #endif  /* NGX_HTTP_LUA_USE_OCSP */
 }
 
+
+int
+ngx_http_lua_ffi_ssl_ocsp_cert_id(const char *chain_data, size_t chain_len,
+    u_char *out, size_t *out_size, char **err)
+{
+#ifndef NGX_HTTP_LUA_USE_OCSP
+
+    *err = "no OCSP support";
+    return NGX_ERROR;
+
+#else
+
+    int             len;
+    BIO            *bio = NULL;
+    X509           *cert = NULL, *issuer = NULL;
+    OCSP_CERTID    *id;
+
+    bio = BIO_new_mem_buf((char *) chain_data, chain_len);
+    if (bio == NULL) {
+        *err = "BIO_new_mem_buf() failed";
+        goto failed;
+    }
+
+    cert = d2i_X509_bio(bio, NULL);
+    if (cert == NULL) {
+        *err = "d2i_X509_bio() failed";
+        goto failed;
+    }
+
+    if (BIO_eof(bio)) {
+        *err = "no issuer certificate in chain";
+        goto failed;
+    }
+
+    issuer = d2i_X509_bio(bio, NULL);
+    if (issuer == NULL) {
+        *err = "d2i_X509_bio() failed";
+        goto failed;
+    }
+
+    id = OCSP_cert_to_id(NULL, cert, issuer);
+    if (id == NULL) {
+        *err = "OCSP_cert_to_id() failed";
+        goto failed;
+    }
+
+    len = i2d_OCSP_CERTID(id, NULL);
+    if (len <= 0) {
+        OCSP_CERTID_free(id);
+        *err = "i2d_OCSP_CERTID() failed";
+        goto failed;
+    }
+
+    if ((size_t) len > *out_size) {
+        OCSP_CERTID_free(id);
+        *err = "output buffer too small";
+        *out_size = len;
+        goto failed;
+    }
+
+    *out_size = i2d_OCSP_CERTID(id, &out);
+
+    OCSP_CERTID_free(id);
+    X509_free(issuer);
+    X509_free(cert);
+    BIO_free(bio);
+
+    return NGX_OK;
+
+failed:
+
+    if (issuer) {
+        X509_free(issuer);
+    }
+
+    if (cert) {
+        X509_free(cert);
+    }
+
+    if (bio) {
+        BIO_free(bio);
+    }
+
+    ERR_clear_error();
+
+    return NGX_ERROR;
+
+#endif  /* NGX_HTTP_LUA_USE_OCSP */
+}
+
+
+int
+ngx_http_lua_ffi_ssl_ocsp_cache_store(ngx_shm_zone_t *zone,
+    const u_char *resp, size_t resp_len, const char *chain_data,
+    size_t chain_len, u_char *errbuf, size_t *errbuf_size)
+{
+#ifndef NGX_HTTP_LUA_USE_OCSP
+
+    *errbuf_size = ngx_snprintf(errbuf, *errbuf_size,
+                                "no OCSP support") - errbuf;
+    return NGX_ERROR;
+
+#else
+
+    int         forcible;
+    char       *errmsg;
+    u_char     *p;
+    size_t      id_len;
+    time_t      next_update, now, ttl;
+    ngx_int_t   rc;
+    u_char      key[sizeof(NGX_HTTP_LUA_OCSP_REFRESH_PREFIX) - 1
+                    + NGX_HTTP_LUA_OCSP_MAX_ID_SIZE];
+
+    if (resp_len > NGX_HTTP_LUA_OCSP_MAX_RESP_SIZE) {
+        *errbuf_size = ngx_snprintf(errbuf, *errbuf_size,
+                                    "OCSP response too large") - errbuf;
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key, NGX_HTTP_LUA_OCSP_CACHE_PREFIX,
+                   sizeof(NGX_HTTP_LUA_OCSP_CACHE_PREFIX) - 1);
+
+    id_len = NGX_HTTP_LUA_OCSP_MAX_ID_SIZE;
+
+    rc = ngx_http_lua_ssl_check_ocsp_response(resp, resp_len, chain_data,
+                                              chain_len, errbuf, errbuf_size,
+                                              &next_update, p, &id_len);
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    now = ngx_time();
+
+    if (next_update == NGX_ERROR) {
+        next_update = now + NGX_HTTP_LUA_OCSP_DEFAULT_VALIDITY;
+    }
+
+    if (next_update <= now) {
+        *errbuf_size = ngx_snprintf(errbuf, *errbuf_size,
+                                    "OCSP response expired") - errbuf;
+        return NGX_ERROR;
+    }
+
+    if (next_update > NGX_MAX_INT32_VALUE) {
+        *errbuf_size = ngx_snprintf(errbuf, *errbuf_size,
+                                    "OCSP response nextUpdate out of range")
+                       - errbuf;
+        return NGX_ERROR;
+    }
+
+    /* the response expires from the cache together with its nextUpdate,
+     * which is also kept in the user flags for the refresh check; the
+     * shdict takes the expire time in milliseconds as an int, so the
+     * responses valid for longer than that (like those of intermediate
+     * CAs) expire early and are refreshed by then */
+
+    ttl = next_update - now;
+
+    if (ttl > NGX_MAX_INT32_VALUE / 1000) {
+        ttl = NGX_MAX_INT32_VALUE / 1000;
+    }
+
+    errmsg = "no zone";
+
+    rc = ngx_http_lua_ffi_shdict_store(zone, 0, key, p - key + id_len,
+                                       LUA_TSTRING, (u_char *) resp,
+                                       resp_len, 0,
+                                       (int) ttl * 1000,
+                                       (int) next_update, &errmsg,
+                                       &forcible);
+    if (rc != NGX_OK) {
+        *errbuf_size = ngx_snprintf(errbuf, *errbuf_size,
+                                    "failed to cache OCSP response: %s",
+                                    errmsg) - errbuf;
+        return NGX_ERROR;
+    }
+
+    /* release the refresh lock, if any */
+
+    ngx_memmove(key + sizeof(NGX_HTTP_LUA_OCSP_REFRESH_PREFIX) - 1, p,
+                id_len);
+    p = ngx_cpymem(key, NGX_HTTP_LUA_OCSP_REFRESH_PREFIX,
+                   sizeof(NGX_HTTP_LUA_OCSP_REFRESH_PREFIX) - 1);
+
+    (void) ngx_http_lua_ffi_shdict_store(zone, 0, key, p - key + id_len,
+                                         LUA_TNIL, NULL, 0, 0, 0, 0, &errmsg,
+                                         &forcible);
+
+    return NGX_OK;
+
+#endif  /* NGX_HTTP_LUA_USE_OCSP */
+}
+
+
+int
+ngx_http_lua_ffi_ssl_ocsp_cache_staple(ngx_http_request_t *r,
+    ngx_shm_zone_t *zone, const u_char *id, size_t id_len, int refresh_ahead,
+    char **err)
+{
+#ifndef NGX_HTTP_LUA_USE_OCSP
+
+    *err = "no OCSP support";
+    return NGX_ERROR;
+
+#else
+
+    int             value_type, user_flags, is_stale, forcible;
+    char           *errmsg;
+    u_char         *p, *buf;
+    size_t          len;
+    double          num;
+    ngx_int_t       rc;
+    u_char          key[sizeof(NGX_HTTP_LUA_OCSP_REFRESH_PREFIX) - 1
+                        + NGX_HTTP_LUA_OCSP_MAX_ID_SIZE];
+
+    static u_char   resp[NGX_HTTP_LUA_OCSP_MAX_RESP_SIZE];
+
+    if (id_len > NGX_HTTP_LUA_OCSP_MAX_ID_SIZE) {
+        *err = "certificate ID too long";
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key, NGX_HTTP_LUA_OCSP_CACHE_PREFIX,
+                   sizeof(NGX_HTTP_LUA_OCSP_CACHE_PREFIX) - 1);
+    p = ngx_cpymem(p, id, id_len);
+
+    /* lock-free for dictionaries configured with l1_size= */
+
+    buf = resp;
+    len = sizeof(resp);
+
+    rc = ngx_http_lua_ffi_shdict_get(zone, key, p - key, &value_type, &buf,
+                                     &len, &num, &user_flags, 0, &is_stale);
+    if (rc != NGX_OK) {
+        *err = "failed to look up the OCSP cache";
+        return NGX_ERROR;
+    }
+
+    if (value_type != LUA_TSTRING) {
+        dd("ocsp cache miss");
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_lua_ffi_ssl_set_ocsp_status_resp(r, buf, len, err);
+
+    if (buf != resp) {
+        free(buf);
+    }
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (refresh_ahead <= 0
+        || (time_t) (uint32_t) user_flags - ngx_time() > refresh_ahead)
+    {
+        return rc;
+    }
+
+    /* the response is about to expire: let only one caller across all the
+     * workers refresh it until the new one is stored or the lock expires */
+
+    p = ngx_cpymem(key, NGX_HTTP_LUA_OCSP_REFRESH_PREFIX,
+                   sizeof(NGX_HTTP_LUA_OCSP_REFRESH_PREFIX) - 1);
+    p = ngx_cpymem(p, id, id_len);
+
+    errmsg = "no zone";
+
+    if (ngx_http_lua_ffi_shdict_store(zone, NGX_HTTP_LUA_SHDICT_ADD, key,
+                                      p - key, LUA_TBOOLEAN, NULL, 0, 1,
+                                      refresh_ahead * 1000, 0, &errmsg,
+                                      &forcible)
+        != NGX_OK)
+    {
+        dd("ocsp refresh lock not acquired: %s", errmsg);
+        return rc;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua ssl ocsp cache: response expires in %T seconds, "
+                   "refresh needed",
+                   (time_t) (uint32_t) user_flags - ngx_time());
+
+    return NGX_BUSY;
+
+#endif  /* NGX_HTTP_LUA_USE_OCSP */
+}
+
+
 #endif  /* NGX_LUA_NO_FFI_API */
 
 
@@ -79,6 +79,16 @@ static ngx_int_t ngx_http_post_request_to_head(ngx_http_request_t *r);
 static ngx_int_t ngx_http_lua_copy_in_file_request_body(ngx_http_request_t *r);
 static ngx_int_t ngx_http_lua_copy_request_headers(ngx_http_request_t *sr,
     ngx_http_request_t *r);
+static void ngx_http_lua_push_subreq_headers(lua_State *co,
+    ngx_http_headers_out_t *sr_headers);
+static void ngx_http_lua_subrequest_stream_done(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_int_t rc);
+static int ngx_http_lua_subrequest_stream_read(lua_State *L);
+static int ngx_http_lua_subrequest_stream_push_body(lua_State *L,
+    ngx_http_lua_subrequest_stream_t *st);
+static void ngx_http_lua_subrequest_stream_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_lua_subrequest_stream_resume(ngx_http_request_t *r);
+static void ngx_http_lua_subrequest_stream_cleanup(void *data);
 
 
 /* ngx.location.capture is just a thin wrapper around
@@ -145,9 +155,11 @@ ngx_http_lua_ngx_location_capture_multi(lua_State *L)
     size_t                           sr_flags_len;
     size_t                           ofs1, ofs2;
     unsigned                         custom_ctx;
+    unsigned                         stream;
     ngx_http_lua_co_ctx_t           *coctx;
 
     ngx_http_lua_post_subrequest_data_t      *psr_data;
+    ngx_http_lua_subrequest_stream_t         *st = NULL;
 
     n = lua_gettop(L);
     if (n != 1) {
@@ -255,6 +267,8 @@ ngx_http_lua_ngx_location_capture_multi(lua_State *L)
 
         custom_ctx = 0;
 
+        stream = 0;
+
         if (nargs == 2) {
             /* check out the options table */
 
@@ -377,6 +391,17 @@ ngx_http_lua_ngx_location_capture_multi(lua_State *L)
 
             dd("always foward body: %d", always_forward_body);
 
+            /* check the "stream" option */
+
+            lua_getfield(L, 4, "stream");
+            stream = lua_toboolean(L, -1);
+            lua_pop(L, 1);
+
+            if (stream && nsubreqs != 1) {
+                return luaL_error(L, "the stream option is not allowed for "
+                                  "multiple subrequests");
+            }
+
             /* check the "method" option */
 
             lua_getfield(L, 4, "method");
@@ -591,6 +616,26 @@ ngx_http_lua_ngx_location_capture_multi(lua_State *L)
                               (int) rc);
         }
 
+        if (stream) {
+            st = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_subrequest_stream_t));
+            if (st == NULL) {
+                ngx_http_lua_cancel_subreq(sr);
+                return luaL_error(L, "no memory");
+            }
+
+            st->request = sr;
+            st->last_pending = &st->pending;
+
+            st->event.handler = ngx_http_lua_subrequest_stream_handler;
+            st->event.data = st;
+            st->event.log = r->connection->log;
+
+            st->next = ctx->streams;
+            ctx->streams = st;
+
+            sr_ctx->stream = st;
+        }
+
         dd("queries query uri opts ctx? %d", lua_gettop(L));
 
         /* stack: queries query uri ctx? */
@@ -610,6 +655,18 @@ ngx_http_lua_ngx_location_capture_multi(lua_State *L)
         ngx_array_destroy(extra_vars);
     }
 
+    if (st) {
+        /* wait for the response header only */
+
+        coctx->pending_subreqs = 0;
+
+        ngx_http_lua_cleanup_pending_operation(coctx);
+        coctx->cleanup = ngx_http_lua_subrequest_stream_cleanup;
+        coctx->data = st;
+
+        st->wait_co_ctx = coctx;
+    }
+
     ctx->no_abort = 1;
 
     return lua_yield(L, 0);
@@ -975,6 +1032,11 @@ ngx_http_lua_post_subrequest(ngx_http_request_t *r, void *data, ngx_int_t rc)
         return NGX_ERROR;
     }
 
+    if (ctx->stream) {
+        ngx_http_lua_subrequest_stream_done(r, ctx, rc);
+        goto done;
+    }
+
     pr_coctx = psr_data->pr_co_ctx;
     pr_coctx->pending_subreqs--;
 
@@ -1081,6 +1143,8 @@ ngx_http_lua_post_subrequest(ngx_http_request_t *r, void *data, ngx_int_t rc)
 
     ngx_http_post_request_to_head(pr);
 
+done:
+
     if (r != r->connection->data) {
         r->connection->data = r;
     }
@@ -1216,17 +1280,11 @@ static void
 ngx_http_lua_handle_subreq_responses(ngx_http_request_t *r,
     ngx_http_lua_ctx_t *ctx)
 {
-    ngx_uint_t                   i, count;
     ngx_uint_t                   index;
     lua_State                   *co;
     ngx_str_t                   *body_str;
-    ngx_table_elt_t             *header;
-    ngx_list_part_t             *part;
-    ngx_http_headers_out_t      *sr_headers;
     ngx_http_lua_co_ctx_t       *coctx;
 
-    u_char                  buf[sizeof("Mon, 28 Sep 1970 06:00:00 GMT") - 1];
-
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua handle subrequest responses");
 
@@ -1273,147 +1331,159 @@ ngx_http_lua_handle_subreq_responses(ngx_http_request_t *r,
 
         /* copy captured headers */
 
-        sr_headers = coctx->sr_headers[index];
+        ngx_http_lua_push_subreq_headers(co, coctx->sr_headers[index]);
 
-        part = &sr_headers->headers.part;
-        count = part->nelts;
-        while (part->next) {
-            part = part->next;
-            count += part->nelts;
-        }
+        lua_setfield(co, -2, "header");
+
+        /*  }}} */
+    }
+}
+
+
+static void
+ngx_http_lua_push_subreq_headers(lua_State *co,
+    ngx_http_headers_out_t *sr_headers)
+{
+    ngx_uint_t                   i, count;
+    ngx_table_elt_t             *header;
+    ngx_list_part_t             *part;
+
+    u_char                  buf[sizeof("Mon, 28 Sep 1970 06:00:00 GMT") - 1];
 
-        lua_createtable(co, 0, count + 5); /* res.header */
+    part = &sr_headers->headers.part;
+    count = part->nelts;
+    while (part->next) {
+        part = part->next;
+        count += part->nelts;
+    }
 
-        dd("saving subrequest response headers");
+    lua_createtable(co, 0, count + 5); /* res.header */
 
-        part = &sr_headers->headers.part;
-        header = part->elts;
+    dd("saving subrequest response headers");
 
-        for (i = 0; /* void */; i++) {
+    part = &sr_headers->headers.part;
+    header = part->elts;
 
-            if (i >= part->nelts) {
-                if (part->next == NULL) {
-                    break;
-                }
+    for (i = 0; /* void */; i++) {
 
-                part = part->next;
-                header = part->elts;
-                i = 0;
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
             }
 
-            dd("checking sr header %.*s", (int) header[i].key.len,
-               header[i].key.data);
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        dd("checking sr header %.*s", (int) header[i].key.len,
+           header[i].key.data);
 
 #if 1
-            if (header[i].hash == 0) {
-                continue;
-            }
+        if (header[i].hash == 0) {
+            continue;
+        }
 #endif
 
-            header[i].hash = 0;
+        header[i].hash = 0;
 
-            dd("pushing sr header %.*s", (int) header[i].key.len,
-               header[i].key.data);
+        dd("pushing sr header %.*s", (int) header[i].key.len,
+           header[i].key.data);
 
-            lua_pushlstring(co, (char *) header[i].key.data,
-                            header[i].key.len); /* header key */
-            lua_pushvalue(co, -1); /* stack: table key key */
+        lua_pushlstring(co, (char *) header[i].key.data,
+                        header[i].key.len); /* header key */
+        lua_pushvalue(co, -1); /* stack: table key key */
 
-            /* check if header already exists */
-            lua_rawget(co, -3); /* stack: table key value */
+        /* check if header already exists */
+        lua_rawget(co, -3); /* stack: table key value */
 
-            if (lua_isnil(co, -1)) {
-                lua_pop(co, 1); /* stack: table key */
+        if (lua_isnil(co, -1)) {
+            lua_pop(co, 1); /* stack: table key */
 
-                lua_pushlstring(co, (char *) header[i].value.data,
-                                header[i].value.len);
-                    /* stack: table key value */
+            lua_pushlstring(co, (char *) header[i].value.data,
+                            header[i].value.len);
+                /* stack: table key value */
 
-                lua_rawset(co, -3); /* stack: table */
+            lua_rawset(co, -3); /* stack: table */
 
-            } else {
+        } else {
 
-                if (!lua_istable(co, -1)) { /* already inserted one value */
-                    lua_createtable(co, 4, 0);
-                        /* stack: table key value table */
+            if (!lua_istable(co, -1)) { /* already inserted one value */
+                lua_createtable(co, 4, 0);
+                    /* stack: table key value table */
 
-                    lua_insert(co, -2); /* stack: table key table value */
-                    lua_rawseti(co, -2, 1); /* stack: table key table */
+                lua_insert(co, -2); /* stack: table key table value */
+                lua_rawseti(co, -2, 1); /* stack: table key table */
 
-                    lua_pushlstring(co, (char *) header[i].value.data,
-                                    header[i].value.len);
-                        /* stack: table key table value */
+                lua_pushlstring(co, (char *) header[i].value.data,
+                                header[i].value.len);
+                    /* stack: table key table value */
 
-                    lua_rawseti(co, -2, lua_objlen(co, -2) + 1);
-                        /* stack: table key table */
+                lua_rawseti(co, -2, lua_objlen(co, -2) + 1);
+                    /* stack: table key table */
 
-                    lua_rawset(co, -3); /* stack: table */
+                lua_rawset(co, -3); /* stack: table */
 
-                } else {
-                    lua_pushlstring(co, (char *) header[i].value.data,
-                                    header[i].value.len);
-                        /* stack: table key table value */
+            } else {
+                lua_pushlstring(co, (char *) header[i].value.data,
+                                header[i].value.len);
+                    /* stack: table key table value */
 
-                    lua_rawseti(co, -2, lua_objlen(co, -2) + 1);
-                        /* stack: table key table */
+                lua_rawseti(co, -2, lua_objlen(co, -2) + 1);
+                    /* stack: table key table */
 
-                    lua_pop(co, 2); /* stack: table */
-                }
+                lua_pop(co, 2); /* stack: table */
             }
         }
+    }
 
-        if (sr_headers->content_type.len) {
-            lua_pushliteral(co, "Content-Type"); /* header key */
-            lua_pushlstring(co, (char *) sr_headers->content_type.data,
-                            sr_headers->content_type.len); /* head key value */
-            lua_rawset(co, -3); /* head */
-        }
-
-        if (sr_headers->content_length == NULL
-            && sr_headers->content_length_n >= 0)
-        {
-            lua_pushliteral(co, "Content-Length"); /* header key */
-
-            lua_pushnumber(co, (lua_Number) sr_headers->content_length_n);
-                /* head key value */
+    if (sr_headers->content_type.len) {
+        lua_pushliteral(co, "Content-Type"); /* header key */
+        lua_pushlstring(co, (char *) sr_headers->content_type.data,
+                        sr_headers->content_type.len); /* head key value */
+        lua_rawset(co, -3); /* head */
+    }
 
-            lua_rawset(co, -3); /* head */
-        }
+    if (sr_headers->content_length == NULL
+        && sr_headers->content_length_n >= 0)
+    {
+        lua_pushliteral(co, "Content-Length"); /* header key */
 
-        /* to work-around an issue in ngx_http_static_module
-         * (github issue #41) */
-        if (sr_headers->location && sr_headers->location->value.len) {
-            lua_pushliteral(co, "Location"); /* header key */
-            lua_pushlstring(co, (char *) sr_headers->location->value.data,
-                            sr_headers->location->value.len);
+        lua_pushnumber(co, (lua_Number) sr_headers->content_length_n);
             /* head key value */
-            lua_rawset(co, -3); /* head */
-        }
 
-        if (sr_headers->last_modified_time != -1) {
-            if (sr_headers->status != NGX_HTTP_OK
-                && sr_headers->status != NGX_HTTP_PARTIAL_CONTENT
-                && sr_headers->status != NGX_HTTP_NOT_MODIFIED
-                && sr_headers->status != NGX_HTTP_NO_CONTENT)
-            {
-                sr_headers->last_modified_time = -1;
-                sr_headers->last_modified = NULL;
-            }
-        }
+        lua_rawset(co, -3); /* head */
+    }
 
-        if (sr_headers->last_modified == NULL
-            && sr_headers->last_modified_time != -1)
-        {
-            (void) ngx_http_time(buf, sr_headers->last_modified_time);
+    /* to work-around an issue in ngx_http_static_module
+     * (github issue #41) */
+    if (sr_headers->location && sr_headers->location->value.len) {
+        lua_pushliteral(co, "Location"); /* header key */
+        lua_pushlstring(co, (char *) sr_headers->location->value.data,
+                        sr_headers->location->value.len);
+        /* head key value */
+        lua_rawset(co, -3); /* head */
+    }
 
-            lua_pushliteral(co, "Last-Modified"); /* header key */
-            lua_pushlstring(co, (char *) buf, sizeof(buf)); /* head key value */
-            lua_rawset(co, -3); /* head */
+    if (sr_headers->last_modified_time != -1) {
+        if (sr_headers->status != NGX_HTTP_OK
+            && sr_headers->status != NGX_HTTP_PARTIAL_CONTENT
+            && sr_headers->status != NGX_HTTP_NOT_MODIFIED
+            && sr_headers->status != NGX_HTTP_NO_CONTENT)
+        {
+            sr_headers->last_modified_time = -1;
+            sr_headers->last_modified = NULL;
         }
+    }
 
-        lua_setfield(co, -2, "header");
+    if (sr_headers->last_modified == NULL
+        && sr_headers->last_modified_time != -1)
+    {
+        (void) ngx_http_time(buf, sr_headers->last_modified_time);
 
-        /*  }}} */
+        lua_pushliteral(co, "Last-Modified"); /* header key */
+        lua_pushlstring(co, (char *) buf, sizeof(buf)); /* head key value */
+        lua_rawset(co, -3); /* head */
     }
 }
 
@@ -1646,6 +1716,375 @@ ngx_http_lua_subrequest_resume(ngx_http_request_t *r)
 }
 
 
+static void
+ngx_http_lua_subrequest_stream_done(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_int_t rc)
+{
+    ngx_http_lua_subrequest_stream_t    *st;
+
+    st = ctx->stream;
+
+    st->done = 1;
+
+    if (!ctx->seen_last_for_subreq) {
+        st->truncated = 1;
+    }
+
+    if (!st->header_ready) {
+        st->status = r->headers_out.status;
+
+        if (st->status == 0) {
+            if (rc == NGX_OK) {
+                rc = NGX_HTTP_OK;
+            }
+
+            if (rc == NGX_ERROR) {
+                rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            if (rc >= 100) {
+                st->status = rc;
+            }
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua subrequest stream done, status:%i truncated:%d",
+                   st->status, (int) st->truncated);
+
+    ngx_http_lua_subrequest_stream_wakeup(st);
+}
+
+
+void
+ngx_http_lua_subrequest_stream_wakeup(ngx_http_lua_subrequest_stream_t *st)
+{
+    if (st->wait_co_ctx == NULL) {
+        return;
+    }
+
+    if (st->header_returned) {
+        if (st->pending == NULL && !st->done) {
+            return;
+        }
+
+    } else if (!st->header_ready && !st->done) {
+        return;
+    }
+
+#if defined(nginx_version) && nginx_version >= 1007005
+    if (!st->event.posted) {
+#else
+    if (st->event.prev == NULL) {
+#endif
+        ngx_post_event(&st->event, &ngx_posted_events);
+    }
+}
+
+
+void
+ngx_http_lua_discard_subrequest_streams(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx)
+{
+    ngx_chain_t                         *cl;
+    ngx_http_lua_subrequest_stream_t    *st;
+
+    for (st = ctx->streams; st; st = st->next) {
+        if (st->done || st->discard) {
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua discarding the unread response body of "
+                       "subrequest \"%V\"", &st->request->uri);
+
+        st->discard = 1;
+
+        for (cl = st->pending; cl; cl = cl->next) {
+            cl->buf->pos = cl->buf->last;
+            cl->buf->file_pos = cl->buf->file_last;
+        }
+
+        st->pending = NULL;
+        st->last_pending = &st->pending;
+
+        if (st->blocked) {
+            st->blocked = 0;
+            (void) ngx_http_post_request(st->request, NULL);
+        }
+    }
+
+    ctx->streams = NULL;
+}
+
+
+static int
+ngx_http_lua_subrequest_stream_read(lua_State *L)
+{
+    int                                  n;
+    ngx_http_request_t                  *r;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_lua_co_ctx_t               *coctx;
+    ngx_http_lua_subrequest_stream_t    *st;
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    if (r != lua_touserdata(L, lua_upvalueindex(1))) {
+        return luaL_error(L, "bad request");
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return luaL_error(L, "no ctx found");
+    }
+
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_REWRITE
+                               | NGX_HTTP_LUA_CONTEXT_ACCESS
+                               | NGX_HTTP_LUA_CONTEXT_CONTENT);
+
+    st = lua_touserdata(L, lua_upvalueindex(2));
+
+    n = ngx_http_lua_subrequest_stream_push_body(L, st);
+    if (n) {
+        return n;
+    }
+
+    if (st->wait_co_ctx) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "stream busy reading");
+        return 2;
+    }
+
+    coctx = ctx->cur_co_ctx;
+    if (coctx == NULL) {
+        return luaL_error(L, "no co ctx found");
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua subrequest stream waiting for more data from \"%V\"",
+                   &st->request->uri);
+
+    ngx_http_lua_cleanup_pending_operation(coctx);
+    coctx->cleanup = ngx_http_lua_subrequest_stream_cleanup;
+    coctx->data = st;
+
+    st->wait_co_ctx = coctx;
+
+    ctx->no_abort = 1;
+
+    return lua_yield(L, 0);
+}
+
+
+/* pushes all the pending response body data as a single string, or nil
+ * (plus "truncated" or "discarded") at the end of the body; returns 0 if
+ * there is nothing to return yet */
+static int
+ngx_http_lua_subrequest_stream_push_body(lua_State *L,
+    ngx_http_lua_subrequest_stream_t *st)
+{
+    ngx_chain_t             *cl, *next;
+    luaL_Buffer              b;
+
+    if (st->discard) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "discarded");
+        return 2;
+    }
+
+    if (st->pending == NULL) {
+        if (!st->done) {
+            return 0;
+        }
+
+        lua_pushnil(L);
+
+        if (st->truncated) {
+            lua_pushliteral(L, "truncated");
+            return 2;
+        }
+
+        return 1;
+    }
+
+    luaL_buffinit(L, &b);
+
+    for (cl = st->pending; cl; cl = next) {
+        next = cl->next;
+
+        luaL_addlstring(&b, (char *) cl->buf->pos,
+                        cl->buf->last - cl->buf->pos);
+
+        /* hand the buffer back to the subrequest */
+
+        cl->buf->pos = cl->buf->last;
+        cl->buf->file_pos = cl->buf->file_last;
+
+        ngx_free_chain(st->request->pool, cl);
+    }
+
+    luaL_pushresult(&b);
+
+    st->pending = NULL;
+    st->last_pending = &st->pending;
+
+    if (st->blocked) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, st->request->connection->log, 0,
+                       "lua subrequest stream resuming subrequest \"%V\"",
+                       &st->request->uri);
+
+        st->blocked = 0;
+        (void) ngx_http_post_request(st->request, NULL);
+    }
+
+    return 1;
+}
+
+
+static void
+ngx_http_lua_subrequest_stream_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                    *c;
+    ngx_http_request_t                  *r;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_log_ctx_t                  *log_ctx;
+    ngx_http_lua_co_ctx_t               *coctx;
+    ngx_http_lua_subrequest_stream_t    *st;
+
+    st = ev->data;
+
+    coctx = st->wait_co_ctx;
+    if (coctx == NULL) {
+        return;
+    }
+
+    r = st->request->parent;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return;
+    }
+
+    log_ctx = c->log->data;
+    log_ctx->current_request = r;
+
+    st->wait_co_ctx = NULL;
+    coctx->cleanup = NULL;
+
+    ctx->no_abort = 0;
+    ctx->cur_co_ctx = coctx;
+
+    if (ctx->entered_content_phase) {
+        (void) ngx_http_lua_subrequest_stream_resume(r);
+
+    } else {
+        ctx->resume_handler = ngx_http_lua_subrequest_stream_resume;
+        ngx_http_core_run_phases(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_lua_subrequest_stream_resume(ngx_http_request_t *r)
+{
+    int                                  nret;
+    lua_State                           *vm;
+    lua_State                           *co;
+    ngx_int_t                            rc;
+    ngx_connection_t                    *c;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_lua_co_ctx_t               *coctx;
+    ngx_http_lua_subrequest_stream_t    *st;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->resume_handler = ngx_http_lua_wev_handler;
+
+    coctx = ctx->cur_co_ctx;
+    co = coctx->co;
+    st = coctx->data;
+
+    if (st->header_returned) {
+        nret = ngx_http_lua_subrequest_stream_push_body(co, st);
+
+    } else {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua subrequest stream got the response header of "
+                       "\"%V\"", &st->request->uri);
+
+        st->header_returned = 1;
+
+        lua_createtable(co, 0 /* narr */, 3 /* nrec */);
+
+        lua_pushinteger(co, st->status);
+        lua_setfield(co, -2, "status");
+
+        ngx_http_lua_push_subreq_headers(co, &st->request->headers_out);
+        lua_setfield(co, -2, "header");
+
+        lua_pushlightuserdata(co, r);
+        lua_pushlightuserdata(co, st);
+        lua_pushcclosure(co, ngx_http_lua_subrequest_stream_read, 2);
+        lua_setfield(co, -2, "read");
+
+        nret = 1;
+    }
+
+    c = r->connection;
+    vm = ngx_http_lua_get_lua_vm(r, ctx);
+
+    rc = ngx_http_lua_run_thread(vm, r, ctx, nret);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua run thread returned %d", rc);
+
+    if (rc == NGX_AGAIN) {
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_http_lua_finalize_request(r, NGX_DONE);
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    }
+
+    if (ctx->entered_content_phase) {
+        ngx_http_lua_finalize_request(r, rc);
+        return NGX_DONE;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_lua_subrequest_stream_cleanup(void *data)
+{
+    ngx_http_lua_co_ctx_t               *coctx = data;
+    ngx_http_lua_subrequest_stream_t    *st;
+
+    st = coctx->data;
+
+    st->wait_co_ctx = NULL;
+
+#if defined(nginx_version) && nginx_version >= 1007005
+    if (st->event.posted) {
+#else
+    if (st->event.prev) {
+#endif
+        ngx_delete_posted_event(&st->event);
+    }
+}
+
+
 static void
 ngx_http_lua_cancel_subreq(ngx_http_request_t *r)
 {
@@ -15,6 +15,10 @@
 void ngx_http_lua_inject_subrequest_api(lua_State *L);
 ngx_int_t ngx_http_lua_post_subrequest(ngx_http_request_t *r, void *data,
     ngx_int_t rc);
+void ngx_http_lua_subrequest_stream_wakeup(
+    ngx_http_lua_subrequest_stream_t *st);
+void ngx_http_lua_discard_subrequest_streams(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx);
 
 
 extern ngx_str_t  ngx_http_lua_get_method;
@@ -41,6 +45,34 @@ typedef struct ngx_http_lua_post_subrequest_data_s {
 } ngx_http_lua_post_subrequest_data_t;
 
 
+struct ngx_http_lua_subrequest_stream_s {
+    ngx_http_request_t                  *request; /* the subrequest */
+    ngx_http_lua_co_ctx_t               *wait_co_ctx; /* the coroutine
+                                                         waiting on this
+                                                         stream */
+    ngx_http_lua_subrequest_stream_t    *next;
+
+    ngx_chain_t                         *pending; /* response body buffers
+                                                     not yet read, still
+                                                     owned by the
+                                                     subrequest */
+    ngx_chain_t                        **last_pending;
+
+    ngx_event_t                          event; /* resumes wait_co_ctx */
+
+    ngx_int_t                            status;
+
+    unsigned                             header_ready:1;
+    unsigned                             header_returned:1;
+    unsigned                             blocked:1; /* the subrequest waits
+                                                       for pending to be
+                                                       read */
+    unsigned                             done:1;
+    unsigned                             truncated:1;
+    unsigned                             discard:1;
+};
+
+
 #endif /* _NGX_HTTP_LUA_SUBREQUEST_H_INCLUDED_ */
 
 /* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -14,6 +14,7 @@
 #include "ngx_http_lua_util.h"
 #include "ngx_http_lua_contentby.h"
 #include "ngx_http_lua_probe.h"
+#include "ngx_http_lua_logbuf.h"
 
 
 typedef struct {
@@ -36,13 +37,30 @@ typedef struct {
     ngx_http_lua_main_conf_t          *lmcf;
     ngx_http_lua_vm_state_t           *vm_state;
 
+    /* for the recurring timers created by ngx.timer.every only */
+    ngx_msec_t                         interval;
+    ngx_msec_t                         deadline;
+    int                                fn_ref;  /* entry function & args */
+    int                                nargs;
+    unsigned                           running:1;
+    unsigned                           exiting:1;
+
 } ngx_http_lua_timer_ctx_t;
 
 
 static int ngx_http_lua_ngx_timer_at(lua_State *L);
+static int ngx_http_lua_ngx_timer_every(lua_State *L);
 static int ngx_http_lua_ngx_timer_running_count(lua_State *L);
 static int ngx_http_lua_ngx_timer_pending_count(lua_State *L);
+static int ngx_http_lua_ngx_timer_pool_stats(lua_State *L);
+static ngx_int_t ngx_http_lua_timer_create_watcher(
+    ngx_http_lua_main_conf_t *lmcf);
 static void ngx_http_lua_timer_handler(ngx_event_t *ev);
+static void ngx_http_lua_timer_every_handler(ngx_event_t *ev);
+static void ngx_http_lua_timer_every_tick(ngx_http_lua_timer_ctx_t *tctx);
+static void ngx_http_lua_timer_every_cleanup(void *data);
+static void ngx_http_lua_timer_every_free(ngx_http_lua_timer_ctx_t *tctx);
+static void ngx_http_lua_timer_run(ngx_http_lua_timer_ctx_t *tctx);
 static u_char *ngx_http_lua_log_timer_error(ngx_log_t *log, u_char *buf,
     size_t len);
 static void ngx_http_lua_abort_pending_timers(ngx_event_t *ev);
@@ -51,17 +69,23 @@ static void ngx_http_lua_abort_pending_timers(ngx_event_t *ev);
 void
 ngx_http_lua_inject_timer_api(lua_State *L)
 {
-    lua_createtable(L, 0 /* narr */, 3 /* nrec */);    /* ngx.timer. */
+    lua_createtable(L, 0 /* narr */, 5 /* nrec */);    /* ngx.timer. */
 
     lua_pushcfunction(L, ngx_http_lua_ngx_timer_at);
     lua_setfield(L, -2, "at");
 
+    lua_pushcfunction(L, ngx_http_lua_ngx_timer_every);
+    lua_setfield(L, -2, "every");
+
     lua_pushcfunction(L, ngx_http_lua_ngx_timer_running_count);
     lua_setfield(L, -2, "running_count");
 
     lua_pushcfunction(L, ngx_http_lua_ngx_timer_pending_count);
     lua_setfield(L, -2, "pending_count");
 
+    lua_pushcfunction(L, ngx_http_lua_ngx_timer_pool_stats);
+    lua_setfield(L, -2, "pool_stats");
+
     lua_setfield(L, -2, "timer");
 }
 
@@ -104,6 +128,34 @@ ngx_http_lua_ngx_timer_pending_count(lua_State *L)
 }
 
 
+static int
+ngx_http_lua_ngx_timer_pool_stats(lua_State *L)
+{
+    ngx_http_request_t          *r;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request");
+    }
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    lua_createtable(L, 0 /* narr */, 3 /* nrec */);
+
+    lua_pushinteger(L, (lua_Integer) lmcf->fake_pools_free);
+    lua_setfield(L, -2, "free");
+
+    lua_pushnumber(L, (lua_Number) lmcf->fake_pools_created);
+    lua_setfield(L, -2, "created");
+
+    lua_pushnumber(L, (lua_Number) lmcf->fake_pools_reused);
+    lua_setfield(L, -2, "reused");
+
+    return 1;
+}
+
+
 static int
 ngx_http_lua_ngx_timer_at(lua_State *L)
 {
@@ -114,7 +166,6 @@ ngx_http_lua_ngx_timer_at(lua_State *L)
     ngx_msec_t               delay;
     ngx_event_t             *ev = NULL;
     ngx_http_request_t      *r;
-    ngx_connection_t        *saved_c = NULL;
     ngx_http_lua_ctx_t      *ctx;
 #if 0
     ngx_http_connection_t   *hc;
@@ -158,32 +209,8 @@ ngx_http_lua_ngx_timer_at(lua_State *L)
         return 2;
     }
 
-    if (lmcf->watcher == NULL) {
-        /* create the watcher fake connection */
-
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "lua creating fake watcher connection");
-
-        if (ngx_cycle->files) {
-            saved_c = ngx_cycle->files[0];
-        }
-
-        lmcf->watcher = ngx_get_connection(0, ngx_cycle->log);
-
-        if (ngx_cycle->files) {
-            ngx_cycle->files[0] = saved_c;
-        }
-
-        if (lmcf->watcher == NULL) {
-            return luaL_error(L, "no memory");
-        }
-
-        /* to work around the -1 check in ngx_worker_process_cycle: */
-        lmcf->watcher->fd = (ngx_socket_t) -2;
-
-        lmcf->watcher->idle = 1;
-        lmcf->watcher->read->handler = ngx_http_lua_abort_pending_timers;
-        lmcf->watcher->data = lmcf;
+    if (ngx_http_lua_timer_create_watcher(lmcf) != NGX_OK) {
+        return luaL_error(L, "no memory");
     }
 
     vm = ngx_http_lua_get_lua_vm(r, ctx);
@@ -251,8 +278,11 @@ ngx_http_lua_ngx_timer_at(lua_State *L)
         /* co stack: func [args] */
     }
 
-    p = ngx_alloc(sizeof(ngx_event_t) + sizeof(ngx_http_lua_timer_ctx_t),
-                  r->connection->log);
+    /* the pool for the fake request is only taken when the timer expires,
+     * so we keep a copy of the client address along with the event */
+
+    p = ngx_alloc(sizeof(ngx_event_t) + sizeof(ngx_http_lua_timer_ctx_t)
+                  + r->connection->addr_text.len, r->connection->log);
     if (p == NULL) {
         goto nomem;
     }
@@ -265,6 +295,10 @@ ngx_http_lua_ngx_timer_at(lua_State *L)
 
     tctx = (ngx_http_lua_timer_ctx_t *) p;
 
+    ngx_memzero(tctx, sizeof(ngx_http_lua_timer_ctx_t));
+
+    p += sizeof(ngx_http_lua_timer_ctx_t);
+
     tctx->premature = 0;
     tctx->co_ref = co_ref;
     tctx->co = co;
@@ -273,11 +307,6 @@ ngx_http_lua_ngx_timer_at(lua_State *L)
     tctx->loc_conf = r->loc_conf;
     tctx->lmcf = lmcf;
 
-    tctx->pool = ngx_create_pool(128, ngx_cycle->log);
-    if (tctx->pool == NULL) {
-        goto nomem;
-    }
-
     if (r->connection) {
         tctx->listening = r->connection->listening;
 
@@ -286,15 +315,11 @@ ngx_http_lua_ngx_timer_at(lua_State *L)
     }
 
     if (r->connection->addr_text.len) {
-        tctx->client_addr_text.data = ngx_palloc(tctx->pool,
-                                                 r->connection->addr_text.len);
-        if (tctx->client_addr_text.data == NULL) {
-            goto nomem;
-        }
+        tctx->client_addr_text.data = p;
+        tctx->client_addr_text.len = r->connection->addr_text.len;
 
-        ngx_memcpy(tctx->client_addr_text.data, r->connection->addr_text.data,
+        ngx_memcpy(p, r->connection->addr_text.data,
                    r->connection->addr_text.len);
-        tctx->client_addr_text.len = r->connection->addr_text.len;
 
     } else {
         tctx->client_addr_text.len = 0;
@@ -322,10 +347,6 @@ ngx_http_lua_ngx_timer_at(lua_State *L)
 
 nomem:
 
-    if (tctx && tctx->pool) {
-        ngx_destroy_pool(tctx->pool);
-    }
-
     if (ev) {
         ngx_free(ev);
     }
@@ -338,8 +359,433 @@ nomem:
 }
 
 
+static int
+ngx_http_lua_ngx_timer_every(lua_State *L)
+{
+    int                      nargs, i;
+    u_char                  *p;
+    lua_Number               interval;
+    ngx_event_t             *ev;
+    ngx_http_request_t      *r;
+    ngx_http_lua_ctx_t      *ctx;
+
+    ngx_http_lua_timer_ctx_t      *tctx;
+    ngx_http_lua_main_conf_t      *lmcf;
+
+    nargs = lua_gettop(L);
+    if (nargs < 2) {
+        return luaL_error(L, "expecting at least 2 arguments but got %d",
+                          nargs);
+    }
+
+    interval = luaL_checknumber(L, 1) * 1000;
+
+    luaL_argcheck(L, interval >= 1, 1, "interval must be at least 0.001");
+
+    luaL_argcheck(L, lua_isfunction(L, 2) && !lua_iscfunction(L, 2), 2,
+                  "Lua function expected");
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request");
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    if (ngx_exiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "process exiting");
+        return 2;
+    }
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    /* a recurring timer takes exactly one pending slot for its lifetime */
+
+    if (lmcf->pending_timers >= lmcf->max_pending_timers) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "too many pending timers");
+        return 2;
+    }
+
+    if (ngx_http_lua_timer_create_watcher(lmcf) != NGX_OK) {
+        return luaL_error(L, "no memory");
+    }
+
+    /* the event and the timer context live as long as the timer itself,
+     * i.e., until the worker process exits */
+
+    p = ngx_alloc(sizeof(ngx_event_t) + sizeof(ngx_http_lua_timer_ctx_t)
+                  + r->connection->addr_text.len, r->connection->log);
+    if (p == NULL) {
+        return luaL_error(L, "no memory");
+    }
+
+    ev = (ngx_event_t *) p;
+
+    ngx_memzero(ev, sizeof(ngx_event_t));
+
+    p += sizeof(ngx_event_t);
+
+    tctx = (ngx_http_lua_timer_ctx_t *) p;
+
+    ngx_memzero(tctx, sizeof(ngx_http_lua_timer_ctx_t));
+
+    p += sizeof(ngx_http_lua_timer_ctx_t);
+
+    /* save the entry function and the user arguments for all the ticks */
+
+    lua_createtable(L, nargs - 1, 0);
+    lua_insert(L, 2);
+
+    /* L stack: interval args_tb func [args] */
+
+    for (i = nargs - 1; i >= 1; i--) {
+        lua_rawseti(L, 2, i);
+    }
+
+    /* L stack: interval args_tb */
+
+    lua_pushlightuserdata(L, &ngx_http_lua_coroutines_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_insert(L, -2);
+
+    /* L stack: interval coroutines args_tb */
+
+    tctx->fn_ref = luaL_ref(L, -2);
+    lua_pop(L, 1);
+
+    tctx->nargs = nargs - 1;
+
+    /* the event ident */
+    tctx->co_ref = tctx->fn_ref;
+
+    tctx->main_conf = r->main_conf;
+    tctx->srv_conf = r->srv_conf;
+    tctx->loc_conf = r->loc_conf;
+    tctx->lmcf = lmcf;
+    tctx->listening = r->connection->listening;
+
+    if (r->connection->addr_text.len) {
+        tctx->client_addr_text.data = p;
+        tctx->client_addr_text.len = r->connection->addr_text.len;
+
+        ngx_memcpy(p, r->connection->addr_text.data,
+                   r->connection->addr_text.len);
+    }
+
+    if (ctx && ctx->vm_state) {
+        tctx->vm_state = ctx->vm_state;
+        tctx->vm_state->count++;
+    }
+
+    tctx->interval = (ngx_msec_t) interval;
+    tctx->deadline = ngx_current_msec + tctx->interval;
+
+    ev->handler = ngx_http_lua_timer_every_handler;
+    ev->data = tctx;
+    ev->log = ngx_cycle->log;
+
+    lmcf->pending_timers++;
+
+    ngx_add_timer(ev, tctx->interval);
+
+    lua_pushinteger(L, 1);
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_lua_timer_create_watcher(ngx_http_lua_main_conf_t *lmcf)
+{
+    ngx_connection_t        *saved_c = NULL;
+
+    if (lmcf->watcher) {
+        return NGX_OK;
+    }
+
+    /* create the watcher fake connection */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua creating fake watcher connection");
+
+    if (ngx_cycle->files) {
+        saved_c = ngx_cycle->files[0];
+    }
+
+    lmcf->watcher = ngx_get_connection(0, ngx_cycle->log);
+
+    if (ngx_cycle->files) {
+        ngx_cycle->files[0] = saved_c;
+    }
+
+    if (lmcf->watcher == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* to work around the -1 check in ngx_worker_process_cycle: */
+    lmcf->watcher->fd = (ngx_socket_t) -2;
+
+    lmcf->watcher->idle = 1;
+    lmcf->watcher->read->handler = ngx_http_lua_abort_pending_timers;
+    lmcf->watcher->data = lmcf;
+
+    return NGX_OK;
+}
+
+
 static void
 ngx_http_lua_timer_handler(ngx_event_t *ev)
+{
+    u_char                        *p;
+    ngx_http_lua_timer_ctx_t       tctx;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua ngx.timer expired");
+
+    ngx_memcpy(&tctx, ev->data, sizeof(ngx_http_lua_timer_ctx_t));
+
+    tctx.lmcf->pending_timers--;
+
+    tctx.pool = ngx_http_lua_get_fake_pool(ngx_cycle->log);
+
+    if (tctx.pool && tctx.client_addr_text.len) {
+        p = ngx_pnalloc(tctx.pool, tctx.client_addr_text.len);
+        if (p == NULL) {
+            ngx_http_lua_free_fake_pool(tctx.pool);
+            tctx.pool = NULL;
+
+        } else {
+            ngx_memcpy(p, tctx.client_addr_text.data,
+                       tctx.client_addr_text.len);
+            tctx.client_addr_text.data = p;
+        }
+    }
+
+    ngx_free(ev);
+    ev = NULL;
+
+    ngx_http_lua_timer_run(&tctx);
+}
+
+
+static void
+ngx_http_lua_timer_every_handler(ngx_event_t *ev)
+{
+    ngx_msec_t                     now;
+    ngx_http_lua_timer_ctx_t      *tctx;
+
+    tctx = ev->data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua ngx.timer.every expired: premature=%d running=%d",
+                   tctx->premature, tctx->running);
+
+    if (tctx->premature) {
+        /* the worker is shutting down: run the callback one last time
+         * (unless it is still busy with the last tick) and release the
+         * timer when that run is over */
+
+        tctx->exiting = 1;
+
+        if (tctx->running) {
+            return;
+        }
+
+        ngx_http_lua_timer_every_tick(tctx);
+        return;
+    }
+
+    /* schedule the next tick against the absolute deadline so that the
+     * callback's run time and the event loop latency do not accumulate,
+     * and skip the ticks we have already missed altogether */
+
+    now = ngx_current_msec;
+
+    tctx->deadline += tctx->interval;
+
+    if ((ngx_msec_int_t) (tctx->deadline - now) <= 0) {
+        tctx->deadline += ((now - tctx->deadline) / tctx->interval + 1)
+                          * tctx->interval;
+    }
+
+    ngx_add_timer(ev, tctx->deadline - now);
+
+    if (tctx->running) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "lua ngx.timer.every skipping a tick because the "
+                       "previous one is still running");
+        return;
+    }
+
+    ngx_http_lua_timer_every_tick(tctx);
+}
+
+
+static void
+ngx_http_lua_timer_every_tick(ngx_http_lua_timer_ctx_t *tctx)
+{
+    int                      i;
+    lua_State               *vm;  /* the main thread */
+    lua_State               *co;
+    ngx_pool_cleanup_t      *cln;
+
+    ngx_http_lua_timer_ctx_t      tick;
+
+    ngx_memcpy(&tick, tctx, sizeof(ngx_http_lua_timer_ctx_t));
+
+    tick.co_ref = LUA_NOREF;
+    tick.co = NULL;
+
+    tick.pool = ngx_http_lua_get_fake_pool(ngx_cycle->log);
+    if (tick.pool == NULL) {
+        goto nomem;
+    }
+
+    cln = ngx_pool_cleanup_add(tick.pool, 0);
+    if (cln == NULL) {
+        ngx_http_lua_free_fake_pool(tick.pool);
+        goto nomem;
+    }
+
+    /* from now on, the timer is released from the "running" state whenever
+     * the pool is released, either by the fake connection or below */
+
+    cln->handler = ngx_http_lua_timer_every_cleanup;
+    cln->data = tctx;
+
+    tctx->running = 1;
+
+    if (tctx->vm_state) {
+        tctx->vm_state->count++;
+        vm = tctx->vm_state->vm;
+
+    } else {
+        vm = tctx->lmcf->lua;
+    }
+
+    if (tctx->client_addr_text.len) {
+        tick.client_addr_text.data = ngx_pnalloc(tick.pool,
+                                                 tctx->client_addr_text.len);
+        if (tick.client_addr_text.data == NULL) {
+            goto failed;
+        }
+
+        ngx_memcpy(tick.client_addr_text.data, tctx->client_addr_text.data,
+                   tctx->client_addr_text.len);
+    }
+
+    co = lua_newthread(vm);
+
+    /* vm stack: thread */
+
+    lua_createtable(co, 0, 0);  /* the new globals table */
+
+    /* co stack: global_tb */
+
+    lua_createtable(co, 0, 1);  /* the metatable */
+    ngx_http_lua_get_globals_table(co);
+    lua_setfield(co, -2, "__index");
+    lua_setmetatable(co, -2);
+
+    /* co stack: global_tb */
+
+    ngx_http_lua_set_globals_table(co);
+
+    /* co stack: <empty> */
+
+    lua_pushlightuserdata(vm, &ngx_http_lua_coroutines_key);
+    lua_rawget(vm, LUA_REGISTRYINDEX);
+    lua_pushvalue(vm, -2);
+
+    /* vm stack: thread coroutines thread */
+
+    tick.co_ref = luaL_ref(vm, -2);
+    tick.co = co;
+
+    lua_rawgeti(vm, -1, tctx->fn_ref);
+
+    /* vm stack: thread coroutines args_tb */
+
+    for (i = 1; i <= tctx->nargs; i++) {
+        lua_rawgeti(vm, -1, i);
+        lua_xmove(vm, co, 1);
+
+        if (i == 1) {
+            /* co stack: func */
+
+            ngx_http_lua_get_globals_table(co);
+            lua_setfenv(co, -2);
+        }
+    }
+
+    lua_pop(vm, 3);
+
+    /* co stack: func [args] */
+
+    ngx_http_lua_timer_run(&tick);
+    return;
+
+failed:
+
+    if (tick.vm_state) {
+        ngx_http_lua_cleanup_vm(tick.vm_state);
+    }
+
+    ngx_http_lua_free_fake_pool(tick.pool);
+    return;
+
+nomem:
+
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                  "lua ngx.timer.every failed to run the callback: no memory");
+
+    if (tctx->exiting) {
+        ngx_http_lua_timer_every_free(tctx);
+    }
+}
+
+
+static void
+ngx_http_lua_timer_every_cleanup(void *data)
+{
+    ngx_http_lua_timer_ctx_t      *tctx = data;
+
+    tctx->running = 0;
+
+    if (tctx->exiting) {
+        ngx_http_lua_timer_every_free(tctx);
+    }
+}
+
+
+static void
+ngx_http_lua_timer_every_free(ngx_http_lua_timer_ctx_t *tctx)
+{
+    lua_State               *vm;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua ngx.timer.every freeing the timer");
+
+    vm = tctx->vm_state ? tctx->vm_state->vm : tctx->lmcf->lua;
+
+    lua_pushlightuserdata(vm, &ngx_http_lua_coroutines_key);
+    lua_rawget(vm, LUA_REGISTRYINDEX);
+    luaL_unref(vm, -1, tctx->fn_ref);
+    lua_pop(vm, 1);
+
+    if (tctx->vm_state) {
+        ngx_http_lua_cleanup_vm(tctx->vm_state);
+    }
+
+    tctx->lmcf->pending_timers--;
+
+    ngx_free((u_char *) tctx - sizeof(ngx_event_t));
+}
+
+
+static void
+ngx_http_lua_timer_run(ngx_http_lua_timer_ctx_t *tctx)
 {
     int                      n;
     lua_State               *L;
@@ -350,20 +796,14 @@ ngx_http_lua_timer_handler(ngx_event_t *ev)
     ngx_http_cleanup_t      *cln;
     ngx_pool_cleanup_t      *pcln;
 
-    ngx_http_lua_timer_ctx_t         tctx;
     ngx_http_lua_main_conf_t        *lmcf;
     ngx_http_core_loc_conf_t        *clcf;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "lua ngx.timer expired");
-
-    ngx_memcpy(&tctx, ev->data, sizeof(ngx_http_lua_timer_ctx_t));
-    ngx_free(ev);
-    ev = NULL;
-
-    lmcf = tctx.lmcf;
+    lmcf = tctx->lmcf;
 
-    lmcf->pending_timers--;
+    if (tctx->pool == NULL) {
+        goto failed;
+    }
 
     if (lmcf->running_timers >= lmcf->max_running_timers) {
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
@@ -372,7 +812,7 @@ ngx_http_lua_timer_handler(ngx_event_t *ev)
         goto failed;
     }
 
-    c = ngx_http_lua_create_fake_connection(tctx.pool);
+    c = ngx_http_lua_create_fake_connection(tctx->pool);
     if (c == NULL) {
         goto failed;
     }
@@ -380,17 +820,17 @@ ngx_http_lua_timer_handler(ngx_event_t *ev)
     c->log->handler = ngx_http_lua_log_timer_error;
     c->log->data = c;
 
-    c->listening = tctx.listening;
-    c->addr_text = tctx.client_addr_text;
+    c->listening = tctx->listening;
+    c->addr_text = tctx->client_addr_text;
 
     r = ngx_http_lua_create_fake_request(c);
     if (r == NULL) {
         goto failed;
     }
 
-    r->main_conf = tctx.main_conf;
-    r->srv_conf = tctx.srv_conf;
-    r->loc_conf = tctx.loc_conf;
+    r->main_conf = tctx->main_conf;
+    r->srv_conf = tctx->srv_conf;
+    r->loc_conf = tctx->loc_conf;
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
@@ -423,8 +863,8 @@ ngx_http_lua_timer_handler(ngx_event_t *ev)
         goto failed;
     }
 
-    if (tctx.vm_state) {
-        ctx->vm_state = tctx.vm_state;
+    if (tctx->vm_state) {
+        ctx->vm_state = tctx->vm_state;
 
         pcln = ngx_pool_cleanup_add(r->pool, 0);
         if (pcln == NULL) {
@@ -432,7 +872,7 @@ ngx_http_lua_timer_handler(ngx_event_t *ev)
         }
 
         pcln->handler = ngx_http_lua_cleanup_vm;
-        pcln->data = tctx.vm_state;
+        pcln->data = tctx->vm_state;
     }
 
     ctx->cur_co_ctx = &ctx->entry_co_ctx;
@@ -453,22 +893,22 @@ ngx_http_lua_timer_handler(ngx_event_t *ev)
 
     r->read_event_handler = ngx_http_block_reading;
 
-    ctx->cur_co_ctx->co_ref = tctx.co_ref;
-    ctx->cur_co_ctx->co = tctx.co;
+    ctx->cur_co_ctx->co_ref = tctx->co_ref;
+    ctx->cur_co_ctx->co = tctx->co;
     ctx->cur_co_ctx->co_status = NGX_HTTP_LUA_CO_RUNNING;
 
     dd("r connection: %p, log %p", r->connection, r->connection->log);
 
     /*  save the request in coroutine globals table */
-    ngx_http_lua_set_req(tctx.co, r);
+    ngx_http_lua_set_req(tctx->co, r);
 
     lmcf->running_timers++;
 
-    lua_pushboolean(tctx.co, tctx.premature);
+    lua_pushboolean(tctx->co, tctx->premature);
 
-    n = lua_gettop(tctx.co);
+    n = lua_gettop(tctx->co);
     if (n > 2) {
-        lua_insert(tctx.co, 2);
+        lua_insert(tctx->co, 2);
     }
 
 #ifdef NGX_LUA_USE_ASSERT
@@ -497,22 +937,22 @@ ngx_http_lua_timer_handler(ngx_event_t *ev)
 
 failed:
 
-    if (tctx.co_ref && tctx.co) {
-        lua_pushlightuserdata(tctx.co, &ngx_http_lua_coroutines_key);
-        lua_rawget(tctx.co, LUA_REGISTRYINDEX);
-        luaL_unref(tctx.co, -1, tctx.co_ref);
-        lua_settop(tctx.co, 0);
+    if (tctx->co_ref && tctx->co) {
+        lua_pushlightuserdata(tctx->co, &ngx_http_lua_coroutines_key);
+        lua_rawget(tctx->co, LUA_REGISTRYINDEX);
+        luaL_unref(tctx->co, -1, tctx->co_ref);
+        lua_settop(tctx->co, 0);
     }
 
-    if (tctx.vm_state) {
-        ngx_http_lua_cleanup_vm(tctx.vm_state);
+    if (tctx->vm_state) {
+        ngx_http_lua_cleanup_vm(tctx->vm_state);
     }
 
     if (c) {
         ngx_http_lua_close_fake_connection(c);
 
-    } else if (tctx.pool) {
-        ngx_destroy_pool(tctx.pool);
+    } else if (tctx->pool) {
+        ngx_http_lua_free_fake_pool(tctx->pool);
     }
 }
 
@@ -594,6 +1034,9 @@ ngx_http_lua_abort_pending_timers(ngx_event_t *ev)
         ngx_cycle->files[0] = saved_c;
     }
 
+    /* let the lua_log_buffer flusher ship the remaining records now */
+    ngx_http_lua_logbuf_wakeup(lmcf);
+
     if (lmcf->pending_timers == 0) {
         return;
     }
@@ -640,7 +1083,9 @@ ngx_http_lua_abort_pending_timers(ngx_event_t *ev)
                 ev = (ngx_event_t *)
                     ((char *) cur - offsetof(ngx_event_t, timer));
 
-                if (ev->handler == ngx_http_lua_timer_handler) {
+                if (ev->handler == ngx_http_lua_timer_handler
+                    || ev->handler == ngx_http_lua_timer_every_handler)
+                {
                     dd("found node: %p", cur);
                     events[n++] = ev;
                 }
@@ -654,7 +1099,9 @@ ngx_http_lua_abort_pending_timers(ngx_event_t *ev)
             ev = (ngx_event_t *)
                 ((char *) cur - offsetof(ngx_event_t, timer));
 
-            if (ev->handler == ngx_http_lua_timer_handler) {
+            if (ev->handler == ngx_http_lua_timer_handler
+                || ev->handler == ngx_http_lua_timer_every_handler)
+            {
                 dd("found node 2: %p", cur);
                 events[n++] = ev;
             }
@@ -46,6 +46,8 @@
 #include "ngx_http_lua_uthread.h"
 #include "ngx_http_lua_contentby.h"
 #include "ngx_http_lua_timer.h"
+#include "ngx_http_lua_logbuf.h"
+#include "ngx_http_lua_bundle.h"
 #include "ngx_http_lua_config.h"
 #include "ngx_http_lua_worker.h"
 #include "ngx_http_lua_socket_tcp.h"
@@ -68,11 +70,26 @@
 #endif
 
 
+/* the fake requests (for timers and etc.) usually fit in a single pool block
+ * of this size, which keeps their pools cheap to recycle */
+#ifndef NGX_HTTP_LUA_FAKE_POOL_SIZE
+#define NGX_HTTP_LUA_FAKE_POOL_SIZE  4096
+#endif
+
+
+#ifndef NGX_HTTP_LUA_FAKE_POOL_MAX_BLOCKS
+#define NGX_HTTP_LUA_FAKE_POOL_MAX_BLOCKS  4
+#endif
+
+
 char ngx_http_lua_code_cache_key;
-char ngx_http_lua_regex_cache_key;
 char ngx_http_lua_socket_pool_key;
 char ngx_http_lua_coroutines_key;
 char ngx_http_lua_headers_metatable_key;
+char ngx_http_lua_pinned_strs_key;
+char ngx_http_lua_env_metatable_key;
+char ngx_http_lua_phase_envs_key;
+char ngx_http_lua_logbuf_key;
 
 
 ngx_uint_t  ngx_http_lua_location_hash = 0;
@@ -185,6 +202,115 @@ ngx_http_lua_create_new_globals_table(lua_State *L, int narr, int nrec)
 }
 
 
+/**
+ * Create new globals table inheriting the main thread's globals table
+ * through a new metatable {__index = _G}, so that the Lua code changing
+ * the metatable of its _G only affects its own run.
+ *
+ * After:
+ *         | new table | <- top
+ *         |    ...    |
+ * */
+void
+ngx_http_lua_create_new_env_table(lua_State *L, int narr, int nrec)
+{
+    ngx_http_lua_create_new_globals_table(L, narr, nrec);
+
+    lua_createtable(L, 0, 1 /* nrec */);
+    ngx_http_lua_get_globals_table(L);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+}
+
+
+/**
+ * Push the env table for a Lua handler run without yielding on L, that is,
+ * header_filter_by_lua*, body_filter_by_lua*, and log_by_lua*. With
+ * lua_reuse_phase_env on, the env is taken from a per-VM pool and must be
+ * given back by ngx_http_lua_release_phase_env() once the handler returns.
+ * Handlers may nest (a subrequest's output running through its parent's
+ * filters), so the pool is used as a stack.
+ *
+ * After:
+ *         | env table | <- top
+ *         |    ...    |
+ * */
+void
+ngx_http_lua_push_phase_env(lua_State *L, ngx_http_request_t *r)
+{
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    if (!lmcf->reuse_phase_env) {
+        ngx_http_lua_create_new_env_table(L, 0 /* narr */, 1 /* nrec */);
+        return;
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_phase_envs_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_rawgeti(L, -1, (int) ++lmcf->phase_envs_used);  /* stack: envs env */
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);  /* stack: envs */
+
+        /* the pooled envs share a single metatable {__index = _G} */
+
+        ngx_http_lua_create_new_globals_table(L, 0 /* narr */, 1 /* nrec */);
+        lua_pushlightuserdata(L, &ngx_http_lua_env_metatable_key);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        lua_setmetatable(L, -2);
+
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, (int) lmcf->phase_envs_used);
+    }
+
+    lua_remove(L, -2);  /* stack: env */
+}
+
+
+void
+ngx_http_lua_release_phase_env(lua_State *L, ngx_http_request_t *r)
+{
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    if (!lmcf->reuse_phase_env || lmcf->phase_envs_used == 0) {
+        return;
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_phase_envs_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_rawgeti(L, -1, (int) lmcf->phase_envs_used--);  /* stack: envs env */
+
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        return;
+    }
+
+    /* clear all the globals set by the handler */
+
+    lua_pushnil(L);  /* stack: envs env key */
+    while (lua_next(L, -2) != 0) {  /* stack: envs env key value */
+        lua_pop(L, 1);  /* stack: envs env key */
+        lua_pushvalue(L, -1);  /* stack: envs env key key */
+        lua_pushnil(L);  /* stack: envs env key key nil */
+        lua_rawset(L, -4);  /* stack: envs env key */
+    }
+
+    lua_pushliteral(L, "_G");
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -3);  /* env._G = env */
+
+    lua_pushlightuserdata(L, &ngx_http_lua_env_metatable_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    lua_pop(L, 2);
+}
+
+
 static lua_State *
 ngx_http_lua_new_state(lua_State *parent_vm, ngx_cycle_t *cycle,
     ngx_http_lua_main_conf_t *lmcf, ngx_log_t *log)
@@ -291,6 +417,10 @@ ngx_http_lua_new_state(lua_State *parent_vm, ngx_cycle_t *cycle,
         }
     }
 
+    if (lmcf->bundles) {
+        ngx_http_lua_bundle_inject_loader(L, lmcf);
+    }
+
     lua_pop(L, 1); /* remove the "package" table */
 
     ngx_http_lua_init_registry(L, log);
@@ -321,12 +451,7 @@ ngx_http_lua_new_thread(ngx_http_request_t *r, lua_State *L, int *ref)
      *  globals table.
      */
     /*  new globals table for coroutine */
-    ngx_http_lua_create_new_globals_table(co, 0, 0);
-
-    lua_createtable(co, 0, 1);
-    ngx_http_lua_get_globals_table(co);
-    lua_setfield(co, -2, "__index");
-    lua_setmetatable(co, -2);
+    ngx_http_lua_create_new_env_table(co, 0, 0);
 
     ngx_http_lua_set_globals_table(co);
     /*  }}} */
@@ -615,6 +740,10 @@ ngx_http_lua_output_filter(ngx_http_request_t *r, ngx_chain_t *in)
                             &ctx->free_bufs, &ctx->busy_bufs, &in,
                             (ngx_buf_tag_t) &ngx_http_lua_module);
 
+    if (ctx->pinned_strs) {
+        ngx_http_lua_release_pinned_strs(r, ctx, 0 /* all */);
+    }
+
     return rc;
 }
 
@@ -681,12 +810,35 @@ ngx_http_lua_init_registry(lua_State *L, ngx_log_t *log)
     lua_createtable(L, 0, 8 /* nrec */);
     lua_rawset(L, LUA_REGISTRYINDEX);
 
-#if (NGX_PCRE)
-    /* create the registry entry for the Lua precompiled regex object cache */
-    lua_pushlightuserdata(L, &ngx_http_lua_regex_cache_key);
-    lua_createtable(L, 0, 16 /* nrec */);
+    /* {{{ register a table to anchor the Lua strings sent by ngx.print
+     * and ngx.say without copying: {([int]ref) = [string]} */
+    lua_pushlightuserdata(L, &ngx_http_lua_pinned_strs_key);
+    lua_createtable(L, 0, 8 /* nrec */);
     lua_rawset(L, LUA_REGISTRYINDEX);
-#endif
+    /* }}} */
+
+    /* {{{ register the metatable shared by the env tables pooled when
+     * lua_reuse_phase_env is on: {__index = _G} */
+    lua_pushlightuserdata(L, &ngx_http_lua_env_metatable_key);
+    lua_createtable(L, 0, 1 /* nrec */);
+    ngx_http_lua_get_globals_table(L);
+    lua_setfield(L, -2, "__index");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    /* }}} */
+
+    /* {{{ register a table to pool the env tables of the Lua handlers
+     * when lua_reuse_phase_env is on: {([int]depth) = [env]} */
+    lua_pushlightuserdata(L, &ngx_http_lua_phase_envs_key);
+    lua_createtable(L, 4 /* narr */, 0);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    /* }}} */
+
+    /* {{{ register the ring of records appended to lua_log_buffer:
+     * {([int]slot) = [record]} */
+    lua_pushlightuserdata(L, &ngx_http_lua_logbuf_key);
+    lua_createtable(L, 0, 0);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    /* }}} */
 
     /* {{{ register table to cache user code:
      * { [(string)cache_key] = <code closure> } */
@@ -719,12 +871,13 @@ static void
 ngx_http_lua_inject_ngx_api(lua_State *L, ngx_http_lua_main_conf_t *lmcf,
     ngx_log_t *log)
 {
-    lua_createtable(L, 0 /* narr */, 116 /* nrec */);    /* ngx.* */
+    lua_createtable(L, 0 /* narr */, 118 /* nrec */);    /* ngx.* */
 
     lua_pushcfunction(L, ngx_http_lua_get_raw_phase_context);
     lua_setfield(L, -2, "_phase_ctx");
 
     ngx_http_lua_inject_arg_api(L);
+    ngx_http_lua_inject_chain_api(L);
 
     ngx_http_lua_inject_http_consts(L);
     ngx_http_lua_inject_core_consts(L);
@@ -751,6 +904,7 @@ ngx_http_lua_inject_ngx_api(lua_State *L, ngx_http_lua_main_conf_t *lmcf,
     ngx_http_lua_inject_socket_udp_api(log, L);
     ngx_http_lua_inject_uthread_api(log, L);
     ngx_http_lua_inject_timer_api(L);
+    ngx_http_lua_inject_logbuf_api(L);
     ngx_http_lua_inject_config_api(L);
     ngx_http_lua_inject_worker_api(L);
 
@@ -1480,6 +1634,10 @@ no_parent:
 
 done:
 
+    if (ctx->streams) {
+        ngx_http_lua_discard_subrequest_streams(r, ctx);
+    }
+
     if (ctx->entered_content_phase
         && r->connection->fd != (ngx_socket_t) -1)
     {
@@ -3124,6 +3282,10 @@ ngx_http_lua_finalize_threads(ngx_http_request_t *r,
     top = lua_gettop(L);
 #endif
 
+    if (ctx->streams) {
+        ngx_http_lua_discard_subrequest_streams(r, ctx);
+    }
+
 #if 1
     coctx = ctx->on_abort_co_ctx;
     if (coctx && coctx->co_ref != LUA_NOREF) {
@@ -3697,7 +3859,7 @@ ngx_http_lua_close_fake_connection(ngx_connection_t *c)
     }
 
     if (pool) {
-        ngx_destroy_pool(pool);
+        ngx_http_lua_free_fake_pool(pool);
     }
 }
 
@@ -3823,7 +3985,7 @@ ngx_http_lua_create_fake_connection(ngx_pool_t *pool)
         c->pool = pool;
 
     } else {
-        c->pool = ngx_create_pool(128, c->log);
+        c->pool = ngx_http_lua_get_fake_pool(c->log);
         if (c->pool == NULL) {
             goto failed;
         }
@@ -3864,6 +4026,119 @@ failed:
 }
 
 
+ngx_pool_t *
+ngx_http_lua_get_fake_pool(ngx_log_t *log)
+{
+    ngx_pool_t                  *pool;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_module);
+
+    if (lmcf && lmcf->fake_pools_free) {
+        pool = lmcf->fake_pools[--lmcf->fake_pools_free];
+        pool->log = log;
+
+        lmcf->fake_pools_reused++;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http lua reusing fake pool %p", pool);
+
+        return pool;
+    }
+
+    pool = ngx_create_pool(NGX_HTTP_LUA_FAKE_POOL_SIZE, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    if (lmcf) {
+        lmcf->fake_pools_created++;
+    }
+
+    return pool;
+}
+
+
+void
+ngx_http_lua_free_fake_pool(ngx_pool_t *pool)
+{
+    ngx_uint_t                   n;
+    ngx_pool_t                  *p;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    /* run the cleanup handlers just as ngx_destroy_pool() does */
+
+    for (cln = pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler) {
+            ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
+                           "run cleanup: %p", cln);
+            cln->handler(cln->data);
+        }
+    }
+
+    pool->cleanup = NULL;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_module);
+
+    if (lmcf == NULL || ngx_exiting || ngx_quit || ngx_terminate
+        || lmcf->fake_pools_free >= (ngx_uint_t) lmcf->max_running_timers)
+    {
+        goto destroy;
+    }
+
+    /* do not keep the pools grown too much by the user code around */
+
+    n = 0;
+
+    for (p = pool; p; p = p->d.next) {
+        if (++n > NGX_HTTP_LUA_FAKE_POOL_MAX_BLOCKS) {
+            goto destroy;
+        }
+    }
+
+    if (lmcf->fake_pools == NULL) {
+        lmcf->fake_pools = ngx_palloc(ngx_cycle->pool,
+                                      lmcf->max_running_timers
+                                      * sizeof(ngx_pool_t *));
+        if (lmcf->fake_pools == NULL) {
+            goto destroy;
+        }
+    }
+
+    ngx_reset_pool(pool);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pool->log, 0,
+                   "http lua caching fake pool %p", pool);
+
+    lmcf->fake_pools[lmcf->fake_pools_free++] = pool;
+    return;
+
+destroy:
+
+    ngx_destroy_pool(pool);
+}
+
+
+void
+ngx_http_lua_destroy_fake_pools(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf)
+{
+    ngx_pool_t          *pool;
+
+    while (lmcf->fake_pools_free) {
+        pool = lmcf->fake_pools[--lmcf->fake_pools_free];
+
+        /* the log the pool was last used with may be long gone */
+        pool->log = cycle->log;
+
+        ngx_destroy_pool(pool);
+    }
+}
+
+
 ngx_http_request_t *
 ngx_http_lua_create_fake_request(ngx_connection_t *c)
 {
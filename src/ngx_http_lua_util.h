@@ -41,10 +41,6 @@ extern char ngx_http_lua_code_cache_key;
 #define ngx_http_lua_ctx_tables_key  "ngx_lua_ctx_tables"
 
 
-/* char whose address we use as the key in Lua vm registry for
- * regex cache table  */
-extern char ngx_http_lua_regex_cache_key;
-
 /* char whose address we use as the key in Lua vm registry for
  * socket connection pool table */
 extern char ngx_http_lua_socket_pool_key;
@@ -58,6 +54,18 @@ extern char ngx_http_lua_coroutines_key;
 /* key to the metatable for ngx.req.get_headers() and ngx.resp.get_headers() */
 extern char ngx_http_lua_headers_metatable_key;
 
+/* key in Lua vm registry for the Lua strings referenced by output bufs */
+extern char ngx_http_lua_pinned_strs_key;
+
+/* key to the metatable shared by the pooled env tables: {__index = _G} */
+extern char ngx_http_lua_env_metatable_key;
+
+/* key in Lua vm registry for the pooled envs of lua_reuse_phase_env */
+extern char ngx_http_lua_phase_envs_key;
+
+/* key in Lua vm registry for the records buffered by lua_log_buffer */
+extern char ngx_http_lua_logbuf_key;
+
 
 #ifndef ngx_str_set
 #define ngx_str_set(str, text)                                               \
@@ -188,6 +196,12 @@ ngx_chain_t *ngx_http_lua_chain_get_free_buf(ngx_log_t *log, ngx_pool_t *p,
 
 void ngx_http_lua_create_new_globals_table(lua_State *L, int narr, int nrec);
 
+void ngx_http_lua_create_new_env_table(lua_State *L, int narr, int nrec);
+
+void ngx_http_lua_push_phase_env(lua_State *L, ngx_http_request_t *r);
+
+void ngx_http_lua_release_phase_env(lua_State *L, ngx_http_request_t *r);
+
 int ngx_http_lua_traceback(lua_State *L);
 
 ngx_http_lua_co_ctx_t *ngx_http_lua_get_co_ctx(lua_State *L,
@@ -228,6 +242,13 @@ void ngx_http_lua_cleanup_vm(void *data);
 
 ngx_connection_t *ngx_http_lua_create_fake_connection(ngx_pool_t *pool);
 
+ngx_pool_t *ngx_http_lua_get_fake_pool(ngx_log_t *log);
+
+void ngx_http_lua_free_fake_pool(ngx_pool_t *pool);
+
+void ngx_http_lua_destroy_fake_pools(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf);
+
 ngx_http_request_t *ngx_http_lua_create_fake_request(ngx_connection_t *c);
 
 ngx_int_t ngx_http_lua_report(ngx_log_t *log, lua_State *L, int status,
@@ -364,6 +385,15 @@ ngx_http_lua_set_globals_table(lua_State *L)
 }
 
 
+/* the number of bytes currently allocated by the Lua VM */
+static ngx_inline size_t
+ngx_http_lua_gc_size(lua_State *L)
+{
+    return (size_t) lua_gc(L, LUA_GCCOUNT, 0) * 1024
+           + (size_t) lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+
 #define ngx_http_lua_hash_literal(s)                                        \
     ngx_http_lua_hash_str((u_char *) s, sizeof(s) - 1)
 
@@ -13,10 +13,13 @@
 
 #include "ngx_http_lua_variable.h"
 #include "ngx_http_lua_util.h"
+#include "ngx_http_lua_headers_in.h"
 
 
 static int ngx_http_lua_var_get(lua_State *L);
 static int ngx_http_lua_var_set(lua_State *L);
+static ngx_int_t ngx_http_lua_var_get_header(ngx_http_request_t *r,
+    u_char *lowcase, size_t len, ngx_str_t *value);
 
 
 void
@@ -114,6 +117,20 @@ ngx_http_lua_var_get(lua_State *L)
 
     hash = ngx_hash_strlow(lowcase, p, len);
 
+    switch (ngx_http_lua_var_get_header(r, lowcase, len, &name)) {
+
+    case NGX_OK:
+        lua_pushlstring(L, (const char *) name.data, name.len);
+        return 1;
+
+    case NGX_DECLINED:
+        lua_pushnil(L);
+        return 1;
+
+    default: /* NGX_DONE */
+        break;
+    }
+
     name.len = len;
     name.data = lowcase;
 
@@ -286,6 +303,42 @@ ngx_http_lua_var_set(lua_State *L)
 }
 
 
+/* looks up $http_NAME in the per-request index of the request headers;
+ * returns NGX_DONE for other variables and for multi-value headers, whose
+ * values are joined by nginx itself */
+static ngx_int_t
+ngx_http_lua_var_get_header(ngx_http_request_t *r, u_char *lowcase,
+    size_t len, ngx_str_t *value)
+{
+    ngx_uint_t           next;
+    ngx_table_elt_t     *h;
+
+    if (len <= sizeof("http_") - 1
+        || ngx_strncmp(lowcase, "http_", sizeof("http_") - 1) != 0)
+    {
+        return NGX_DONE;
+    }
+
+    lowcase += sizeof("http_") - 1;
+    len -= sizeof("http_") - 1;
+
+    next = 0;
+
+    h = ngx_http_lua_find_input_header(r, lowcase, len, &next);
+    if (h == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_lua_find_input_header(r, lowcase, len, &next) != NULL) {
+        return NGX_DONE;
+    }
+
+    *value = h->value;
+
+    return NGX_OK;
+}
+
+
 #ifndef NGX_LUA_NO_FFI_API
 int
 ngx_http_lua_ffi_var_get(ngx_http_request_t *r, u_char *name_data,
@@ -345,6 +398,20 @@ ngx_http_lua_ffi_var_get(ngx_http_request_t *r, u_char *name_data,
 
     hash = ngx_hash_strlow(lowcase_buf, name_data, name_len);
 
+    switch (ngx_http_lua_var_get_header(r, lowcase_buf, name_len, &name)) {
+
+    case NGX_OK:
+        *value = name.data;
+        *value_len = name.len;
+        return NGX_OK;
+
+    case NGX_DECLINED:
+        return NGX_DECLINED;
+
+    default: /* NGX_DONE */
+        break;
+    }
+
     name.data = lowcase_buf;
     name.len = name_len;
 
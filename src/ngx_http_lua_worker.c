@@ -11,18 +11,48 @@
 
 
 #include "ngx_http_lua_worker.h"
+#include "ngx_http_lua_util.h"
 
 
 static int ngx_http_lua_ngx_worker_exiting(lua_State *L);
 static int ngx_http_lua_ngx_worker_pid(lua_State *L);
 static int ngx_http_lua_ngx_worker_id(lua_State *L);
 static int ngx_http_lua_ngx_worker_count(lua_State *L);
+static int ngx_http_lua_ngx_worker_memory(lua_State *L);
+#if (NGX_LINUX)
+static ngx_int_t ngx_http_lua_worker_read_smaps(lua_State *L);
+static ngx_int_t ngx_http_lua_worker_read_statm(lua_State *L);
+static ssize_t ngx_http_lua_worker_read_proc(char *path, u_char *buf,
+    size_t size);
+
+
+typedef struct {
+    ngx_str_t            name;   /* of the smaps_rollup line */
+    ngx_uint_t           field;  /* index in the fields below */
+} ngx_http_lua_worker_smaps_line_t;
+
+
+static char *ngx_http_lua_worker_smaps_fields[] = {
+    "rss", "pss", "shared", "private"
+};
+
+
+static ngx_http_lua_worker_smaps_line_t  ngx_http_lua_worker_smaps_lines[] = {
+    { ngx_string("Rss"), 0 },
+    { ngx_string("Pss"), 1 },
+    { ngx_string("Shared_Clean"), 2 },
+    { ngx_string("Shared_Dirty"), 2 },
+    { ngx_string("Private_Clean"), 3 },
+    { ngx_string("Private_Dirty"), 3 },
+    { ngx_null_string, 0 }
+};
+#endif
 
 
 void
 ngx_http_lua_inject_worker_api(lua_State *L)
 {
-    lua_createtable(L, 0 /* narr */, 4 /* nrec */);    /* ngx.worker. */
+    lua_createtable(L, 0 /* narr */, 5 /* nrec */);    /* ngx.worker. */
 
     lua_pushcfunction(L, ngx_http_lua_ngx_worker_exiting);
     lua_setfield(L, -2, "exiting");
@@ -36,6 +66,9 @@ ngx_http_lua_inject_worker_api(lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_ngx_worker_count);
     lua_setfield(L, -2, "count");
 
+    lua_pushcfunction(L, ngx_http_lua_ngx_worker_memory);
+    lua_setfield(L, -2, "memory");
+
     lua_setfield(L, -2, "worker");
 }
 
@@ -81,6 +114,176 @@ ngx_http_lua_ngx_worker_count(lua_State *L)
 }
 
 
+static int
+ngx_http_lua_ngx_worker_memory(lua_State *L)
+{
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_module);
+
+    lua_createtable(L, 0 /* narr */, 6 /* nrec */);
+
+    lua_pushnumber(L, (lua_Number) ngx_http_lua_gc_size(L));
+    lua_setfield(L, -2, "lua");
+
+    if (lmcf && lmcf->init_heap_size) {
+        lua_pushnumber(L, (lua_Number) lmcf->init_heap_size);
+        lua_setfield(L, -2, "init_lua");
+    }
+
+#if (NGX_LINUX)
+    /* /proc/self/smaps_rollup appeared in Linux 4.14 */
+
+    if (ngx_http_lua_worker_read_smaps(L) != NGX_OK) {
+        (void) ngx_http_lua_worker_read_statm(L);
+    }
+#endif
+
+    return 1;
+}
+
+
+#if (NGX_LINUX)
+
+static ngx_int_t
+ngx_http_lua_worker_read_smaps(lua_State *L)
+{
+    off_t                                kb, sizes[4];
+    u_char                              *p, *v, *eol, *last;
+    ssize_t                              n;
+    ngx_uint_t                           i;
+    ngx_http_lua_worker_smaps_line_t    *line;
+    u_char                               buf[4096];
+
+    n = ngx_http_lua_worker_read_proc("/proc/self/smaps_rollup", buf,
+                                      sizeof(buf));
+    if (n <= 0) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < 4; i++) {
+        sizes[i] = -1;
+    }
+
+    last = buf + n;
+
+    for (p = buf; p < last; p = eol + 1) {
+        eol = ngx_strlchr(p, last, LF);
+        if (eol == NULL) {
+            eol = last;
+        }
+
+        /* lines like "Rss:                2048 kB" */
+
+        v = ngx_strlchr(p, eol, ':');
+        if (v == NULL) {
+            continue;
+        }
+
+        for (line = ngx_http_lua_worker_smaps_lines; line->name.len; line++) {
+            if ((size_t) (v - p) == line->name.len
+                && ngx_strncmp(p, line->name.data, line->name.len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (line->name.len == 0) {
+            continue;
+        }
+
+        for (v++; v < eol && *v == ' '; v++) { /* void */ }
+
+        for (p = v; p < eol && *p >= '0' && *p <= '9'; p++) { /* void */ }
+
+        kb = ngx_atoof(v, p - v);
+        if (kb == NGX_ERROR) {
+            continue;
+        }
+
+        if (sizes[line->field] == -1) {
+            sizes[line->field] = 0;
+        }
+
+        sizes[line->field] += kb * 1024;
+    }
+
+    if (sizes[0] == -1) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (sizes[i] != -1) {
+            lua_pushnumber(L, (lua_Number) sizes[i]);
+            lua_setfield(L, -2, ngx_http_lua_worker_smaps_fields[i]);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_worker_read_statm(lua_State *L)
+{
+    u_char          *p, *v, *last;
+    off_t            pages;
+    ssize_t          n;
+    u_char           buf[256];
+
+    n = ngx_http_lua_worker_read_proc("/proc/self/statm", buf, sizeof(buf));
+    if (n <= 0) {
+        return NGX_ERROR;
+    }
+
+    /* "size resident shared text lib data dt", all in pages */
+
+    last = buf + n;
+
+    p = ngx_strlchr(buf, last, ' ');
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (v = ++p; p < last && *p >= '0' && *p <= '9'; p++) { /* void */ }
+
+    pages = ngx_atoof(v, p - v);
+    if (pages == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    lua_pushnumber(L, (lua_Number) pages * ngx_pagesize);
+    lua_setfield(L, -2, "rss");
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_http_lua_worker_read_proc(char *path, u_char *buf, size_t size)
+{
+    ssize_t          n;
+    ngx_fd_t         fd;
+
+    fd = ngx_open_file(path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        return NGX_ERROR;
+    }
+
+    n = read(fd, buf, size);
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", path);
+    }
+
+    return n;
+}
+
+#endif
+
+
 #ifndef NGX_LUA_NO_FFI_API
 int
 ngx_http_lua_ffi_worker_pid(void)
@@ -10,7 +10,7 @@ use Test::Nginx::Socket::Lua;
 repeat_each(2);
 #repeat_each(1);
 
-plan tests => repeat_each() * (blocks() * 2 + 19);
+plan tests => repeat_each() * (blocks() * 2 + 23);
 
 #no_diff();
 #no_long_string();
@@ -837,3 +837,45 @@ GET /lua
 --- error_log eval
 qr/failed to load inlined Lua code: /
 
+
+
+
+=== TEST 43: long strings are sent without copying
+--- config
+    location /lua {
+        content_by_lua_block {
+            local big = string.rep("a", 4096)
+            ngx.print({"<", big, ">", {nil, big}, true})
+            ngx.say(big, "!")
+        }
+    }
+--- request
+GET /lua
+--- response_body eval
+"<" . ("a" x 4096) . ">nil" . ("a" x 4096) . "true" . ("a" x 4096) . "!\n"
+--- error_log
+lua sending 8192 bytes of Lua strings without copying
+--- no_error_log
+[error]
+
+
+
+=== TEST 44: pinned strings survive garbage collection
+--- config
+    location /lua {
+        content_by_lua_block {
+            for i = 1, 3 do
+                ngx.print(string.rep(i, 5000))
+                collectgarbage()
+            end
+            ngx.say()
+        }
+    }
+--- request
+GET /lua
+--- response_body eval
+("1" x 5000) . ("2" x 5000) . ("3" x 5000) . "\n"
+--- error_log
+lua sending 5000 bytes of Lua strings without copying
+--- no_error_log
+[error]
@@ -4,7 +4,7 @@ use Test::Nginx::Socket::Lua;
 
 repeat_each(2);
 
-plan tests => repeat_each() * 155;
+plan tests => repeat_each() * 161;
 
 #$ENV{LUA_PATH} = $ENV{HOME} . '/work/JSON4Lua-0.9.30/json/?.lua';
 
@@ -1245,3 +1245,86 @@ qr/\[alert\] \S+ lua_code_cache is off; this will hurt performance/,
 "lua close the global Lua VM",
 ]
 
+
+
+=== TEST 34: lua_code_cache stat reloads changed files only
+--- config
+    lua_code_cache stat;
+
+    location /lua {
+        content_by_lua_file html/test.lua;
+    }
+    location /update {
+        content_by_lua_block {
+            local code
+            if ngx.var.arg_v == "1" then
+                code = 'ngx.say("v1")'
+            else
+                code = 'ngx.say("version 2")'
+            end
+
+            -- replace the file as a whole just like most editors
+            local path = "t/servroot/html/test.lua"
+            local f = assert(io.open(path .. ".tmp", "w"))
+            f:write(code)
+            f:close()
+            assert(os.rename(path .. ".tmp", path))
+            ngx.say("updated")
+        }
+    }
+    location /main {
+        echo_location /update v=1;
+        echo_location /lua;
+        echo_location /lua;
+        echo_location /update v=2;
+        echo_location /lua;
+    }
+--- user_files
+>>> test.lua
+ngx.say(32)
+--- request
+GET /main
+--- response_body
+updated
+v1
+v1
+updated
+version 2
+--- no_error_log
+[error]
+
+
+
+=== TEST 35: lua_code_cache stat honors open_file_cache_valid
+--- config
+    lua_code_cache stat;
+    open_file_cache max=10;
+    open_file_cache_valid 60s;
+
+    location /lua {
+        content_by_lua_file html/test.lua;
+    }
+    location /update {
+        content_by_lua_block {
+            local f = assert(io.open("t/servroot/html/test.lua", "w"))
+            f:write('ngx.say("version 2")')
+            f:close()
+            ngx.say("updated")
+        }
+    }
+    location /main {
+        echo_location /lua;
+        echo_location /update;
+        echo_location /lua;
+    }
+--- user_files
+>>> test.lua
+ngx.say(32)
+--- request
+GET /main
+--- response_body
+32
+updated
+32
+--- no_error_log
+[error]
@@ -8,7 +8,7 @@ use Test::Nginx::Socket::Lua;
 
 repeat_each(2);
 
-plan tests => repeat_each() * (2 * blocks() + 28);
+plan tests => repeat_each() * (2 * blocks() + 33);
 
 #no_diff();
 #no_long_string();
@@ -1582,3 +1582,87 @@ X-Forwarded-For: 8.8.8.8
 Foo: 127.0.0.1
 --- no_error_log
 [error]
+
+
+
+=== TEST 52: $http_NAME follows the request header changes made by Lua
+--- config
+    location = /t {
+        content_by_lua_block {
+            ngx.say(ngx.var.http_x_foo)
+            ngx.req.set_header("X-Foo", "new")
+            ngx.say(ngx.var.http_x_foo)
+            ngx.req.clear_header("X-Foo")
+            ngx.say(ngx.var.http_x_foo)
+            ngx.req.set_header("X_Bar", "bar")
+            ngx.say(ngx.var.http_x_bar)
+        }
+    }
+--- request
+GET /t
+--- more_headers
+X-Foo: old
+--- response_body
+old
+new
+nil
+bar
+--- grep_error_log eval: qr/lua indexed/
+--- grep_error_log_out
+lua indexed
+lua indexed
+lua indexed
+lua indexed
+--- no_error_log
+[error]
+
+
+
+=== TEST 53: headers table lookups ignore case and underscores
+--- config
+    location = /t {
+        content_by_lua_block {
+            local h = ngx.req.get_headers()
+            ngx.say(h["X_Foo_Bar"], " ", h.x_foo_bar, " ", h["x-foo-bar"])
+            ngx.say(h.X_Missing, " ", h[1])
+        }
+    }
+--- request
+GET /t
+--- more_headers
+X-Foo-Bar: baz
+--- response_body
+baz baz baz
+nil nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 54: repeated $http_NAME reads share the header index
+--- config
+    location = /t {
+        content_by_lua_block {
+            for i = 1, 3 do
+                ngx.say(ngx.var.http_x_foo)
+            end
+            ngx.say(ngx.var.http_user_agent)
+            ngx.say(ngx.var.http_x_missing)
+        }
+    }
+--- request
+GET /t
+--- more_headers
+X-Foo: foo
+User-Agent: bar
+--- response_body
+foo
+foo
+foo
+bar
+nil
+--- grep_error_log eval: qr/lua indexed/
+--- grep_error_log_out
+lua indexed
+--- no_error_log
+[error]
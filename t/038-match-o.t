@@ -741,3 +741,141 @@ hello
 nil
 nil
 
+
+
+
+=== TEST 34: regex cache evicts the least recently used entry
+--- http_config
+    lua_regex_cache_max_entries 2;
+--- config
+    location /re {
+        content_by_lua '
+            ngx.re.match("hello, 1234", "([0-9]+)", "oa")
+            ngx.re.match("hello, 1234", "([0-9]+)", "om")
+
+            local s0 = ngx.re.cache_stats()
+
+            local m = ngx.re.match("hello, 1234", "([0-9]+)", "o")
+            ngx.say(m and m[0])
+
+            m = ngx.re.match("howdy, 567", "([0-9]+)", "oi")
+            ngx.say(m and m[0])
+
+            m = ngx.re.match("howdy, 567", "([0-9]+)", "oi")
+            ngx.say(m and m[0])
+
+            m = ngx.re.match("hello, 1234", "([0-9]+)", "o")
+            ngx.say(m and m[0])
+
+            m = ngx.re.match("hiya, 98", "([0-9]+)", "ox")
+            ngx.say(m and m[0])
+
+            local s1 = ngx.re.cache_stats()
+            ngx.say("entries: ", s1.entries, ", max: ", s1.max_entries)
+            ngx.say("hits: ", s1.hits - s0.hits)
+            ngx.say("misses: ", s1.misses - s0.misses)
+            ngx.say("evictions: ", s1.evictions - s0.evictions)
+        ';
+    }
+--- request
+    GET /re
+--- response_body
+1234
+567
+567
+1234
+98
+entries: 2, max: 2
+hits: 2
+misses: 3
+evictions: 3
+
+
+
+=== TEST 35: live gmatch iterators pin their regexes in the cache
+--- http_config
+    lua_regex_cache_max_entries 1;
+--- config
+    location /re {
+        content_by_lua '
+            local it = ngx.re.gmatch("a1b2c3", "[0-9]", "o")
+
+            local s0 = ngx.re.cache_stats()
+
+            local m = ngx.re.match("hello, 1234", "([0-9]+)", "o")
+            ngx.say(m and m[0])
+
+            local s1 = ngx.re.cache_stats()
+            ngx.say("entries: ", s1.entries)
+            ngx.say("evictions: ", s1.evictions - s0.evictions)
+
+            while true do
+                m = it()
+                if not m then
+                    break
+                end
+                ngx.say(m[0])
+            end
+        ';
+    }
+--- request
+    GET /re
+--- response_body
+1234
+entries: 1
+evictions: 0
+1
+2
+3
+
+
+
+=== TEST 36: gsub replace function evicting other regexes
+--- http_config
+    lua_regex_cache_max_entries 1;
+--- config
+    location /re {
+        content_by_lua '
+            local s, n = ngx.re.gsub("a1b2c3", "[0-9]", function (m)
+                local m2 = ngx.re.match("hello, " .. m[0], "[0-9]+", "o")
+                return "<" .. m2[0] .. ">"
+            end, "o")
+            ngx.say(s)
+            ngx.say(n)
+        ';
+    }
+--- request
+    GET /re
+--- response_body
+a<1>b<2>c<3>
+3
+
+
+
+=== TEST 37: throwing gsub replace functions do not pin their regexes
+--- http_config
+    lua_regex_cache_max_entries 1;
+--- config
+    location /re {
+        content_by_lua '
+            local ok, err = pcall(ngx.re.gsub, "a1b2c3", "[0-9]",
+                                  function (m) error("oops") end, "o")
+            ngx.say(ok, " ", string.find(err, "oops", 1, true) ~= nil)
+
+            local s0 = ngx.re.cache_stats()
+
+            local m = ngx.re.match("hello, 1234", "([0-9]+)", "o")
+            ngx.say(m and m[0])
+
+            local s1 = ngx.re.cache_stats()
+            ngx.say("entries: ", s1.entries)
+            ngx.say("evictions: ", s1.evictions - s0.evictions)
+        ';
+    }
+--- request
+    GET /re
+--- response_body
+false true
+1234
+entries: 1
+evictions: 1
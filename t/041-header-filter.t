@@ -10,7 +10,7 @@ log_level('debug');
 
 repeat_each(2);
 
-plan tests => repeat_each() * 94;
+plan tests => repeat_each() * 108;
 
 #no_diff();
 #no_long_string();
@@ -791,3 +791,165 @@ GET /t
 --- no_error_log
 [error]
 
+
+
+
+=== TEST 42: reused phase envs are emptied between runs
+--- http_config
+    lua_reuse_phase_env on;
+--- config
+    location = /sub {
+        echo sub;
+        header_filter_by_lua '
+            ngx.log(ngx.WARN, "foo: ", tostring(foo), ", _G: ",
+                    _G == getfenv(1), ", print: ", type(print))
+            foo = 1
+        ';
+    }
+
+    location = /t {
+        content_by_lua '
+            for i = 1, 3 do
+                local res = ngx.location.capture("/sub")
+                ngx.print(res.body)
+            end
+        ';
+    }
+--- request
+GET /t
+--- response_body
+sub
+sub
+sub
+--- grep_error_log eval: qr/foo: \w+, _G: \w+, print: \w+/
+--- grep_error_log_out
+foo: nil, _G: true, print: function
+foo: nil, _G: true, print: function
+foo: nil, _G: true, print: function
+--- no_error_log
+[error]
+
+
+
+=== TEST 43: reused phase envs allocate nothing per run
+--- http_config
+    lua_reuse_phase_env on;
+--- config
+    location = /sub {
+        echo sub;
+        header_filter_by_lua 'local a = 1';
+    }
+
+    location = /plain {
+        echo sub;
+    }
+
+    location = /t {
+        content_by_lua '
+            local function measure(uri)
+                for i = 1, 10 do
+                    ngx.location.capture(uri)
+                end
+
+                collectgarbage("collect")
+                collectgarbage("stop")
+
+                local before = collectgarbage("count")
+                for i = 1, 100 do
+                    ngx.location.capture(uri)
+                end
+                local used = collectgarbage("count") - before
+
+                collectgarbage("restart")
+                return used
+            end
+
+            local extra = (measure("/sub") - measure("/plain")) * 1024 / 100
+            ngx.say("env allocated: ", extra > 100)
+        ';
+    }
+--- request
+GET /t
+--- response_body
+env allocated: false
+--- no_error_log
+[error]
+
+
+
+=== TEST 44: new phase envs are allocated per run without lua_reuse_phase_env
+--- config
+    location = /sub {
+        echo sub;
+        header_filter_by_lua 'local a = 1';
+    }
+
+    location = /plain {
+        echo sub;
+    }
+
+    location = /t {
+        content_by_lua '
+            local function measure(uri)
+                for i = 1, 10 do
+                    ngx.location.capture(uri)
+                end
+
+                collectgarbage("collect")
+                collectgarbage("stop")
+
+                local before = collectgarbage("count")
+                for i = 1, 100 do
+                    ngx.location.capture(uri)
+                end
+                local used = collectgarbage("count") - before
+
+                collectgarbage("restart")
+                return used
+            end
+
+            local extra = (measure("/sub") - measure("/plain")) * 1024 / 100
+            ngx.say("env allocated: ", extra > 100)
+        ';
+    }
+--- request
+GET /t
+--- response_body
+env allocated: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 45: env metatable changes stay in their own run without lua_reuse_phase_env
+--- config
+    location = /sub {
+        echo sub;
+        header_filter_by_lua '
+            local mt = getmetatable(_G)
+            ngx.log(ngx.WARN, "guarded: ", mt.__newindex ~= nil)
+            mt.__newindex = function () error("no globals") end
+        ';
+    }
+
+    location = /t {
+        content_by_lua '
+            for i = 1, 3 do
+                local res = ngx.location.capture("/sub")
+                ngx.print(res.body)
+            end
+        ';
+    }
+--- request
+GET /t
+--- response_body
+sub
+sub
+sub
+--- grep_error_log eval: qr/guarded: \w+/
+--- grep_error_log_out
+guarded: false
+guarded: false
+guarded: false
+--- no_error_log
+[error]
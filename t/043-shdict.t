@@ -2429,3 +2429,195 @@ nil
 nil
 --- no_error_log
 [error]
+
+
+
+=== TEST 92: l1 cache serves repeated gets and is invalidated by writes
+--- http_config
+    lua_shared_dict dogs 1m l1_size=16k l1_ttl=10s;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            local s0 = dogs:l1_stats()
+            dogs:set("foo", 32)
+            ngx.say(dogs:get("foo"))
+            ngx.say(dogs:get("foo"))
+            ngx.say(dogs:get("foo"))
+            dogs:set("foo", "bar")
+            ngx.say(dogs:get("foo"))
+            ngx.say(dogs:get("baz"))
+            ngx.say(dogs:get("baz"))
+            local s = dogs:l1_stats()
+            ngx.say("hits: ", s.hits - s0.hits)
+            ngx.say("misses: ", s.misses - s0.misses)
+            ngx.say("max_size: ", s.max_size)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+32
+32
+32
+bar
+nil
+nil
+hits: 3
+misses: 3
+max_size: 16384
+--- no_error_log
+[error]
+
+
+
+=== TEST 93: l1 cache honours the item expiration and returns flags
+--- http_config
+    lua_shared_dict dogs 1m l1_size=16k l1_ttl=10s;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", "hello", 0.01, 5)
+            local v, flags = dogs:get("foo")
+            ngx.say(v, " ", flags)
+            v, flags = dogs:get("foo")
+            ngx.say(v, " ", flags)
+            ngx.sleep(0.02)
+            v, flags = dogs:get("foo")
+            ngx.say(v, " ", flags)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+hello 5
+hello 5
+nil nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 94: l1_stats without l1 cache
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say(dogs:l1_stats())
+        ';
+    }
+--- request
+GET /test
+--- response_body
+nill1 cache disabled
+--- no_error_log
+[error]
+
+
+
+=== TEST 95: sharded zone
+--- http_config
+    lua_shared_dict dogs 1m shards=4;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:flush_all()
+            dogs:flush_expired()
+            for i = 1, 100 do
+                dogs:set("key" .. i, i)
+            end
+            dogs:set("tmp", 1, 0.001)
+            local keys = dogs:get_keys(0)
+            ngx.say("keys: ", #keys)
+            ngx.say("limited keys: ", #dogs:get_keys(10))
+            ngx.say(dogs:get("key1"), " ", dogs:get("key100"))
+            ngx.say(dogs:incr("key50", 2))
+            ngx.say(dogs:add("key7", 1))
+            dogs:delete("key7")
+            ngx.say(dogs:get("key7"))
+            ngx.sleep(0.002)
+            ngx.say("expired: ", dogs:flush_expired())
+            dogs:flush_all()
+            ngx.say("keys: ", #dogs:get_keys(0))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+keys: 101
+limited keys: 10
+1 100
+52nil
+falseexistsfalse
+nil
+expired: 1
+keys: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 96: sharded zone with l1 cache
+--- http_config
+    lua_shared_dict dogs 1m shards=2 l1_size=16k;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            local s0 = dogs:l1_stats()
+            dogs:set("foo", 1)
+            dogs:set("bar", 2)
+            ngx.say(dogs:get("foo"), " ", dogs:get("bar"))
+            ngx.say(dogs:get("foo"), " ", dogs:get("bar"))
+            dogs:set("foo", 3)
+            dogs:set("bar", 4)
+            ngx.say(dogs:get("foo"), " ", dogs:get("bar"))
+            local s = dogs:l1_stats()
+            ngx.say("hits: ", s.hits - s0.hits)
+            ngx.say("misses: ", s.misses - s0.misses)
+            ngx.say("max_size: ", s.max_size)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+1 2
+1 2
+3 4
+hits: 2
+misses: 4
+max_size: 16384
+--- no_error_log
+[error]
+
+
+
+=== TEST 97: many shards in a small zone
+--- http_config
+    lua_shared_dict dogs 1m shards=32;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 320 do
+                local ok, err = dogs:set("key" .. i, i)
+                if not ok then
+                    ngx.say("failed to set key", i, ": ", err)
+                    return
+                end
+            end
+            ngx.say("keys: ", #dogs:get_keys(0))
+            ngx.say(dogs:get("key1"), " ", dogs:get("key320"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+keys: 320
+1 320
+--- no_error_log
+[error]
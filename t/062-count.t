@@ -34,7 +34,7 @@ __DATA__
 --- request
 GET /test
 --- response_body
-ngx: 116
+ngx: 118
 --- no_error_log
 [error]
 
@@ -55,7 +55,7 @@ ngx: 116
 --- request
 GET /test
 --- response_body
-116
+118
 --- no_error_log
 [error]
 
@@ -83,7 +83,7 @@ GET /test
 --- request
 GET /test
 --- response_body
-n = 116
+n = 118
 --- no_error_log
 [error]
 
@@ -283,7 +283,7 @@ n = 4
 --- request
 GET /test
 --- response_body
-n = 13
+n = 19
 --- no_error_log
 [error]
 
@@ -305,7 +305,7 @@ GET /t
 --- response_body_like: 404 Not Found
 --- error_code: 404
 --- error_log
-ngx. entry count: 116
+ngx. entry count: 118
 
 
 
@@ -323,7 +323,7 @@ ngx. entry count: 116
 --- request
 GET /test
 --- response_body
-n = 3
+n = 5
 --- no_error_log
 [error]
 
@@ -363,7 +363,7 @@ n = 5
 --- request
 GET /test
 --- response_body
-n = 5
+n = 6
 --- no_error_log
 [error]
 
@@ -438,7 +438,7 @@ thread: 3
 --- request
 GET /test
 --- response_body
-worker: 4
+worker: 5
 --- no_error_log
 [error]
 
@@ -459,7 +459,7 @@ worker: 4
 --- request
 GET /test
 --- response_body
-n = 6
+n = 8
 --- no_error_log
 [error]
 
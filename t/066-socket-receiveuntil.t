@@ -1330,3 +1330,74 @@ ok
 --- no_error_log
 [error]
 
+
+
+
+=== TEST 20: boundaries far apart in long data
+--- config
+    location /t {
+        content_by_lua '
+            local sock, err = ngx.req.socket()
+            if not sock then
+                ngx.say("failed to get req socket: ", err)
+                return
+            end
+
+            local reader = sock:receiveuntil("--abc")
+
+            for i = 1, 3 do
+                local data, err, part = reader()
+                if data then
+                    ngx.say("read: ", #data, " ", string.sub(data, -3))
+
+                else
+                    ngx.say("failed to read: ", err, " [", part, "]")
+                end
+            end
+        ';
+    }
+--- request eval
+"POST /t\n" . ("a" x 100) . "--abc" . ("b" x 37) . "-" . ("c" x 64)
+. "--abc" . "tail"
+--- response_body
+read: 100 aaa
+read: 102 ccc
+failed to read: closed [tail]
+--- no_error_log
+[error]
+
+
+
+=== TEST 21: boundaries far apart in long data, size-limited reads
+--- config
+    location /t {
+        content_by_lua '
+            local sock, err = ngx.req.socket()
+            if not sock then
+                ngx.say("failed to get req socket: ", err)
+                return
+            end
+
+            local reader = sock:receiveuntil("--abc")
+
+            for i = 1, 5 do
+                local data, err, part = reader(40)
+                if data then
+                    ngx.say("read: ", #data)
+
+                else
+                    ngx.say("failed to read: ", err, " [", part, "]")
+                end
+            end
+        ';
+    }
+--- request eval
+"POST /t\n" . ("x" x 90) . "--abc" . "yyyy"
+--- response_body
+read: 40
+read: 40
+read: 10
+failed to read: nil [nil]
+failed to read: closed [yyyy]
+--- no_error_log
+[error]
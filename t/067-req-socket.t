@@ -574,7 +574,7 @@ failed to receive: closed []
 
 
 
-=== TEST 9: chunked support is still a TODO
+=== TEST 9: chunked request body
 --- config
     location /t {
         content_by_lua '
@@ -620,7 +620,10 @@ F(ngx_http_free_request) {
 }
 */
 --- response_body
-failed to get the request socket: chunked request bodies not supported yet
+got the request socket
+received: hello
+received:  worl
+failed to receive: closed [d]
 --- no_error_log
 [error]
 [alert]
@@ -1097,3 +1100,118 @@ done
 lua finalize socket
 GC cycle done
 
+
+
+
+=== TEST 18: long lines with carriage returns in the middle
+--- config
+    location /t {
+        content_by_lua '
+            local sock, err = ngx.req.socket()
+            if not sock then
+                ngx.say("failed to get the request socket: ", err)
+                return
+            end
+
+            for i = 1, 3 do
+                local line, err, part = sock:receive()
+                if line then
+                    ngx.say("received: ", #line, " ", string.sub(line, -3))
+
+                else
+                    ngx.say("failed to receive: ", err, " [", part, "]")
+                end
+            end
+        ';
+    }
+--- request eval
+"POST /t\n" . "line one is longer than thirty-two bytes\r\n"
+. ("z" x 50) . "\rz\n" . "last"
+--- response_body
+received: 40 tes
+received: 51 zzz
+failed to receive: closed [last]
+--- no_error_log
+[error]
+
+
+
+=== TEST 19: chunked request body split across chunks
+--- config
+    location /t {
+        content_by_lua '
+            local sock, err = ngx.req.socket()
+            if not sock then
+                ngx.say("failed to get the request socket: ", err)
+                return
+            end
+
+            while true do
+                local data, err, part = sock:receive(4)
+                if not data then
+                    ngx.say("failed to receive: ", err, " [", part, "]")
+                    break
+                end
+                ngx.say("received: ", data)
+            end
+        ';
+    }
+--- raw_request eval
+"POST /t HTTP/1.1\r
+Host: localhost\r
+Transfer-Encoding: chunked\r
+Connection: close\r
+\r
+3\r
+abc\r
+5;foo=bar\r
+defgh\r
+1\r
+i\r
+0\r
+\r
+"
+--- response_body
+received: abcd
+received: efgh
+failed to receive: closed [i]
+--- no_error_log
+[error]
+--- skip_nginx: 3: <1.3.9
+
+
+
+=== TEST 20: chunked request body exceeding client_max_body_size
+--- config
+    location /t {
+        client_max_body_size 8;
+
+        content_by_lua '
+            local sock, err = ngx.req.socket()
+            if not sock then
+                ngx.say("failed to get the request socket: ", err)
+                return
+            end
+
+            local data, err = sock:receive(16)
+            ngx.say("failed to receive: ", err)
+        ';
+    }
+--- raw_request eval
+"POST /t HTTP/1.1\r
+Host: localhost\r
+Transfer-Encoding: chunked\r
+Connection: close\r
+\r
+5\r
+hello\r
+6\r
+ world\r
+0\r
+\r
+"
+--- response_body
+failed to receive: error
+--- error_log
+client intended to send too large chunked body: 5+6 bytes
+--- skip_nginx: 3: <1.3.9
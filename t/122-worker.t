@@ -80,3 +80,59 @@ worker pid is correct\.
 --- no_error_log
 [error]
 
+
+
+
+=== TEST 4: ngx.worker.memory
+--- config
+    location /lua {
+        content_by_lua_block {
+            local mem = ngx.worker.memory()
+            ngx.say("lua: ", mem.lua > 0)
+            ngx.say("init_lua: ", mem.init_lua)
+            ngx.say("rss: ", mem.rss > mem.lua)
+            ngx.say("private: ", mem.private == nil or mem.private <= mem.rss)
+        }
+    }
+--- request
+GET /lua
+--- response_body
+lua: true
+init_lua: nil
+rss: true
+private: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: lua_freeze_init_heap
+--- http_config
+    lua_freeze_init_heap on;
+
+    init_by_lua_block {
+        big = {}
+        for i = 1, 10000 do
+            big[i] = { i }
+        end
+
+        -- garbage left behind by init_by_lua
+        for i = 1, 10000 do
+            local t = { i }
+        end
+    }
+--- config
+    location /lua {
+        content_by_lua_block {
+            local mem = ngx.worker.memory()
+            ngx.say("init_lua: ", mem.init_lua > 10000 * 32)
+            ngx.say("big: ", #big)
+        }
+    }
+--- request
+GET /lua
+--- response_body
+init_lua: true
+big: 10000
+--- no_error_log
+[error]
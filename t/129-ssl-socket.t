@@ -2584,3 +2584,89 @@ SSL reused session
 [alert]
 --- timeout: 5
 
+
+
+
+=== TEST 32: unix domain ssl cosocket (sessions shared via lua_ssl_session_cache)
+--- http_config
+    lua_shared_dict ssl_sessions 1m;
+
+    server {
+        listen unix:$TEST_NGINX_HTML_DIR/nginx.sock ssl;
+        server_name   test.com;
+        ssl_certificate ../html/test.crt;
+        ssl_certificate_key ../html/test.key;
+        ssl_session_cache shared:SSL:1m;
+
+        server_tokens off;
+        location /foo {
+            default_type 'text/plain';
+            content_by_lua 'ngx.status = 201 ngx.say("foo") ngx.exit(201)';
+            more_clear_headers Date;
+        }
+    }
+--- config
+    server_tokens off;
+    lua_ssl_session_cache ssl_sessions;
+
+    location /t {
+        content_by_lua '
+            ngx.shared.ssl_sessions:flush_all()
+
+            for i = 1, 2 do
+                local sock = ngx.socket.tcp()
+                sock:settimeout(3000)
+                local ok, err = sock:connect("unix:$TEST_NGINX_HTML_DIR/nginx.sock")
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                local sess, err = sock:sslhandshake(false, "test.com", false,
+                                                    false,
+                                                    { session_cache = true })
+                if not sess then
+                    ngx.say("failed to do SSL handshake: ", err)
+                    return
+                end
+
+                ngx.say(i, ": ssl handshake: ", sess)
+
+                local req = "GET /foo HTTP/1.0\\r\\nHost: test.com\\r\\nConnection: close\\r\\n\\r\\n"
+                local bytes, err = sock:send(req)
+                if not bytes then
+                    ngx.say("failed to send http request: ", err)
+                    return
+                end
+
+                ngx.say(i, ": received: ", sock:receive())
+                sock:close()
+            end
+        ';
+    }
+
+--- request
+GET /t
+--- response_body
+1: ssl handshake: true
+1: received: HTTP/1.1 201 Created
+2: ssl handshake: true
+2: received: HTTP/1.1 201 Created
+
+--- user_files eval
+">>> test.key
+$::TestCertificateKey
+>>> test.crt
+$::TestCertificate"
+
+--- grep_error_log eval: qr/lua ssl session cache \w+/
+--- grep_error_log_out
+lua ssl session cache miss
+lua ssl session cache store
+lua ssl session cache hit
+--- error_log
+SSL reused session
+--- no_error_log
+[error]
+[alert]
+--- timeout: 5
@@ -109,3 +109,29 @@ GET /timers
 3
 --- no_error_log
 [error]
+
+
+
+=== TEST 7: fake request pools are recycled
+--- config
+    location /timers {
+        content_by_lua_block {
+            local before = ngx.timer.pool_stats()
+            for i = 1, 10 do
+                ngx.timer.at(0, function() end)
+                ngx.sleep(0.005)
+            end
+            local after = ngx.timer.pool_stats()
+            ngx.say("created: ", after.created - before.created)
+            ngx.say("reused: ", after.reused - before.reused)
+            ngx.say("free: ", after.free)
+        }
+    }
+--- request
+GET /timers
+--- response_body
+created: 1
+reused: 9
+free: 1
+--- no_error_log
+[error]
@@ -4413,3 +4413,305 @@ close: 1 nil
 uthread: thread created: running
 uthread: hello in thread
 uthread: done
+
+
+
+=== TEST 47: set cert and private key handles parsed only once
+--- http_config
+    lua_package_path "lua/?.lua;../lua-resty-core/lib/?.lua;;";
+
+    init_by_lua_block {
+        local ffi = require "ffi"
+
+        ffi.cdef[[
+            void *ngx_http_lua_ffi_parse_der_cert(const char *data,
+                size_t len, char **err);
+            void *ngx_http_lua_ffi_parse_der_priv_key(const char *data,
+                size_t len, char **err);
+            int ngx_http_lua_ffi_ssl_set_cert(void *r, void *cdata,
+                char **err);
+            int ngx_http_lua_ffi_ssl_set_priv_key(void *r, void *cdata,
+                char **err);
+            void ngx_http_lua_ffi_free_cert(void *cdata);
+            void ngx_http_lua_ffi_free_priv_key(void *cdata);
+            int ngx_http_lua_ffi_ssl_clear_certs(void *r, char **err);
+        ]]
+    }
+
+    server {
+        listen unix:$TEST_NGINX_HTML_DIR/nginx.sock ssl;
+        server_name   test.com;
+        ssl_certificate_by_lua_block {
+            local ffi = require "ffi"
+            local C = ffi.C
+
+            local errmsg = ffi.new("char *[1]")
+
+            local function parse(file, f, free)
+                local fh = assert(io.open(file))
+                local data = fh:read("*a")
+                fh:close()
+
+                local cdata = f(data, #data, errmsg)
+                if cdata == nil then
+                    return nil, ffi.string(errmsg[0])
+                end
+
+                return ffi.gc(cdata, free)
+            end
+
+            if not package.loaded.test_cert then
+                local cert = assert(parse("t/cert/test.crt.der",
+                                          C.ngx_http_lua_ffi_parse_der_cert,
+                                          C.ngx_http_lua_ffi_free_cert))
+
+                local pkey = assert(parse("t/cert/test.key.der",
+                                    C.ngx_http_lua_ffi_parse_der_priv_key,
+                                    C.ngx_http_lua_ffi_free_priv_key))
+
+                package.loaded.test_cert = { cert = cert, pkey = pkey }
+            end
+
+            local r = getfenv(0).__ngx_req
+            local handles = package.loaded.test_cert
+
+            C.ngx_http_lua_ffi_ssl_clear_certs(r, errmsg)
+
+            if C.ngx_http_lua_ffi_ssl_set_cert(r, handles.cert, errmsg)
+               ~= 0
+            then
+                ngx.log(ngx.ERR, "failed to set cert: ",
+                        ffi.string(errmsg[0]))
+                return
+            end
+
+            if C.ngx_http_lua_ffi_ssl_set_priv_key(r, handles.pkey, errmsg)
+               ~= 0
+            then
+                ngx.log(ngx.ERR, "failed to set private key: ",
+                        ffi.string(errmsg[0]))
+                return
+            end
+
+            print("ssl cert handles installed")
+        }
+        ssl_certificate ../../cert/test2.crt;
+        ssl_certificate_key ../../cert/test2.key;
+
+        server_tokens off;
+        location /foo {
+            default_type 'text/plain';
+            content_by_lua 'ngx.status = 201 ngx.say("foo") ngx.exit(201)';
+            more_clear_headers Date;
+        }
+    }
+--- config
+    server_tokens off;
+    resolver $TEST_NGINX_RESOLVER;
+    lua_ssl_trusted_certificate ../../cert/test.crt;
+
+    location /t {
+        content_by_lua '
+            do
+                local sock = ngx.socket.tcp()
+
+                sock:settimeout(2000)
+
+                local ok, err = sock:connect("unix:$TEST_NGINX_HTML_DIR/nginx.sock")
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                ngx.say("connected: ", ok)
+
+                local sess, err = sock:sslhandshake(nil, "test.com", true)
+                if not sess then
+                    ngx.say("failed to do SSL handshake: ", err)
+                    return
+                end
+
+                ngx.say("ssl handshake: ", type(sess))
+
+                local req = "GET /foo HTTP/1.0\\r\\nHost: test.com\\r\\nConnection: close\\r\\n\\r\\n"
+                local bytes, err = sock:send(req)
+                if not bytes then
+                    ngx.say("failed to send http request: ", err)
+                    return
+                end
+
+                ngx.say("sent http request: ", bytes, " bytes.")
+
+                while true do
+                    local line, err = sock:receive()
+                    if not line then
+                        break
+                    end
+
+                    ngx.say("received: ", line)
+                end
+
+                local ok, err = sock:close()
+                ngx.say("close: ", ok, " ", err)
+            end  -- do
+        ';
+    }
+
+--- request
+GET /t
+--- response_body
+connected: 1
+ssl handshake: userdata
+sent http request: 56 bytes.
+received: HTTP/1.1 201 Created
+received: Server: nginx
+received: Content-Type: text/plain
+received: Content-Length: 4
+received: Connection: close
+received: 
+received: foo
+close: 1 nil
+
+--- error_log
+ssl cert handles installed
+
+--- no_error_log
+[error]
+[alert]
+[emerg]
+
+
+
+=== TEST 48: staple OCSP responses from the shared memory cache
+--- http_config
+    lua_package_path "lua/?.lua;../lua-resty-core/lib/?.lua;;";
+    lua_shared_dict ocsp 1m;
+
+    init_by_lua_block {
+        local ffi = require "ffi"
+
+        ffi.cdef[[
+            void *ngx_http_lua_find_zone(const char *name_data,
+                size_t name_len);
+            int ngx_http_lua_ffi_ssl_ocsp_cert_id(const char *chain_data,
+                size_t chain_len, unsigned char *out, size_t *out_size,
+                char **err);
+            int ngx_http_lua_ffi_ssl_ocsp_cache_store(void *zone,
+                const unsigned char *resp, size_t resp_len,
+                const char *chain_data, size_t chain_len,
+                unsigned char *errbuf, size_t *errbuf_size);
+            int ngx_http_lua_ffi_ssl_ocsp_cache_staple(void *r, void *zone,
+                const unsigned char *id, size_t id_len, int refresh_ahead,
+                char **err);
+        ]]
+    }
+
+    server {
+        listen 127.0.0.2:8080 ssl;
+        server_name test.com;
+        ssl_certificate_by_lua_block {
+            local ffi = require "ffi"
+            local ssl = require "ngx.ssl"
+            local C = ffi.C
+
+            local zone = C.ngx_http_lua_find_zone("ocsp", 4)
+            local errmsg = ffi.new("char *[1]")
+
+            local f = assert(io.open("t/cert/ocsp/chain.pem"))
+            local chain = assert(ssl.cert_pem_to_der(f:read("*a")))
+            f:close()
+
+            local id = ffi.new("unsigned char[128]")
+            local id_len = ffi.new("size_t[1]", 128)
+            if C.ngx_http_lua_ffi_ssl_ocsp_cert_id(chain, #chain, id, id_len,
+                                                   errmsg) ~= 0
+            then
+                ngx.log(ngx.ERR, "failed to get cert id: ",
+                        ffi.string(errmsg[0]))
+                return
+            end
+
+            -- the response has no nextUpdate, so it is cached for an hour
+            local rc = C.ngx_http_lua_ffi_ssl_ocsp_cache_staple(
+                           getfenv(0).__ngx_req, zone, id, id_len[0], 7200,
+                           errmsg)
+            print("ocsp cache staple: ", rc)
+
+            if rc == -5 then
+                f = assert(io.open("t/cert/ocsp/ocsp-resp.der"))
+                local resp = f:read("*a")
+                f:close()
+
+                local errbuf = ffi.new("unsigned char[256]")
+                local errlen = ffi.new("size_t[1]", 256)
+                if C.ngx_http_lua_ffi_ssl_ocsp_cache_store(zone, resp, #resp,
+                                                           chain, #chain,
+                                                           errbuf, errlen)
+                   ~= 0
+                then
+                    ngx.log(ngx.ERR, "failed to cache OCSP response: ",
+                            ffi.string(errbuf, errlen[0]))
+                end
+            end
+        }
+        ssl_certificate ../../cert/test.crt;
+        ssl_certificate_key ../../cert/test.key;
+
+        server_tokens off;
+        location /foo {
+            default_type 'text/plain';
+            content_by_lua 'ngx.status = 201 ngx.say("foo") ngx.exit(201)';
+            more_clear_headers Date;
+        }
+    }
+--- config
+    server_tokens off;
+    resolver $TEST_NGINX_RESOLVER;
+    lua_ssl_trusted_certificate ../../cert/test.crt;
+    lua_ssl_verify_depth 3;
+
+    location /t {
+        content_by_lua_block {
+            ngx.shared.ocsp:flush_all()
+
+            for i = 1, 3 do
+                local sock = ngx.socket.tcp()
+
+                sock:settimeout(2000)
+
+                local ok, err = sock:connect("127.0.0.2", 8080)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                local sess, err = sock:sslhandshake(nil, "test.com", true,
+                                                    true)
+                if not sess then
+                    ngx.say("failed to do SSL handshake: ", err)
+                    return
+                end
+
+                ngx.say("ssl handshake: ", type(sess))
+                sock:close()
+            end
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+ssl handshake: userdata
+ssl handshake: userdata
+ssl handshake: userdata
+
+--- grep_error_log eval: qr/ocsp cache staple: -?\d+/
+--- grep_error_log_out
+ocsp cache staple: -5
+ocsp cache staple: -3
+ocsp cache staple: 0
+
+--- no_error_log
+[error]
+[alert]
+[emerg]
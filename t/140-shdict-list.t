@@ -0,0 +1,284 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: lpush & lpop
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+
+            local len, err = dogs:lpush("foo", "bar")
+            if len then
+                ngx.say("push success")
+            else
+                ngx.say("push err: ", err)
+            end
+
+            local val, err = dogs:llen("foo")
+            ngx.say(val, " ", err)
+
+            local val, err = dogs:lpop("foo")
+            ngx.say(val, " ", err)
+
+            local val, err = dogs:llen("foo")
+            ngx.say(val, " ", err)
+
+            local val, err = dogs:lpop("foo")
+            ngx.say(val, " ", err)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+push success
+1 nil
+bar nil
+0 nil
+nil nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: both ends of the list
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:rpush("foo", 2))
+            ngx.say(dogs:rpush("foo", "three"))
+            ngx.say(dogs:lpush("foo", 1))
+            ngx.say(dogs:lpush("foo", "zero"))
+
+            local val = dogs:rpop("foo")
+            ngx.say(val, " ", type(val))
+            val = dogs:lpop("foo")
+            ngx.say(val, " ", type(val))
+            val = dogs:lpop("foo")
+            ngx.say(val, " ", type(val))
+            val = dogs:rpop("foo")
+            ngx.say(val, " ", type(val))
+            ngx.say(dogs:llen("foo"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+1
+2
+3
+4
+three string
+zero string
+1 number
+2 number
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: list operations on scalar values and scalar ones on lists
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:flush_all()
+
+            dogs:set("foo", "bar")
+            ngx.say(dogs:lpush("foo", "bar"))
+            ngx.say(dogs:rpop("foo"))
+            ngx.say(dogs:llen("foo"))
+
+            ngx.say(dogs:rpush("list", "bar"))
+            ngx.say(dogs:get("list"))
+            ngx.say(dogs:incr("list", 1))
+            ngx.say(dogs:add("list", 1))
+
+            ngx.say(dogs:set("list", 8))
+            ngx.say(dogs:get("list"))
+            ngx.say(dogs:llen("list"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+nilvalue not a list
+nilvalue not a list
+nilvalue not a list
+1
+nilvalue is a list
+nilnot a number
+falseexistsfalse
+truenilfalse
+8
+nilvalue not a list
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad values
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say(dogs:lpush("foo", true))
+            ngx.say(dogs:rpush("foo", nil))
+            ngx.say(dogs:lpush(nil, "bar"))
+            ngx.say(dogs:lpop(""))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+nilbad value type
+nilbad value type
+nilnil key
+nilempty key
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: expiration of the whole list
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:delete("foo")
+
+            dogs:rpush("foo", "a", 0.01)
+            dogs:rpush("foo", "b")
+            ngx.say(dogs:llen("foo"))
+
+            ngx.sleep(0.02)
+
+            ngx.say(dogs:llen("foo"))
+            ngx.say(dogs:lpop("foo"))
+            ngx.say(dogs:rpush("foo", "c"))
+            ngx.say(dogs:lpop("foo"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+2
+0
+nil
+1
+c
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: list memory is reclaimed by delete and flush_expired
+--- http_config
+    lua_shared_dict dogs 100k;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            local s = string.rep("x", 1024)
+
+            dogs:delete("foo")
+
+            for round = 1, 3 do
+                local i = 0
+                while true do
+                    local len, err
+                    if round == 2 and i == 0 then
+                        len, err = dogs:rpush("foo", s, 0.001)
+                    else
+                        len, err = dogs:rpush("foo", s)
+                    end
+
+                    if not len then
+                        ngx.say(round, ": ", err, " ", i > 10)
+                        break
+                    end
+                    i = len
+                end
+
+                if round == 1 then
+                    dogs:delete("foo")
+
+                elseif round == 2 then
+                    ngx.sleep(0.002)
+                    dogs:flush_expired()
+                end
+            end
+        ';
+    }
+--- request
+GET /test
+--- response_body
+1: no memory true
+2: no memory true
+3: no memory true
+--- no_error_log
+[error]
+
+
+
+=== TEST 7: lists in a sharded zone
+--- http_config
+    lua_shared_dict dogs 1m shards=4;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 20 do
+                dogs:rpush("queue" .. i % 5, i)
+            end
+
+            local total = 0
+            for i = 0, 4 do
+                total = total + dogs:llen("queue" .. i)
+            end
+            ngx.say("total: ", total)
+            ngx.say("keys: ", #dogs:get_keys(0))
+
+            for i = 0, 4 do
+                while dogs:lpop("queue" .. i) do end
+            end
+            ngx.say("keys: ", #dogs:get_keys(0))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+total: 20
+keys: 5
+keys: 0
+--- no_error_log
+[error]
@@ -0,0 +1,186 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+repeat_each(1);
+
+plan tests => repeat_each() * (blocks() * 3 + 7);
+
+#no_diff();
+no_long_string();
+
+worker_connections(1024);
+run_tests();
+
+__DATA__
+
+=== TEST 1: simple every
+--- config
+    location /t {
+        content_by_lua_block {
+            local n = 0
+            local function f(premature, a, b)
+                n = n + 1
+                print("tick ", n, ": ", premature, " ", a, " ", b)
+            end
+            local ok, err = ngx.timer.every(0.05, f, "foo", 42)
+            if not ok then
+                ngx.say("failed to set timer: ", err)
+                return
+            end
+            ngx.say("registered timer")
+        }
+    }
+--- request
+GET /t
+--- response_body
+registered timer
+--- wait: 0.18
+--- error_log
+tick 1: false foo 42
+tick 2: false foo 42
+tick 3: false foo 42
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: counted as a single pending timer
+--- config
+    location /t {
+        content_by_lua_block {
+            local ok, err = ngx.timer.every(0.01, function () end)
+            if not ok then
+                ngx.say("failed to set timer: ", err)
+                return
+            end
+            ngx.say("pending: ", ngx.timer.pending_count())
+            ngx.sleep(0.055)
+            ngx.say("pending: ", ngx.timer.pending_count())
+        }
+    }
+--- request
+GET /t
+--- response_body
+pending: 1
+pending: 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: too many pending timers
+--- http_config
+    lua_max_pending_timers 1;
+--- config
+    location /t {
+        content_by_lua_block {
+            local function f() end
+            ngx.say(ngx.timer.every(0.1, f))
+            ngx.say(ngx.timer.every(0.1, f))
+            ngx.say(ngx.timer.at(0.1, f))
+        }
+    }
+--- request
+GET /t
+--- response_body
+1
+niltoo many pending timers
+niltoo many pending timers
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments
+--- config
+    location /t {
+        content_by_lua_block {
+            local function f() end
+            ngx.say(pcall(ngx.timer.every, 0, f))
+            ngx.say(pcall(ngx.timer.every, 0.0001, f))
+            ngx.say(pcall(ngx.timer.every, 1, print))
+            ngx.say(pcall(ngx.timer.every, 1))
+        }
+    }
+--- request
+GET /t
+--- response_body_like chop
+^false.*?interval must be at least 0\.001.*?
+false.*?interval must be at least 0\.001.*?
+false.*?Lua function expected.*?
+falseexpecting at least 2 arguments but got 1$
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: a slow callback does not overlap with itself
+--- config
+    location /t {
+        content_by_lua_block {
+            local n = 0
+            local running = false
+            local function f(premature)
+                if running then
+                    print("overlapped")
+                end
+                running = true
+                n = n + 1
+                ngx.sleep(0.05)
+                running = false
+                print("tick ", n, " done")
+            end
+            local ok, err = ngx.timer.every(0.02, f)
+            if not ok then
+                ngx.say("failed to set timer: ", err)
+                return
+            end
+            ngx.say("registered timer")
+        }
+    }
+--- request
+GET /t
+--- response_body
+registered timer
+--- wait: 0.2
+--- error_log
+tick 2 done
+lua ngx.timer.every skipping a tick because the previous one is still running
+--- no_error_log
+overlapped
+[error]
+
+
+
+=== TEST 6: ticks do not drift with the callback's run time
+--- config
+    location /t {
+        content_by_lua_block {
+            local begin = ngx.now()
+            local n = 0
+            local function f(premature)
+                n = n + 1
+                ngx.sleep(0.03)
+                if n == 4 then
+                    ngx.update_time()
+                    print("tick 4 done after ", ngx.now() - begin)
+                end
+            end
+            local ok, err = ngx.timer.every(0.05, f)
+            if not ok then
+                ngx.say("failed to set timer: ", err)
+                return
+            end
+            ngx.say("registered timer")
+        }
+    }
+--- request
+GET /t
+--- response_body
+registered timer
+--- wait: 0.3
+--- error_log eval
+qr/tick 4 done after 0\.2(?:2|3|4)\d*/
+--- no_error_log
+[error]
@@ -0,0 +1,157 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 1);
+
+$ENV{TEST_NGINX_MEMCACHED_PORT} ||= 11211;
+
+no_long_string();
+#no_diff();
+log_level 'debug';
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: setoption on a socket that is not connected
+--- config
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            ngx.say(sock:setoption("keepalive", true))
+        ';
+    }
+--- request
+GET /t
+--- response_body
+nilclosed
+--- error_log
+attempt to set an option on a closed socket
+
+
+
+=== TEST 2: set the standard options
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            ngx.say("keepalive: ", sock:setoption("keepalive", true))
+            ngx.say("tcp-nodelay: ", sock:setoption("tcp-nodelay", false))
+            ngx.say("sndbuf: ", sock:setoption("sndbuf", 65536))
+            ngx.say("rcvbuf: ", sock:setoption("rcvbuf", 65536))
+            ngx.say("linger: ", sock:setoption("linger", 1))
+            ngx.say("linger: ", sock:setoption("linger", false))
+            ngx.say(sock:setoption("foo", true))
+
+            local bytes, err = sock:send("flush_all\\r\\n")
+            if not bytes then
+                ngx.say("failed to send request: ", err)
+                return
+            end
+
+            ngx.say("received: ", sock:receive())
+            sock:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+keepalive: 1
+tcp-nodelay: 1
+sndbuf: 1
+rcvbuf: 1
+linger: 1
+linger: 1
+nilunsupported option "foo"
+received: OK
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: bad option values
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            ngx.say(pcall(sock.setoption, sock, "keepalive", 1))
+            ngx.say(pcall(sock.setoption, sock, "rcvbuf", -1))
+            ngx.say(pcall(sock.setoption, sock, "linger", true))
+            ngx.say(pcall(sock.setoption, sock, "keepalive"))
+            sock:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body_like chop
+^false.*?boolean expected.*?
+false.*?positive number expected.*?
+false.*?number expected.*?
+falseexpecting 3 arguments \(including the object\), but got 2$
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: pooled connections keep their options
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            for i = 1, 2 do
+                local sock = ngx.socket.tcp()
+                local ok, err = sock:connect("127.0.0.1", ngx.var.port)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                if i == 1 then
+                    ngx.say(sock:setoption("tcp-quickack", true))
+                    ngx.say(sock:setoption("tcp-cork", true))
+                end
+
+                local bytes, err = sock:send("flush_all\\r\\n")
+                if not bytes then
+                    ngx.say("failed to send request: ", err)
+                    return
+                end
+
+                ngx.say("received: ", sock:receive(), ", reused: ",
+                        sock:getreusedtimes())
+                sock:setkeepalive()
+            end
+        ';
+    }
+--- request
+GET /t
+--- response_body
+1
+1
+received: OK, reused: 0
+received: OK, reused: 1
+--- grep_error_log eval: qr/lua tcp socket set option "[^"]+" to \d+/
+--- grep_error_log_out
+lua tcp socket set option "tcp-quickack" to 1
+lua tcp socket set option "tcp-cork" to 1
+lua tcp socket set option "tcp-cork" to 0
+lua tcp socket set option "tcp-quickack" to 1
+--- no_error_log
+[error]
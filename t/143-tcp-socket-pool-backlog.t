@@ -0,0 +1,184 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+$ENV{TEST_NGINX_MEMCACHED_PORT} ||= 11211;
+
+no_long_string();
+#no_diff();
+log_level 'debug';
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: backlog queue full
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local opts = { pool = "backlog-full", pool_size = 1, backlog = 0 }
+
+            local sock1 = ngx.socket.tcp()
+            ngx.say(sock1:connect("127.0.0.1", ngx.var.port, opts))
+
+            local sock2 = ngx.socket.tcp()
+            ngx.say(sock2:connect("127.0.0.1", ngx.var.port, opts))
+
+            sock1:close()
+
+            ngx.say(sock2:connect("127.0.0.1", ngx.var.port, opts))
+            sock2:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+1
+niltoo many waiting connect operations
+1
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: waiting connect resumed by setkeepalive
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local port = ngx.var.port
+            local opts = { pool = "backlog-keepalive", pool_size = 1,
+                           backlog = 1 }
+
+            local function worker(id)
+                local sock = ngx.socket.tcp()
+                local ok, err = sock:connect("127.0.0.1", port, opts)
+                if not ok then
+                    ngx.say(id, ": failed to connect: ", err)
+                    return
+                end
+
+                ngx.say(id, ": connected, reused: ", sock:getreusedtimes())
+                ngx.sleep(0.01)
+
+                local ok, err = sock:setkeepalive()
+                if not ok then
+                    ngx.say(id, ": failed to set keepalive: ", err)
+                end
+            end
+
+            local t1 = ngx.thread.spawn(worker, 1)
+            local t2 = ngx.thread.spawn(worker, 2)
+            ngx.thread.wait(t1)
+            ngx.thread.wait(t2)
+        ';
+    }
+--- request
+GET /t
+--- response_body
+1: connected, reused: 0
+2: connected, reused: 1
+--- error_log
+lua tcp socket queued connect operation for pool "backlog-keepalive", waiting: 1
+
+
+
+=== TEST 3: waiting connect resumed by close
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local port = ngx.var.port
+            local opts = { pool = "backlog-close", pool_size = 1,
+                           backlog = 2 }
+
+            local function worker(id)
+                local sock = ngx.socket.tcp()
+                local ok, err = sock:connect("127.0.0.1", port, opts)
+                if not ok then
+                    ngx.say(id, ": failed to connect: ", err)
+                    return
+                end
+
+                ngx.say(id, ": connected, reused: ", sock:getreusedtimes())
+                ngx.sleep(0.01)
+                sock:close()
+            end
+
+            local threads = {}
+            for i = 1, 3 do
+                threads[i] = ngx.thread.spawn(worker, i)
+            end
+
+            for i = 1, 3 do
+                ngx.thread.wait(threads[i])
+            end
+        ';
+    }
+--- request
+GET /t
+--- response_body
+1: connected, reused: 0
+2: connected, reused: 0
+3: connected, reused: 0
+--- grep_error_log eval: qr/handing a connection slot over to a waiting connect operation/
+--- grep_error_log_out
+handing a connection slot over to a waiting connect operation
+handing a connection slot over to a waiting connect operation
+
+
+
+=== TEST 4: timed out waiting in the backlog queue
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local opts = { pool = "backlog-timeout", pool_size = 1,
+                           backlog = 1 }
+
+            local sock1 = ngx.socket.tcp()
+            ngx.say(sock1:connect("127.0.0.1", ngx.var.port, opts))
+
+            local sock2 = ngx.socket.tcp()
+            sock2:settimeout(50)
+            ngx.say(sock2:connect("127.0.0.1", ngx.var.port, opts))
+
+            sock1:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+1
+niltimeout
+--- error_log
+lua tcp socket connect operation timed out waiting in pool "backlog-timeout"
+
+
+
+=== TEST 5: bad option values
+--- config
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            ngx.say(pcall(sock.connect, sock, "127.0.0.1", 12345,
+                          { pool_size = 0 }))
+            ngx.say(pcall(sock.connect, sock, "127.0.0.1", 12345,
+                          { backlog = -1 }))
+            ngx.say(pcall(sock.connect, sock, "127.0.0.1", 12345,
+                          { backlog = true }))
+        ';
+    }
+--- request
+GET /t
+--- response_body_like chop
+^false.*?bad "pool_size" option value: 0.*?
+false.*?bad "backlog" option value: -1.*?
+false.*?bad "backlog" option type: boolean.*?$
+--- no_error_log
+[error]
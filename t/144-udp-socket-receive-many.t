@@ -0,0 +1,194 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 1);
+
+$ENV{TEST_NGINX_MEMCACHED_PORT} ||= 11211;
+
+no_long_string();
+#no_diff();
+log_level 'debug';
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: drain several replies at once
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local udp = ngx.socket.udp()
+            udp:settimeout(1000)
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            for i = 1, 3 do
+                local req = "\\0" .. string.char(i)
+                            .. "\\0\\0\\0\\1\\0\\0flush_all\\r\\n"
+                local ok, err = udp:send(req)
+                if not ok then
+                    ngx.say("failed to send: ", err)
+                    return
+                end
+            end
+
+            local replies = {}
+            while #replies < 3 do
+                local datagrams, err = udp:receive_many(8)
+                if not datagrams then
+                    ngx.say("failed to receive data: ", err)
+                    return
+                end
+
+                for _, data in ipairs(datagrams) do
+                    replies[#replies + 1] = string.byte(data, 2) .. ": "
+                                            .. string.sub(data, 9)
+                end
+            end
+
+            table.sort(replies)
+            ngx.print(table.concat(replies))
+            udp:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body eval
+"1: OK\r\n2: OK\r\n3: OK\r\n"
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: wait for the first datagram
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local udp = ngx.socket.udp()
+            udp:settimeout(1000)
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local ok, err = udp:send("\\0\\1\\0\\0\\0\\1\\0\\0flush_all\\r\\n")
+            if not ok then
+                ngx.say("failed to send: ", err)
+                return
+            end
+
+            local datagrams, err = udp:receive_many(4)
+            if not datagrams then
+                ngx.say("failed to receive data: ", err)
+                return
+            end
+
+            ngx.say("received ", #datagrams, " datagram(s) of ",
+                    #datagrams[1], " bytes")
+        ';
+    }
+--- request
+GET /t
+--- response_body
+received 1 datagram(s) of 12 bytes
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: timeout
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local udp = ngx.socket.udp()
+            udp:settimeout(50)
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            ngx.say(udp:receive_many(4))
+        ';
+    }
+--- request
+GET /t
+--- response_body
+niltimeout
+--- error_log
+lua udp socket read timed out
+
+
+
+=== TEST 4: bad arguments
+--- config
+    location /t {
+        content_by_lua '
+            local udp = ngx.socket.udp()
+            ngx.say(pcall(udp.receive_many, udp, 0))
+            ngx.say(pcall(udp.receive_many, udp, 65))
+            ngx.say(pcall(udp.receive_many, udp))
+        ';
+    }
+--- request
+GET /t
+--- response_body_like chop
+^false.*?number of datagrams must be between 1 and 64.*?
+false.*?number of datagrams must be between 1 and 64.*?
+falseexpecting 2 or 3 arguments \(including the object\), but got 1$
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: receive buffers larger than 8192 bytes
+--- config
+    location /t {
+        content_by_lua '
+            local udp = ngx.socket.udp()
+            udp:settimeout(1000)
+
+            local ok, err = udp:setpeername("127.0.0.1", 19232)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local ok, err = udp:send("hi")
+            if not ok then
+                ngx.say("failed to send: ", err)
+                return
+            end
+
+            local data, err = udp:receive(100000)
+            if not data then
+                ngx.say("failed to receive data: ", err)
+                return
+            end
+
+            ngx.say("received: ", data)
+        ';
+    }
+--- udp_listen: 19232
+--- udp_reply: hello world
+--- request
+GET /t
+--- response_body
+received: hello world
+--- error_log
+lua udp socket receive buffer size: 65507
+--- no_error_log
+[error]
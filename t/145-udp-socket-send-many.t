@@ -0,0 +1,229 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+$ENV{TEST_NGINX_MEMCACHED_PORT} ||= 11211;
+
+no_long_string();
+#no_diff();
+log_level 'debug';
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: send several requests at once
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local udp = ngx.socket.udp()
+            udp:settimeout(1000)
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local reqs = {}
+            for i = 1, 3 do
+                reqs[i] = "\\0" .. string.char(i)
+                          .. "\\0\\0\\0\\1\\0\\0flush_all\\r\\n"
+            end
+
+            local count, err = udp:send_many(reqs)
+            if not count then
+                ngx.say("failed to send: ", err)
+                return
+            end
+
+            ngx.say("sent: ", count)
+
+            local replies = {}
+            while #replies < 3 do
+                local datagrams, err = udp:receive_many(8)
+                if not datagrams then
+                    ngx.say("failed to receive data: ", err)
+                    return
+                end
+
+                for _, data in ipairs(datagrams) do
+                    replies[#replies + 1] = string.byte(data, 2) .. ": "
+                                            .. string.sub(data, 9)
+                end
+            end
+
+            table.sort(replies)
+            ngx.print(table.concat(replies))
+            udp:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body eval
+"sent: 3\n1: OK\r\n2: OK\r\n3: OK\r\n"
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: more datagrams than a single system call takes
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local udp = ngx.socket.udp()
+            udp:settimeout(1000)
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local reqs = {}
+            for i = 1, 70 do
+                reqs[i] = "\\0" .. string.char(i)
+                          .. "\\0\\0\\0\\1\\0\\0flush_all\\r\\n"
+            end
+
+            ngx.say("sent: ", udp:send_many(reqs))
+
+            local n = 0
+            while n < 70 do
+                local datagrams, err = udp:receive_many(64)
+                if not datagrams then
+                    ngx.say("failed to receive data: ", err)
+                    return
+                end
+
+                n = n + #datagrams
+            end
+
+            ngx.say("received: ", n)
+            udp:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+sent: 70
+received: 70
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: deferred datagrams go out at the end of the event loop iteration
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local udp = ngx.socket.udp()
+            udp:settimeout(1000)
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            for i = 1, 3 do
+                local req = "\\0" .. string.char(i)
+                            .. "\\0\\0\\0\\1\\0\\0flush_all\\r\\n"
+                ngx.say("queued: ", udp:send_many({ req }, true))
+            end
+
+            local n = 0
+            while n < 3 do
+                local datagrams, err = udp:receive_many(8)
+                if not datagrams then
+                    ngx.say("failed to receive data: ", err)
+                    return
+                end
+
+                n = n + #datagrams
+            end
+
+            ngx.say("received: ", n)
+            udp:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+queued: 1
+queued: 1
+queued: 1
+received: 3
+--- error_log
+lua udp socket flushing 3 deferred datagrams of 57 bytes
+
+
+
+=== TEST 4: deferred datagrams are flushed before closing
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local udp = ngx.socket.udp()
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local req = "\\0\\1\\0\\0\\0\\1\\0\\0flush_all\\r\\n"
+            ngx.say("queued: ", udp:send_many({ req, req }, true))
+            ngx.say(udp:close())
+        ';
+    }
+--- request
+GET /t
+--- response_body
+queued: 2
+1
+--- error_log
+lua udp socket flushing 2 deferred datagrams of 38 bytes
+
+
+
+=== TEST 5: bad arguments
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local udp = ngx.socket.udp()
+            ngx.say(udp:send_many({ "foo" }))
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            ngx.say(pcall(udp.send_many, udp, "foo"))
+            ngx.say(pcall(udp.send_many, udp, { "foo", true }))
+            ngx.say(pcall(udp.send_many, udp, { string.rep("a", 65508) }))
+            ngx.say(pcall(udp.send_many, udp))
+            ngx.say(udp:send_many({}))
+            udp:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body_like chop
+^nilclosed
+false.*?table expected, got string.*?
+false.*?bad datagram type at index 2: boolean
+false.*?datagram at index 1 too large: 65508 bytes
+falseexpecting 2 or 3 arguments \(including the object\), but got 1
+0$
+--- error_log
+attempt to send data on a closed socket
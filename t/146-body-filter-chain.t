@@ -0,0 +1,182 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 2);
+
+#no_diff();
+no_long_string();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: inspect a file buffer without reading the whole file
+--- config
+    location = /a.txt {
+        sendfile on;
+        lua_body_filter_in_memory off;
+
+        body_filter_by_lua '
+            for i = 1, ngx.chain.count() do
+                local size, in_file = ngx.chain.size(i)
+                if size > 0 then
+                    print("buf ", i, ": ", size, " ", in_file, " ",
+                          ngx.chain.get(i, 1, 5))
+                end
+            end
+        ';
+    }
+--- user_files
+>>> a.txt
+hello, world
+--- request
+GET /a.txt
+--- response_body
+hello, world
+--- error_log
+buf 1: 13 true hello
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: prepend, replace and append
+--- config
+    location = /t {
+        content_by_lua 'ngx.print("hello world")';
+
+        body_filter_by_lua '
+            if ngx.arg[2] then
+                ngx.chain.append("!")
+                return
+            end
+
+            ngx.chain.prepend(">> ")
+            ngx.chain.replace(2, 1, 5, "howdy")
+            print("chunk: ", ngx.arg[1], ", bufs: ", ngx.chain.count())
+        ';
+    }
+--- request
+GET /t
+--- response_body chop
+>> howdy world!
+--- error_log
+chunk: >> howdy world, bufs: 3
+
+
+
+=== TEST 3: remove and insert bytes in the middle of a buffer
+--- config
+    location = /t {
+        content_by_lua 'ngx.print("hello world")';
+
+        body_filter_by_lua '
+            if ngx.chain.count() == 0 or ngx.chain.size(1) == 0 then
+                return
+            end
+
+            ngx.chain.replace(1, 6, 6)
+            ngx.chain.replace(2, 1, 0, ", ")
+
+            for i = 1, ngx.chain.count() do
+                print("buf ", i, ": [", ngx.chain.get(i), "]")
+            end
+        ';
+    }
+--- request
+GET /t
+--- response_body chop
+hello, world
+--- grep_error_log eval: qr/buf \d: \[[^\]]*\]/
+--- grep_error_log_out
+buf 1: [hello]
+buf 2: [, ]
+buf 3: [world]
+
+
+
+=== TEST 4: string.sub style ranges
+--- config
+    location = /t {
+        content_by_lua 'ngx.print("hello world")';
+
+        body_filter_by_lua '
+            if ngx.arg[2] then
+                return
+            end
+
+            print("1: [", ngx.chain.get(1, -5), "]")
+            print("2: [", ngx.chain.get(1, 3, 2), "]")
+            print("3: [", ngx.chain.get(1, -100, 2), "]")
+        ';
+    }
+--- request
+GET /t
+--- response_body chop
+hello world
+--- grep_error_log eval: qr/\d: \[[^\]]*\]/
+--- grep_error_log_out
+1: [world]
+2: []
+3: [he]
+
+
+
+=== TEST 5: replace the head of a file buffer
+--- config
+    location = /a.txt {
+        sendfile on;
+        lua_body_filter_in_memory off;
+
+        body_filter_by_lua '
+            if ngx.chain.count() > 0 and ngx.chain.size(1) > 0 then
+                ngx.chain.replace(1, 1, 5, "HELLO")
+            end
+        ';
+    }
+--- user_files
+>>> a.txt
+hello, world
+--- request
+GET /a.txt
+--- response_body
+HELLO, world
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: bad arguments
+--- config
+    location = /t {
+        content_by_lua '
+            ngx.say(pcall(ngx.chain.count))
+            ngx.print("hello world")
+        ';
+
+        body_filter_by_lua '
+            if ngx.arg[2] then
+                return
+            end
+
+            print(pcall(ngx.chain.get, 5))
+            print(pcall(ngx.chain.append, {}))
+        ';
+    }
+--- request
+GET /t
+--- response_body_like chop
+^false.*?API disabled in the context of content_by_lua\*
+hello world$
+--- error_log eval
+[
+qr/false.*?buffer index out of range/,
+qr/false.*?bad chunk data type: table/,
+]
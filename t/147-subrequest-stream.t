@@ -0,0 +1,193 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+no_root_location;
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 2);
+
+#no_diff();
+no_long_string();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: read the response body chunk by chunk
+--- config
+    location /sub {
+        content_by_lua_block {
+            ngx.header["X-Foo"] = "bar"
+            ngx.say("hello")
+            ngx.sleep(0.01)
+            ngx.say("world")
+        }
+    }
+
+    location /t {
+        content_by_lua_block {
+            local res = ngx.location.capture("/sub", { stream = true })
+            ngx.say("status: ", res.status)
+            ngx.say("X-Foo: ", res.header["X-Foo"])
+            ngx.say("body: ", res.body)
+
+            while true do
+                local chunk, err = res:read()
+                if not chunk then
+                    ngx.say("eof: ", err)
+                    break
+                end
+                ngx.print("chunk: ", chunk)
+            end
+        }
+    }
+--- request
+GET /t
+--- response_body
+status: 200
+X-Foo: bar
+body: nil
+chunk: hello
+chunk: world
+eof: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: the subrequest waits for the reader
+--- config
+    location /sub {
+        content_by_lua_block {
+            for i = 1, 3 do
+                ngx.say(i)
+                ngx.flush(true)
+                ngx.log(ngx.WARN, "sent ", i)
+            end
+        }
+    }
+
+    location /t {
+        content_by_lua_block {
+            local res = ngx.location.capture("/sub", { stream = true })
+            ngx.sleep(0.05)
+
+            while true do
+                local chunk = res:read()
+                if not chunk then
+                    break
+                end
+                ngx.log(ngx.WARN, "read ", chunk)
+                ngx.print(chunk)
+            end
+        }
+    }
+--- request
+GET /t
+--- response_body
+1
+2
+3
+--- grep_error_log eval: qr/(?:sent|read) \d/
+--- grep_error_log_out
+read 1
+sent 1
+read 2
+sent 2
+read 3
+sent 3
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: responses without a Lua content handler
+--- config
+    location /sub {
+        return 201 "created\n";
+    }
+
+    location /t {
+        content_by_lua_block {
+            local res = ngx.location.capture("/sub", { stream = true })
+            ngx.say("status: ", res.status)
+
+            local body = {}
+            while true do
+                local chunk, err = res:read()
+                if not chunk then
+                    ngx.say("eof: ", err)
+                    break
+                end
+                body[#body + 1] = chunk
+            end
+
+            ngx.print(table.concat(body))
+        }
+    }
+--- request
+GET /t
+--- response_body
+status: 201
+eof: nil
+created
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: not allowed for multiple subrequests
+--- config
+    location /sub {
+        echo hello;
+    }
+
+    location /t {
+        content_by_lua_block {
+            ngx.say(pcall(ngx.location.capture_multi, {
+                { "/sub", { stream = true } },
+                { "/sub" },
+            }))
+        }
+    }
+--- request
+GET /t
+--- response_body
+falsethe stream option is not allowed for multiple subrequests
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: unread data is discarded once the issuing handler terminates
+--- config
+    location /sub {
+        content_by_lua_block {
+            ngx.say("hello")
+            ngx.sleep(0.01)
+            ngx.say("world")
+        }
+    }
+
+    location /t {
+        access_by_lua_block {
+            local res = ngx.location.capture("/sub", { stream = true })
+            ngx.ctx.first = res:read()
+            ngx.ctx.res = res
+        }
+
+        content_by_lua_block {
+            ngx.print("first: ", ngx.ctx.first)
+            ngx.say(ngx.ctx.res:read())
+        }
+    }
+--- request
+GET /t
+--- response_body
+first: hello
+nildiscarded
+--- error_log
+lua discarding the unread response body of subrequest "/sub"
+--- no_error_log
+[error]
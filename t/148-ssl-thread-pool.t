@@ -0,0 +1,166 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 1);
+
+our $HttpConfig = <<'_EOC_';
+    init_by_lua_block {
+        local ffi = require "ffi"
+
+        ffi.cdef[[
+            int ngx_http_lua_ffi_ssl_rsa_generate_key_async(void *r,
+                int bits, char **err);
+        ]]
+
+        local C = ffi.C
+        local co_yield = coroutine._yield
+        local errmsg = ffi.new("char *[1]")
+
+        function rsa_generate_key(bits)
+            local r = getfenv(0).__ngx_req
+
+            local rc = C.ngx_http_lua_ffi_ssl_rsa_generate_key_async(r, bits,
+                                                                     errmsg)
+            if rc == -2 then  -- NGX_AGAIN
+                return co_yield()
+            end
+
+            if rc == -5 then  -- NGX_DECLINED
+                return nil, "declined"
+            end
+
+            return nil, ffi.string(errmsg[0])
+        end
+    }
+_EOC_
+
+#no_diff();
+no_long_string();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: generate an RSA key in the thread pool
+--- http_config eval
+"lua_ssl_thread_pool default;" . $::HttpConfig
+--- config
+    location /t {
+        content_by_lua_block {
+            local key, err = rsa_generate_key(1024)
+            if not key then
+                ngx.say("failed to generate key: ", err)
+                return
+            end
+
+            ngx.say("key: ", #key > 500, " ", string.byte(key, 1) == 0x30)
+        }
+    }
+--- request
+GET /t
+--- response_body
+key: true true
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: other requests are served while the key is being generated
+--- http_config eval
+"lua_ssl_thread_pool default;" . $::HttpConfig
+--- config
+    location /t {
+        content_by_lua_block {
+            local ticks = 0
+            local function tick(premature)
+                ticks = ticks + 1
+            end
+
+            ngx.timer.at(0, tick)
+
+            local key, err = rsa_generate_key(2048)
+            if not key then
+                ngx.say("failed to generate key: ", err)
+                return
+            end
+
+            ngx.say("ticks: ", ticks)
+        }
+    }
+--- request
+GET /t
+--- response_body
+ticks: 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: too many pending tasks
+--- http_config eval
+"lua_ssl_thread_pool default; lua_ssl_max_pending_tasks 1;" . $::HttpConfig
+--- config
+    location /t {
+        content_by_lua_block {
+            local function gen(i)
+                local key, err = rsa_generate_key(1024)
+                return i .. ": " .. (key and "ok" or err)
+            end
+
+            local t1 = ngx.thread.spawn(gen, 1)
+            local t2 = ngx.thread.spawn(gen, 2)
+
+            ngx.say(select(2, ngx.thread.wait(t1)))
+            ngx.say(select(2, ngx.thread.wait(t2)))
+        }
+    }
+--- request
+GET /t
+--- response_body
+1: ok
+2: too many pending tasks
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: no thread pool configured
+--- http_config eval: $::HttpConfig
+--- config
+    location /t {
+        content_by_lua_block {
+            ngx.say(rsa_generate_key(1024))
+        }
+    }
+--- request
+GET /t
+--- response_body
+nildeclined
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: the request is aborted before the key is generated
+--- http_config eval
+"lua_ssl_thread_pool default;" . $::HttpConfig
+--- config
+    location /t {
+        content_by_lua_block {
+            ngx.thread.spawn(function ()
+                rsa_generate_key(4096)
+            end)
+            ngx.exit(200)
+        }
+    }
+--- request
+GET /t
+--- response_body
+--- error_log
+lua ssl task cleanup
+--- log_level: debug
+--- no_error_log
+[error]
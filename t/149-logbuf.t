@@ -0,0 +1,198 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+repeat_each(1);
+
+plan tests => repeat_each() * (blocks() * 3 + 2);
+
+#no_diff();
+no_long_string();
+
+our $FlusherConfig = <<'_EOC_';
+    init_worker_by_lua_block {
+        local function flush(premature)
+            while true do
+                local records, err = ngx.logbuf.wait()
+                if not records then
+                    ngx.log(ngx.WARN, "flusher exiting: ", err)
+                    return
+                end
+                ngx.log(ngx.WARN, "flushed: ", table.concat(records, ","))
+            end
+        end
+
+        local ok, err = ngx.timer.at(0, flush)
+        if not ok then
+            ngx.log(ngx.ERR, "failed to start the flusher: ", err)
+        end
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a full batch wakes up the flusher
+--- http_config eval
+"lua_log_buffer 100 batch=3 flush=10s;" . $::FlusherConfig
+--- config
+    location /t {
+        content_by_lua_block {
+            for i = 1, 3 do
+                ngx.logbuf.append("r" .. i)
+            end
+            ngx.sleep(0.01)
+            local stats = ngx.logbuf.stats()
+            ngx.say(stats.pending, " ", stats.flushed, " ", stats.dropped)
+        }
+    }
+--- request
+GET /t
+--- response_body
+0 3 0
+--- error_log
+flushed: r1,r2,r3
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: records appended by log_by_lua are flushed after the flush time
+--- http_config eval
+"lua_log_buffer 100 batch=10 flush=50ms;" . $::FlusherConfig
+--- config
+    location /t {
+        echo ok;
+        log_by_lua_block {
+            ngx.logbuf.append(ngx.var.uri .. " " .. ngx.var.status)
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- wait: 0.1
+--- error_log
+flushed: /t 200
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: the newest records are dropped from a full buffer by default
+--- http_config
+    lua_log_buffer 2;
+--- config
+    location /t {
+        content_by_lua_block {
+            for i = 1, 3 do
+                ngx.say(ngx.logbuf.append(i))
+            end
+            local stats = ngx.logbuf.stats()
+            ngx.say(stats.pending, " ", stats.flushed, " ", stats.dropped)
+        }
+    }
+--- request
+GET /t
+--- response_body
+true
+true
+nilfull
+2 0 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: drop=oldest and table records
+--- http_config
+    lua_log_buffer 2 drop=oldest;
+--- config
+    location /t {
+        content_by_lua_block {
+            for i = 1, 3 do
+                ngx.logbuf.append({ id = i })
+            end
+
+            local records = ngx.logbuf.wait()
+            for _, rec in ipairs(records) do
+                ngx.say("id: ", rec.id)
+            end
+
+            local stats = ngx.logbuf.stats()
+            ngx.say(stats.pending, " ", stats.flushed, " ", stats.dropped)
+        }
+    }
+--- request
+GET /t
+--- response_body
+id: 2
+id: 3
+0 2 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: only one thread can wait
+--- http_config eval
+"lua_log_buffer 100;" . $::FlusherConfig
+--- config
+    location /t {
+        content_by_lua_block {
+            ngx.sleep(0.01)
+            ngx.say(ngx.logbuf.wait())
+            ngx.say(pcall(ngx.logbuf.append, nil))
+            ngx.say(pcall(ngx.logbuf.append, 1, 2))
+        }
+    }
+--- request
+GET /t
+--- response_body_like chop
+^nilbusy
+false.*?non-nil value expected.*?
+falseexpecting 1 argument, but got 2$
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: no lua_log_buffer configured
+--- config
+    location /t {
+        content_by_lua_block {
+            ngx.say(pcall(ngx.logbuf.append, "foo"))
+            ngx.say(pcall(ngx.logbuf.stats))
+        }
+    }
+--- request
+GET /t
+--- response_body
+falseno lua_log_buffer configured
+falseno lua_log_buffer configured
+--- no_error_log
+[error]
+
+
+
+=== TEST 7: not usable with lua_code_cache off
+--- http_config
+    lua_log_buffer 100;
+--- config
+    location /t {
+        lua_code_cache off;
+        content_by_lua_block {
+            ngx.say(pcall(ngx.logbuf.append, "foo"))
+            ngx.say(pcall(ngx.logbuf.wait))
+            ngx.say("pending: ", ngx.logbuf.stats().pending)
+        }
+    }
+--- request
+GET /t
+--- response_body
+falselua_log_buffer not usable with lua_code_cache off
+falselua_log_buffer not usable with lua_code_cache off
+pending: 0
+--- no_error_log
+[error]
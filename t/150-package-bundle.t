@@ -0,0 +1,116 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+
+# builds a lua_package_bundle file out of (module name, Lua code) pairs
+sub make_bundle {
+    my %modules = @_;
+    my @names = sort keys %modules;
+    my $off = 16 + 16 * @names;
+    my ($index, $data) = ('', '');
+
+    for my $name (@names) {
+        my $code = $modules{$name};
+        $index .= pack("VVVV", $off, length($name), $off + length($name),
+                       length($code));
+        $data .= $name . $code;
+        $off += length($name) + length($code);
+    }
+
+    return "NGXLUAB1" . pack("VV", scalar(@names), 0) . $index . $data;
+}
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: require modules from a bundle
+--- http_config
+    lua_package_path "/tmp/no-such-dir/?.lua";
+    lua_package_bundle html/test.bundle;
+--- config
+    location /t {
+        content_by_lua_block {
+            local foo = require "foo"
+            local bar = require "foo.bar"
+            ngx.say(foo.name, " ", bar)
+            ngx.say(package.loaded["foo.bar"] == bar)
+        }
+    }
+--- user_files eval
+">>> test.bundle\n" . main::make_bundle(
+    "foo" => 'return { name = "foo" }',
+    "foo.bar" => 'return "bar"',
+)
+--- request
+GET /t
+--- response_body
+foo bar
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: package.preload goes first and missing modules fall through
+--- http_config
+    lua_package_bundle html/test.bundle;
+--- config
+    location /t {
+        content_by_lua_block {
+            package.preload.foo = function () return "preloaded" end
+            ngx.say(require "foo")
+
+            local ok, err = pcall(require, "baz")
+            ngx.say(ok)
+            ngx.say(err:find("no module 'baz' in the lua package bundles",
+                             1, true) ~= nil)
+        }
+    }
+--- user_files eval
+">>> test.bundle\n" . main::make_bundle(
+    "foo" => 'return "bundled"',
+)
+--- request
+GET /t
+--- response_body
+preloaded
+false
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: the first bundle providing a module wins
+--- http_config
+    lua_package_bundle html/a.bundle;
+    lua_package_bundle html/b.bundle;
+--- config
+    location /t {
+        content_by_lua_block {
+            ngx.say(require "foo")
+            ngx.say(require "bar")
+        }
+    }
+--- user_files eval
+">>> a.bundle\n" . main::make_bundle(
+    "foo" => 'return "foo from a"',
+) . "\n>>> b.bundle\n" . main::make_bundle(
+    "bar" => 'return "bar from b"',
+    "foo" => 'return "foo from b"',
+)
+--- request
+GET /t
+--- response_body
+foo from a
+bar from b
+--- no_error_log
+[error]
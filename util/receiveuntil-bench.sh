@@ -0,0 +1,174 @@
+#!/usr/bin/env bash
+
+# this script is for developers only.
+# it measures the throughput of the cosocket readers on realistic data:
+# tcpsock:receiveuntil() splitting a multipart/form-data body on its
+# boundary (in both the unlimited and the size-limited modes) and
+# tcpsock:receive("*l") splitting a CSV-like body into lines.
+#
+# usage: util/receiveuntil-bench.sh [iterations] [part size]
+# e.g.:  util/receiveuntil-bench.sh 50 1048576
+#
+# build nginx with and without --with-cc-opt="-mavx2" (or -march=native) to
+# compare the SSE2/AVX2 delimiter scanning with the scalar one.
+#
+# the nginx executable is taken from ./work/nginx/sbin/nginx (see build2.sh)
+# unless the NGINX environment variable says otherwise.
+
+root=`pwd`
+nginx=${NGINX:-$root/work/nginx/sbin/nginx}
+iterations=${1:-50}
+part_size=${2:-1048576}
+port=${PORT:-1984}
+
+if [ ! -x "$nginx" ]; then
+    echo "$nginx not found" >&2
+    exit 1
+fi
+
+prefix=`mktemp -d /tmp/receiveuntil-bench.XXXXXX`
+mkdir -p $prefix/conf $prefix/logs
+
+trap "rm -rf $prefix" EXIT
+
+cat > $prefix/conf/nginx.conf <<EOF
+worker_processes 1;
+daemon on;
+master_process on;
+error_log logs/error.log warn;
+pid logs/nginx.pid;
+
+events {
+    worker_connections 1024;
+}
+
+http {
+    access_log off;
+
+    init_by_lua '
+        local boundary = "----------------------------2c4e7d8f9a0b1c3d"
+        local parts = {}
+
+        -- binary-looking payloads with plenty of dashes and CR/LF bytes,
+        -- like the uploads seen in the wild
+
+        math.randomseed(42)
+
+        local chars = {}
+        for i = 1, 4096 do
+            local c = math.random(0, 255)
+            if i % 97 == 0 then
+                c = 45  -- "-"
+            end
+            chars[i] = string.char(c)
+        end
+
+        local chunk = table.concat(chars)
+        local payload = string.rep(chunk, math.ceil($part_size / 4096))
+        payload = string.sub(payload, 1, $part_size)
+
+        for i = 1, 8 do
+            parts[i] = "--" .. boundary .. "\\\\r\\\\n"
+                       .. "Content-Disposition: form-data; name=\\\\"file" .. i
+                       .. "\\\\"; filename=\\\\"file" .. i .. ".bin\\\\"\\\\r\\\\n"
+                       .. "Content-Type: application/octet-stream\\\\r\\\\n\\\\r\\\\n"
+                       .. payload .. "\\\\r\\\\n"
+        end
+
+        multipart_boundary = boundary
+        multipart_body = table.concat(parts) .. "--" .. boundary .. "--\\\\r\\\\n"
+
+        local lines = {}
+        for i = 1, math.ceil(8 * $part_size / 64) do
+            lines[i] = string.format("%08d,%s,%.3f,%s", i, "2016-01-01T00:00:00",
+                                     i / 7, "GET /index.html HTTP/1.1")
+        end
+
+        lines_body = table.concat(lines, "\\\\r\\\\n") .. "\\\\r\\\\n"
+    ';
+
+    server {
+        listen 127.0.0.1:$port;
+
+        location = /multipart {
+            content_by_lua 'ngx.print(multipart_body)';
+        }
+
+        location = /lines {
+            content_by_lua 'ngx.print(lines_body)';
+        }
+
+        location = /bench {
+            content_by_lua '
+                local mode = ngx.var.arg_mode
+                local uri = mode == "lines" and "/lines" or "/multipart"
+                local total = 0
+
+                ngx.update_time()
+                local begin = ngx.now()
+
+                for i = 1, $iterations do
+                    local sock = ngx.socket.tcp()
+                    local ok, err = sock:connect("127.0.0.1", $port)
+                    if not ok then
+                        ngx.log(ngx.ERR, "failed to connect: ", err)
+                        return ngx.exit(500)
+                    end
+
+                    sock:send("GET " .. uri .. " HTTP/1.0\\\\r\\\\n\\\\r\\\\n")
+
+                    local read_headers = sock:receiveuntil("\\\\r\\\\n\\\\r\\\\n")
+                    read_headers()
+
+                    if mode == "lines" then
+                        while true do
+                            local line = sock:receive()
+                            if not line then
+                                break
+                            end
+                            total = total + #line + 2
+                        end
+
+                    else
+                        local reader = sock:receiveuntil("\\\\r\\\\n--"
+                                                         .. multipart_boundary)
+                        local size = mode == "chunked" and 8192 or nil
+
+                        while true do
+                            local data, err = reader(size)
+                            if err then
+                                break
+                            end
+                            if data then
+                                total = total + #data
+                            end
+                        end
+                    end
+
+                    sock:close()
+                end
+
+                ngx.update_time()
+                local elapsed = ngx.now() - begin
+
+                ngx.say(string.format("%.1f", total / elapsed / 1048576))
+            ';
+        }
+    }
+}
+EOF
+
+$nginx -p $prefix/ -c conf/nginx.conf || exit 1
+
+printf "%-12s %12s\n" mode "MB/sec"
+
+for mode in multipart chunked lines; do
+    out=`curl -s -f "http://127.0.0.1:$port/bench?mode=$mode"`
+    printf "%-12s %12s\n" $mode "$out"
+done
+
+kill -QUIT `cat $prefix/logs/nginx.pid`
+
+while [ -f $prefix/logs/nginx.pid ]; do
+    sleep 0.1
+done
@@ -0,0 +1,145 @@
+#!/usr/bin/env bash
+
+# this script is for developers only.
+# it measures the throughput of ngx.shared.DICT:incr() and :get() when all
+# the nginx worker processes hammer the same zone at the same time, for a
+# list of "shards=N" settings of the lua_shared_dict directive.
+#
+# usage: util/shdict-bench.sh [workers] [iterations] [shards...]
+# e.g.:  util/shdict-bench.sh 48 1000000 1 2 4 8 16 32
+#
+# the nginx executable is taken from ./work/nginx/sbin/nginx (see build2.sh)
+# unless the NGINX environment variable says otherwise.
+
+root=`pwd`
+nginx=${NGINX:-$root/work/nginx/sbin/nginx}
+workers=${1:-`nproc`}
+iterations=${2:-1000000}
+
+if [ $# -ge 2 ]; then
+    shift 2
+else
+    shift $#
+fi
+
+shards_list=${*:-1 2 4 8 16}
+
+if [ ! -x "$nginx" ]; then
+    echo "$nginx not found" >&2
+    exit 1
+fi
+
+prefix=`mktemp -d /tmp/shdict-bench.XXXXXX`
+mkdir -p $prefix/conf $prefix/logs
+
+trap "rm -rf $prefix" EXIT
+
+printf "%-8s %-8s %16s %16s\n" shards workers "incr ops/sec" "get ops/sec"
+
+for shards in $shards_list; do
+    cat > $prefix/conf/nginx.conf <<EOF
+worker_processes $workers;
+daemon on;
+master_process on;
+error_log logs/error.log warn;
+pid logs/nginx.pid;
+
+events {
+    worker_connections 1024;
+}
+
+http {
+    access_log off;
+
+    lua_shared_dict bench 64m shards=$shards;
+    lua_shared_dict results 1m;
+
+    init_worker_by_lua '
+        local function bench(premature)
+            if premature then
+                return
+            end
+
+            local dict = ngx.shared.bench
+            local results = ngx.shared.results
+            local n = $iterations
+            local keys = {}
+
+            for i = 1, 1024 do
+                keys[i] = "counter-" .. i
+                dict:add(keys[i], 0)
+            end
+
+            -- wait for all the workers to start at the same time
+            results:incr("ready", 1)
+            while results:get("ready") < $workers do
+                ngx.sleep(0.01)
+            end
+
+            ngx.update_time()
+            local begin = ngx.now()
+
+            for i = 1, n do
+                dict:incr(keys[i % 1024 + 1], 1)
+            end
+
+            ngx.update_time()
+            local incr_elapsed = ngx.now() - begin
+            begin = ngx.now()
+
+            for i = 1, n do
+                dict:get(keys[i % 1024 + 1])
+            end
+
+            ngx.update_time()
+            local get_elapsed = ngx.now() - begin
+
+            results:incr("incr", n / incr_elapsed)
+            results:incr("get", n / get_elapsed)
+            results:incr("done", 1)
+        end
+
+        ngx.shared.results:add("ready", 0)
+        ngx.shared.results:add("incr", 0)
+        ngx.shared.results:add("get", 0)
+        ngx.shared.results:add("done", 0)
+
+        ngx.timer.at(0, bench)
+    ';
+
+    server {
+        listen 127.0.0.1:${PORT:-1984};
+
+        location = /results {
+            content_by_lua '
+                local results = ngx.shared.results
+                if results:get("done") < $workers then
+                    return ngx.exit(503)
+                end
+
+                ngx.say(string.format("%d %d", results:get("incr"),
+                                      results:get("get")))
+            ';
+        }
+    }
+}
+EOF
+
+    $nginx -p $prefix/ -c conf/nginx.conf || exit 1
+
+    while :; do
+        out=`curl -s -f http://127.0.0.1:${PORT:-1984}/results`
+        if [ -n "$out" ]; then
+            break
+        fi
+        sleep 0.5
+    done
+
+    kill -QUIT `cat $prefix/logs/nginx.pid`
+
+    while [ -f $prefix/logs/nginx.pid ]; do
+        sleep 0.1
+    done
+
+    printf "%-8s %-8s %16s %16s\n" $shards $workers $out
+done